@@ -0,0 +1,96 @@
+/* account_bench.cpp
+ * Benchmarks bet reservations and payouts against a single account
+ * from many concurrent sessions. Runs the lock-free AccountDetails
+ * from accounts.h next to a copy of the previous mutex-based account
+ * (check the balance, then lock and debit) so the two can be compared.
+ *
+ * Usage: ./account_bench [<sessions>] [<rounds per session>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../server/accounts.h"
+
+// MutexAccount is the account as it was before accounts.h: a mutex per
+// update, an unlocked read, and a separate check before each debit.
+class MutexAccount
+{
+   private:
+      std::mutex mtx;
+      uint32_t balance = 0;
+   public:
+      uint32_t getBalance() {
+         return balance;
+      }
+      void adjustBalance(int32_t funds) {
+         mtx.lock();
+         uint32_t new_balance = balance + funds;
+         bool overflow = (((funds < 0) && (new_balance > balance)) || ((funds > 0) && (new_balance < balance)));
+         if (!overflow) {
+            balance += funds;
+         }
+         mtx.unlock();
+      }
+      // The old BET path: check the balance, then debit it.
+      bool reserve(uint32_t amt) {
+         if (amt > getBalance()) {
+            return false;
+         }
+         adjustBalance(-amt);
+         return true;
+      }
+};
+
+// run has every session play rounds rounds against account: bet 25, then
+// be paid out 50 on every other round. Prints the throughput and the
+// final balance, which must match the expected balance if no bet was lost.
+template <typename Account>
+void run(const char* name, int sessions, int rounds) {
+   Account account;
+   uint32_t start_balance = 1000000;
+   account.adjustBalance(start_balance);
+   std::vector<std::thread> threads;
+   std::atomic<uint64_t> accepted {0};
+   auto start = std::chrono::steady_clock::now();
+   for (int s = 0; s < sessions; s++) {
+      threads.push_back(std::thread([&account, &accepted, rounds]() {
+         uint64_t mine = 0;
+         for (int r = 0; r < rounds; r++) {
+            if (account.reserve(25)) {
+               mine++;
+               if (r % 2 == 0) {
+                  account.adjustBalance(50);
+               }
+            }
+         }
+         accepted += mine;
+      }));
+   }
+   for (auto& t : threads) {
+      t.join();
+   }
+   double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   uint64_t ops = (uint64_t)sessions * rounds;
+   printf("%-8s sessions=%d ops=%llu time=%.3fs throughput=%.2f Mops/s ns/op=%.1f balance=%u\n",
+         name, sessions, (unsigned long long)ops, secs, ops / secs / 1e6, secs * 1e9 / ops,
+         account.getBalance());
+}
+
+int main(int argc, char* argv[]) {
+   int sessions = 64;
+   int rounds = 200000;
+   if (argc > 1) {
+      sessions = atoi(argv[1]);
+   }
+   if (argc > 2) {
+      rounds = atoi(argv[2]);
+   }
+   run<MutexAccount>("mutex", sessions, rounds);
+   run<AccountDetails>("atomic", sessions, rounds);
+   return EXIT_SUCCESS;
+}
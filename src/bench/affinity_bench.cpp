@@ -0,0 +1,158 @@
+/* affinity_bench.cpp
+ * Benchmarks the Scheduler from scheduler.h with core affinity against
+ * the shared design it replaced. Each producer thread stands in for the
+ * connections seated at a set of tables: it posts commands to their
+ * mailboxes, and each table applies them to its seats and writes back
+ * to the seat's connection state, as a hit and its reply would. With
+ * affinity, each producer is pinned to a core and only posts to tables
+ * homed there; without, the producers and tables go wherever the OS and
+ * the shared run queue put them. The run reports commands per second
+ * and how many commands were applied on a different core than the one
+ * that posted them.
+ *
+ * Usage: ./affinity_bench [<workers>] [<tables>] [<commands per producer>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../server/lockprof.h"
+#include "../server/fiber.h"
+struct Session;
+#include "../server/mailbox.h"
+#include "../server/clock.h"
+#include "../server/scheduler.h"
+
+// BenchCommand is a hit from the connection at seat.
+struct BenchCommand
+{
+   std::atomic<BenchCommand*> next {NULL};
+   uint8_t seat = 0;
+   uint8_t card = 0;
+   int cpu = 0; // CPU the command was posted from
+};
+
+// BenchSeat is the connection state a table writes back to.
+struct alignas(64) BenchSeat
+{
+   uint32_t total = 0;
+   uint32_t replies = 0;
+};
+
+std::atomic<uint64_t> applied {0}; // Commands applied, across every table
+std::atomic<uint64_t> crossed {0}; // Commands applied on a different CPU than they were posted from
+
+// BenchTable applies hits from its mailbox to its seats.
+class BenchTable : public Actor
+{
+   private:
+      Scheduler* sched;
+      Mailbox<BenchCommand> mailbox;
+   public:
+      BenchSeat seats[6];
+      BenchTable(Scheduler* sched_) : sched(sched_) {}
+      void post(BenchCommand* cmd) {
+         mailbox.push(cmd);
+         sched->schedule(this);
+      }
+      bool run() {
+         int cpu = sched_getcpu();
+         uint64_t n = 0;
+         uint64_t x = 0;
+         while (BenchCommand* cmd = mailbox.pop()) {
+            BenchSeat& seat = seats[cmd->seat];
+            seat.total = seat.total > 21 ? cmd->card : seat.total + cmd->card;
+            seat.replies++;
+            x += cmd->cpu != cpu;
+            n++;
+            delete cmd;
+         }
+         applied.fetch_add(n);
+         crossed.fetch_add(x);
+         return true;
+      }
+      bool has_work() {
+         return !mailbox.empty();
+      }
+};
+
+// run_mode runs the benchmark on a fresh scheduler, returning commands per second.
+static double run_mode(bool affinity, unsigned workers, int tables, long commands)
+{
+   Scheduler* sched = new Scheduler();
+   sched->start(workers, affinity);
+   std::vector<BenchTable*> all;
+   for (int i = 0; i < tables; i++) {
+      BenchTable* table = new BenchTable(sched);
+      // Home table i on core i % workers, the tables producer i % workers posts to
+      table->core = affinity ? (int)(i % workers) : -1;
+      all.push_back(table);
+   }
+   applied = 0;
+   crossed = 0;
+   auto start = std::chrono::steady_clock::now();
+   std::vector<std::thread> producers;
+   for (unsigned p = 0; p < workers; p++) {
+      producers.emplace_back([=, &all]{
+         if (affinity) {
+            pin_to_cpu(p);
+         }
+         uint32_t rng = p * 2654435761u + 1;
+         for (long i = 0; i < commands; i++) {
+            rng = rng * 1103515245u + 12345u;
+            BenchCommand* cmd = new BenchCommand();
+            cmd->seat = (rng >> 8) % 6;
+            cmd->card = (rng >> 16) % 10 + 1;
+            cmd->cpu = sched_getcpu();
+            // Post to one of this producer's tables
+            int t = p + workers * ((rng >> 4) % ((tables + workers - 1 - p) / workers));
+            all[t]->post(cmd);
+         }
+      });
+   }
+   for (auto& t : producers) {
+      t.join();
+   }
+   while (applied.load() < (uint64_t)commands * workers) {
+      std::this_thread::yield();
+   }
+   double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   printf("%-9s %10.0f commands/s, %5.1f%% applied on another core\n", affinity ? "affinity:" : "shared:",
+         commands * workers / secs, 100.0 * crossed.load() / applied.load());
+   return commands * workers / secs;
+}
+
+int main(int argc, char* argv[]) {
+   unsigned workers = std::thread::hardware_concurrency();
+   int tables = 256;
+   long commands = 1000000;
+   if (argc > 1) {
+      workers = atoi(argv[1]);
+   }
+   if (argc > 2) {
+      tables = atoi(argv[2]);
+   }
+   if (argc > 3) {
+      commands = atol(argv[3]);
+   }
+   if (workers == 0) {
+      workers = 1;
+   }
+   if (tables < (int)workers) {
+      tables = workers;
+   }
+   printf("%u workers, %d tables, %ld commands per producer, %u CPUs\n", workers, tables, commands,
+         std::thread::hardware_concurrency());
+   double shared = run_mode(false, workers, tables, commands);
+   double affine = run_mode(true, workers, tables, commands);
+   printf("affinity speedup: %.2fx\n", affine / shared);
+   // The scheduler threads run for the life of the process, so exit
+   // without running destructors on the schedulers they are using
+   fflush(stdout);
+   _exit(EXIT_SUCCESS);
+}
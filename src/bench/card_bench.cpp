@@ -0,0 +1,290 @@
+/* card_bench.cpp
+ * Benchmarks dealing rounds with the compact cards from cards.h against
+ * the representation they replaced, where every card in the shoe was a
+ * heap CardPDU (all of them new'd again on each reshuffle), hands were
+ * vectors of CardPDU* copied out of the seat on every read, and every
+ * hand sent was a new'd CardHandResponsePDU. Each round deals two cards
+ * to every player, has each one hit to 17, plays the dealer and checks
+ * every hand for blackjack, encoding each hand as the server sends it.
+ * The run reports ns and heap allocations per round for each.
+ *
+ * Usage: ./card_bench [<rounds>] [<players>] [<decks>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "../protocol/pdu.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+
+static uint64_t allocations = 0; // Heap allocations made by the process
+
+void* operator new(size_t size)
+{
+   allocations++;
+   void* p = malloc(size ? size : 1);
+   if (!p) {
+      throw std::bad_alloc();
+   }
+   return p;
+}
+
+void operator delete(void* p) noexcept
+{
+   free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+   free(p);
+}
+
+// rank_to_values is the server's map of ranks to soft and hard values.
+std::map<char, std::pair<uint8_t, uint8_t>> rank_to_values = {
+   {'A', {11,1}}, {'2', {2,2}}, {'3', {3,3}}, {'4', {4,4}}, {'5', {5,5}},
+   {'6', {6,6}}, {'7', {7,7}}, {'8', {8,8}}, {'9', {9,9}}, {'T', {10,10}},
+   {'J', {10,10}}, {'Q', {10,10}}, {'K', {10,10}},
+};
+
+// hand_value is the server's soft and hard valuation, merged, over any
+// sequence of cards whose ranks rank_of reads.
+template <typename Cards, typename RankOf>
+static uint8_t hand_value(const Cards& hand, RankOf rank_of)
+{
+   bool seen_soft_ace = false;
+   uint8_t soft_value = 0;
+   uint8_t hard_value = 0;
+   for (auto card : hand) {
+      char rank = rank_of(card);
+      soft_value += seen_soft_ace ? rank_to_values[rank].second : rank_to_values[rank].first;
+      hard_value += rank_to_values[rank].second;
+      seen_soft_ace |= rank == 'A';
+   }
+   return soft_value <= 21 ? soft_value : hard_value;
+}
+
+// OldSeat is the seat as it was before cards.h.
+class OldSeat
+{
+   std::vector<CardPDU*> hand;
+   public:
+      void addCard(CardPDU* c) {
+         hand.push_back(c);
+      }
+      void clearHand() {
+         hand.clear();
+      }
+      std::vector<CardPDU*> getHand() {
+         return hand;
+      }
+};
+
+// OldTable deals with the representation from before cards.h.
+struct OldTable
+{
+   std::vector<CardPDU*> deck;
+   std::vector<CardPDU*> dealer_hand;
+   std::default_random_engine rng;
+   uint8_t number_decks;
+   char* write_buffer = (char*)malloc(4096);
+   OldTable(uint8_t decks, unsigned seed) : rng(seed), number_decks(decks) {}
+   void init_deck() {
+      std::vector<char> ranks = {'A','2','3','4','5','6','7','8','9','T','J','Q','K'};
+      std::vector<char> suits = {'H','C','D','S'};
+      std::vector<CardPDU*> cards;
+      for (int i = 0; i < number_decks; i++) {
+         for (auto rank : ranks) {
+            for (auto suit : suits) {
+               cards.push_back(new CardPDU(rank, suit));
+            }
+         }
+      }
+      std::shuffle(std::begin(cards), std::end(cards), rng);
+      deck = cards;
+   }
+   CardPDU* draw() {
+      if (deck.size() == 0) {
+         init_deck();
+      }
+      CardPDU* card = deck.back();
+      deck.pop_back();
+      return card;
+   }
+   // Deal a card to the seat, returning its new value.
+   uint8_t hit(OldSeat& seat) {
+      seat.addCard(draw());
+      std::vector<CardPDU*> hand = seat.getHand();
+      uint8_t value = hand_value(hand, [](CardPDU* c) { return c->getRank(); });
+      CardHandResponsePDU* chr_pdu = new CardHandResponsePDU(1,1,1,1,value,value,hand);
+      chr_pdu->to_bytes(&write_buffer);
+      delete chr_pdu;
+      return value;
+   }
+   uint8_t hit_dealer() {
+      dealer_hand.push_back(draw());
+      uint8_t value = hand_value(dealer_hand, [](CardPDU* c) { return c->getRank(); });
+      CardHandResponsePDU* chr_pdu = new CardHandResponsePDU(1,1,1,0,value,value,dealer_hand);
+      chr_pdu->to_bytes(&write_buffer);
+      delete chr_pdu;
+      return value;
+   }
+   // Play one round, returning the number of blackjacks, so the work is kept.
+   int round(std::vector<OldSeat>& seats) {
+      dealer_hand.clear();
+      for (auto& seat : seats) {
+         seat.clearHand();
+         hit(seat);
+      }
+      hit_dealer();
+      for (auto& seat : seats) {
+         while (hit(seat) < 17) {}
+      }
+      while (hit_dealer() < 17) {}
+      int blackjacks = 0;
+      for (auto& seat : seats) {
+         blackjacks += seat.getHand().size() == 2;
+      }
+      return blackjacks;
+   }
+};
+
+// NewSeat holds its hand inline, as PlayerInfo does.
+class NewSeat
+{
+   Hand hand;
+   public:
+      void addCard(card_t c) {
+         hand.add(c);
+      }
+      void clearHand() {
+         hand.clear();
+      }
+      const Hand& getHand() {
+         return hand;
+      }
+};
+
+// NewTable deals with the representation from cards.h.
+struct NewTable
+{
+   Shoe shoe;
+   Hand dealer_hand;
+   ChaCha20 seeds;
+   uint8_t number_decks;
+   char* write_buffer = (char*)malloc(4096);
+   NewTable(uint8_t decks, unsigned seed) : seeds(ShoeSeed(), seed), number_decks(decks) {}
+   card_t draw() {
+      if (shoe.empty()) {
+         shoe.fill(number_decks, seeds.seed());
+      }
+      return shoe.draw();
+   }
+   uint8_t hit(NewSeat& seat) {
+      seat.addCard(draw());
+      const Hand& hand = seat.getHand();
+      uint8_t value = hand_value(hand, card_rank);
+      encode_hand(&write_buffer,1,1,1,1,value,value,hand);
+      return value;
+   }
+   uint8_t hit_dealer() {
+      dealer_hand.add(draw());
+      uint8_t value = hand_value(dealer_hand, card_rank);
+      encode_hand(&write_buffer,1,1,1,0,value,value,dealer_hand);
+      return value;
+   }
+   int round(std::vector<NewSeat>& seats) {
+      dealer_hand.clear();
+      for (auto& seat : seats) {
+         seat.clearHand();
+         hit(seat);
+      }
+      hit_dealer();
+      for (auto& seat : seats) {
+         while (hit(seat) < 17) {}
+      }
+      while (hit_dealer() < 17) {}
+      int blackjacks = 0;
+      for (auto& seat : seats) {
+         blackjacks += seat.getHand().size() == 2;
+      }
+      return blackjacks;
+   }
+};
+
+// check_encoding exits if encode_hand and CardHandResponsePDU disagree on any card.
+static void check_encoding()
+{
+   char* a = (char*)malloc(4096);
+   char* b = (char*)malloc(4096);
+   Hand hand;
+   std::vector<CardPDU*> pdus;
+   for (uint8_t rank = 0; rank < 13; rank++) {
+      for (uint8_t suit = 0; suit < 4; suit++) {
+         if (hand.size() == Hand::MAX_CARDS) {
+            hand.clear();
+            pdus.clear();
+         }
+         hand.add(make_card(rank, suit));
+         pdus.push_back(new CardPDU(card_ranks[rank], card_suits[suit]));
+         ssize_t len_a = encode_hand(&a,1,1,6,1,21,11,hand);
+         CardHandResponsePDU pdu(1,1,6,1,21,11,pdus);
+         ssize_t len_b = pdu.to_bytes(&b);
+         if (len_a != len_b || memcmp(a, b, len_a) != 0) {
+            fprintf(stderr, "encode_hand differs from CardHandResponsePDU\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+   }
+   free(a);
+   free(b);
+}
+
+// run times rounds rounds at table, printing ns and allocations per round.
+template <typename Table, typename Seat>
+static double run(const char* name, long rounds, int players, uint8_t decks)
+{
+   Table table(decks, 12345);
+   std::vector<Seat> seats(players);
+   long blackjacks = 0;
+   table.round(seats); // warm up
+   uint64_t before = allocations;
+   auto start = std::chrono::steady_clock::now();
+   for (long i = 0; i < rounds; i++) {
+      blackjacks += table.round(seats);
+   }
+   double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+   printf("%-8s %8.1f ns/round, %7.2f allocations/round (%ld blackjacks)\n", name, ns,
+         (double)(allocations - before) / rounds, blackjacks);
+   return ns;
+}
+
+int main(int argc, char* argv[]) {
+   long rounds = 1000000;
+   int players = 5;
+   int decks = 8;
+   if (argc > 1) {
+      rounds = atol(argv[1]);
+   }
+   if (argc > 2) {
+      players = atoi(argv[2]);
+   }
+   if (argc > 3) {
+      decks = atoi(argv[3]);
+   }
+   if (decks < 1 || decks > 255) {
+      decks = 8;
+   }
+   check_encoding();
+   printf("%ld rounds, %d players, %d decks\n", rounds, players, decks);
+   double old_ns = run<OldTable, OldSeat>("old:", rounds, players, decks);
+   double new_ns = run<NewTable, NewSeat>("compact:", rounds, players, decks);
+   printf("speedup: %.2fx\n", old_ns / new_ns);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,370 @@
+/* clock_bench.cpp
+ * Benchmarks playing rounds in virtual time (see clock.h). Every table
+ * steps through the server's phases on the Scheduler: a bet window, then
+ * a turn with a timeout for each player, then the dealer. Its players are
+ * bots, each an actor of its own that the table prompts and that posts
+ * its bet, hit or stand back to the table, as a connection would. Now
+ * and then a bot is away and lets the window or its turn time out, or
+ * leaves the table, and players join between rounds. The run reports
+ * rounds played, how much table time that covered, and replies that
+ * arrived after their phase had timed out, which a virtual clock must
+ * never cause.
+ *
+ * Usage: ./clock_bench [--real] [<tables>] [<seconds>] [<bet window ms>] [<turn timeout ms>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../server/lockprof.h"
+#include "../protocol/pdu.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+#include "../server/clock.h"
+#include "../server/scheduler.h"
+
+std::atomic<bool> done {false}; // set once the measurement is over, tables stop prompting and arming
+
+class BenchTable;
+
+// Prompt is what a table asks of a bot: a bet, or a play on a hand of value.
+struct Prompt
+{
+   bool bet;
+   uint8_t value;
+   uint64_t seq; // Echoed in the reply, so the table can tell a late one
+};
+
+// Reply is a bot's answer to a prompt, posted to the table.
+struct Reply
+{
+   enum Kind { BET, HIT, STAND, LEAVE } kind;
+   int seat;
+   uint64_t seq;
+};
+
+// Bot plays one seat. It answers every prompt by hitting to 17, except
+// that now and then it is away and does not answer, or leaves.
+class Bot : public Actor
+{
+   private:
+      ProfiledMutex mtx LOCK_SITE("Bot::mtx"); // Protects prompted and prompt
+      bool prompted = false;
+      Prompt prompt;
+      BenchTable* table;
+      int seat;
+      std::default_random_engine rng;
+   public:
+      Bot(BenchTable* table_, int seat_, unsigned seed) : table(table_), seat(seat_), rng(seed) {}
+      // ask has the bot answer p, replacing any prompt it has not answered yet.
+      void ask(const Prompt& p) {
+         {
+            std::lock_guard<ProfiledMutex> lock(mtx);
+            prompted = true;
+            prompt = p;
+         }
+         scheduler.schedule(this);
+      }
+      bool run();
+      bool has_work() {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         return prompted;
+      }
+};
+
+// BenchTable runs rounds for up to SEATS bots, with the phases and
+// timeouts of TableDetails, reading the time from the scheduler's clock.
+class BenchTable : public Actor
+{
+   private:
+      static const int SEATS = 5;
+      enum Phase { WAITING, BETTING, TURNS };
+      ProfiledMutex mtx LOCK_SITE("BenchTable::mtx"); // Protects replies
+      std::vector<Reply> replies; // Posted by bots, not yet applied
+      std::vector<Reply> applying; // Replies being applied, swapped with replies
+      Bot* bots[SEATS];
+      bool seated[SEATS] = {false};
+      bool betting[SEATS] = {false};
+      uint64_t asked[SEATS] = {0}; // seq of the prompt each seat owes an answer to, 0 if none
+      Hand hands[SEATS];
+      Hand dealer;
+      Shoe shoe;
+      ChaCha20 seeds;
+      std::default_random_engine rng;
+      Phase phase = WAITING;
+      Deadline deadline = Deadline::max();
+      Deadline::duration bet_window;
+      Deadline::duration turn_timeout;
+      int turn = 0;
+      uint64_t seq = 0;
+      // arm_for sets the deadline of the current phase to d from now.
+      void arm_for(Deadline::duration d) {
+         deadline = scheduler.now() + d;
+         scheduler.arm(this, deadline);
+      }
+      // ask prompts the bot in seat.
+      void ask(int seat, bool bet) {
+         asked[seat] = ++seq;
+         bots[seat]->ask(Prompt{bet, hands[seat].value(), seq});
+      }
+      // start_round seats anyone joining, then opens betting, or waits a
+      // minute for a player if the table is empty.
+      void start_round() {
+         int players = 0;
+         for (int s = 0; s < SEATS; s++) {
+            if (!seated[s] && rng() % 10 == 0) {
+               seated[s] = true;
+               joins++;
+            }
+            players += seated[s];
+         }
+         if (players == 0) {
+            phase = WAITING;
+            arm_for(std::chrono::seconds(60));
+            return;
+         }
+         phase = BETTING;
+         for (int s = 0; s < SEATS; s++) {
+            betting[s] = false;
+            if (seated[s]) {
+               ask(s, true);
+            }
+         }
+         arm_for(bet_window);
+      }
+      // deal_round closes betting and deals to everyone who bet.
+      void deal_round() {
+         if (shoe.cards.empty() || shoe.past_cut()) {
+            shoe.fill(8, seeds.seed());
+            shoe.place_cut(75);
+         }
+         dealer.clear();
+         dealer.add(draw());
+         for (int s = 0; s < SEATS; s++) {
+            asked[s] = 0;
+            hands[s].clear();
+            if (betting[s]) {
+               hands[s].add(draw());
+               hands[s].add(draw());
+            }
+         }
+         phase = TURNS;
+         turn = 0;
+         next_turn();
+      }
+      // next_turn prompts the next player from turn, or plays the dealer
+      // and starts the next round once everyone has played.
+      void next_turn() {
+         for (; turn < SEATS; turn++) {
+            if (betting[turn] && seated[turn] && hands[turn].value() < 21) {
+               ask(turn, false);
+               arm_for(turn_timeout);
+               return;
+            }
+         }
+         while (dealer.value() < 17) {
+            dealer.add(draw());
+         }
+         rounds++;
+         start_round();
+      }
+      // draw deals the next card, refilling the shoe if a round runs it out.
+      card_t draw() {
+         if (shoe.empty()) {
+            shoe.fill(8, seeds.seed());
+         }
+         return shoe.draw();
+      }
+      // apply applies one bot's reply.
+      void apply(const Reply& r) {
+         if (r.seq != asked[r.seat]) {
+            late++;
+            return;
+         }
+         asked[r.seat] = 0;
+         if (r.kind == Reply::LEAVE) {
+            seated[r.seat] = false;
+            leaves++;
+         } else if (r.kind == Reply::BET) {
+            betting[r.seat] = true;
+         } else if (r.kind == Reply::HIT) {
+            hands[r.seat].add(draw());
+            if (hands[r.seat].value() < 21) {
+               ask(r.seat, false);
+               return;
+            }
+         }
+         // The reply may have finished the betting window or the turn
+         if (phase == BETTING) {
+            for (int s = 0; s < SEATS; s++) {
+               if (asked[s]) {
+                  return;
+               }
+            }
+            deal_round();
+         } else if (phase == TURNS && r.seat == turn) {
+            turn++;
+            next_turn();
+         }
+      }
+      // on_timeout moves on when the current phase's deadline passes.
+      void on_timeout() {
+         if (phase == WAITING) {
+            start_round();
+         } else if (phase == BETTING) {
+            for (int s = 0; s < SEATS; s++) {
+               timeouts += asked[s] != 0;
+            }
+            deal_round();
+         } else {
+            timeouts++;
+            asked[turn] = 0;
+            turn++;
+            next_turn();
+         }
+      }
+   public:
+      uint64_t rounds = 0;
+      uint64_t timeouts = 0; // Bets and turns that timed out
+      uint64_t joins = 0;
+      uint64_t leaves = 0;
+      uint64_t late = 0; // Replies to a prompt that had already timed out
+      BenchTable(unsigned seed, Deadline::duration bet_window_, Deadline::duration turn_timeout_) :
+            seeds(ShoeSeed(), seed), rng(seed), bet_window(bet_window_), turn_timeout(turn_timeout_) {
+         for (int s = 0; s < SEATS; s++) {
+            bots[s] = new Bot(this, s, seed * SEATS + s);
+         }
+      }
+      // Open the table, staggering the first round so tables do not all start together.
+      void begin() {
+         arm_for(std::chrono::milliseconds(rng() % 1000));
+      }
+      // post hands the table a bot's reply, and schedules the table to apply it.
+      void post(const Reply& r) {
+         {
+            std::lock_guard<ProfiledMutex> lock(mtx);
+            replies.push_back(r);
+         }
+         scheduler.schedule(this);
+      }
+      bool run() {
+         if (done) {
+            return true;
+         }
+         {
+            std::lock_guard<ProfiledMutex> lock(mtx);
+            applying.swap(replies);
+         }
+         for (auto& r : applying) {
+            apply(r);
+         }
+         applying.clear();
+         if (scheduler.now() >= deadline) {
+            deadline = Deadline::max();
+            on_timeout();
+         }
+         return true;
+      }
+      bool has_work() {
+         if (done) {
+            return false;
+         }
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         return !replies.empty() || scheduler.now() >= deadline;
+      }
+};
+
+bool Bot::run() {
+   Prompt p;
+   {
+      std::lock_guard<ProfiledMutex> lock(mtx);
+      if (!prompted || done) {
+         return true;
+      }
+      prompted = false;
+      p = prompt;
+   }
+   unsigned roll = rng() % 100;
+   if (roll < 5) {
+      return true; // Away, the prompt times out
+   }
+   Reply::Kind kind;
+   if (roll < 6) {
+      kind = Reply::LEAVE;
+   } else if (p.bet) {
+      kind = Reply::BET;
+   } else {
+      kind = p.value < 17 ? Reply::HIT : Reply::STAND;
+   }
+   table->post(Reply{kind, seat, p.seq});
+   return true;
+}
+
+int main(int argc, char* argv[]) {
+   bool real = false;
+   int tables = 1000;
+   int seconds = 5;
+   int bet_window_ms = 15000;
+   int turn_timeout_ms = 30000;
+   int arg = 0;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--real") == 0) {
+         real = true;
+      } else if (arg == 0) {
+         tables = atoi(argv[i]), arg++;
+      } else if (arg == 1) {
+         seconds = atoi(argv[i]), arg++;
+      } else if (arg == 2) {
+         bet_window_ms = atoi(argv[i]), arg++;
+      } else if (arg == 3) {
+         turn_timeout_ms = atoi(argv[i]), arg++;
+      }
+   }
+   unsigned workers = std::thread::hardware_concurrency();
+   VirtualClock virtual_clock;
+   Clock* clock = real ? (Clock*)&real_clock : (Clock*)&virtual_clock;
+   printf("%d tables, %u workers, %d ms bet window, %d ms turns, %d s, %s clock\n", tables, workers, bet_window_ms,
+         turn_timeout_ms, seconds, real ? "real" : "virtual");
+   scheduler.start(workers, false, clock);
+   std::vector<BenchTable*> all;
+   for (int i = 0; i < tables; i++) {
+      all.push_back(new BenchTable(i, std::chrono::milliseconds(bet_window_ms), std::chrono::milliseconds(turn_timeout_ms)));
+   }
+   Deadline begin = clock->now();
+   for (auto t : all) {
+      t->begin();
+   }
+   std::this_thread::sleep_for(std::chrono::seconds(seconds));
+   done = true;
+   double table_secs = std::chrono::duration<double>(clock->now() - begin).count();
+   // Let any table or bot that is mid-step finish before reading its stats
+   std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   uint64_t rounds = 0;
+   uint64_t timeouts = 0;
+   uint64_t joins = 0;
+   uint64_t leaves = 0;
+   uint64_t late = 0;
+   for (auto t : all) {
+      rounds += t->rounds;
+      timeouts += t->timeouts;
+      joins += t->joins;
+      leaves += t->leaves;
+      late += t->late;
+   }
+   printf("rounds: %llu, %.0f/s\n", (unsigned long long)rounds, (double)rounds / seconds);
+   printf("timeouts: %llu, joins: %llu, leaves: %llu\n", (unsigned long long)timeouts, (unsigned long long)joins,
+         (unsigned long long)leaves);
+   printf("clock moved %.1f h in %d s (%.0fx real time), %.0f table-hours\n", table_secs / 3600, seconds,
+         table_secs / seconds, table_secs * tables / 3600);
+   printf("late replies: %llu\n", (unsigned long long)late);
+   // The scheduler's threads run for the life of the process, so exit
+   // without running destructors on the scheduler they are using
+   fflush(stdout);
+   _exit(!real && late ? EXIT_FAILURE : EXIT_SUCCESS);
+}
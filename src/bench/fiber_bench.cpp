@@ -0,0 +1,238 @@
+/* fiber_bench.cpp
+ * Benchmarks the fiber runtime from fiber.h against what a thread per
+ * connection pays. It times a bare context switch (the hand-written
+ * switch, and ucontext's swapcontext for comparison), a yield through
+ * the scheduler's run queue, a park/unpark handoff between two fibers
+ * (what a Completion costs a connection), the same handoff between two
+ * OS threads with a mutex and condition variable, spawning and
+ * finishing a fiber, and the memory a parked fiber holds.
+ *
+ * Usage: ./fiber_bench [<switches>] [<fibers>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "../server/lockprof.h"
+#include "../server/fiber.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// ns_per returns the nanoseconds per op since start.
+static double ns_per(bench_clock::time_point start, long ops)
+{
+   return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / ops;
+}
+
+// wait_for spins the main thread (not a fiber) until counter reaches n.
+static void wait_for(std::atomic<long>& counter, long n)
+{
+   while (counter.load() < n) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+   }
+}
+
+FiberContext main_ctx; // The main thread, for the bare switch benchmark
+FiberContext bare_ctx; // A context that switches straight back to main, forever
+
+// bare_switch switches from the main thread to bare_ctx and back n times.
+static double bare_switch(long n)
+{
+   Fiber* fiber = new Fiber();
+   fiber->fn = []{
+      for (;;) {
+         fiber_context_switch(&bare_ctx, &main_ctx);
+      }
+   };
+   char* stack = (char*)malloc(64 * 1024);
+   fiber_context_init(&bare_ctx, stack, 64 * 1024, fiber);
+   fiber_context_switch(&main_ctx, &bare_ctx); // warm up
+   auto start = bench_clock::now();
+   for (long i = 0; i < n; i++) {
+      fiber_context_switch(&main_ctx, &bare_ctx);
+   }
+   return ns_per(start, 2 * n);
+}
+
+ucontext_t main_uc;
+ucontext_t bare_uc;
+
+// ucontext_loop switches straight back to main, forever.
+static void ucontext_loop()
+{
+   for (;;) {
+      swapcontext(&bare_uc, &main_uc);
+   }
+}
+
+// ucontext_switch is bare_switch with swapcontext.
+static double ucontext_switch(long n)
+{
+   char* stack = (char*)malloc(64 * 1024);
+   getcontext(&bare_uc);
+   bare_uc.uc_stack.ss_sp = stack;
+   bare_uc.uc_stack.ss_size = 64 * 1024;
+   bare_uc.uc_link = NULL;
+   makecontext(&bare_uc, ucontext_loop, 0);
+   swapcontext(&main_uc, &bare_uc); // warm up
+   auto start = bench_clock::now();
+   for (long i = 0; i < n; i++) {
+      swapcontext(&main_uc, &bare_uc);
+   }
+   return ns_per(start, 2 * n);
+}
+
+// yield_switch has two fibers yield to each other n times each.
+static double yield_switch(long n)
+{
+   std::atomic<long> finished {0};
+   auto start = bench_clock::now();
+   for (int f = 0; f < 2; f++) {
+      fibers.spawn([n, &finished]{
+         for (long i = 0; i < n; i++) {
+            fibers.yield();
+         }
+         finished.fetch_add(1);
+      });
+   }
+   wait_for(finished, 2);
+   return ns_per(start, 2 * n);
+}
+
+// park_handoff has two fibers take turns, each unparking the other and
+// parking until it is its turn again, n times each.
+static double park_handoff(long n)
+{
+   std::atomic<long> finished {0};
+   std::atomic<long> turn {0};
+   std::atomic<Fiber*> players[2] = {{NULL}, {NULL}};
+   auto start = bench_clock::now();
+   for (int f = 0; f < 2; f++) {
+      fibers.spawn([f, n, &finished, &turn, &players]{
+         players[f].store(fibers.current());
+         while (!players[1 - f].load()) {
+            fibers.yield();
+         }
+         for (long i = 0; i < n; i++) {
+            while (turn.load() % 2 != f) {
+               fibers.park();
+            }
+            turn.fetch_add(1);
+            fibers.unpark(players[1 - f].load());
+         }
+         finished.fetch_add(1);
+      });
+   }
+   wait_for(finished, 2);
+   return ns_per(start, 2 * n);
+}
+
+// thread_handoff is park_handoff between two OS threads.
+static double thread_handoff(long n)
+{
+   std::mutex mtx;
+   std::condition_variable cv;
+   long turn = 0;
+   auto play = [n, &mtx, &cv, &turn](int f) {
+      for (long i = 0; i < n; i++) {
+         std::unique_lock<std::mutex> lock(mtx);
+         cv.wait(lock, [&]{ return turn % 2 == f; });
+         turn++;
+         cv.notify_one();
+      }
+   };
+   auto start = bench_clock::now();
+   std::thread a(play, 0);
+   std::thread b(play, 1);
+   a.join();
+   b.join();
+   return ns_per(start, 2 * n);
+}
+
+// spawn_exit spawns n fibers that finish at once.
+static double spawn_exit(long n)
+{
+   std::atomic<long> finished {0};
+   auto start = bench_clock::now();
+   for (long i = 0; i < n; i++) {
+      fibers.spawn([&finished]{ finished.fetch_add(1); });
+   }
+   wait_for(finished, n);
+   return ns_per(start, n);
+}
+
+// spawn_parked spawns n fibers that all park at once, as idle connections
+// do, then wakes them all. Returns the resident memory they added, in KiB.
+static long spawn_parked(long n)
+{
+   std::atomic<long> parked {0};
+   std::atomic<long> finished {0};
+   std::atomic<bool> release {false};
+   std::vector<Fiber*> all(n, NULL);
+   long before = 0;
+   long during = 0;
+   FILE* f = fopen("/proc/self/statm", "r");
+   long size;
+   long pages;
+   if (f && fscanf(f, "%ld %ld", &size, &pages) == 2) {
+      before = pages;
+   }
+   if (f) {
+      fclose(f);
+   }
+   for (long i = 0; i < n; i++) {
+      fibers.spawn([i, &all, &parked, &finished, &release]{
+         all[i] = fibers.current();
+         parked.fetch_add(1);
+         while (!release.load()) {
+            fibers.park();
+         }
+         finished.fetch_add(1);
+      });
+   }
+   wait_for(parked, n);
+   f = fopen("/proc/self/statm", "r");
+   if (f && fscanf(f, "%ld %ld", &size, &pages) == 2) {
+      during = pages;
+   }
+   if (f) {
+      fclose(f);
+   }
+   release.store(true);
+   for (long i = 0; i < n; i++) {
+      fibers.unpark(all[i]);
+   }
+   wait_for(finished, n);
+   return (during - before) * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char* argv[]) {
+   long switches = 2000000;
+   long count = 10000;
+   if (argc > 1) {
+      switches = atol(argv[1]);
+   }
+   if (argc > 2) {
+      count = atol(argv[2]);
+   }
+   fibers.start(1);
+   printf("%ld switches, %ld fibers, 1 worker\n", switches, count);
+   printf("bare context switch:      %7.1f ns\n", bare_switch(switches));
+   printf("ucontext swapcontext:     %7.1f ns\n", ucontext_switch(switches));
+   printf("fiber yield:              %7.1f ns\n", yield_switch(switches));
+   printf("fiber park/unpark:        %7.1f ns\n", park_handoff(switches));
+   printf("thread mutex/condvar:     %7.1f ns\n", thread_handoff(switches / 10));
+   printf("fiber spawn and exit:     %7.1f ns\n", spawn_exit(count));
+   long kib = spawn_parked(count);
+   printf("%ld parked fibers:    %7ld KiB resident (%.1f KiB each)\n", count, kib, (double)kib / count);
+   // The fiber threads run for the life of the process, so exit without
+   // running destructors on the scheduler they are using
+   fflush(stdout);
+   _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,247 @@
+/* hand_bench.cpp
+ * Benchmarks the incremental hand evaluator in cards.h against the
+ * functions it replaced, which summed every card again on each hit,
+ * looking each rank up in a std::map: first as they were with hands of
+ * CardPDU* passed by value, then over a Hand. Each hand is dealt from a
+ * shuffled shoe until it reaches 17, and after every card the soft,
+ * hard and overall values are computed and the hand is checked for
+ * blackjack, bust and whether the dealer stands. Every evaluation is
+ * also checked against the old functions before timing.
+ *
+ * Usage: ./hand_bench [<hands>] [<decks>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <vector>
+
+#include "../protocol/pdu.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+
+// rank_to_values maps card ranks to valuations, as the server did.
+// Each pair represents the soft valuation and hard valuation respectively.
+std::map<char, std::pair<uint8_t, uint8_t>> rank_to_values = {
+   {'A', {11,1}}, {'2', {2,2}}, {'3', {3,3}}, {'4', {4,4}}, {'5', {5,5}},
+   {'6', {6,6}}, {'7', {7,7}}, {'8', {8,8}}, {'9', {9,9}}, {'T', {10,10}},
+   {'J', {10,10}}, {'Q', {10,10}}, {'K', {10,10}},
+};
+
+// get_soft_value is the server's old soft valuation, over any sequence of
+// cards whose ranks rank_of reads.
+template <typename Cards, typename RankOf>
+static uint8_t get_soft_value(Cards hand, RankOf rank_of)
+{
+   bool seen_soft_ace = false;
+   uint8_t value = 0;
+   for (auto card : hand) {
+      char rank = rank_of(card);
+      if (!seen_soft_ace) {
+         value += rank_to_values[rank].first;
+      } else {
+         value += rank_to_values[rank].second;
+      }
+      if (rank == 'A') {
+         seen_soft_ace = true;
+      }
+   }
+   return value;
+}
+
+// get_hard_value is the server's old hard valuation.
+template <typename Cards, typename RankOf>
+static uint8_t get_hard_value(Cards hand, RankOf rank_of)
+{
+   uint8_t value = 0;
+   for (auto card : hand) {
+      value += rank_to_values[rank_of(card)].second;
+   }
+   return value;
+}
+
+// get_value is the server's old merge of the soft and hard values.
+static uint8_t get_value(uint8_t soft_value, uint8_t hard_value)
+{
+   return soft_value <= 21 ? soft_value : hard_value;
+}
+
+// Eval is everything the table decides from a hand after a card.
+struct Eval
+{
+   uint8_t soft;
+   uint8_t hard;
+   uint8_t value;
+   bool blackjack;
+   bool bust;
+   bool stands; // dealer stands, hitting soft 17
+};
+
+// old_eval evaluates a hand of CardPDU* from scratch, the hand passed by value.
+static Eval old_eval(std::vector<CardPDU*> hand)
+{
+   auto rank_of = [](CardPDU* c) { return c->getRank(); };
+   Eval e;
+   e.soft = get_soft_value(hand, rank_of);
+   e.hard = get_hard_value(hand, rank_of);
+   e.value = get_value(e.soft, e.hard);
+   e.blackjack = e.value == 21 && hand.size() == 2;
+   e.bust = e.value > 21;
+   e.stands = e.value >= 18 || e.hard == 17;
+   return e;
+}
+
+// scan_eval evaluates a Hand from scratch, through the map.
+static Eval scan_eval(const Hand& hand)
+{
+   Eval e;
+   e.soft = get_soft_value<const Hand&>(hand, card_rank);
+   e.hard = get_hard_value<const Hand&>(hand, card_rank);
+   e.value = get_value(e.soft, e.hard);
+   e.blackjack = e.value == 21 && hand.size() == 2;
+   e.bust = e.value > 21;
+   e.stands = e.value >= 18 || e.hard == 17;
+   return e;
+}
+
+// incremental_eval reads the totals the Hand keeps.
+static Eval incremental_eval(const Hand& hand)
+{
+   Eval e;
+   e.soft = hand.soft_value();
+   e.hard = hand.hard_value();
+   e.value = hand.value();
+   e.blackjack = hand.is_blackjack();
+   e.bust = hand.is_bust();
+   e.stands = hand.dealer_stands(true);
+   return e;
+}
+
+// same checks two evaluations agree.
+static bool same(const Eval& a, const Eval& b)
+{
+   return a.soft == b.soft && a.hard == b.hard && a.value == b.value && a.blackjack == b.blackjack &&
+      a.bust == b.bust && a.stands == b.stands;
+}
+
+// check exits if the evaluators disagree on any hand dealt from shoe, or
+// on soft 17 standing, for every hand of up to 21 aces and twos.
+static void check(const std::vector<card_t>& shoe)
+{
+   std::vector<CardPDU*> pdus;
+   Hand hand;
+   for (size_t i = 0; i < shoe.size(); i++) {
+      pdus.push_back(new CardPDU(card_rank(shoe[i]), card_suit(shoe[i])));
+      hand.add(shoe[i]);
+      Eval a = old_eval(pdus);
+      Eval b = scan_eval(hand);
+      Eval c = incremental_eval(hand);
+      bool soft_17 = a.value == 17 && a.soft == 17 && a.hard != 17;
+      if (!same(a, b) || !same(a, c) || hand.dealer_stands(false) != (a.stands || soft_17)) {
+         fprintf(stderr, "evaluators disagree on a %zu card hand\n", pdus.size());
+         exit(EXIT_FAILURE);
+      }
+      if (a.value >= 17) {
+         pdus.clear();
+         hand.clear();
+      }
+   }
+   for (int aces = 0; aces <= Hand::MAX_CARDS; aces++) {
+      for (int twos = 0; aces + twos <= Hand::MAX_CARDS && aces + 2 * twos <= 31; twos++) {
+         pdus.clear();
+         hand.clear();
+         for (int i = 0; i < aces + twos; i++) {
+            card_t card = make_card(i < aces ? 0 : 1, i & 3);
+            pdus.push_back(new CardPDU(card_rank(card), card_suit(card)));
+            hand.add(card);
+         }
+         if (!same(old_eval(pdus), incremental_eval(hand))) {
+            fprintf(stderr, "evaluators disagree on %d aces and %d twos\n", aces, twos);
+            exit(EXIT_FAILURE);
+         }
+      }
+   }
+}
+
+// time_old deals hands of CardPDU* and evaluates them with old_eval, returning ns per card.
+static double time_old(const std::vector<CardPDU*>& shoe, long hands, uint64_t& checksum)
+{
+   std::vector<CardPDU*> hand;
+   long cards = 0;
+   size_t next = 0;
+   auto start = std::chrono::steady_clock::now();
+   for (long h = 0; h < hands; h++) {
+      hand.clear();
+      for (;;) {
+         hand.push_back(shoe[next]);
+         next = next + 1 == shoe.size() ? 0 : next + 1;
+         cards++;
+         Eval e = old_eval(hand);
+         checksum += e.soft + e.blackjack + e.bust;
+         if (e.value >= 17) {
+            break;
+         }
+      }
+   }
+   return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / cards;
+}
+
+// time_hand deals Hands and evaluates them with eval, returning ns per card.
+template <typename Evaluator>
+static double time_hand(const std::vector<card_t>& shoe, long hands, Evaluator eval, uint64_t& checksum)
+{
+   Hand hand;
+   long cards = 0;
+   size_t next = 0;
+   auto start = std::chrono::steady_clock::now();
+   for (long h = 0; h < hands; h++) {
+      hand.clear();
+      for (;;) {
+         hand.add(shoe[next]);
+         next = next + 1 == shoe.size() ? 0 : next + 1;
+         cards++;
+         Eval e = eval(hand);
+         checksum += e.soft + e.blackjack + e.bust;
+         if (e.value >= 17) {
+            break;
+         }
+      }
+   }
+   return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / cards;
+}
+
+int main(int argc, char* argv[]) {
+   long hands = 5000000;
+   int decks = 8;
+   if (argc > 1) {
+      hands = atol(argv[1]);
+   }
+   if (argc > 2) {
+      decks = atoi(argv[2]);
+   }
+   if (decks < 1 || decks > 255) {
+      decks = 8;
+   }
+   ChaCha20 seeds(ShoeSeed(), 12345);
+   Shoe shoe;
+   shoe.fill(decks, seeds.seed());
+   std::vector<CardPDU*> pdus;
+   for (auto card : shoe.cards) {
+      pdus.push_back(new CardPDU(card_rank(card), card_suit(card)));
+   }
+   check(shoe.cards);
+   printf("%ld hands, %d decks\n", hands, decks);
+   uint64_t sums[3] = {0, 0, 0};
+   double old_ns = time_old(pdus, hands, sums[0]);
+   double scan_ns = time_hand(shoe.cards, hands, scan_eval, sums[1]);
+   double inc_ns = time_hand(shoe.cards, hands, incremental_eval, sums[2]);
+   if (sums[0] != sums[1] || sums[0] != sums[2]) {
+      fprintf(stderr, "evaluators disagree on the timed hands\n");
+      return EXIT_FAILURE;
+   }
+   printf("CardPDU* by value, map: %7.1f ns/card\n", old_ns);
+   printf("Hand, map:              %7.1f ns/card\n", scan_ns);
+   printf("incremental:            %7.1f ns/card (%.1fx, %.1fx)\n", inc_ns, old_ns / inc_ns, scan_ns / inc_ns);
+   return EXIT_SUCCESS;
+}
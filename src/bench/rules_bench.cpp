@@ -0,0 +1,121 @@
+/* rules_bench.cpp
+ * Benchmarks the rules policies from rules.h: a FixedRules, with the soft
+ * 17 rule and payoff fixed at compile time, against RuntimeRules, which
+ * reads them from the settings, both inlined into a templated loop (as
+ * cbp-sim plays) and behind a RulesEngine (as server tables play). Each
+ * hand deals the player two cards and hits them to 17, plays the dealer
+ * out and settles, from one shuffled shoe, so only the rules differ. All
+ * four paths are checked to pay out the same before timing.
+ *
+ * Usage: ./rules_bench [<hands>] [<header>:<value> ...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../protocol/pdu.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+#include "../server/rules.h"
+
+// play_hands plays hands hands from shoe with rules (a policy or a
+// RulesEngine), returning the total paid out on bets of 10.
+template <typename Rules>
+static uint64_t play_hands(const Rules& rules, const std::vector<card_t>& shoe, long hands)
+{
+   Hand player;
+   Hand dealer;
+   size_t next = 0;
+   uint64_t paid = 0;
+   for (long h = 0; h < hands; h++) {
+      player.clear();
+      dealer.clear();
+      player.add(shoe[next]);
+      next = next + 1 == shoe.size() ? 0 : next + 1;
+      dealer.add(shoe[next]);
+      next = next + 1 == shoe.size() ? 0 : next + 1;
+      player.add(shoe[next]);
+      next = next + 1 == shoe.size() ? 0 : next + 1;
+      while (player.value() < 17) {
+         player.add(shoe[next]);
+         next = next + 1 == shoe.size() ? 0 : next + 1;
+      }
+      do {
+         dealer.add(shoe[next]);
+         next = next + 1 == shoe.size() ? 0 : next + 1;
+      } while (rules.dealer_hits(dealer));
+      paid += rules.payout(10, player, dealer);
+   }
+   return paid;
+}
+
+// time_hands returns the ns per hand of play_hands, and its payout in paid.
+template <typename Rules>
+static double time_hands(const Rules& rules, const std::vector<card_t>& shoe, long hands, uint64_t& paid)
+{
+   auto start = std::chrono::steady_clock::now();
+   paid = play_hands(rules, shoe, hands);
+   return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / hands;
+}
+
+// Bench times every path once with_rules has picked the policy of the settings.
+struct Bench
+{
+   TableSettings settings;
+   std::vector<card_t> shoe;
+   long hands;
+   int failed = 0;
+   template <typename Rules>
+   void operator()(const Rules& policy) {
+      RuntimeRules generic(settings);
+      RulesEngine* specialized_engine = new RulesEngineOf<Rules>(policy);
+      RulesEngine* generic_engine = new RulesEngineOf<RuntimeRules>(generic);
+      if (play_hands(policy, shoe, 100000) != play_hands(generic, shoe, 100000) ||
+            play_hands(*specialized_engine, shoe, 100000) != play_hands(*generic_engine, shoe, 100000) ||
+            play_hands(policy, shoe, 100000) != play_hands(*generic_engine, shoe, 100000)) {
+         fprintf(stderr, "the rules paths pay out differently\n");
+         failed = 1;
+         return;
+      }
+      uint64_t paid[4];
+      double fixed_ns = time_hands(policy, shoe, hands, paid[0]);
+      double runtime_ns = time_hands(generic, shoe, hands, paid[1]);
+      double fixed_engine_ns = time_hands(*specialized_engine, shoe, hands, paid[2]);
+      double runtime_engine_ns = time_hands(*generic_engine, shoe, hands, paid[3]);
+      printf("rules: %s\n", policy.name().c_str());
+      printf("inlined, specialized:  %6.1f ns/hand\n", fixed_ns);
+      printf("inlined, generic:      %6.1f ns/hand (%.2fx)\n", runtime_ns, runtime_ns / fixed_ns);
+      printf("engine, specialized:   %6.1f ns/hand\n", fixed_engine_ns);
+      printf("engine, generic:       %6.1f ns/hand (%.2fx)\n", runtime_engine_ns, runtime_engine_ns / fixed_engine_ns);
+      printf("(paid %llu)\n", (unsigned long long)(paid[0] + paid[1] + paid[2] + paid[3]));
+      delete specialized_engine;
+      delete generic_engine;
+   }
+};
+
+int main(int argc, char* argv[]) {
+   long hands = 20000000;
+   std::string headers = "";
+   for (int i = 1; i < argc; i++) {
+      if (strchr(argv[i], ':')) {
+         headers += argv[i];
+         headers += "\n";
+      } else {
+         hands = atol(argv[i]);
+      }
+   }
+   Bench bench;
+   bench.settings.parse(headers + "\n");
+   bench.hands = hands;
+   ChaCha20 seeds(ShoeSeed(), 12345);
+   Shoe shoe;
+   shoe.fill(bench.settings.number_decks, seeds.seed());
+   bench.shoe = shoe.cards;
+   printf("%ld hands, %u decks\n", hands, bench.settings.number_decks);
+   with_rules(bench.settings, bench);
+   return bench.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/* scheduler_bench.cpp
+ * Benchmarks how many tables the Scheduler from scheduler.h can keep
+ * on time per core. Every simulated table arms a timer for its next
+ * phase, does a round step's worth of work when the timer fires (a
+ * shuffle and a few hand totals), and arms the next one. The run
+ * reports phase steps per second per worker and how late timers fire,
+ * which is what players would see as a slow table.
+ *
+ * Usage: ./scheduler_bench [<workers>] [<tables>] [<phase ms>] [<seconds>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../server/lockprof.h"
+#include "../server/clock.h"
+#include "../server/scheduler.h"
+
+std::atomic<bool> done {false}; // set once the measurement is over, tables stop re-arming
+
+// BenchTable is a table with no players: it only steps through phases on timers.
+class BenchTable : public Actor
+{
+   private:
+      std::chrono::milliseconds phase;
+      Deadline deadline;
+      std::vector<uint8_t> shoe;
+      std::default_random_engine rng;
+   public:
+      uint64_t steps = 0; // phases completed
+      uint64_t checksum = 0; // sum of the hand totals, so the work is not optimized out
+      uint64_t late_total_us = 0; // sum of how late each timer fired
+      uint64_t late_max_us = 0; // latest any timer fired
+      std::vector<uint32_t> late_us; // every lateness, for percentiles
+      BenchTable(std::chrono::milliseconds phase_, unsigned seed) : phase(phase_), rng(seed) {
+         for (int i = 0; i < 52; i++) {
+            shoe.push_back(i % 13 + 1);
+         }
+      }
+      // Stagger the first deadline so the tables do not all fire together.
+      void begin() {
+         deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(rng() % (phase.count() * 1000));
+         scheduler.arm(this, deadline);
+      }
+      bool run() {
+         if (done) {
+            return true;
+         }
+         auto now = std::chrono::steady_clock::now();
+         if (now < deadline) {
+            return true;
+         }
+         uint64_t late = std::chrono::duration_cast<std::chrono::microseconds>(now - deadline).count();
+         late_total_us += late;
+         late_max_us = std::max(late_max_us, late);
+         late_us.push_back(late);
+         // A round step: shuffle the shoe and total a few hands
+         std::shuffle(shoe.begin(), shoe.end(), rng);
+         uint32_t total = 0;
+         for (int i = 0; i < 14; i++) {
+            total += std::min<uint8_t>(shoe[i], 10);
+         }
+         checksum += total;
+         steps += 1;
+         deadline = now + phase;
+         scheduler.arm(this, deadline);
+         return true;
+      }
+      bool has_work() {
+         return !done && std::chrono::steady_clock::now() >= deadline;
+      }
+};
+
+int main(int argc, char* argv[]) {
+   unsigned workers = std::thread::hardware_concurrency();
+   int tables = 10000;
+   int phase_ms = 100;
+   int seconds = 5;
+   if (argc > 1) {
+      workers = atoi(argv[1]);
+   }
+   if (argc > 2) {
+      tables = atoi(argv[2]);
+   }
+   if (argc > 3) {
+      phase_ms = atoi(argv[3]);
+   }
+   if (argc > 4) {
+      seconds = atoi(argv[4]);
+   }
+   if (workers == 0) {
+      workers = 1;
+   }
+   printf("%d tables, %u workers, %d ms phases, %d s\n", tables, workers, phase_ms, seconds);
+   scheduler.start(workers);
+   std::vector<BenchTable*> all;
+   for (int i = 0; i < tables; i++) {
+      all.push_back(new BenchTable(std::chrono::milliseconds(phase_ms), i));
+   }
+   for (auto t : all) {
+      t->begin();
+   }
+   std::this_thread::sleep_for(std::chrono::seconds(seconds));
+   done = true;
+   // Let any table that is mid-step finish before reading its stats
+   std::this_thread::sleep_for(std::chrono::milliseconds(phase_ms * 2 + 100));
+   uint64_t steps = 0;
+   uint64_t late_total = 0;
+   uint64_t late_max = 0;
+   std::vector<uint32_t> late;
+   for (auto t : all) {
+      steps += t->steps;
+      late_total += t->late_total_us;
+      late_max = std::max(late_max, t->late_max_us);
+      late.insert(late.end(), t->late_us.begin(), t->late_us.end());
+   }
+   std::sort(late.begin(), late.end());
+   double expected = (double)tables * seconds * 1000 / phase_ms;
+   printf("phase steps: %llu (%.1f%% of schedule), %.0f/s, %.0f/s per worker\n",
+         (unsigned long long)steps, 100.0 * steps / expected,
+         (double)steps / seconds, (double)steps / seconds / workers);
+   if (!late.empty()) {
+      printf("timer lateness: mean %llu us, p50 %u us, p99 %u us, max %llu us\n",
+            (unsigned long long)(late_total / late.size()), late[late.size() / 2],
+            late[late.size() * 99 / 100], (unsigned long long)late_max);
+   }
+   printf("tables per worker: %.0f (a thread per table would need %d threads)\n",
+         (double)tables / workers, tables);
+   // The scheduler's threads run for the life of the process, so exit
+   // without running destructors on the scheduler they are using
+   fflush(stdout);
+   _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,144 @@
+/* shoe_bench.cpp
+ * Benchmarks how long dealing a round takes when a table shuffles its
+ * own shoe the moment it runs out, as tables did, against changing to a
+ * shoe the ShoeShuffler from shuffler.h has ready once the cut card
+ * comes out. Each round deals two cards to every player, has each one
+ * draw to 17 and plays the dealer. The run reports the mean, p99, p99.9
+ * and longest round, which is where a mid-round shuffle shows up, and
+ * how many shoes the table had to shuffle itself.
+ *
+ * Usage: ./shoe_bench [<rounds>] [<players>] [<decks>] [<penetration>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../protocol/pdu.h"
+#include "../server/lockprof.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+#include "../server/shuffler.h"
+
+// BenchTable deals rounds from its shoe, either shuffling it when it runs
+// out or changing it between rounds at the cut card.
+struct BenchTable
+{
+   bool pooled;
+   uint8_t decks;
+   uint8_t penetration;
+   Shoe* shoe;
+   Hand dealer_hand;
+   std::vector<Hand> hands;
+   ChaCha20 seeds;
+   long shuffles = 0; // shoes shuffled inline
+   BenchTable(bool pooled_, int players, uint8_t decks_, uint8_t penetration_) :
+      pooled(pooled_), decks(decks_), penetration(penetration_), hands(players), seeds(ShoeSeed(), 12345) {
+      shoe = new Shoe();
+      shoe->fill(decks, seeds.seed());
+   }
+   void change_shoe() {
+      shuffler.recycle(shoe);
+      shoe = shuffler.take(decks);
+      shoe->place_cut(penetration);
+   }
+   card_t draw() {
+      if (shoe->empty()) {
+         if (pooled) {
+            change_shoe();
+         } else {
+            shoe->fill(decks, seeds.seed());
+            shuffles++;
+         }
+      }
+      return shoe->draw();
+   }
+   // Deal one round, returning the dealer's value, so the work is kept.
+   int round() {
+      if (pooled && shoe->past_cut()) {
+         change_shoe();
+      }
+      dealer_hand.clear();
+      for (auto& hand : hands) {
+         hand.clear();
+         hand.add(draw());
+      }
+      dealer_hand.add(draw());
+      for (auto& hand : hands) {
+         do {
+            hand.add(draw());
+         } while (hand.value() < 17);
+      }
+      while (!dealer_hand.dealer_stands(true)) {
+         dealer_hand.add(draw());
+      }
+      return dealer_hand.value();
+   }
+};
+
+volatile long sink; // Where round results go, so the work is kept
+
+// run deals rounds rounds and prints the distribution of round times.
+static void run(const char* name, bool pooled, long rounds, int players, uint8_t decks, uint8_t penetration)
+{
+   BenchTable table(pooled, players, decks, penetration);
+   std::vector<double> ns(rounds);
+   uint64_t misses = shuffler.getMisses();
+   for (long i = 0; i < rounds; i++) {
+      auto start = std::chrono::steady_clock::now();
+      sink = table.round();
+      ns[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      if (pooled) {
+         // Leave the shuffler time between rounds, as a table's betting window does
+         std::this_thread::yield();
+      }
+   }
+   double total = 0;
+   for (auto t : ns) {
+      total += t;
+   }
+   std::sort(ns.begin(), ns.end());
+   long shuffled = pooled ? (long)(shuffler.getMisses() - misses) : table.shuffles;
+   printf("%-8s mean %6.0f ns, p99 %6.0f ns, p99.9 %7.0f ns, max %7.0f ns, %ld shoes shuffled by the table\n", name,
+         total / rounds, ns[rounds * 99 / 100], ns[rounds * 999 / 1000], ns[rounds - 1], shuffled);
+}
+
+int main(int argc, char* argv[]) {
+   long rounds = 200000;
+   int players = 5;
+   int decks = 8;
+   int penetration = 75;
+   if (argc > 1) {
+      rounds = atol(argv[1]);
+   }
+   if (argc > 2) {
+      players = atoi(argv[2]);
+   }
+   if (argc > 3) {
+      decks = atoi(argv[3]);
+   }
+   if (argc > 4) {
+      penetration = atoi(argv[4]);
+   }
+   if (decks < 1 || decks > 255) {
+      decks = 8;
+   }
+   if (penetration < 1 || penetration > 100) {
+      penetration = 75;
+   }
+   if (rounds < 1000) {
+      rounds = 1000;
+   }
+   shuffler.start();
+   printf("%ld rounds, %d players, %d decks, %d%% penetration\n", rounds, players, decks, penetration);
+   run("inline:", false, rounds, players, decks, penetration);
+   run("pooled:", true, rounds, players, decks, penetration);
+   // The shuffler thread runs for the life of the process, so exit without
+   // running destructors on the shuffler it is using
+   fflush(stdout);
+   _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,153 @@
+/* shuffle_bench.cpp
+ * Benchmarks shuffling a shoe with the ChaCha20 generator from chacha.h
+ * against the std::default_random_engine tables used to shuffle with
+ * (and std::mt19937 for reference), and what a table paid to set its
+ * engine up. Before timing, it checks the generator against the RFC 8439
+ * block function test vector, checks that a seed always gives the same
+ * shoe, and counts every ordering of small shuffles to check they are
+ * uniform.
+ *
+ * Usage: ./shuffle_bench [<shoes>] [<decks>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../protocol/pdu.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// check_rfc8439 exits unless the first block matches RFC 8439 section 2.3.2.
+static void check_rfc8439()
+{
+   ShoeSeed key;
+   for (int i = 0; i < 32; i++) {
+      key.bytes[i] = i;
+   }
+   // The RFC's block counter 1 and nonce 00:00:00:09:00:00:00:4a:00:00:00:00,
+   // as this generator's 64-bit counter and stream
+   ChaCha20 rng(key, 0x4a000000, 1 | (uint64_t)0x09000000 << 32);
+   const uint32_t expected[4] = {0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3};
+   for (int i = 0; i < 4; i++) {
+      if (rng() != expected[i]) {
+         fprintf(stderr, "ChaCha20 does not match the RFC 8439 test vector\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+// check_replay exits unless the same seed gives the same shoe.
+static void check_replay(uint8_t decks)
+{
+   ChaCha20 seeds(ShoeSeed::random());
+   ShoeSeed seed = seeds.seed();
+   Shoe a;
+   Shoe b;
+   a.fill(decks, seed);
+   b.fill(decks, seeds.seed());
+   b.fill(decks, seed);
+   if (a.cards != b.cards) {
+      fprintf(stderr, "a seed did not reproduce its shoe\n");
+      exit(EXIT_FAILURE);
+   }
+}
+
+// check_uniform shuffles 4 items n times and exits if any of the 24
+// orderings comes up far more or less often than n / 24 (a chi-squared
+// statistic over 23 degrees of freedom above 60, about p < 0.00003).
+static void check_uniform(long n)
+{
+   ChaCha20 rng(ShoeSeed::random());
+   long counts[256] = {0};
+   for (long i = 0; i < n; i++) {
+      uint8_t items[4] = {0, 1, 2, 3};
+      fisher_yates(items, 4, rng);
+      counts[items[0] << 6 | items[1] << 4 | items[2] << 2 | items[3]]++;
+   }
+   double expected = n / 24.0;
+   double chi2 = 0;
+   int seen = 0;
+   for (int i = 0; i < 256; i++) {
+      if (counts[i]) {
+         seen++;
+         chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+      }
+   }
+   printf("4-item shuffles: %d orderings seen, chi-squared %.1f (23 degrees of freedom)\n", seen, chi2);
+   if (seen != 24 || chi2 > 60) {
+      fprintf(stderr, "shuffles are not uniform\n");
+      exit(EXIT_FAILURE);
+   }
+}
+
+// time_std shuffles a shoe of decks decks shoes times with std::shuffle and Engine.
+template <typename Engine>
+static double time_std(long shoes, uint8_t decks)
+{
+   std::vector<card_t> cards(decks * 52);
+   for (size_t i = 0; i < cards.size(); i++) {
+      cards[i] = i % 52;
+   }
+   std::random_device rd {};
+   Engine rng { rd() };
+   auto start = bench_clock::now();
+   for (long i = 0; i < shoes; i++) {
+      std::shuffle(cards.begin(), cards.end(), rng);
+   }
+   return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / shoes;
+}
+
+// time_chacha refills a Shoe from a fresh seed shoes times, as the shuffler does.
+static double time_chacha(long shoes, uint8_t decks)
+{
+   ChaCha20 seeds(ShoeSeed::random());
+   Shoe shoe;
+   auto start = bench_clock::now();
+   for (long i = 0; i < shoes; i++) {
+      shoe.fill(decks, seeds.seed());
+   }
+   return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / shoes;
+}
+
+volatile unsigned sink; // Where engine output goes, so the setup is kept
+
+// time_setup returns the ns a table paid to set up its random device and engine.
+static double time_setup(long n)
+{
+   auto start = bench_clock::now();
+   for (long i = 0; i < n; i++) {
+      std::random_device rd {};
+      std::default_random_engine rng { rd() };
+      sink = rng();
+   }
+   return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / n;
+}
+
+int main(int argc, char* argv[]) {
+   long shoes = 20000;
+   int decks = 8;
+   if (argc > 1) {
+      shoes = atol(argv[1]);
+   }
+   if (argc > 2) {
+      decks = atoi(argv[2]);
+   }
+   if (decks < 1 || decks > 255) {
+      decks = 8;
+   }
+   check_rfc8439();
+   check_replay(decks);
+   check_uniform(2400000);
+   printf("%ld shoes, %d decks\n", shoes, decks);
+   printf("default_random_engine: %9.0f ns/shoe\n", time_std<std::default_random_engine>(shoes, decks));
+   printf("mt19937:               %9.0f ns/shoe\n", time_std<std::mt19937>(shoes, decks));
+   printf("ChaCha20, seeded shoe: %9.0f ns/shoe\n", time_chacha(shoes, decks));
+   printf("per-table random_device and engine setup: %.0f ns\n", time_setup(10000));
+   return EXIT_SUCCESS;
+}
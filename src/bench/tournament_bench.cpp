@@ -0,0 +1,67 @@
+/* tournament_bench.cpp
+ * Benchmarks a tournament (see tournament.h) of thousands of tables of
+ * bots, played by the server's own tables and tournament in virtual time
+ * (see clock.h), so bet windows and turn timeouts pass instantly and the
+ * run measures the tables and the round barrier rather than the clock.
+ * The tournament is added from AddTable headers, as a connection would
+ * add it, and the bots enter it by joining its tables. The run reports
+ * the rounds played until one bot is left, the wall time they took, and
+ * how long the barrier between rounds took, from the last table arriving
+ * to every table released into the next round.
+ *
+ * Usage: ./tournament_bench [<tables>] [<bots per table>] [<starting chips>] [<bot strategy>]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "../server/server.h"
+
+int main(int argc, char* argv[]) {
+   int tables = argc > 1 ? atoi(argv[1]) : 10000;
+   int bots = argc > 2 ? atoi(argv[2]) : 5;
+   int chips = argc > 3 ? atoi(argv[3]) : 500;
+   std::string strategy = argc > 4 ? argv[4] : "stand-17";
+   std::string settings = "max-players:" + std::to_string(bots) + "\nbet-limits:25-1000\nbet-window:15\n"
+         "turn-timeout:30\ntournament-tables:" + std::to_string(tables) + "\nstarting-chips:" + std::to_string(chips) +
+         "\ntournament-start:60\nbots:" + std::to_string(bots) + "\nbot-strategy:" + strategy + "\n\n";
+   TableSettings ts;
+   ts.parse(settings);
+   if (ts.tournament_tables != tables) {
+      fprintf(stderr, "A tournament plays at 2 to %u tables.\n", (unsigned)TableSettings::MAX_TOURNAMENT_TABLES);
+      return EXIT_FAILURE;
+   }
+   unsigned workers = std::thread::hardware_concurrency();
+   printf("%d tables of %d %s bots, %d chips each, %u workers, virtual clock\n", tables, bots, strategy.c_str(), chips,
+         workers);
+   VirtualClock virtual_clock;
+   scheduler.start(workers, true, &virtual_clock);
+   shuffler.start();
+   // The tournament's creator, a session with no connection, like a bot's
+   Session* admin = sessions.acquire(NULL);
+   // The tournament is freed once over, so its results are taken as it finishes
+   uint32_t rounds = 0;
+   uint64_t barrier_max_ns = 0;
+   uint64_t barrier_total_ns = 0;
+   Completion finished;
+   auto begin = std::chrono::steady_clock::now();
+   addtournament(ts, admin, [&](Tournament* tournament) {
+      rounds = tournament->round;
+      barrier_max_ns = tournament->barrier_max_ns;
+      barrier_total_ns = tournament->barrier_total_ns;
+      finished.signal();
+   });
+   finished.wait();
+   double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+   printf("rounds: %u in %.2f s, %.1f ms per round\n", rounds, secs, rounds ? secs * 1000 / rounds : 0.0);
+   printf("barrier: %.3f ms at most, %.3f ms on average\n", barrier_max_ns / 1e6,
+         rounds ? barrier_total_ns / 1e6 / rounds : 0.0);
+   // The scheduler's threads run for the life of the process, so exit
+   // without running destructors on the scheduler they are using
+   fflush(stdout);
+   _exit(EXIT_SUCCESS);
+}
@@ -124,6 +124,65 @@ bool is_number(const std::string& s) {
    return !s.empty() && std::find_if(s.begin(), s.end(), [](unsigned char c) { return !std::isdigit(c); }) == s.end();
 }
 
+// focus_states returns the states game commands are checked against: the
+// connection's, or in multi-table play, those at the table in focus.
+TableStates focus_states() {
+   TableStates t;
+   if (!multitable) {
+      t.state = state;
+      t.seats = seat_states;
+   } else if (table_states.count(focus_table)) {
+      t = table_states[focus_table];
+   }
+   return t;
+}
+
+// seat_state returns the state a game command is played in: the connection's
+// (or the focus table's), or while the client holds several seats there, the
+// state of the seat given at tokens[index] (seat 0 if none is given), which
+// is stored in seat. A seat that does not exist is reported as ACCOUNT, where
+// no game command is valid.
+STATE seat_state(const std::vector<std::string>& tokens, size_t index, uint8_t* seat) {
+   *seat = 0;
+   if (tokens.size() > index) {
+      if (!is_number(tokens[index]) || tokens[index].length() > 3 || stoi(tokens[index]) > 255) {
+         return ACCOUNT;
+      }
+      *seat = stoi(tokens[index]);
+   }
+   TableStates t = focus_states();
+   if (t.seats.empty()) { // One seat
+      return *seat == 0 ? t.state : ACCOUNT;
+   }
+   return *seat < t.seats.size() ? t.seats[*seat] : ACCOUNT;
+}
+
+// send_table sends TABLE ahead of a table command in multi-table play, for
+// the focus table. Otherwise there is only the one table, and nothing is sent.
+void send_table(SSL* ssl, char** write_buffer) {
+   if (!multitable) {
+      return;
+   }
+   AtTablePDU *at_pdu = new AtTablePDU(htons(focus_table));
+   ssize_t len = at_pdu->to_bytes(write_buffer);
+   SSL_write(ssl, *write_buffer, len);
+   delete at_pdu;
+}
+
+// send_seat sends what addresses a game command to seat ahead of it: TABLE
+// (see send_table), then SEAT while the client holds several seats at the
+// table. Otherwise nothing is sent.
+void send_seat(SSL* ssl, uint8_t seat, char** write_buffer) {
+   send_table(ssl, write_buffer);
+   if (focus_states().seats.empty()) {
+      return;
+   }
+   SeatPDU *s_pdu = new SeatPDU(seat);
+   ssize_t len = s_pdu->to_bytes(write_buffer);
+   SSL_write(ssl, *write_buffer, len);
+   delete s_pdu;
+}
+
 // This is the main method for the client. Establishes a TLS TCP connection to a CBP server, and
 // services commands to the server. Also runs a receiver thread separately to handle server responses.
 int main(int argc, char const *argv[])
@@ -243,12 +302,18 @@ int main(int argc, char const *argv[])
    std::cout << "> add" << std::endl;
    std::cout << "> remove <table id>" << std::endl;
    std::cout << "> join <table id>" << std::endl;
+   std::cout << "> seats <table id> <number of seats>" << std::endl;
+   std::cout << "> waitlist <table id> (join, or wait for a seat if the table is full)" << std::endl;
    std::cout << "> leave" << std::endl;
-   std::cout << "> bet <amount>" << std::endl;
-   std::cout << "> hit" << std::endl;
-   std::cout << "> stand" << std::endl;
-   std::cout << "> double" << std::endl;
+   std::cout << "> bet <amount> (<seat>)" << std::endl;
+   std::cout << "> hit (<seat>)" << std::endl;
+   std::cout << "> stand (<seat>)" << std::endl;
+   std::cout << "> double (<seat>)" << std::endl;
    std::cout << "> chat <msg>" << std::endl;
+   std::cout << "> strategy <table id>" << std::endl;
+   std::cout << "> multi (play at several tables at once)" << std::endl;
+   std::cout << "> table <table id> (table to play at, in multi-table play)" << std::endl;
+   std::cout << "> lockstats (administrators only)" << std::endl;
    // UI
    // Main command loop driver.
    for (; std::getline(std::cin, line);) {
@@ -266,12 +331,18 @@ int main(int argc, char const *argv[])
          std::cout << "> add" << std::endl;
          std::cout << "> remove <table id>" << std::endl;
          std::cout << "> join <table id>" << std::endl;
+         std::cout << "> seats <table id> <number of seats>" << std::endl;
+         std::cout << "> waitlist <table id> (join, or wait for a seat if the table is full)" << std::endl;
          std::cout << "> leave" << std::endl;
-         std::cout << "> bet <amount>" << std::endl;
-         std::cout << "> hit" << std::endl;
-         std::cout << "> stand" << std::endl;
-         std::cout << "> double" << std::endl;
+         std::cout << "> bet <amount> (<seat>) (0 to sit out the round)" << std::endl;
+         std::cout << "> hit (<seat>)" << std::endl;
+         std::cout << "> stand (<seat>)" << std::endl;
+         std::cout << "> double (<seat>)" << std::endl;
          std::cout << "> chat <msg>" << std::endl;
+         std::cout << "> strategy <table id>" << std::endl;
+         std::cout << "> multi (play at several tables at once)" << std::endl;
+         std::cout << "> table <table id> (table to play at, in multi-table play)" << std::endl;
+         std::cout << "> lockstats (administrators only)" << std::endl;
          continue;
       }
       // Get command, look up what to do
@@ -312,6 +383,18 @@ int main(int argc, char const *argv[])
          } else {
             std::cout << "expected: quit" << std::endl;
          }
+      } else if (command == "lockstats") { // Get the server's lock profile
+         if (state != ACCOUNT) { // Lockstats only works at ACCOUNT
+            std::cout << "Sorry, command not valid at current state." << std::endl;
+         } else if (tokens.size() == 1) {
+            // Send the LockStats request
+            LockStatsPDU *ls_pdu = new LockStatsPDU();
+            ssize_t len = ls_pdu->to_bytes(&write_buffer);
+            SSL_write(ssl, write_buffer, len);
+            delete ls_pdu;
+         } else {
+            std::cout << "expected: lockstats" << std::endl;
+         }
       } else if (command == "list") { // List all tables
          if (state != ACCOUNT) { // List only works at ACCOUNT
             std::cout << "Sorry, command not valid at current state." << std::endl;
@@ -369,8 +452,46 @@ int main(int argc, char const *argv[])
             } else { // Default any other response as false
                headers += "false";
             }
+            headers += "\n";
+            // Round pacing is optional, a blank line keeps the server's default
+            std::cout << "Enter betting window in seconds ([15]): ";
+            do {
+               std::getline(std::cin, line);
+            } while (!line.empty() && !is_number(line)); // Loop until blank or a number
+            if (!line.empty()) {
+               headers += "bet-window:" + line + "\n";
+            }
+            std::cout << "Enter turn timeout in seconds ([30]): ";
+            do {
+               std::getline(std::cin, line);
+            } while (!line.empty() && !is_number(line)); // Loop until blank or a number
+            if (!line.empty()) {
+               headers += "turn-timeout:" + line + "\n";
+            }
+            std::cout << "Enter minimum players to start ([1]): ";
+            do {
+               std::getline(std::cin, line);
+            } while (!line.empty() && !is_number(line)); // Loop until blank or a number
+            if (!line.empty()) {
+               headers += "min-players-to-start:" + line + "\n";
+            }
+            std::cout << "All players take their turns at once? (yes/[no]): ";
+            std::getline(std::cin, line);
+            headers += "simultaneous-turns:";
+            if (line == "yes") { // Matching yes means to set simultaneous-turns as true
+               headers += "true\n";
+            } else { // Default any other response as false
+               headers += "false\n";
+            }
+            std::cout << "Enter percent of the shoe dealt before reshuffling ([75]): ";
+            do {
+               std::getline(std::cin, line);
+            } while (!line.empty() && !is_number(line)); // Loop until blank or a number
+            if (!line.empty()) {
+               headers += "penetration:" + line + "\n";
+            }
             // Terminate the headers, send the AddTable command
-            headers += "\n\n";
+            headers += "\n";
             AddTablePDU *send_pdu = new AddTablePDU(headers);
             ssize_t len = send_pdu->to_bytes(&write_buffer);
             SSL_write(ssl, write_buffer, len);
@@ -406,6 +527,7 @@ int main(int argc, char const *argv[])
                // Try to convert table ID to int, send request over big endian
                uint16_t id = stoi(id_str);
                JoinTablePDU *jt_pdu = new JoinTablePDU(htons(id));
+               focus_table = id;
                ssize_t len = jt_pdu->to_bytes(&write_buffer);
                SSL_write(ssl, write_buffer, len);
                delete jt_pdu;
@@ -416,14 +538,97 @@ int main(int argc, char const *argv[])
          } else {
             std::cout << "expected: join <table id>" << std::endl;
          }
+      } else if (command == "seats") { // Join a table with several seats
+         if (state != ACCOUNT) { // Only valid at ACCOUNT state
+            std::cout << "Sorry, command not valid at current state." << std::endl;
+         } else if (tokens.size() == 3 && is_number(tokens[2]) && stoi(tokens[2]) >= 1 && stoi(tokens[2]) <= 255) {
+            std::string id_str = tokens[1];
+            try {
+               // Try to convert table ID to int, send request over big endian with the seats wanted
+               uint16_t id = stoi(id_str);
+               JoinSeatsPDU *js_pdu = new JoinSeatsPDU(htons(id), stoi(tokens[2]));
+               focus_table = id;
+               ssize_t len = js_pdu->to_bytes(&write_buffer);
+               SSL_write(ssl, write_buffer, len);
+               delete js_pdu;
+            }
+            catch (const std::out_of_range& oor) {
+               std::cout << "error, out of range" << std::endl;
+            }
+         } else {
+            std::cout << "expected: seats <table id> <number of seats, 1 to 255>" << std::endl;
+         }
+      } else if (command == "waitlist") { // Join a table, or its waitlist if it is full
+         if (state != ACCOUNT) { // Only valid at ACCOUNT state
+            std::cout << "Sorry, command not valid at current state." << std::endl;
+         } else if (tokens.size() == 2) {
+            std::string id_str = tokens[1];
+            try {
+               // Try to convert table ID to int, send request over big endian
+               uint16_t id = stoi(id_str);
+               WaitlistPDU *wl_pdu = new WaitlistPDU(htons(id));
+               focus_table = id;
+               ssize_t len = wl_pdu->to_bytes(&write_buffer);
+               SSL_write(ssl, write_buffer, len);
+               delete wl_pdu;
+            }
+            catch (const std::out_of_range& oor) {
+               std::cout << "error, out of range" << std::endl;
+            }
+         } else {
+            std::cout << "expected: waitlist <table id>" << std::endl;
+         }
+      } else if (command == "strategy") { // Get a table's strategy chart
+         // Run at any post-authentication state
+         if (tokens.size() == 2) {
+            std::string id_str = tokens[1];
+            try {
+               // Try to convert table ID to int, send request over big endian
+               uint16_t id = stoi(id_str);
+               GetStrategyPDU *gs_pdu = new GetStrategyPDU(htons(id));
+               ssize_t len = gs_pdu->to_bytes(&write_buffer);
+               SSL_write(ssl, write_buffer, len);
+               delete gs_pdu;
+            }
+            catch (const std::out_of_range& oor) {
+               std::cout << "error, out of range" << std::endl;
+            }
+         } else {
+            std::cout << "expected: strategy <table id>" << std::endl;
+         }
+      } else if (command == "multi") { // Switch to multi-table play
+         if (state != ACCOUNT || multitable) { // Only valid at ACCOUNT state, once
+            std::cout << "Sorry, command not valid at current state." << std::endl;
+         } else if (tokens.size() == 1) {
+            // Send the MultiTable request
+            MultiTablePDU *mt_pdu = new MultiTablePDU();
+            ssize_t len = mt_pdu->to_bytes(&write_buffer);
+            SSL_write(ssl, write_buffer, len);
+            delete mt_pdu;
+         } else {
+            std::cout << "expected: multi" << std::endl;
+         }
+      } else if (command == "table") { // Pick the table game commands are for
+         if (!multitable) { // Only valid in multi-table play
+            std::cout << "Sorry, command not valid at current state." << std::endl;
+         } else if (tokens.size() == 2 && is_number(tokens[1]) && tokens[1].length() <= 5 && stoi(tokens[1]) <= 65535) {
+            focus_table = stoi(tokens[1]);
+            if (!table_states.count(focus_table)) {
+               std::cout << "Not at table " << focus_table << " yet." << std::endl;
+            }
+         } else {
+            std::cout << "expected: table <table id>" << std::endl;
+         }
       } else if (command == "leave") { // Leave table
-         if (state != ENTER_BETS && state != WAIT_FOR_TURN &&
-               state != TURN && state != WAIT_FOR_DEALER &&
-               state != IN_PROGRESS) {
+         STATE table_state = focus_states().state;
+         if (table_state != ENTER_BETS && table_state != WAIT_FOR_TURN &&
+               table_state != TURN && table_state != WAIT_FOR_DEALER &&
+               table_state != IN_PROGRESS) {
             // current state MUST be a game state to leave a table
             std::cout << "Sorry, command not valid at current state." << std::endl;
          } else if (tokens.size() == 1) {
-            // Send the leave request
+            // Send the leave request, for the focus table in multi-table play
+            send_table(ssl, &write_buffer);
             LeaveTablePDU *send_pdu = new LeaveTablePDU();
             ssize_t len = send_pdu->to_bytes(&write_buffer);
             SSL_write(ssl, write_buffer, len);
@@ -432,13 +637,15 @@ int main(int argc, char const *argv[])
             std::cout << "expected: leave" << std::endl;
          }
       } else if (command == "bet") { // Bet an amount on a current round.
-         if (state != ENTER_BETS) { // Bet is only valid at the BET state
+         uint8_t seat;
+         if (seat_state(tokens, 2, &seat) != ENTER_BETS) { // Bet is only valid at the BET state
             std::cout << "Sorry, command not valid at current state." << std::endl;
-         } if (tokens.size() == 2) {
+         } else if (tokens.size() == 2 || tokens.size() == 3) {
             std::string amt_str = tokens[1];
             try {
                // Try to convert amount to an int, send over big endian
                uint32_t amt = stoi(amt_str);
+               send_seat(ssl, seat, &write_buffer);
                BetPDU *b_pdu = new BetPDU(htonl(amt));
                ssize_t len = b_pdu->to_bytes(&write_buffer);
                SSL_write(ssl, write_buffer, len);
@@ -448,48 +655,55 @@ int main(int argc, char const *argv[])
                std::cout << "error, out of range" << std::endl;
             }
          } else {
-            std::cout << "expected: bet <amount>" << std::endl;
+            std::cout << "expected: bet <amount> (<seat>)" << std::endl;
          }
       } else if (command == "hit") { // Hit (request a new card)
-         if (state != TURN) { // Hit is only valid on your TURN
+         uint8_t seat;
+         if (seat_state(tokens, 1, &seat) != TURN) { // Hit is only valid on your TURN
             std::cout << "Sorry, command not valid at current state." << std::endl;
-         } else if (tokens.size() == 1) {
-            // Send the hit request
+         } else if (tokens.size() == 1 || tokens.size() == 2) {
+            // Send the hit request, for the seat
+            send_seat(ssl, seat, &write_buffer);
             HitPDU *send_pdu = new HitPDU();
             ssize_t len = send_pdu->to_bytes(&write_buffer);
             SSL_write(ssl, write_buffer, len);
             delete send_pdu;
          } else {
-            std::cout << "expected: hit" << std::endl;
+            std::cout << "expected: hit (<seat>)" << std::endl;
          }
       } else if (command == "stand") { // Stand (end turn)
-         if (state != TURN) { // Stand is only valid on your TURN
+         uint8_t seat;
+         if (seat_state(tokens, 1, &seat) != TURN) { // Stand is only valid on your TURN
             std::cout << "Sorry, command not valid at current state." << std::endl;
-         } else if (tokens.size() == 1) {
-            // Send the stand request
+         } else if (tokens.size() == 1 || tokens.size() == 2) {
+            // Send the stand request, for the seat
+            send_seat(ssl, seat, &write_buffer);
             StandPDU *send_pdu = new StandPDU();
             ssize_t len = send_pdu->to_bytes(&write_buffer);
             SSL_write(ssl, write_buffer, len);
             delete send_pdu;
          } else {
-            std::cout << "expected: stand" << std::endl;
+            std::cout << "expected: stand (<seat>)" << std::endl;
          }
       } else if (command == "double") { // Double (increase bet, hit once)
-         if (state != TURN) { // Double is only valid on your TURN
+         uint8_t seat;
+         if (seat_state(tokens, 1, &seat) != TURN) { // Double is only valid on your TURN
             std::cout << "Sorry, command not valid at current state." << std::endl;
-         } else if (tokens.size() == 1) {
-            // Send the double request
+         } else if (tokens.size() == 1 || tokens.size() == 2) {
+            // Send the double request, for the seat
+            send_seat(ssl, seat, &write_buffer);
             DoubleDownPDU *send_pdu = new DoubleDownPDU();
             ssize_t len = send_pdu->to_bytes(&write_buffer);
             SSL_write(ssl, write_buffer, len);
             delete send_pdu;
          } else {
-            std::cout << "expected: double" << std::endl;
+            std::cout << "expected: double (<seat>)" << std::endl;
          }
       } else if (command == "chat") { // Send a chat message
-         if (state != ENTER_BETS && state != WAIT_FOR_TURN &&
-               state != TURN && state != WAIT_FOR_DEALER &&
-               state != IN_PROGRESS) {
+         STATE table_state = focus_states().state;
+         if (table_state != ENTER_BETS && table_state != WAIT_FOR_TURN &&
+               table_state != TURN && table_state != WAIT_FOR_DEALER &&
+               table_state != IN_PROGRESS) {
             // Chat only works at a game state
             std::cout << "Sorry, command not valid at current state." << std::endl;
          } else if (tokens.size() > 1) { // Need more than 1 token for chat
@@ -503,7 +717,8 @@ int main(int argc, char const *argv[])
                msg += " " + *it; // Add a space between each subsequent token
                ++it;
             }
-            msg += "\n"; // Terminate in \n, send chat message
+            msg += "\n"; // Terminate in \n, send chat message, to the focus table in multi-table play
+            send_table(ssl, &write_buffer);
             ChatPDU *chat_pdu = new ChatPDU(msg);
             ssize_t len = chat_pdu->to_bytes(&write_buffer);
             SSL_write(ssl, write_buffer, len);
@@ -521,12 +736,18 @@ int main(int argc, char const *argv[])
          std::cout << "> add" << std::endl;
          std::cout << "> remove <table id>" << std::endl;
          std::cout << "> join <table id>" << std::endl;
+         std::cout << "> seats <table id> <number of seats>" << std::endl;
+         std::cout << "> waitlist <table id> (join, or wait for a seat if the table is full)" << std::endl;
          std::cout << "> leave" << std::endl;
-         std::cout << "> bet <amount>" << std::endl;
-         std::cout << "> hit" << std::endl;
-         std::cout << "> stand" << std::endl;
-         std::cout << "> double" << std::endl;
+         std::cout << "> bet <amount> (<seat>) (0 to sit out the round)" << std::endl;
+         std::cout << "> hit (<seat>)" << std::endl;
+         std::cout << "> stand (<seat>)" << std::endl;
+         std::cout << "> double (<seat>)" << std::endl;
          std::cout << "> chat <msg>" << std::endl;
+         std::cout << "> strategy <table id>" << std::endl;
+         std::cout << "> multi (play at several tables at once)" << std::endl;
+         std::cout << "> table <table id> (table to play at, in multi-table play)" << std::endl;
+         std::cout << "> lockstats (administrators only)" << std::endl;
       }
    }
    // Send a quit PDU on disconnect.
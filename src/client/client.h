@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <mutex>
@@ -35,6 +36,34 @@
 // This is the state of the protocol between client and server.
 STATE state = VERSION;
 
+// These are the states of each seat, while the client holds several seats at
+// a table (see JOINSEATS). Empty otherwise.
+std::vector<STATE> seat_states;
+
+// This is the seat the next response is for, as marked by a 1-1-8 response, or -1.
+int marked_seat = -1;
+
+// TableStates is the client's view of one table in multi-table play: the
+// state at the table, and of each seat while holding several there.
+struct TableStates
+{
+   STATE state = ACCOUNT;
+   std::vector<STATE> seats;
+};
+
+// This is set once the server has switched the connection to multi-table play
+// (see MULTITABLE), after which the connection stays at ACCOUNT and every
+// table it is at has states of its own here, by table ID.
+bool multitable = false;
+std::map<uint16_t, TableStates> table_states;
+
+// This is the table the next response is from, as marked by a 1-1-9 response, or -1.
+int marked_table = -1;
+
+// This is the table game commands are sent to in multi-table play, picked by
+// the "table" command or the last table joined.
+uint16_t focus_table = 0;
+
 // get_udp_datagram reads a datagram from sock, and writes
 // the ip/port into buffer. The flag is also set to true on read.
 // E.g. given 127.0.0.1 which sends 1234, the buffer is populated
@@ -122,65 +151,67 @@ std::string get_blackjack_server(std::string ip, std::string port) {
 }
 
 // handle_state_transition looks at the three-byte header and
-// the current state, and determines what state the client moves into
-// next.
+// the current state st, of the connection or of one of its seats, and
+// determines what state st moves into next.
 // STATEFUL
-void handle_state_transition(uint8_t rc1, uint8_t rc2, uint8_t rc3) {
-   if (state == ACCOUNT) {
+void handle_state_transition(STATE& st, uint8_t rc1, uint8_t rc2, uint8_t rc3) {
+   if (st == ACCOUNT) {
       if (rc1 == 1 && rc2 == 1 && rc3 == 0) { // wait for next round
-         state = IN_PROGRESS;
+         st = IN_PROGRESS;
       } else if (rc1 == 3 && rc2 == 1 && rc3 == 0) { // game started
-         state = ENTER_BETS;
+         st = ENTER_BETS;
       }
-   } else if (state == IN_PROGRESS) {
+   } else if (st == IN_PROGRESS) {
       if (rc1 == 3 && rc2 == 1 && rc3 == 0) { // game started
-         state = ENTER_BETS;
+         st = ENTER_BETS;
       } else if (rc1 == 2 && rc2 == 1 && rc3 == 5) { // left game
-         state = ACCOUNT;
+         st = ACCOUNT;
       } else if (rc1 == 4 && rc2 == 1 && rc3 == 4) { // kicked from table
-         state = ACCOUNT;
+         st = ACCOUNT;
       }
-   } else if (state == ENTER_BETS) {
+   } else if (st == ENTER_BETS) {
       if (rc1 == 2 && rc2 == 1 && rc3 == 0) { // bet successfully placed
-         state = WAIT_FOR_TURN;
+         st = WAIT_FOR_TURN;
       } else if (rc1 == 1 && rc2 == 1 && rc3 == 7) { // timeout
-         state = IN_PROGRESS;
+         st = IN_PROGRESS;
+      } else if (rc1 == 1 && rc2 == 1 && rc3 == 0) { // sat out the round
+         st = IN_PROGRESS;
       } else if (rc1 == 2 && rc2 == 1 && rc3 == 5) { // left game
-         state = ACCOUNT;
+         st = ACCOUNT;
       } else if (rc1 == 4 && rc2 == 1 && rc3 == 4) { // kicked from table
-         state = ACCOUNT;
+         st = ACCOUNT;
       }
-   } else if (state == WAIT_FOR_TURN) {
+   } else if (st == WAIT_FOR_TURN) {
       if (rc1 == 1 && rc2 == 1 && rc3 == 4) { // got a blackjack
-         state = WAIT_FOR_DEALER;
+         st = WAIT_FOR_DEALER;
       } else if (rc1 == 3 && rc2 == 1 && rc3 == 2) { // it's the client's turn
-         state = TURN;
+         st = TURN;
       } else if (rc1 == 2 && rc2 == 1 && rc3 == 5) { // left game
-         state = ACCOUNT;
+         st = ACCOUNT;
       } else if (rc1 == 4 && rc2 == 1 && rc3 == 4) { // kicked from table
-         state = ACCOUNT;
+         st = ACCOUNT;
       }
-   } else if (state == TURN) {
+   } else if (st == TURN) {
       if (rc1 == 2 && rc2 == 1 && rc3 == 0) { // successfully stand
-         state = WAIT_FOR_DEALER;
+         st = WAIT_FOR_DEALER;
       } else if (rc1 == 1 && rc2 == 1) { // hit/doubledown which led to next state
          if (rc3 == 2 || rc3 == 3 || rc3 == 6 || rc3 == 7) {
-            state = WAIT_FOR_DEALER;
+            st = WAIT_FOR_DEALER;
          }
       } else if (rc1 == 2 && rc2 == 1 && rc3 == 5) { // left game
-         state = ACCOUNT;
+         st = ACCOUNT;
       } else if (rc1 == 4 && rc2 == 1 && rc3 == 4) { // kicked from table
-         state = ACCOUNT;
+         st = ACCOUNT;
       }
-   } else if (state == WAIT_FOR_DEALER) {
+   } else if (st == WAIT_FOR_DEALER) {
       if (rc1 == 3 && rc2 == 1 && rc3 == 3) { // game over
-         state = ENTER_BETS;
+         st = ENTER_BETS;
       } else if (rc1 == 3 && rc2 == 1 && rc3 == 4) { // game over
-         state = ENTER_BETS;
+         st = ENTER_BETS;
       } else if (rc1 == 2 && rc2 == 1 && rc3 == 5) { // left game
-         state = ACCOUNT;
+         st = ACCOUNT;
       } else if (rc1 == 4 && rc2 == 1 && rc3 == 4) { // kicked from table
-         state = ACCOUNT;
+         st = ACCOUNT;
       }
    }
 }
@@ -349,6 +380,72 @@ PDU* parse_pdu_client(SSL* ssl) {
          carddata.push_back(new CardPDU(rank,suit));
       }
       pdu = new CardHandResponsePDU(rc1,rc2,rc3,holder,soft_value,hard_value,carddata);
+   } else if (rc1 == 2 && rc2 == 1 && rc3 == 13) {
+      // Handle strategy chart response
+      uint16_t table_id;
+      int32_t house_edge;
+      uint8_t number_of_rows;
+      // Read in the table id
+      if ((rc = SSL_read(ssl, &table_id, 2)) <= 0) {
+         return pdu;
+      }
+      // Read in the house edge
+      if ((rc = SSL_read(ssl, &house_edge, 4)) <= 0) {
+         return pdu;
+      }
+      // Read in number of rows
+      if ((rc = SSL_read(ssl, &number_of_rows, 1)) <= 0) {
+         return pdu;
+      }
+      // Read in every row
+      char chart_buf[256 * StrategyResponsePDU::ROW_LENGTH];
+      int length = number_of_rows * StrategyResponsePDU::ROW_LENGTH;
+      int got = 0;
+      while (got < length) {
+         if ((rc = SSL_read(ssl, chart_buf + got, length - got)) <= 0) {
+            return pdu;
+         }
+         got += rc;
+      }
+      pdu = new StrategyResponsePDU(rc1,rc2,rc3,table_id,house_edge,std::string(chart_buf, length));
+   } else if (rc1 == 1 && rc2 == 1 && rc3 == 9) {
+      // Handle table marker
+      uint16_t table_id;
+      // Read in the table ID
+      if ((rc = SSL_read(ssl, &table_id, 2)) <= 0) {
+         return pdu;
+      }
+      pdu = new TableResponsePDU(rc1,rc2,rc3,table_id);
+      // The next response (and any seat marker before it) is from this table
+      marked_table = ntohs(table_id);
+      return pdu;
+   } else if ((rc1 == 1 && rc2 == 1 && rc3 == 8) || (rc1 == 2 && rc2 == 1 && rc3 == 14)) {
+      // Handle seat marker or seats response
+      uint8_t seat;
+      // Read in the seat
+      if ((rc = SSL_read(ssl, &seat, 1)) <= 0) {
+         return pdu;
+      }
+      pdu = new SeatResponsePDU(rc1,rc2,rc3,seat);
+      if (rc3 == 8) {
+         // The next response is for this seat, and moves only its state
+         marked_seat = seat;
+         return pdu;
+      }
+      if (seat > 1) {
+         // Every seat starts out at ACCOUNT, and the connection (or in
+         // multi-table play, the table's view) is at the table until its last
+         // seat leaves
+         if (marked_table >= 0) {
+            table_states[marked_table].seats.assign(seat, ACCOUNT);
+            table_states[marked_table].state = IN_PROGRESS;
+            marked_table = -1;
+         } else {
+            seat_states.assign(seat, ACCOUNT);
+            state = IN_PROGRESS;
+         }
+         return pdu;
+      }
    } else if (rc1 == 3 && rc2 == 1 && (rc3 == 3 || rc3 == 4)) {
       // Handle winnings response
       uint32_t winnings;
@@ -389,9 +486,35 @@ PDU* parse_pdu_client(SSL* ssl) {
          pdu = new ASCIIResponsePDU(rc1,rc2,rc3,std::string(message_buf));
       }
    }
-   // State transition handler, run on header values
+   if (rc1 == 2 && rc2 == 0 && rc3 == 7) { // Switched to multi-table play
+      multitable = true;
+   }
+   // State transition handler, run on header values, for the states of the
+   // table the response is marked as from in multi-table play, else the connection's
    // STATEFUL
-   handle_state_transition(rc1,rc2,rc3);
+   STATE* st = &state;
+   std::vector<STATE>* seats = &seat_states;
+   if (marked_table >= 0) {
+      st = &table_states[marked_table].state;
+      seats = &table_states[marked_table].seats;
+   }
+   if (marked_seat >= 0 && marked_seat < (int)seats->size()) {
+      // Response for one of several seats
+      handle_state_transition((*seats)[marked_seat],rc1,rc2,rc3);
+      // Back in the lobby once every seat has left
+      if (std::count(seats->begin(), seats->end(), ACCOUNT) == (long)seats->size()) {
+         seats->clear();
+         *st = ACCOUNT;
+      }
+   } else {
+      handle_state_transition(*st,rc1,rc2,rc3);
+   }
+   // A table the client has left is forgotten
+   if (marked_table >= 0 && *st == ACCOUNT) {
+      table_states.erase(marked_table);
+   }
+   marked_seat = -1;
+   marked_table = -1;
    return pdu;
 };
 
@@ -479,6 +602,41 @@ void listen_to_server(SSL* ssl) {
          std::cout << std::endl;
          continue;
       }
+      // Check for StrategyResponse, print the house edge and chart
+      StrategyResponsePDU* sr_pdu = dynamic_cast<StrategyResponsePDU*>(p);
+      if (sr_pdu) {
+         std::cout << "> table ID " << sr_pdu->getTableID() << ", house edge "
+            << sr_pdu->getHouseEdge() / 10000.0 << "% with this strategy" << std::endl;
+         std::cout << ">          2 3 4 5 6 7 8 9 T A" << std::endl;
+         std::string chart = sr_pdu->getChart();
+         // Print every row, its hand value then the play per dealer up card
+         for (size_t i = 0; i + StrategyResponsePDU::ROW_LENGTH <= chart.length(); i += StrategyResponsePDU::ROW_LENGTH) {
+            uint8_t label = chart[i];
+            std::cout << "> " << ((label & 0x80) ? "soft " : "hard ");
+            std::cout << ((label & 0x7f) < 10 ? " " : "") << std::to_string(label & 0x7f) << ":";
+            for (int j = 1; j < StrategyResponsePDU::ROW_LENGTH; j++) {
+               std::cout << " " << chart[i + j];
+            }
+            std::cout << std::endl;
+         }
+         continue;
+      }
+      // Check for a seat marker or the seats given, print the seat
+      SeatResponsePDU* sr2_pdu = dynamic_cast<SeatResponsePDU*>(p);
+      if (sr2_pdu) {
+         if (sr2_pdu->getReplyCode3() == 8) { // The next response is for this seat
+            std::cout << "[seat " << std::to_string(sr2_pdu->getSeat()) << "] ";
+         } else {
+            std::cout << "> seated with " << std::to_string(sr2_pdu->getSeat()) << " seat(s)" << std::endl;
+         }
+         continue;
+      }
+      // Check for a table marker, print the table
+      TableResponsePDU* tr_pdu = dynamic_cast<TableResponsePDU*>(p);
+      if (tr_pdu) { // The next response is from this table
+         std::cout << "[table " << tr_pdu->getTableID() << "] ";
+         continue;
+      }
       // Check for winnings, print winnings in last game
       WinningsResponsePDU* wr_pdu = dynamic_cast<WinningsResponsePDU*>(p);
       if (wr_pdu) {
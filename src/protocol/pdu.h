@@ -54,6 +54,42 @@ struct JoinTable {
    uint16_t table_id;
 };
 
+// Structure of GETSTRATEGY command
+struct GetStrategy {
+   uint8_t category_code;
+   uint8_t command_code;
+   uint16_t table_id;
+};
+
+// Structure of JOINSEATS command
+struct JoinSeats {
+   uint8_t category_code;
+   uint8_t command_code;
+   uint16_t table_id;
+   uint8_t seats;
+};
+
+// Structure of SEAT command
+struct Seat {
+   uint8_t category_code;
+   uint8_t command_code;
+   uint8_t seat;
+};
+
+// Structure of TABLE command
+struct AtTable {
+   uint8_t category_code;
+   uint8_t command_code;
+   uint16_t table_id;
+};
+
+// Structure of WAITLIST command
+struct Waitlist {
+   uint8_t category_code;
+   uint8_t command_code;
+   uint16_t table_id;
+};
+
 // Structure of BET command
 struct Bet {
    uint8_t category_code;
@@ -117,6 +153,16 @@ struct CardHandResponseHeader {
    uint8_t number_of_cards;
 };
 
+// Structure of a strategy chart response header
+struct StrategyResponseHeader {
+   uint8_t reply_code_1;
+   uint8_t reply_code_2;
+   uint8_t reply_code_3;
+   uint16_t table_id;
+   int32_t house_edge;
+   uint8_t number_of_rows;
+};
+
 // Structure of WINNINGS response
 struct WinningsResponse {
    uint8_t reply_code_1;
@@ -124,6 +170,22 @@ struct WinningsResponse {
    uint8_t reply_code_3;
    uint32_t winnings;
 };
+
+// Structure of SEAT and SEATS responses
+struct SeatResponse {
+   uint8_t reply_code_1;
+   uint8_t reply_code_2;
+   uint8_t reply_code_3;
+   uint8_t seat;
+};
+
+// Structure of the TABLE response
+struct TableResponse {
+   uint8_t reply_code_1;
+   uint8_t reply_code_2;
+   uint8_t reply_code_3;
+   uint16_t table_id;
+};
 #pragma pack(pop)
 
 // Generic abstract PDU class, PDU must support a way
@@ -266,6 +328,42 @@ class QuitPDU: public PDU
       }
 };
 
+// This class represents the LOCKSTATS PDU, an administrator command
+// asking for the server's lock profile
+class LockStatsPDU: public PDU
+{
+   private:
+      Header header;
+   public:
+      LockStatsPDU() {
+         header.category_code = 0;
+         header.command_code = 6;
+      }
+      // to_bytes copies over the header, LOCKSTATS has a specific header value
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&header), sizeof(Header));
+         return sizeof(Header);
+      }
+};
+
+// This class represents the MULTITABLE PDU, which lets the connection play
+// at several tables at once for the rest of its life
+class MultiTablePDU: public PDU
+{
+   private:
+      Header header;
+   public:
+      MultiTablePDU() {
+         header.category_code = 0;
+         header.command_code = 7;
+      }
+      // to_bytes copies over the header, MULTITABLE has a specific header value
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&header), sizeof(Header));
+         return sizeof(Header);
+      }
+};
+
 // This class represents the GETTABLES PDU
 class GetTablesPDU: public PDU
 {
@@ -465,6 +563,126 @@ class ChatPDU: public PDU
       }
 };
 
+// This class represents the GETSTRATEGY PDU, asking for the strategy chart of a table
+class GetStrategyPDU: public PDU
+{
+   private:
+      GetStrategy details;
+   public:
+      GetStrategyPDU(uint16_t tid) {
+         details.category_code = 1;
+         details.command_code = 13;
+         details.table_id = tid;
+      }
+      // Return the table ID as little endian (from big endian)
+      uint16_t getTableID() {
+         return ntohs(details.table_id);
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(GetStrategy));
+         return sizeof(GetStrategy);
+      }
+};
+
+// This class represents the JOINSEATS PDU, joining a table with up to seats
+// seats on the one connection, each playing a hand of its own
+class JoinSeatsPDU: public PDU
+{
+   private:
+      JoinSeats details;
+   public:
+      JoinSeatsPDU(uint16_t tid, uint8_t s) {
+         details.category_code = 1;
+         details.command_code = 14;
+         details.table_id = tid;
+         details.seats = s;
+      }
+      // Return the table ID as little endian (from big endian)
+      uint16_t getTableID() {
+         return ntohs(details.table_id);
+      }
+      // Return the number of seats asked for
+      uint8_t getSeats() {
+         return details.seats;
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(JoinSeats));
+         return sizeof(JoinSeats);
+      }
+};
+
+// This class represents the SEAT PDU, which addresses the command following
+// it (BET, HIT, STAND or DOUBLEDOWN) to one of the connection's seats
+class SeatPDU: public PDU
+{
+   private:
+      Seat details;
+   public:
+      SeatPDU(uint8_t s) {
+         details.category_code = 1;
+         details.command_code = 15;
+         details.seat = s;
+      }
+      // Return the seat, numbered from 0
+      uint8_t getSeat() {
+         return details.seat;
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(Seat));
+         return sizeof(Seat);
+      }
+};
+
+// This class represents the TABLE PDU, which addresses the command following
+// it (LEAVETABLE, CHAT, BET, HIT, STAND or DOUBLEDOWN, or a SEAT and one of
+// those) to one of the tables a connection in multi-table play is at
+class AtTablePDU: public PDU
+{
+   private:
+      AtTable details;
+   public:
+      AtTablePDU(uint16_t tid) {
+         details.category_code = 1;
+         details.command_code = 16;
+         details.table_id = tid;
+      }
+      // Return the table ID as little endian (from big endian)
+      uint16_t getTableID() {
+         return ntohs(details.table_id);
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(AtTable));
+         return sizeof(AtTable);
+      }
+};
+
+// This class represents the WAITLIST PDU, which joins a table as JOINTABLE
+// does, or if it is full, queues for the next seat to free up there
+class WaitlistPDU: public PDU
+{
+   private:
+      Waitlist details;
+   public:
+      WaitlistPDU(uint16_t tid) {
+         details.category_code = 1;
+         details.command_code = 17;
+         details.table_id = tid;
+      }
+      // Return the table ID as little endian (from big endian)
+      uint16_t getTableID() {
+         return ntohs(details.table_id);
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(Waitlist));
+         return sizeof(Waitlist);
+      }
+};
+
 // PDUs sent by SERVER
 
 // ASCIIResponsePDU represents a response with an ASCII message. This
@@ -808,3 +1026,120 @@ class WinningsResponsePDU: public PDU
       }
 };
 
+// StrategyResponsePDU is a successful response to a GETSTRATEGY command. It
+// holds the table's house edge against the best play, in millionths of a bet,
+// and its strategy chart. Each row of the chart is a hand value byte (0x80 set
+// for soft hands), then one play per dealer up card 2 to 9, ten and ace:
+// 'H' hit, 'S' stand or 'D' double down.
+class StrategyResponsePDU: public PDU
+{
+   private:
+      StrategyResponseHeader header;
+      std::string chart;
+   public:
+      static const int ROW_LENGTH = 11; // Hand value and 10 plays
+      StrategyResponsePDU(uint8_t rc_1, uint8_t rc_2, uint8_t rc_3, uint16_t tid, int32_t edge, std::string c) {
+         header.reply_code_1 = rc_1;
+         header.reply_code_2 = rc_2;
+         header.reply_code_3 = rc_3;
+         header.table_id = tid;
+         header.house_edge = edge;
+         header.number_of_rows = (uint8_t)(c.length() / ROW_LENGTH);
+         chart = c;
+      }
+      uint8_t getReplyCode1() {
+         return header.reply_code_1;
+      }
+      uint8_t getReplyCode2() {
+         return header.reply_code_2;
+      }
+      uint8_t getReplyCode3() {
+         return header.reply_code_3;
+      }
+      // Convert table ID from big endian to little endian
+      uint16_t getTableID() {
+         return ntohs(header.table_id);
+      }
+      // Convert the house edge from big endian to little endian
+      int32_t getHouseEdge() {
+         return ntohl(header.house_edge);
+      }
+      // Return the chart, number_of_rows rows of ROW_LENGTH bytes
+      std::string getChart() {
+         return chart;
+      }
+      // to_bytes copies over the response header, then the chart rows
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&header), sizeof(StrategyResponseHeader));
+         chart.copy(*buf+sizeof(StrategyResponseHeader), chart.length());
+         return sizeof(StrategyResponseHeader) + chart.length();
+      }
+};
+
+// SeatResponsePDU carries a seat number. As 1-1-8 it marks the response
+// following it as being for that seat of a connection holding several, and
+// as 2-1-14 it is the number of seats a JOINSEATS command was given.
+class SeatResponsePDU: public PDU
+{
+   private:
+      SeatResponse details;
+   public:
+      SeatResponsePDU(uint8_t rc_1, uint8_t rc_2, uint8_t rc_3, uint8_t s) {
+         details.reply_code_1 = rc_1;
+         details.reply_code_2 = rc_2;
+         details.reply_code_3 = rc_3;
+         details.seat = s;
+      }
+      uint8_t getReplyCode1() {
+         return details.reply_code_1;
+      }
+      uint8_t getReplyCode2() {
+         return details.reply_code_2;
+      }
+      uint8_t getReplyCode3() {
+         return details.reply_code_3;
+      }
+      // Return the seat, or number of seats
+      uint8_t getSeat() {
+         return details.seat;
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(SeatResponse));
+         return sizeof(SeatResponse);
+      }
+};
+
+// TableResponsePDU carries a table ID. As 1-1-9 it marks the response
+// following it (and any 1-1-8 before that) as being from that table, for a
+// connection in multi-table play.
+class TableResponsePDU: public PDU
+{
+   private:
+      TableResponse details;
+   public:
+      TableResponsePDU(uint8_t rc_1, uint8_t rc_2, uint8_t rc_3, uint16_t tid) {
+         details.reply_code_1 = rc_1;
+         details.reply_code_2 = rc_2;
+         details.reply_code_3 = rc_3;
+         details.table_id = tid;
+      }
+      uint8_t getReplyCode1() {
+         return details.reply_code_1;
+      }
+      uint8_t getReplyCode2() {
+         return details.reply_code_2;
+      }
+      uint8_t getReplyCode3() {
+         return details.reply_code_3;
+      }
+      // Return the table ID as little endian (from big endian)
+      uint16_t getTableID() {
+         return ntohs(details.table_id);
+      }
+      // to_bytes copies over the struct form
+      ssize_t to_bytes(char** buf) {
+         memcpy((void*)*buf, reinterpret_cast<void*>(&details), sizeof(TableResponse));
+         return sizeof(TableResponse);
+      }
+};
@@ -0,0 +1,134 @@
+/* accounts.h
+ * Contains AccountDetails, the balance held by every username, and
+ * the AccountTable which maps usernames to AccountDetails. Balances
+ * are updated with compare-and-swap instead of a lock, and the table
+ * is a fixed-size open-addressing hash table whose lookups never lock.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+// AccountDetails holds all critical information for a given username "account".
+// All usernames map to an AccountDetails for that specific username.
+// Here AccountDetails holds a user balance, which is updated atomically so
+// that the balance is correct if a user is authenticated on multiple clients
+// or is paid out by a table while they bet at another.
+class AccountDetails
+{
+   private:
+      std::atomic<uint32_t> balance {0};
+   public:
+      // Return the user's balance
+      uint32_t getBalance() {
+         return balance.load();
+      }
+      // Update the balance by funds (a change in balance). The change
+      // is dropped if it would overflow or underflow the balance.
+      void adjustBalance(int32_t funds) {
+         uint32_t old_balance = balance.load();
+         uint32_t new_balance;
+         do {
+            new_balance = old_balance + funds;
+            // Check for overflow before applying the change. If there is no overflow, apply the adjustment.
+            bool overflow = (((funds < 0) && (new_balance > old_balance)) || ((funds > 0) && (new_balance < old_balance)));
+            if (overflow) {
+               return;
+            }
+         } while (!balance.compare_exchange_weak(old_balance, new_balance));
+      }
+      // Take amt out of the balance if the balance covers it. Returns true if the
+      // funds were reserved, false (leaving the balance alone) otherwise. The check
+      // and the debit are one atomic step, so two bets can never both pass the check
+      // and overdraw the account.
+      bool reserve(uint32_t amt) {
+         uint32_t old_balance = balance.load();
+         do {
+            if (amt > old_balance) {
+               return false;
+            }
+         } while (!balance.compare_exchange_weak(old_balance, old_balance - amt));
+         return true;
+      }
+};
+
+// AccountTable maps usernames to AccountDetails with open addressing and
+// linear probing over a fixed number of cache-line-sized slots. Accounts are
+// never removed, so a slot goes from empty, to being claimed, to ready, and
+// stays ready for the life of the server. Lookups only read, and creating an
+// account claims its slot with a single compare-and-swap.
+class AccountTable
+{
+   private:
+      static const uint32_t NUM_SLOTS = 1 << 14;
+      static const size_t MAX_USERNAME = 32;
+      enum SlotState : uint8_t { EMPTY, CLAIMED, READY };
+      // One account, padded to a cache line so updates to neighbouring
+      // accounts never contend.
+      struct alignas(64) Slot {
+         std::atomic<uint8_t> state {EMPTY};
+         char username[MAX_USERNAME + 1];
+         AccountDetails account;
+      };
+      Slot slots[NUM_SLOTS];
+      // FNV-1a hash of the username
+      static uint32_t hash(const std::string& username) {
+         uint32_t h = 2166136261u;
+         for (unsigned char c : username) {
+            h = (h ^ c) * 16777619u;
+         }
+         return h;
+      }
+      // Wait for a claimed slot to be published, then return true if it holds username.
+      static bool holds(Slot& slot, const std::string& username) {
+         while (slot.state.load() == CLAIMED) {
+            std::this_thread::yield();
+         }
+         return strcmp(slot.username, username.c_str()) == 0;
+      }
+   public:
+      // Return the account for username, or NULL if it has never been created.
+      AccountDetails* find(const std::string& username) {
+         uint32_t idx = hash(username) & (NUM_SLOTS - 1);
+         for (uint32_t i = 0; i < NUM_SLOTS; i++) {
+            Slot& slot = slots[(idx + i) & (NUM_SLOTS - 1)];
+            if (slot.state.load() == EMPTY) {
+               return NULL;
+            }
+            if (holds(slot, username)) {
+               return &slot.account;
+            }
+         }
+         return NULL;
+      }
+      // Return the account for username, creating it with a zero balance on first
+      // use. Returns NULL if the username is too long or the table is full.
+      AccountDetails* find_or_create(const std::string& username) {
+         if (username.length() > MAX_USERNAME) {
+            return NULL;
+         }
+         uint32_t idx = hash(username) & (NUM_SLOTS - 1);
+         for (uint32_t i = 0; i < NUM_SLOTS; i++) {
+            Slot& slot = slots[(idx + i) & (NUM_SLOTS - 1)];
+            uint8_t state = slot.state.load();
+            if (state == EMPTY) {
+               // Try to claim the slot. If another thread beat us to it, fall
+               // through and check whether it claimed it for the same username.
+               if (slot.state.compare_exchange_strong(state, CLAIMED)) {
+                  strcpy(slot.username, username.c_str());
+                  slot.state.store(READY);
+                  return &slot.account;
+               }
+            }
+            if (holds(slot, username)) {
+               return &slot.account;
+            }
+         }
+         return NULL;
+      }
+};
+
+// accounts holds the account of every username that has logged in.
+AccountTable accounts;
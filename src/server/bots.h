@@ -0,0 +1,78 @@
+/* bots.h
+ * Contains the Bot, an in-process player a table seats alongside its
+ * connections, to keep tables lively and to load test the tables at
+ * engine speed. A bot has a Session with no connection, so it joins,
+ * bets and plays through the same TableCommands a connection posts,
+ * but nothing is sent to it: the table asks the bot for its play as
+ * soon as its seat is waiting on one (see TableDetails::play_bots).
+ * Bots play basic strategy (the table's exact strategy chart, see
+ * strategy.h), stand on a fixed total, or play at random, and bet the
+ * table minimum from a bankroll of their own that never runs out.
+ *
+ * Expects accounts.h, chacha.h, cards.h, strategy.h and mailbox.h to be
+ * included first.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+// BotKind is how a bot plays its hands.
+enum BotKind {
+   BOT_BASIC, // The table's strategy chart
+   BOT_STAND, // Hit until the hand reaches stand_on, then stand
+   BOT_RANDOM, // Hit, stand or double down at random
+};
+
+// Bot is the player behind a bot's Session. It is only used by the table
+// the bot is seated at.
+class Bot
+{
+   private:
+      BotKind kind = BOT_BASIC;
+      uint8_t stand_on = 17; // Total a BOT_STAND bot stands on
+      const StrategyChart* chart; // The table's chart, for BOT_BASIC
+      uint32_t bet; // What the bot bets each round
+      ChaCha20 rng; // Plays of a BOT_RANDOM bot
+   public:
+      static const uint32_t BANKROLL = 1000000; // What the bot's account is topped back up to
+      AccountDetails account; // The bot's own account, never in the account table
+      // Make a bot playing strategy, as given by the bot-strategy setting,
+      // betting bet. chart is the table's strategy chart.
+      Bot(const std::string& strategy, const StrategyChart* chart_, uint32_t bet_) :
+            chart(chart_), bet(bet_), rng(ShoeSeed::random()) {
+         if (strategy == "random") {
+            kind = BOT_RANDOM;
+         } else if (strategy.compare(0, 6, "stand-") == 0) {
+            kind = BOT_STAND;
+            stand_on = atoi(strategy.c_str() + 6);
+         }
+         account.adjustBalance(BANKROLL);
+      }
+      // Return the command the bot plays in state, holding hand against the
+      // dealer's up card, setting amount for a bet. Only ENTER_BETS and TURN
+      // ask the bot anything, in any other state it stands.
+      CommandType decide(STATE state, const Hand& hand, card_t up, uint32_t* amount) {
+         // Top the account back up before it could miss a bet or a double down
+         uint32_t balance = account.getBalance();
+         if (balance < 2 * bet) {
+            account.adjustBalance(BANKROLL - balance);
+         }
+         if (state == ENTER_BETS) {
+            *amount = bet;
+            return CMD_BET;
+         }
+         if (state != TURN) {
+            return CMD_STAND;
+         }
+         char action;
+         if (kind == BOT_STAND) {
+            action = hand.value() < stand_on ? 'H' : 'S';
+         } else if (kind == BOT_RANDOM) {
+            action = "HSD"[rng() % 3];
+         } else {
+            action = chart->action(hand, up);
+         }
+         return action == 'H' ? CMD_HIT : action == 'D' ? CMD_DOUBLEDOWN : CMD_STAND;
+      }
+};
@@ -0,0 +1,181 @@
+/* cards.h
+ * Contains the compact card representation the tables play with. A card
+ * is one byte (its rank in the high bits, its suit in the low two), the
+ * shoe is a contiguous array of those bytes dealt from with a cursor, and
+ * a hand is a fixed-capacity array held inline in its seat, so dealing a
+ * round allocates nothing. Cards only become CardPDUs in encode_hand, as
+ * they are written to the wire. Expects pdu.h and chacha.h to be
+ * included first.
+ *
+ * A hand keeps its hard total and ace count as cards are added, so its
+ * soft total, value, and the blackjack, bust and dealer checks are a few
+ * arithmetic operations instead of a pass over the cards.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// A card is rank * 4 + suit, with ranks A23456789TJQK numbered 0 to 12
+// and suits HCDS numbered 0 to 3.
+typedef uint8_t card_t;
+
+const char card_ranks[] = "A23456789TJQK";
+const char card_suits[] = "HCDS";
+
+// make_card returns the card of the given rank and suit numbers.
+constexpr card_t make_card(uint8_t rank, uint8_t suit)
+{
+   return (rank << 2) | suit;
+}
+
+// rank_hard_values maps rank numbers to their hard value (an ace is 1).
+constexpr uint8_t rank_hard_values[13] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 10, 10, 10};
+
+// card_hard_value returns the hard value of card.
+constexpr uint8_t card_hard_value(card_t card)
+{
+   return rank_hard_values[card >> 2];
+}
+
+// card_rank returns the rank of card as its protocol character.
+inline char card_rank(card_t card)
+{
+   return card_ranks[card >> 2];
+}
+
+// card_suit returns the suit of card as its protocol character.
+inline char card_suit(card_t card)
+{
+   return card_suits[card & 3];
+}
+
+// Hand is the cards held by a player or the dealer. Every card counts at
+// least 1 and nobody draws at 21 or over, so no hand ever holds more than
+// 21 cards (20 aces and the card that takes them past 20).
+// The soft total counts the first ace as 11 and the rest as 1, and the
+// hand's value is the soft total unless that busts, then the hard total.
+struct Hand
+{
+   static const uint8_t MAX_CARDS = 21;
+   uint8_t count = 0;
+   uint8_t hard = 0; // hard total, every ace counted as 1
+   uint8_t aces = 0; // number of aces in the hand
+   card_t cards[MAX_CARDS];
+   // Add a card to the hand, updating its totals.
+   void add(card_t card) {
+      cards[count++] = card;
+      hard += card_hard_value(card);
+      aces += (card >> 2) == 0;
+   }
+   // Remove all cards from the hand.
+   void clear() {
+      count = 0;
+      hard = 0;
+      aces = 0;
+   }
+   // Return the hard total of the hand.
+   constexpr uint8_t hard_value() const {
+      return hard;
+   }
+   // Return the soft total of the hand, which may be over 21.
+   constexpr uint8_t soft_value() const {
+      return hard + 10 * (aces != 0);
+   }
+   // Return the value of the hand: the soft total if it is 21 or under,
+   // otherwise the hard total.
+   constexpr uint8_t value() const {
+      return hard + 10 * ((aces != 0) & (hard <= 11));
+   }
+   // Check whether the hand is a natural blackjack (21 in two cards).
+   constexpr bool is_blackjack() const {
+      return (count == 2) & (value() == 21);
+   }
+   // Check whether the hand is over 21.
+   constexpr bool is_bust() const {
+      return hard > 21;
+   }
+   // Check whether the dealer stands on this hand: on 18 or over, on hard
+   // 17, and on soft 17 unless the table hits soft 17. Busts and 21 stand.
+   constexpr bool dealer_stands(bool hit_soft_17) const {
+      return (value() >= 18) | (hard == 17) | (!hit_soft_17 & (value() == 17));
+   }
+   // Return the number of cards in the hand.
+   uint8_t size() const {
+      return count;
+   }
+   const card_t* begin() const {
+      return cards;
+   }
+   const card_t* end() const {
+      return cards + count;
+   }
+};
+
+// Shoe is the cards a table deals from: number_decks decks shuffled into
+// one array, dealt front to back. The array is allocated once and refilled
+// in place on every reshuffle. The cut card sits penetration percent of
+// the way in, and the shoe is changed before the first round after it.
+// The order of the cards is determined by the seed alone.
+struct Shoe
+{
+   std::vector<card_t> cards; // every card in the shoe, in dealing order
+   size_t cursor = 0; // index of the next card to deal
+   size_t cut = 0; // index the cut card sits at
+   ShoeSeed seed; // seed the shoe was shuffled from
+   // Refill the shoe with decks decks and shuffle it from seed_.
+   void fill(uint8_t decks, const ShoeSeed& seed_) {
+      cards.resize(decks * 52);
+      size_t i = 0;
+      for (int d = 0; d < decks; d++) {
+         for (uint8_t rank = 0; rank < 13; rank++) {
+            for (uint8_t suit = 0; suit < 4; suit++) {
+               cards[i++] = make_card(rank, suit);
+            }
+         }
+      }
+      seed = seed_;
+      ChaCha20 rng(seed);
+      fisher_yates(cards.data(), cards.size(), rng);
+      cursor = 0;
+      cut = cards.size();
+   }
+   // Place the cut card penetration percent of the way into the shoe.
+   void place_cut(uint8_t penetration) {
+      cut = cards.size() * penetration / 100;
+   }
+   // Check whether the cut card has come out.
+   bool past_cut() const {
+      return cursor >= cut;
+   }
+   // Check whether every card has been dealt.
+   bool empty() const {
+      return cursor == cards.size();
+   }
+   // Deal the next card. The shoe must not be empty.
+   card_t draw() {
+      return cards[cursor++];
+   }
+};
+
+// encode_hand writes a card hand response (rc_1-rc_2-rc_3) for hand into
+// *buf, the way CardHandResponsePDU::to_bytes does, and returns its length.
+ssize_t encode_hand(char** buf, uint8_t rc_1, uint8_t rc_2, uint8_t rc_3, uint8_t holder,
+      uint8_t soft_value, uint8_t hard_value, const Hand& hand)
+{
+   CardHandResponseHeader header;
+   header.reply_code_1 = rc_1;
+   header.reply_code_2 = rc_2;
+   header.reply_code_3 = rc_3;
+   header.holder = holder;
+   header.soft_value = soft_value;
+   header.hard_value = hard_value;
+   header.number_of_cards = hand.size();
+   memcpy((void*)*buf, reinterpret_cast<void*>(&header), sizeof(CardHandResponseHeader));
+   ssize_t total_len = sizeof(CardHandResponseHeader);
+   for (auto card : hand) {
+      char* write_at_buf = *buf+total_len; // Get the offset for the next card
+      total_len += CardPDU(card_rank(card), card_suit(card)).to_bytes(&write_at_buf);
+   }
+   return total_len;
+}
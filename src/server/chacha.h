@@ -0,0 +1,171 @@
+/* chacha.h
+ * Contains ChaCha20, the CSPRNG every shoe is shuffled with, and
+ * ShoeSeed, the 256-bit key a shoe's order is derived from. A generator
+ * computes its keystream several blocks at a time and hands it out a
+ * word at a time, and bounded draws use rejection so every index of a
+ * Fisher-Yates shuffle is exactly uniform. The same seed always gives
+ * the same shoe, so a seed recorded when a shoe comes into play is
+ * enough to reproduce its exact card order.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <random>
+#include <string>
+
+// ShoeSeed is the key of one shoe's ChaCha20 stream.
+struct ShoeSeed
+{
+   uint8_t bytes[32] = {0};
+   // Return the seed as 64 hex digits.
+   std::string to_hex() const {
+      char hex[65];
+      for (int i = 0; i < 32; i++) {
+         snprintf(hex + 2 * i, 3, "%02x", bytes[i]);
+      }
+      return std::string(hex, 64);
+   }
+   // Parse 64 hex digits into the seed. Return false if hex is not a seed.
+   bool from_hex(const std::string& hex) {
+      if (hex.length() != 64 || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+         return false;
+      }
+      for (int i = 0; i < 32; i++) {
+         bytes[i] = std::stoul(hex.substr(2 * i, 2), NULL, 16);
+      }
+      return true;
+   }
+   // Return a seed from the operating system's entropy pool.
+   static ShoeSeed random() {
+      ShoeSeed seed;
+      size_t got = 0;
+      while (got < sizeof(seed.bytes)) {
+         ssize_t n = getrandom(seed.bytes + got, sizeof(seed.bytes) - got, 0);
+         if (n <= 0) {
+            break;
+         }
+         got += n;
+      }
+      if (got < sizeof(seed.bytes)) {
+         // No getrandom, fall back to the C++ random device
+         std::random_device rd {};
+         for (size_t i = 0; i < sizeof(seed.bytes); i++) {
+            seed.bytes[i] = rd();
+         }
+      }
+      return seed;
+   }
+};
+
+// ChaCha20 is the ChaCha20 stream cipher's keystream (RFC 8439, with a
+// 64-bit block counter and a 64-bit stream number) used as a random
+// number generator. It also meets UniformRandomBitGenerator, so it can
+// drive the standard library's distributions.
+class ChaCha20
+{
+   private:
+      static const int BLOCKS = 8; // Blocks of keystream generated at once
+      uint32_t state[16];
+      uint32_t buffer[16 * BLOCKS];
+      int used = 16 * BLOCKS; // Words of buffer already handed out
+      static inline uint32_t rotl(uint32_t x, int n) {
+         return (x << n) | (x >> (32 - n));
+      }
+      static inline void quarter_round(uint32_t* x, int a, int b, int c, int d) {
+         x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+         x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+         x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+         x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+      }
+      // Generate the next BLOCKS blocks of keystream into buffer.
+      void refill() {
+         for (int blk = 0; blk < BLOCKS; blk++) {
+            uint32_t* x = buffer + 16 * blk;
+            memcpy(x, state, sizeof(state));
+            for (int i = 0; i < 10; i++) {
+               quarter_round(x, 0, 4, 8, 12);
+               quarter_round(x, 1, 5, 9, 13);
+               quarter_round(x, 2, 6, 10, 14);
+               quarter_round(x, 3, 7, 11, 15);
+               quarter_round(x, 0, 5, 10, 15);
+               quarter_round(x, 1, 6, 11, 12);
+               quarter_round(x, 2, 7, 8, 13);
+               quarter_round(x, 3, 4, 9, 14);
+            }
+            for (int i = 0; i < 16; i++) {
+               x[i] += state[i];
+            }
+            // Advance the 64-bit block counter
+            if (++state[12] == 0) {
+               state[13]++;
+            }
+         }
+         used = 0;
+      }
+   public:
+      typedef uint32_t result_type;
+      // Start the keystream of key at block counter, on the given stream.
+      ChaCha20(const ShoeSeed& key, uint64_t stream = 0, uint64_t counter = 0) {
+         state[0] = 0x61707865; // "expand 32-byte k"
+         state[1] = 0x3320646e;
+         state[2] = 0x79622d32;
+         state[3] = 0x6b206574;
+         for (int i = 0; i < 8; i++) {
+            const uint8_t* k = key.bytes + 4 * i;
+            state[4 + i] = k[0] | (k[1] << 8) | (k[2] << 16) | ((uint32_t)k[3] << 24);
+         }
+         state[12] = (uint32_t)counter;
+         state[13] = (uint32_t)(counter >> 32);
+         state[14] = (uint32_t)stream;
+         state[15] = (uint32_t)(stream >> 32);
+      }
+      static constexpr uint32_t min() {
+         return 0;
+      }
+      static constexpr uint32_t max() {
+         return UINT32_MAX;
+      }
+      // Return the next 32 bits of keystream.
+      uint32_t operator()() {
+         if (used == 16 * BLOCKS) {
+            refill();
+         }
+         return buffer[used++];
+      }
+      // Return a uniform integer in [0, n), for n > 0. Multiplies into 64
+      // bits and rejects the few low products that would favour some
+      // results (Lemire's method), so there is no modulo bias.
+      uint32_t bounded(uint32_t n) {
+         uint64_t m = (uint64_t)(*this)() * n;
+         uint32_t low = (uint32_t)m;
+         if (low < n) {
+            uint32_t threshold = -n % n;
+            while (low < threshold) {
+               m = (uint64_t)(*this)() * n;
+               low = (uint32_t)m;
+            }
+         }
+         return m >> 32;
+      }
+      // Return a fresh seed drawn from the keystream.
+      ShoeSeed seed() {
+         ShoeSeed s;
+         for (int i = 0; i < 8; i++) {
+            uint32_t w = (*this)();
+            memcpy(s.bytes + 4 * i, &w, 4);
+         }
+         return s;
+      }
+};
+
+// fisher_yates shuffles the n items at items uniformly with rng.
+template <typename T>
+void fisher_yates(T* items, size_t n, ChaCha20& rng)
+{
+   for (size_t i = n; i > 1; i--) {
+      size_t j = rng.bounded(i);
+      std::swap(items[i - 1], items[j]);
+   }
+}
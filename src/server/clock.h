@@ -0,0 +1,77 @@
+/* clock.h
+ * Contains the Clock that all table timing goes through, and its two
+ * implementations. RealClock is the steady clock, and waits for
+ * deadlines in real time. VirtualClock only moves when told to: the
+ * Scheduler (see scheduler.h) jumps it straight to the next armed
+ * deadline as soon as every actor has run out of work, so a bet window
+ * or turn timeout passes instantly. Tables read the time from the
+ * scheduler's clock, never from std::chrono directly, so the same game
+ * loop runs in either.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Clock is where the Scheduler and its tables get the time from.
+class Clock
+{
+   public:
+      virtual ~Clock() {}
+      // Return the current time.
+      virtual Deadline now() = 0;
+      // Block on cv, whose mutex lock holds, until deadline passes or cv is
+      // notified, whichever is first. May return early.
+      virtual void wait_until(std::unique_lock<ProfiledMutex>& lock, LockCV& cv, Deadline deadline) = 0;
+      // Return true if time only moves while nothing is left to run.
+      virtual bool is_virtual() {
+         return false;
+      }
+};
+
+// RealClock is the steady clock.
+class RealClock : public Clock
+{
+   public:
+      Deadline now() {
+         return std::chrono::steady_clock::now();
+      }
+      void wait_until(std::unique_lock<ProfiledMutex>& lock, LockCV& cv, Deadline deadline) {
+         cv.wait_until(lock, deadline);
+      }
+};
+
+// VirtualClock starts at the real time it is made, and from then on only
+// moves forward when advanced. Waiting for a deadline advances to it at once.
+class VirtualClock : public Clock
+{
+   private:
+      std::atomic<Deadline::rep> ticks; // Current time, since the steady clock's epoch
+   public:
+      VirtualClock() : ticks(std::chrono::steady_clock::now().time_since_epoch().count()) {}
+      Deadline now() {
+         return Deadline(Deadline::duration(ticks.load(std::memory_order_acquire)));
+      }
+      // Move the time forward to deadline, if it is later than now.
+      void advance_to(Deadline deadline) {
+         Deadline::rep to = deadline.time_since_epoch().count();
+         Deadline::rep at = ticks.load(std::memory_order_relaxed);
+         while (at < to && !ticks.compare_exchange_weak(at, to, std::memory_order_release)) {}
+      }
+      // Move the time forward by d.
+      void advance(Deadline::duration d) {
+         ticks.fetch_add(d.count(), std::memory_order_release);
+      }
+      void wait_until(std::unique_lock<ProfiledMutex>& /* lock */, LockCV& /* cv */, Deadline deadline) {
+         advance_to(deadline);
+      }
+      bool is_virtual() {
+         return true;
+      }
+};
+
+// real_clock is the clock the scheduler runs on unless it is given another.
+RealClock real_clock;
@@ -0,0 +1,573 @@
+/* fiber.h
+ * Contains the FiberScheduler, an M:N runtime that runs every client
+ * connection as a fiber on a small pool of worker threads, instead of
+ * giving each connection an OS thread of its own. A fiber has its own
+ * small stack, mmap'd with a guard page below it so an overflow faults
+ * instead of corrupting a neighbour (a stack and its guard page are two
+ * mappings, so vm.max_map_count, 65530 by default, caps live fibers at
+ * about 32 thousand unless raised), and it runs ordinary blocking-style
+ * code. When it would block (a read with no data, a write to a full
+ * socket, waiting on a table) it parks, and its worker runs another
+ * fiber until it is woken.
+ *
+ * Each worker has its own run queue. A worker runs fibers off the front
+ * of its own queue and, once that is empty, steals from the back of
+ * the others', so a busy worker's backlog is spread across idle ones.
+ * A poller thread waits on every socket a fiber is parked on with
+ * epoll, and puts the fiber back on a run queue when the socket is
+ * ready.
+ *
+ * A fiber may be given a home worker with migrate, after which it only
+ * ever runs there and is never stolen. A connection moves to the core of
+ * the table it joins this way (see scheduler.h).
+ *
+ * Code that may run on either a fiber or a plain thread (Session I/O
+ * is used by both connection fibers and table workers) calls the same
+ * functions, which fall back to blocking the thread when it is not on
+ * a fiber.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+class Fiber;
+extern "C" void cbp_fiber_entry(Fiber* fiber);
+
+#if defined(__x86_64__)
+// FiberContext is a suspended stack. The callee-saved registers are pushed
+// on the stack itself, so switching is a handful of pushes, a stack pointer
+// swap and a handful of pops, with no system call.
+struct FiberContext
+{
+   void* sp = NULL;
+};
+
+extern "C" void cbp_fiber_switch(void** from_sp, void* to_sp);
+extern "C" void cbp_fiber_trampoline();
+
+// cbp_fiber_switch saves the callee-saved registers and the SSE and x87
+// control words on the current stack, stores the stack pointer in *from_sp,
+// and restores the same from to_sp. cbp_fiber_trampoline is where a new
+// fiber's first switch returns to, and calls cbp_fiber_entry with the
+// fiber, which fiber_context_init left in r12.
+asm(R"(
+   .text
+   .globl cbp_fiber_switch
+   .type cbp_fiber_switch, @function
+cbp_fiber_switch:
+   pushq %rbp
+   pushq %rbx
+   pushq %r12
+   pushq %r13
+   pushq %r14
+   pushq %r15
+   subq $8, %rsp
+   stmxcsr (%rsp)
+   fnstcw 4(%rsp)
+   movq %rsp, (%rdi)
+   movq %rsi, %rsp
+   ldmxcsr (%rsp)
+   fldcw 4(%rsp)
+   addq $8, %rsp
+   popq %r15
+   popq %r14
+   popq %r13
+   popq %r12
+   popq %rbx
+   popq %rbp
+   ret
+   .size cbp_fiber_switch, .-cbp_fiber_switch
+
+   .globl cbp_fiber_trampoline
+   .type cbp_fiber_trampoline, @function
+cbp_fiber_trampoline:
+   movq %r12, %rdi
+   call cbp_fiber_entry@PLT
+   ud2
+   .size cbp_fiber_trampoline, .-cbp_fiber_trampoline
+)");
+
+// fiber_context_init sets up ctx to start running cbp_fiber_entry(fiber) on
+// the stack [stack, stack + size) the first time it is switched to.
+static void fiber_context_init(FiberContext* ctx, char* stack, size_t size, Fiber* fiber)
+{
+   uintptr_t top = ((uintptr_t)(stack + size)) & ~(uintptr_t)15;
+   void** sp = (void**)top;
+   sp[-1] = NULL;
+   sp[-2] = NULL;
+   sp[-3] = (void*)cbp_fiber_trampoline; // returned to, leaving the stack 16-byte aligned
+   sp[-4] = NULL; // rbp
+   sp[-5] = NULL; // rbx
+   sp[-6] = (void*)fiber; // r12
+   sp[-7] = NULL; // r13
+   sp[-8] = NULL; // r14
+   sp[-9] = NULL; // r15
+   uint32_t* control = (uint32_t*)&sp[-10];
+   control[0] = 0x1F80; // default MXCSR
+   control[1] = 0x037F; // default x87 control word
+   ctx->sp = &sp[-10];
+}
+
+// fiber_context_switch suspends the running code into from and resumes to.
+static inline void fiber_context_switch(FiberContext* from, FiberContext* to)
+{
+   cbp_fiber_switch(&from->sp, to->sp);
+}
+#else
+// FiberContext falls back to ucontext where there is no hand-written
+// switch, which costs a signal mask system call per switch.
+struct FiberContext
+{
+   ucontext_t uc;
+};
+
+// ucontext_entry rebuilds the fiber pointer makecontext had to split into ints.
+static void ucontext_entry(unsigned int hi, unsigned int lo)
+{
+   cbp_fiber_entry((Fiber*)(((uintptr_t)hi << 32) | (uintptr_t)lo));
+}
+
+// fiber_context_init sets up ctx to start running cbp_fiber_entry(fiber) on
+// the stack [stack, stack + size) the first time it is switched to.
+static void fiber_context_init(FiberContext* ctx, char* stack, size_t size, Fiber* fiber)
+{
+   uintptr_t p = (uintptr_t)fiber;
+   getcontext(&ctx->uc);
+   ctx->uc.uc_stack.ss_sp = stack;
+   ctx->uc.uc_stack.ss_size = size;
+   ctx->uc.uc_link = NULL;
+   makecontext(&ctx->uc, (void (*)())ucontext_entry, 2, (unsigned int)((uint64_t)p >> 32), (unsigned int)p);
+}
+
+// fiber_context_switch suspends the running code into from and resumes to.
+static inline void fiber_context_switch(FiberContext* from, FiberContext* to)
+{
+   swapcontext(&from->uc, &to->uc);
+}
+#endif
+
+// Fiber is one lightweight thread of execution and its stack. A fiber is
+// only ever run by one worker at a time, but may be resumed by a different
+// worker than the one it parked on.
+class Fiber
+{
+   public:
+      // Parking states. A wakeup that arrives before the fiber has finished
+      // parking leaves NOTIFIED behind, so it is never lost.
+      enum ParkState { EMPTY, NOTIFIED, PARKED };
+      // What a fiber asked its worker to do with it once it switched out.
+      enum After { YIELD, PARK, EXIT };
+      std::function<void()> fn; // What the fiber runs
+      FiberContext ctx; // Saved context while the fiber is not running
+      char* mapping = NULL; // The stack mapping, guard page first
+      std::atomic<int> park_state {EMPTY};
+      After after = YIELD;
+      int home = -1; // Worker the fiber is pinned to, -1 if any worker may run it
+      int wait_fd = -1; // Socket to wake the fiber on once it parks, -1 for none
+      bool wait_write = false; // Wait for wait_fd to be writable rather than readable
+      void* local = NULL; // One word of fiber-local storage, see EpochManager
+      void (*local_free)(void*) = NULL; // Frees local when the fiber exits
+};
+
+// FiberScheduler runs fibers on a fixed pool of workers, with a run queue
+// per worker, work stealing between them, and a poller thread for sockets.
+class FiberScheduler
+{
+   private:
+      static const size_t STACK_SIZE = 128 * 1024; // Usable stack per fiber, only touched pages use memory
+      static const size_t MAX_CACHED_STACKS = 1024; // Stacks kept for reuse instead of unmapped
+      // A worker thread and its run queue, padded so workers never share a line.
+      struct alignas(64) Worker {
+         ProfiledMutex mtx LOCK_SITE("FiberScheduler::Worker::mtx"); // Protects the queues and sleeping
+         std::deque<Fiber*> queue; // Runnable fibers, run from the front, stolen from the back
+         std::deque<Fiber*> pinned; // Runnable fibers homed on this worker, never stolen
+         bool pinned_first = false; // Alternates which queue the worker looks at first
+         bool sleeping = false; // Set while the worker waits on cv, cleared by whoever wakes it
+         LockCV cv; // Signalled when the worker is woken
+         FiberContext ctx; // The worker's own context while a fiber runs
+         Fiber* running = NULL; // The fiber this worker is running, if any
+         unsigned index = 0;
+      };
+      std::vector<Worker*> workers;
+      std::atomic<unsigned> next_worker {0}; // Round robin for fibers queued from outside a worker
+      std::atomic<int> sleepers {0}; // Workers asleep with nothing to run
+      int epfd = -1; // epoll instance the poller waits on
+      int max_fds = 0; // Size of waiters
+      std::atomic<Fiber*>* waiters = NULL; // The fiber parked on each socket, indexed by fd
+      Fiber* const WAKING = reinterpret_cast<Fiber*>(1); // Held in a waiter slot while the poller wakes its fiber
+      size_t page_size = 4096;
+      ProfiledMutex stack_mtx LOCK_SITE("FiberScheduler::stack_mtx"); // Protects free_stacks
+      std::vector<char*> free_stacks; // Unmapped-on-exit stacks kept for reuse
+      // The calling thread's worker, NULL off the pool. Never inlined, so a
+      // fiber that moves between workers never sees a cached thread-local.
+      static __attribute__((noinline)) Worker*& this_worker() {
+         static thread_local Worker* w = NULL;
+         return w;
+      }
+      // Map a stack with an inaccessible guard page below it.
+      char* map_stack() {
+         {
+            std::lock_guard<ProfiledMutex> lock(stack_mtx);
+            if (!free_stacks.empty()) {
+               char* mapping = free_stacks.back();
+               free_stacks.pop_back();
+               return mapping;
+            }
+         }
+         void* mapping = mmap(NULL, STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+         if (mapping == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+         }
+         if (mprotect(mapping, page_size, PROT_NONE) < 0) {
+            perror("mprotect");
+            exit(EXIT_FAILURE);
+         }
+         return (char*)mapping;
+      }
+      // Return a stack to the cache, or unmap it if the cache is full.
+      void unmap_stack(char* mapping) {
+         {
+            std::lock_guard<ProfiledMutex> lock(stack_mtx);
+            if (free_stacks.size() < MAX_CACHED_STACKS) {
+               free_stacks.push_back(mapping);
+               return;
+            }
+         }
+         munmap(mapping, STACK_SIZE + page_size);
+      }
+      // Put fiber on a run queue: its home worker's, the calling worker's
+      // own, or the next one round robin if called from outside the pool.
+      void push(Fiber* fiber) {
+         Worker* w = this_worker();
+         if (fiber->home >= 0) {
+            w = workers[fiber->home];
+         } else if (!w) {
+            w = workers[next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+         }
+         bool woken = false;
+         {
+            std::lock_guard<ProfiledMutex> lock(w->mtx);
+            if (fiber->home >= 0) {
+               w->pinned.push_back(fiber);
+            } else {
+               w->queue.push_back(fiber);
+            }
+            if (w->sleeping) {
+               w->sleeping = false;
+               w->cv.notify_one();
+               woken = true;
+            }
+         }
+         // The worker is busy, wake an idle one to steal the fiber. Pinned
+         // fibers can only be run by their home worker, so are left alone.
+         if (!woken && fiber->home < 0 && sleepers.load() > 0) {
+            for (auto other : workers) {
+               std::lock_guard<ProfiledMutex> lock(other->mtx);
+               if (other->sleeping) {
+                  other->sleeping = false;
+                  other->cv.notify_one();
+                  break;
+               }
+            }
+         }
+      }
+      // Take the next fiber for w to run: its own oldest, taking turns
+      // between its pinned and unpinned queues, or another worker's newest
+      // unpinned fiber. Returns NULL if every queue is empty.
+      Fiber* take(Worker* w) {
+         Fiber* fiber = NULL;
+         {
+            std::lock_guard<ProfiledMutex> lock(w->mtx);
+            w->pinned_first = !w->pinned_first;
+            std::deque<Fiber*>* first = w->pinned_first ? &w->pinned : &w->queue;
+            std::deque<Fiber*>* second = w->pinned_first ? &w->queue : &w->pinned;
+            if (!first->empty()) {
+               fiber = first->front();
+               first->pop_front();
+            } else if (!second->empty()) {
+               fiber = second->front();
+               second->pop_front();
+            }
+         }
+         for (size_t i = 1; !fiber && i < workers.size(); i++) {
+            Worker* victim = workers[(w->index + i) % workers.size()];
+            std::lock_guard<ProfiledMutex> lock(victim->mtx);
+            if (!victim->queue.empty()) {
+               fiber = victim->queue.back();
+               victim->queue.pop_back();
+            }
+         }
+         return fiber;
+      }
+      // Switch from the running fiber back to its worker, asking it to do after.
+      void suspend(Fiber::After after) {
+         Worker* w = this_worker();
+         Fiber* fiber = w->running;
+         fiber->after = after;
+         fiber_context_switch(&fiber->ctx, &w->ctx);
+      }
+      // Free a fiber that has finished.
+      void destroy(Fiber* fiber) {
+         if (fiber->local_free) {
+            fiber->local_free(fiber->local);
+         }
+         unmap_stack(fiber->mapping);
+         delete fiber;
+      }
+      // Finish parking fiber, which has just switched out. Called by its worker.
+      void park_switched_out(Fiber* fiber) {
+         if (fiber->wait_fd >= 0) {
+            // Registered only now the fiber is off its stack, so the poller
+            // can never resume it while it is still running
+            int fd = fiber->wait_fd;
+            set_waiter(fd, fiber);
+            struct epoll_event ev;
+            ev.events = (fiber->wait_write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+            ev.data.fd = fd;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+               epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            }
+         }
+         int expected = Fiber::EMPTY;
+         if (!fiber->park_state.compare_exchange_strong(expected, Fiber::PARKED)) {
+            // Woken while switching out, run it again
+            fiber->park_state.store(Fiber::EMPTY);
+            push(fiber);
+         }
+      }
+      // worker runs fibers from the run queues, forever. If pin is set it
+      // first pins itself to the core with its index.
+      void worker(Worker* w, bool pin) {
+         this_worker() = w;
+         if (pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w->index % std::thread::hardware_concurrency(), &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+         }
+         for (;;) {
+            Fiber* fiber = take(w);
+            if (!fiber) {
+               // Sleep until a fiber is pushed to this worker, or another
+               // worker's queue has one to steal
+               std::unique_lock<ProfiledMutex> lock(w->mtx);
+               if (!w->queue.empty() || !w->pinned.empty()) {
+                  continue;
+               }
+               w->sleeping = true;
+               sleepers.fetch_add(1);
+               w->cv.wait(lock, [w]{ return !w->sleeping; });
+               sleepers.fetch_sub(1);
+               continue;
+            }
+            w->running = fiber;
+            fiber_context_switch(&w->ctx, &fiber->ctx);
+            w->running = NULL;
+            switch (fiber->after) {
+               case Fiber::YIELD:
+                  push(fiber);
+                  break;
+               case Fiber::PARK:
+                  park_switched_out(fiber);
+                  break;
+               case Fiber::EXIT:
+                  destroy(fiber);
+                  break;
+            }
+         }
+      }
+      // Put fiber (or NULL) in the waiter slot of fd, once any wake the
+      // poller has in flight there is finished.
+      void set_waiter(int fd, Fiber* fiber) {
+         Fiber* seen = waiters[fd].load();
+         do {
+            while (seen == WAKING) {
+               std::this_thread::yield();
+               seen = waiters[fd].load();
+            }
+         } while (!waiters[fd].compare_exchange_weak(seen, fiber));
+      }
+      // poller wakes the fiber parked on each socket epoll reports ready, forever.
+      void poller() {
+         struct epoll_event events[64];
+         for (;;) {
+            int n = epoll_wait(epfd, events, 64, -1);
+            for (int i = 0; i < n; i++) {
+               // The slot is held until unpark is finished with the fiber, so
+               // forget_fd cannot return, and the fiber exit (freeing itself),
+               // while it is being woken
+               std::atomic<Fiber*>& slot = waiters[events[i].data.fd];
+               Fiber* fiber = slot.exchange(WAKING);
+               if (fiber) {
+                  unpark(fiber);
+               }
+               slot.store(NULL);
+            }
+         }
+      }
+   public:
+      // Start n worker threads and the poller thread. If pin is set, worker
+      // i is pinned to core i. The threads are detached, and run for the
+      // life of the process.
+      void start(unsigned n, bool pin = false) {
+         if (n == 0) {
+            n = 1;
+         }
+         page_size = sysconf(_SC_PAGESIZE);
+         struct rlimit rl;
+         max_fds = 65536;
+         if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > (rlim_t)max_fds) {
+            max_fds = rl.rlim_cur;
+         }
+         waiters = new std::atomic<Fiber*>[max_fds];
+         for (int i = 0; i < max_fds; i++) {
+            waiters[i].store(NULL);
+         }
+         if ((epfd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+         }
+         for (unsigned i = 0; i < n; i++) {
+            Worker* w = new Worker();
+            w->index = i;
+            workers.push_back(w);
+         }
+         for (auto w : workers) {
+            std::thread(&FiberScheduler::worker, this, w, pin).detach();
+         }
+         std::thread(&FiberScheduler::poller, this).detach();
+      }
+      // Start a new fiber running fn. Safe to call from any thread.
+      void spawn(std::function<void()> fn) {
+         Fiber* fiber = new Fiber();
+         fiber->fn = std::move(fn);
+         fiber->mapping = map_stack();
+         fiber_context_init(&fiber->ctx, fiber->mapping + page_size, STACK_SIZE, fiber);
+         push(fiber);
+      }
+      // Return the fiber the calling code is running on, or NULL on a plain thread.
+      Fiber* current() {
+         Worker* w = this_worker();
+         return w ? w->running : NULL;
+      }
+      // Let other fibers run before continuing. On a plain thread, yields the thread.
+      void yield() {
+         if (!current()) {
+            std::this_thread::yield();
+            return;
+         }
+         suspend(Fiber::YIELD);
+      }
+      // Suspend the running fiber until unpark is called on it. A wakeup
+      // may be spurious, so callers re-check what they are waiting for.
+      void park() {
+         Fiber* fiber = current();
+         int expected = Fiber::NOTIFIED;
+         if (fiber->park_state.compare_exchange_strong(expected, Fiber::EMPTY)) {
+            return;
+         }
+         suspend(Fiber::PARK);
+      }
+      // Wake fiber if it is parked, or make its next park return at once if not.
+      // Safe to call from any thread.
+      void unpark(Fiber* fiber) {
+         if (fiber->park_state.exchange(Fiber::NOTIFIED) == Fiber::PARKED) {
+            fiber->park_state.store(Fiber::EMPTY);
+            push(fiber);
+         }
+      }
+      // Wait until fd is readable (or writable, if write), or has an error.
+      // Parks the fiber, or blocks in poll on a plain thread. May return early.
+      void wait_fd(int fd, bool write) {
+         Fiber* fiber = current();
+         if (!fiber || fd >= max_fds) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = write ? POLLOUT : POLLIN;
+            poll(&pfd, 1, -1);
+            return;
+         }
+         fiber->wait_fd = fd;
+         fiber->wait_write = write;
+         park();
+         fiber->wait_fd = -1;
+      }
+      // Stop watching fd, waiting out any wake of it in flight. Must be called
+      // before a socket a fiber waited on is closed.
+      void forget_fd(int fd) {
+         if (fd < 0 || fd >= max_fds) {
+            return;
+         }
+         epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+         set_waiter(fd, NULL);
+      }
+      // Pin the running fiber to worker (modulo the number of workers), moving
+      // it there before returning, or unpin it if worker is -1. Does nothing
+      // on a plain thread.
+      void migrate(int worker) {
+         Fiber* fiber = current();
+         if (!fiber) {
+            return;
+         }
+         fiber->home = worker < 0 ? -1 : worker % workers.size();
+         if (fiber->home >= 0 && (unsigned)fiber->home != this_worker()->index) {
+            // Yielding pushes the fiber onto its home worker's queue
+            suspend(Fiber::YIELD);
+         }
+      }
+      // Finish the running fiber. Never returns.
+      void exit_fiber() {
+         suspend(Fiber::EXIT);
+      }
+};
+
+// fibers runs every client connection in the server.
+FiberScheduler fibers;
+
+// cbp_fiber_entry is the first thing a new fiber runs.
+extern "C" void cbp_fiber_entry(Fiber* fiber)
+{
+   fiber->fn();
+   fibers.exit_fiber();
+}
+
+// FiberMutex is a lock that may be held while a fiber parks, and so be
+// released by a different thread than took it, which std::mutex forbids.
+// It spins by yielding, so it is only for short, rarely contended sections.
+class FiberMutex
+{
+   private:
+      std::atomic<bool> locked {false};
+   public:
+      void lock() {
+         while (locked.exchange(true, std::memory_order_acquire)) {
+            fibers.yield();
+         }
+      }
+      bool try_lock() {
+         return !locked.exchange(true, std::memory_order_acquire);
+      }
+      void unlock() {
+         locked.store(false, std::memory_order_release);
+      }
+};
@@ -0,0 +1,124 @@
+/* ledger.h
+ * Contains the Settlement a table pays a round out through, and the
+ * Ledger every settled round is recorded in. A table first works out
+ * every payout of the round into its Settlement, then credits the
+ * accounts in one pass, each account once however many seats it won
+ * on, then records the round as one ledger record, and only then tells
+ * the players. The ledger is an append-only file, one line per round,
+ * and is off unless the server is started with --ledger.
+ *
+ * Expects accounts.h to be included first.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Settlement is the payouts of one round at one table, in the order the
+// seats were settled. It is only used by its table, and kept between rounds
+// so settling allocates nothing once it has grown.
+class Settlement
+{
+   public:
+      // Entry is one seat's result.
+      struct Entry {
+         AccountDetails* account;
+         const std::string* username; // The seat's, which outlives the round
+         uint32_t bet;
+         uint32_t payout;
+         bool recorded; // false for a bot's seat, whose account is not in the account table
+      };
+   private:
+      std::vector<Entry> entries;
+      std::vector<Entry*> by_account; // entries sorted by account, for apply
+   public:
+      // Start a new round.
+      void clear() {
+         entries.clear();
+      }
+      // Add a seat's result.
+      void add(AccountDetails* account, const std::string& username, uint32_t bet, uint32_t payout, bool recorded) {
+         entries.push_back(Entry{account, &username, bet, payout, recorded});
+      }
+      const std::vector<Entry>& results() {
+         return entries;
+      }
+      // Return true if a seat that is recorded in the ledger was settled.
+      bool has_recorded() {
+         for (auto& e : entries) {
+            if (e.recorded) {
+               return true;
+            }
+         }
+         return false;
+      }
+      // apply credits every payout in one pass over the accounts in address
+      // order, summing the payouts of an account that won on several seats
+      // into one update.
+      void apply() {
+         by_account.clear();
+         for (auto& e : entries) {
+            by_account.push_back(&e);
+         }
+         std::sort(by_account.begin(), by_account.end(), [](Entry* a, Entry* b) { return a->account < b->account; });
+         for (size_t i = 0; i < by_account.size(); ) {
+            AccountDetails* account = by_account[i]->account;
+            uint32_t total = 0;
+            for (; i < by_account.size() && by_account[i]->account == account; i++) {
+               total += by_account[i]->payout;
+            }
+            if (total > 0) {
+               account->adjustBalance(total);
+            }
+         }
+      }
+};
+
+// Ledger appends a record of every settled round to a file. Each record is
+// one line, written with a single write to a file opened for appending, so
+// records from tables settling at once never interleave.
+class Ledger
+{
+   private:
+      int fd = -1;
+   public:
+      // Start recording to the file at path, appending to anything already
+      // there. Returns false if it cannot be opened.
+      bool open(const char* path) {
+         fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+         return fd >= 0;
+      }
+      // Return true if rounds are being recorded.
+      bool enabled() {
+         return fd >= 0;
+      }
+      // Record round of table table_id, as settled: the wall clock time, the
+      // table and round, then username, bet and payout of every seat that
+      // is recorded, as "<time> <table> <round> <username>:<bet>:<payout> ...".
+      // A round of only bots is not recorded.
+      void record(uint16_t table_id, uint64_t round, Settlement& settlement) {
+         if (fd < 0 || !settlement.has_recorded()) {
+            return;
+         }
+         char head[64];
+         snprintf(head, sizeof(head), "%lld %u %llu", (long long)time(NULL), table_id, (unsigned long long)round);
+         std::string line = head;
+         for (auto& e : settlement.results()) {
+            if (e.recorded) {
+               line += " " + *e.username + ":" + std::to_string(e.bet) + ":" + std::to_string(e.payout);
+            }
+         }
+         line += "\n";
+         if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+            perror("ledger write");
+         }
+      }
+};
+
+// ledger records every round the server's tables settle.
+Ledger ledger;
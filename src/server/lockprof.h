@@ -0,0 +1,288 @@
+/* lockprof.h
+ * Contains the lock profiler. Every mutex in the server is declared as
+ * a ProfiledMutex (or a Profiled<M> for other lock types) named with
+ * LOCK_SITE, and every mutex declared with the same name is one site.
+ *
+ * When the server is built with LOCK_PROFILING defined ("make server
+ * LOCK_PROFILING=1"), each site counts acquisitions and how many had to
+ * wait, keeps log2 histograms of wait and hold times, and remembers the
+ * longest holds and the threads that held them. The report is written
+ * to stderr on SIGUSR1, and sent to administrators by the LOCKSTATS
+ * command. Condition variables must then be condition_variable_any,
+ * which LockCV names.
+ *
+ * When LOCK_PROFILING is not defined, ProfiledMutex is std::mutex,
+ * Profiled<M> is M, LockCV is std::condition_variable and LOCK_SITE
+ * expands to nothing, so the build is exactly the plain locks.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+#ifdef LOCK_PROFILING
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#define LOCK_SITE(name) {name}
+
+// LockSite holds the statistics of every lock declared with one name.
+// Counters are updated with relaxed atomics, so recording never takes
+// a lock unless a hold is long enough to make the longest holds list.
+struct LockSite
+{
+   static const int BUCKETS = 40; // Bucket i counts times in [2^(i-1), 2^i) ns
+   static const int LONGEST = 3; // Longest holds kept
+   // One of the longest holds of the site.
+   struct Hold {
+      uint64_t ns = 0;
+      pid_t tid = 0;
+   };
+   const char* name;
+   LockSite* next = NULL; // Next site in the list of every site
+   std::atomic<uint64_t> acquisitions {0};
+   std::atomic<uint64_t> contended {0}; // Acquisitions that had to wait
+   std::atomic<uint64_t> wait_ns {0};
+   std::atomic<uint64_t> hold_ns {0};
+   std::atomic<uint64_t> wait_hist[BUCKETS];
+   std::atomic<uint64_t> hold_hist[BUCKETS];
+   std::atomic<uint64_t> longest_floor {0}; // Shortest hold in longest, holds at or under it are skipped
+   std::mutex longest_mtx; // Protects longest, never profiled itself
+   Hold longest[LONGEST];
+   LockSite(const char* name_) : name(name_) {
+      for (int i = 0; i < BUCKETS; i++) {
+         wait_hist[i].store(0);
+         hold_hist[i].store(0);
+      }
+   }
+   // Return the histogram bucket for ns.
+   static int bucket(uint64_t ns) {
+      int b = ns ? 64 - __builtin_clzll(ns) : 0;
+      return b < BUCKETS ? b : BUCKETS - 1;
+   }
+   // Record one acquisition that waited wait ns for the lock.
+   void record_wait(uint64_t wait, bool was_contended) {
+      acquisitions.fetch_add(1, std::memory_order_relaxed);
+      if (was_contended) {
+         contended.fetch_add(1, std::memory_order_relaxed);
+         wait_ns.fetch_add(wait, std::memory_order_relaxed);
+      }
+      wait_hist[bucket(wait)].fetch_add(1, std::memory_order_relaxed);
+   }
+   // Record that the lock was held for hold ns.
+   void record_hold(uint64_t hold) {
+      hold_ns.fetch_add(hold, std::memory_order_relaxed);
+      hold_hist[bucket(hold)].fetch_add(1, std::memory_order_relaxed);
+      if (hold <= longest_floor.load(std::memory_order_relaxed)) {
+         return;
+      }
+      std::lock_guard<std::mutex> lock(longest_mtx);
+      // Replace the shortest of the longest holds
+      int shortest = 0;
+      for (int i = 1; i < LONGEST; i++) {
+         if (longest[i].ns < longest[shortest].ns) {
+            shortest = i;
+         }
+      }
+      if (hold > longest[shortest].ns) {
+         longest[shortest].ns = hold;
+         longest[shortest].tid = syscall(SYS_gettid);
+      }
+      uint64_t floor = longest[0].ns;
+      for (int i = 1; i < LONGEST; i++) {
+         floor = std::min(floor, longest[i].ns);
+      }
+      longest_floor.store(floor, std::memory_order_relaxed);
+   }
+};
+
+// lock_sites is the head of the list of every site, newest first.
+std::atomic<LockSite*> lock_sites {NULL};
+
+// lock_site returns the site named name, creating it on first use. Sites
+// are never freed, so the pointer may be kept for the life of the lock.
+static LockSite* lock_site(const char* name)
+{
+   LockSite* head = lock_sites.load();
+   for (;;) {
+      for (LockSite* s = head; s; s = s->next) {
+         if (strcmp(s->name, name) == 0) {
+            return s;
+         }
+      }
+      LockSite* site = new LockSite(name);
+      site->next = head;
+      if (lock_sites.compare_exchange_strong(head, site)) {
+         return site;
+      }
+      // Another site was added meanwhile, it may be this one
+      delete site;
+   }
+}
+
+// lock_clock_ns returns a monotonic timestamp in nanoseconds.
+static inline uint64_t lock_clock_ns()
+{
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+         std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Profiled wraps the lock type M, recording every acquisition in its site.
+template <typename M>
+class Profiled
+{
+   private:
+      M m;
+      LockSite* site;
+      uint64_t acquired_at = 0; // When the holder acquired the lock, only touched by the holder
+   public:
+      Profiled(const char* name) : site(lock_site(name)) {}
+      void lock() {
+         if (m.try_lock()) {
+            site->record_wait(0, false);
+         } else {
+            uint64_t start = lock_clock_ns();
+            m.lock();
+            site->record_wait(lock_clock_ns() - start, true);
+         }
+         acquired_at = lock_clock_ns();
+      }
+      bool try_lock() {
+         if (!m.try_lock()) {
+            return false;
+         }
+         site->record_wait(0, false);
+         acquired_at = lock_clock_ns();
+         return true;
+      }
+      void unlock() {
+         site->record_hold(lock_clock_ns() - acquired_at);
+         m.unlock();
+      }
+};
+
+typedef Profiled<std::mutex> ProfiledMutex;
+typedef std::condition_variable_any LockCV;
+
+// format_ns formats a duration in ns with a sensible unit.
+static std::string format_ns(uint64_t ns)
+{
+   char buf[32];
+   if (ns < 1000) {
+      snprintf(buf, sizeof(buf), "%llu ns", (unsigned long long)ns);
+   } else if (ns < 1000000) {
+      snprintf(buf, sizeof(buf), "%.1f us", ns / 1e3);
+   } else if (ns < 1000000000) {
+      snprintf(buf, sizeof(buf), "%.1f ms", ns / 1e6);
+   } else {
+      snprintf(buf, sizeof(buf), "%.2f s", ns / 1e9);
+   }
+   return buf;
+}
+
+// hist_percentile returns the upper bound of the bucket holding the p-th
+// percentile of hist.
+static std::string hist_percentile(std::atomic<uint64_t>* hist, double p)
+{
+   uint64_t total = 0;
+   for (int i = 0; i < LockSite::BUCKETS; i++) {
+      total += hist[i].load(std::memory_order_relaxed);
+   }
+   uint64_t seen = 0;
+   for (int i = 0; i < LockSite::BUCKETS; i++) {
+      seen += hist[i].load(std::memory_order_relaxed);
+      if (total && seen >= total * p) {
+         return i == 0 ? "0 ns" : "<" + format_ns(1ull << i);
+      }
+   }
+   return "-";
+}
+
+// lock_profile_report returns the statistics of every site, the sites
+// that waited longest first, cut to at most max_len characters.
+std::string lock_profile_report(size_t max_len = std::string::npos)
+{
+   std::vector<LockSite*> sites;
+   for (LockSite* s = lock_sites.load(); s; s = s->next) {
+      sites.push_back(s);
+   }
+   std::sort(sites.begin(), sites.end(), [](LockSite* a, LockSite* b) {
+      return a->wait_ns.load() > b->wait_ns.load();
+   });
+   std::string report = "";
+   for (auto s : sites) {
+      uint64_t n = s->acquisitions.load();
+      uint64_t c = s->contended.load();
+      char line[256];
+      snprintf(line, sizeof(line), "%s: %llu acquisitions, %llu contended (%.2f%%)\n", s->name,
+            (unsigned long long)n, (unsigned long long)c, n ? 100.0 * c / n : 0.0);
+      std::string entry = line;
+      entry += "  wait: total " + format_ns(s->wait_ns.load()) + ", p50 " + hist_percentile(s->wait_hist, 0.5) +
+         ", p99 " + hist_percentile(s->wait_hist, 0.99) + ", max " + hist_percentile(s->wait_hist, 1.0) + "\n";
+      entry += "  hold: total " + format_ns(s->hold_ns.load()) + ", p50 " + hist_percentile(s->hold_hist, 0.5) +
+         ", p99 " + hist_percentile(s->hold_hist, 0.99) + ", longest:";
+      std::vector<LockSite::Hold> longest;
+      {
+         std::lock_guard<std::mutex> lock(s->longest_mtx);
+         longest.assign(s->longest, s->longest + LockSite::LONGEST);
+      }
+      std::sort(longest.begin(), longest.end(), [](const LockSite::Hold& a, const LockSite::Hold& b) {
+         return a.ns > b.ns;
+      });
+      for (size_t i = 0; i < longest.size() && longest[i].ns; i++) {
+         entry += std::string(i ? ", " : " ") + format_ns(longest[i].ns) + " (thread " + std::to_string(longest[i].tid) + ")";
+      }
+      entry += "\n";
+      if (report.length() + entry.length() > max_len) {
+         report += "(truncated)\n";
+         break;
+      }
+      report += entry;
+   }
+   return report;
+}
+#else
+#include <condition_variable>
+#include <mutex>
+
+#define LOCK_SITE(name)
+
+template <typename M>
+using Profiled = M;
+typedef std::mutex ProfiledMutex;
+typedef std::condition_variable LockCV;
+
+// lock_profile_report explains that profiling is off.
+std::string lock_profile_report(size_t = std::string::npos)
+{
+   return "Lock profiling is not enabled, build the server with LOCK_PROFILING=1.\n";
+}
+#endif
+
+// lock_profile_watch dumps the lock profile to stderr whenever the server
+// gets SIGUSR1. Must be called before any other thread is started, so the
+// signal is blocked everywhere but the thread that waits for it.
+void lock_profile_watch()
+{
+   sigset_t set;
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &set, NULL);
+   std::thread([set]{
+      for (;;) {
+         int sig;
+         if (sigwait(&set, &sig) == 0) {
+            std::string report = lock_profile_report();
+            fprintf(stderr, "Lock profile:\n%s", report.c_str());
+         }
+      }
+   }).detach();
+}
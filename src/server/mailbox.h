@@ -0,0 +1,163 @@
+/* mailbox.h
+ * Contains the Mailbox, a lock-free multi-producer single-consumer
+ * queue, and the TableCommand that connection threads post into a
+ * table's mailbox. Every change to a table (joining, leaving, betting,
+ * hitting, standing, doubling down, chatting, shutting down, and the
+ * rounds and seat moves a tournament drives it through) is a command,
+ * and only the table's executor ever takes them off the queue, so the
+ * table's state is owned by a single thread.
+ *
+ * The queue is Dmitry Vyukov's intrusive MPSC queue: a push is one
+ * atomic exchange, and a pop never touches shared state unless the
+ * queue is nearly empty.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+class AccountDetails;
+class TableDetails;
+
+// Completion lets a connection wait until the executor has processed a
+// command it posted. A connection fiber parks rather than blocking its
+// worker thread.
+class Completion
+{
+   private:
+      ProfiledMutex mtx LOCK_SITE("Completion::mtx");
+      LockCV cv;
+      bool done = false;
+      Fiber* waiter = NULL; // The fiber waiting, if the waiter is a fiber
+   public:
+      // Mark the command as processed, waking the waiting thread or fiber.
+      void signal() {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         done = true;
+         cv.notify_all();
+         // Woken under the lock, so the waiter cannot see done and exit
+         // (freeing itself) before unpark is finished with it
+         if (waiter) {
+            fibers.unpark(waiter);
+         }
+      }
+      // Block until signal is called.
+      void wait() {
+         Fiber* fiber = fibers.current();
+         if (!fiber) {
+            std::unique_lock<ProfiledMutex> lock(mtx);
+            cv.wait(lock, [this]{ return done; });
+            return;
+         }
+         for (;;) {
+            {
+               std::lock_guard<ProfiledMutex> lock(mtx);
+               if (done) {
+                  return;
+               }
+               waiter = fiber;
+            }
+            fibers.park();
+         }
+      }
+};
+
+// CommandType is every kind of request a table can be sent.
+enum CommandType {
+   CMD_JOIN,
+   CMD_WAITLIST, // JOIN, or queue for the next free seat if the table is full
+   CMD_LEAVE,
+   CMD_BET,
+   CMD_HIT,
+   CMD_STAND,
+   CMD_DOUBLEDOWN,
+   CMD_CHAT,
+   CMD_SHUTDOWN,
+   CMD_STOP,
+   CMD_ROUND, // Play the next round of a tournament (see tournament.h)
+   CMD_REPORT, // Report the seats to the tournament's barrier without playing
+   CMD_MOVE_OUT, // Move the seat playing account to the table target
+   CMD_MOVE_IN, // Seat a session moved here from another table of the tournament
+   CMD_KNOCKOUT, // Take the seat playing account out of the tournament, telling it message
+};
+
+// TableCommand is one request posted to a table. The session is the
+// connection the command came from (NULL for SHUTDOWN), amount is the
+// bet for BET or the number of seats asked for by JOINSEATS (0 for a plain
+// JOIN), message is the text for CHAT, and seat is which of the
+// connection's seats the command is for. account is the chips a
+// tournament seat plays with, rather than the session's account, which
+// also name the seat to MOVE_OUT and KNOCKOUT, and target is the table
+// MOVE_OUT moves the seat to. If done is set, the executor signals it
+// once the command has been processed.
+struct TableCommand
+{
+   std::atomic<TableCommand*> next {NULL};
+   CommandType type = CMD_CHAT;
+   Session* session = NULL;
+   uint32_t amount = 0;
+   std::string message = "";
+   uint8_t seat = 0;
+   AccountDetails* account = NULL;
+   TableDetails* target = NULL;
+   Completion* done = NULL;
+};
+
+// Mailbox is an intrusive MPSC queue of T, where T has an
+// std::atomic<T*> next member. Any thread may push, only one
+// thread (the owner) may pop.
+template <typename T>
+class Mailbox
+{
+   private:
+      std::atomic<T*> head; // Most recently pushed node, producers swap themselves in here
+      T* tail; // Oldest node, only touched by the consumer
+      T stub; // Placeholder node so the queue is never truly empty
+   public:
+      Mailbox() {
+         head.store(&stub);
+         tail = &stub;
+      }
+      // Add node to the back of the queue. Safe to call from any thread.
+      void push(T* node) {
+         node->next.store(NULL, std::memory_order_relaxed);
+         T* prev = head.exchange(node, std::memory_order_acq_rel);
+         prev->next.store(node, std::memory_order_release);
+      }
+      // Return true if there is nothing to pop. Only the owner may call this.
+      // A push still in progress may be reported as empty, as in pop.
+      bool empty() {
+         return tail == &stub && tail->next.load(std::memory_order_acquire) == NULL;
+      }
+      // Take the node at the front of the queue, or NULL if there is none.
+      // A push that is still in progress may be missed, in which case its
+      // producer will wake the consumer again once it finishes.
+      T* pop() {
+         T* t = tail;
+         T* next = t->next.load(std::memory_order_acquire);
+         if (t == &stub) {
+            if (!next) {
+               return NULL;
+            }
+            tail = next;
+            t = next;
+            next = next->next.load(std::memory_order_acquire);
+         }
+         if (next) {
+            tail = next;
+            return t;
+         }
+         if (t != head.load(std::memory_order_acquire)) {
+            return NULL;
+         }
+         // t is the last node, put the stub back behind it so it can be taken
+         push(&stub);
+         next = t->next.load(std::memory_order_acquire);
+         if (next) {
+            tail = next;
+            return t;
+         }
+         return NULL;
+      }
+};
@@ -0,0 +1,299 @@
+/* registry.h
+ * Contains the TableRegistry, which maps table IDs to TableDetails*,
+ * and the epoch-based reclamation (EpochManager, EpochGuard) that
+ * lets connection threads read the registry without taking a lock.
+ *
+ * A table ID is a slot index in the low SLOT_BITS bits and a
+ * generation counter in the remaining high bits. Removing a table
+ * bumps the slot's generation, so an ID that was handed out before
+ * the removal does not resolve to whatever table reuses the slot.
+ * The generation wraps, so this only holds until the slot has been
+ * reused once per generation; freed slots are reused oldest first,
+ * which makes that as many removals as possible.
+ * Removed tables are retired rather than deleted, and are only freed
+ * once no reader can still hold a pointer to them, by stopping them
+ * (the scheduler deletes a table once it has run its last command).
+ * Whoever retires a table is usually still reading it, so while any
+ * retired table is left, the registry sweeps again on a scheduler timer.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// EpochManager tracks which epoch every reading thread entered in.
+// A reader publishes the global epoch in its own cache line on entry
+// and clears it on exit, so entering and leaving is two uncontended
+// stores. Writers retire objects at the current epoch and may free
+// them once every active reader has entered a later epoch.
+class EpochManager
+{
+   private:
+      static const int MAX_READERS = 16384;
+      // A reader record, padded to its own cache line so readers never share one.
+      struct alignas(64) Reader {
+         std::atomic<bool> claimed {false}; // true if a thread owns this record
+         std::atomic<uint64_t> epoch {0}; // epoch the owner entered at, 0 if not reading
+      };
+      Reader readers[MAX_READERS];
+      std::atomic<uint64_t> global_epoch {1};
+      std::atomic<int> next_hint {0}; // Where to start looking for a free record
+      // ReaderHandle owns a thread's reader record, and gives it back on thread exit.
+      // A fiber has its own handle, as it may move between threads inside a
+      // read-side section, and gives its record back whenever it leaves one.
+      struct ReaderHandle {
+         Reader* reader = NULL;
+         int depth = 0;
+         bool fiber = false;
+         ~ReaderHandle() {
+            if (reader) {
+               reader->epoch.store(0);
+               reader->claimed.store(false);
+            }
+         }
+      };
+      // Return the calling thread's (or fiber's) handle, claiming a reader
+      // record if it holds none. Never inlined, so a fiber that moves between
+      // threads never sees a cached thread-local.
+      __attribute__((noinline)) ReaderHandle& handle() {
+         static thread_local ReaderHandle th;
+         ReaderHandle* h = &th;
+         Fiber* f = fibers.current();
+         if (f) {
+            if (!f->local) {
+               h = new ReaderHandle();
+               h->fiber = true;
+               f->local = h;
+               f->local_free = [](void* p) { delete (ReaderHandle*)p; };
+            }
+            h = (ReaderHandle*)f->local;
+         }
+         while (!h->reader) {
+            int start = next_hint.load(std::memory_order_relaxed);
+            for (int i = 0; i < MAX_READERS; i++) {
+               int idx = (start + i) % MAX_READERS;
+               bool expected = false;
+               if (readers[idx].claimed.compare_exchange_strong(expected, true)) {
+                  h->reader = &readers[idx];
+                  next_hint.store((idx + 1) % MAX_READERS, std::memory_order_relaxed);
+                  break;
+               }
+            }
+            if (!h->reader) { // Every record is in use, wait for a reader to leave
+               fibers.yield();
+            }
+         }
+         return *h;
+      }
+   public:
+      // Mark the calling thread as reading. Nested calls are allowed.
+      void enter() {
+         ReaderHandle& h = handle();
+         if (h.depth++ == 0) {
+            h.reader->epoch.store(global_epoch.load());
+         }
+      }
+      // Mark the calling thread as no longer reading.
+      void exit() {
+         ReaderHandle& h = handle();
+         if (--h.depth == 0) {
+            h.reader->epoch.store(0);
+            if (h.fiber) {
+               // Fibers far outnumber records, so only hold one while reading
+               h.reader->claimed.store(false);
+               h.reader = NULL;
+            }
+         }
+      }
+      // Advance the global epoch, returning the epoch that just ended.
+      // Anything unpublished before this call is safe to free once
+      // safe_to_free returns true for the returned epoch.
+      uint64_t advance() {
+         return global_epoch.fetch_add(1);
+      }
+      // Return true if no active reader entered at or before epoch e.
+      bool safe_to_free(uint64_t e) {
+         for (int i = 0; i < MAX_READERS; i++) {
+            if (!readers[i].claimed.load()) {
+               continue;
+            }
+            uint64_t reader_epoch = readers[i].epoch.load();
+            if (reader_epoch != 0 && reader_epoch <= e) {
+               return false;
+            }
+         }
+         return true;
+      }
+};
+
+// epochs is the epoch manager shared by every lock-free reader in the server.
+EpochManager epochs;
+
+// EpochGuard marks the enclosing scope as a read-side critical section.
+// Any TableDetails* obtained inside the scope stays valid until it ends,
+// or until release is called.
+class EpochGuard
+{
+   private:
+      bool held = true;
+   public:
+      EpochGuard() {
+         epochs.enter();
+      }
+      // Leave the critical section before the scope ends, so that long work
+      // does not hold up reclamation. No table obtained under the guard may
+      // be used afterwards.
+      void release() {
+         if (held) {
+            held = false;
+            epochs.exit();
+         }
+      }
+      ~EpochGuard() {
+         release();
+      }
+};
+
+// TableRegistry maps table IDs to tables. Lookups and listings are
+// wait-free and must be made under an EpochGuard. Adding and removing
+// tables is serialized by a mutex, as these are rare lobby operations.
+class TableRegistry
+{
+   private:
+      // 1024 slots, leaving six bits of generation, so a stale ID is caught
+      // until its slot has been reused 64 times.
+      static const int SLOT_BITS = 10;
+      static const uint16_t NUM_SLOTS = 1 << SLOT_BITS;
+      static const uint16_t SLOT_MASK = NUM_SLOTS - 1;
+      // A registry slot. The generation is only touched by writers,
+      // readers validate an ID against the ID stored in the table itself.
+      struct alignas(64) Slot {
+         std::atomic<TableDetails*> table {NULL};
+         uint16_t generation = 0;
+      };
+      // A removed table waiting to be freed, and the epoch it was removed in.
+      struct Retired {
+         uint64_t epoch;
+         TableDetails* table;
+      };
+      Slot slots[NUM_SLOTS];
+      ProfiledMutex mtx LOCK_SITE("TableRegistry::mtx"); // Protects free_slots, retired and slot generations
+      std::deque<uint16_t> free_slots; // Unused slots, reused oldest first
+      // Sweeper is the actor whose timer has the registry sweep its retired tables.
+      class Sweeper : public Actor
+      {
+         public:
+            TableRegistry* registry;
+            bool run() {
+               registry->sweep();
+               return true;
+            }
+            bool has_work() {
+               return false;
+            }
+      };
+      std::vector<Retired> retired; // Removed tables not yet freed
+      Sweeper sweeper; // Never finishes, so the scheduler never deletes it
+      bool sweeping = false; // Whether the sweeper's timer is armed, protected by mtx
+      // Stop every retired table that no reader can still see, which
+      // has the scheduler free it, and have the sweeper try the rest
+      // later. Must be called with mtx held.
+      void reclaim() {
+         std::vector<Retired> remaining;
+         for (auto r : retired) {
+            if (epochs.safe_to_free(r.epoch)) {
+               r.table->stop();
+            } else {
+               remaining.push_back(r);
+            }
+         }
+         retired = remaining;
+         if (!retired.empty() && !sweeping) {
+            // Try again in a tenth of a second, by when their readers have likely left
+            sweeping = true;
+            scheduler.arm(&sweeper, scheduler.now() + std::chrono::milliseconds(100));
+         }
+      }
+      // Reclaim on the sweeper's timer, arming it again if any table is left.
+      void sweep() {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         sweeping = false;
+         reclaim();
+      }
+   public:
+      TableRegistry() {
+         sweeper.registry = this;
+         for (uint16_t i = 0; i < NUM_SLOTS; i++) {
+            free_slots.push_back(i);
+         }
+      }
+      // Publish table under a new ID, which is written to id. Returns false if
+      // every slot is taken.
+      bool add(TableDetails* table, uint16_t* id) {
+         mtx.lock();
+         reclaim();
+         if (free_slots.empty()) {
+            mtx.unlock();
+            return false;
+         }
+         uint16_t slot = free_slots.front();
+         free_slots.pop_front();
+         *id = (slots[slot].generation << SLOT_BITS) | slot;
+         table->setID(*id);
+         slots[slot].table.store(table);
+         mtx.unlock();
+         return true;
+      }
+      // Return the table with the given ID, or NULL if there is none (or the
+      // ID is stale). The caller must hold an EpochGuard while using the table.
+      TableDetails* find(uint16_t id) {
+         TableDetails* table = slots[id & SLOT_MASK].table.load();
+         if (table && table->getID() == id) {
+            return table;
+         }
+         return NULL;
+      }
+      // Return every table currently published, in slot order.
+      // The caller must hold an EpochGuard while using the tables.
+      std::vector<TableDetails*> snapshot() {
+         std::vector<TableDetails*> out;
+         for (uint16_t i = 0; i < NUM_SLOTS; i++) {
+            TableDetails* table = slots[i].table.load();
+            if (table) {
+               out.push_back(table);
+            }
+         }
+         return out;
+      }
+      // Unpublish the table with the given ID and return it, or NULL if there is none.
+      // The table stays allocated, the caller should shut it down and then retire it.
+      TableDetails* remove(uint16_t id) {
+         mtx.lock();
+         uint16_t slot = id & SLOT_MASK;
+         TableDetails* table = slots[slot].table.load();
+         if (!table || table->getID() != id) {
+            mtx.unlock();
+            return NULL;
+         }
+         slots[slot].table.store(NULL);
+         // Bump the generation so the old ID is no longer valid, until the
+         // generation wraps back around to it
+         slots[slot].generation = (slots[slot].generation + 1) & (0xFFFF >> SLOT_BITS);
+         free_slots.push_back(slot);
+         mtx.unlock();
+         return table;
+      }
+      // Hand a removed table over to be freed once it is safe to do so.
+      void retire(TableDetails* table) {
+         mtx.lock();
+         retired.push_back({epochs.advance(), table});
+         reclaim();
+         mtx.unlock();
+      }
+};
+
+// table_registry holds every table in the lobby.
+TableRegistry table_registry;
@@ -0,0 +1,345 @@
+/* rules.h
+ * Contains the rules of a table that do not depend on it being played
+ * over the network: its settings, parsed from the AddTable headers, and
+ * what a finished hand pays. The server's tables and the cbp-sim
+ * simulator both use these, so a simulated table plays exactly the
+ * rules the server would.
+ *
+ * The dealer's soft 17 rule and the payoff are also captured as rules
+ * policies: FixedRules, with both fixed at compile time for the common
+ * configurations, and RuntimeRules for any other table. with_rules picks
+ * the policy for a table's settings, for code templated on the policy
+ * (the simulator), and a RulesEngine wraps one for the server's tables.
+ * Expects cards.h to be included first.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+// TableSettings are the settings of a table, as given when adding it.
+// The defaults are the table settings from the design doc, used for any
+// header that is missing.
+struct TableSettings
+{
+   static const uint16_t MAX_TOURNAMENT_TABLES = 10000; // Most tables a tournament may play at
+   uint8_t max_players = 5;
+   uint8_t number_decks = 8;
+   uint8_t payoff_high = 3;
+   uint8_t payoff_low = 2;
+   uint16_t bet_min = 25;
+   uint16_t bet_max = 1000;
+   bool hit_soft_17 = true;
+   uint16_t bet_window = 15;
+   uint16_t turn_timeout = 30;
+   uint8_t min_players = 1;
+   bool simultaneous_turns = false;
+   uint8_t penetration = 75;
+   uint8_t bots = 0; // In-process bots seated when the table is added (see bots.h)
+   std::string bot_strategy = "basic"; // How the bots play: basic, stand-<n> or random
+   uint16_t tournament_tables = 0; // Tables of the tournament to start, 0 for a single table (see tournament.h)
+   uint32_t starting_chips = 1000; // Chips every tournament entrant starts with
+   uint16_t tournament_start = 60; // Seconds entries stay open before the tournament's first round
+   uint32_t tournament_rounds = 0; // Rounds after which the chip leader wins, 0 to play until one entrant is left
+   // Set the settings from the std::string settings, which follows the BNF
+   // grammar from the design document for AddTable. Headers that are missing
+   // or invalid keep their current value.
+   void parse(std::string settings) {
+      std::string headers = settings.substr(0, settings.length()-1); // Cut off trailing \n from headers.
+      std::string line;
+      size_t pos1;
+      // Loop over each individual line in the settings.
+      while ((pos1 = headers.find("\n")) != std::string::npos) {
+         line = headers.substr(0, pos1);
+         size_t pos2 = line.find(":");
+         // Try to split line on first :. Skip the line otherwise.
+         if (pos2 != std::string::npos) {
+            // Get header up to :, value after :
+            std::string header = line.substr(0, pos2);
+            std::string value = line.substr(pos2+1);
+            // Match on header
+            if (header == "max-players") {
+               // Set the max amount of players
+               uint8_t val = atoi(value.c_str());
+               if (val > 0) {
+                  max_players = val;
+               }
+            } else if (header == "number-decks") {
+               // Set the number of decks
+               uint8_t val = atoi(value.c_str());
+               if (val > 0) {
+                  number_decks = val;
+               }
+            } else if (header == "payoff") {
+               // Set payoff ratio
+               size_t pos3 = value.find("-");
+               // Attempt to split off -
+               if (pos3 != std::string::npos) {
+                  // v1 is numerator, v2 is denominator
+                  std::string v1 = value.substr(0, pos3);
+                  std::string v2 = value.substr(pos3+1);
+                  uint8_t val1 = atoi(v1.c_str());
+                  uint8_t val2 = atoi(v2.c_str());
+                  if (val1 > 0 && val2 > 0) {
+                     // Set the payoff ratio if both numbers are positive
+                     payoff_high = val1;
+                     payoff_low = val2;
+                  }
+               }
+            } else if (header == "bet-limits") {
+               // Set the bet limits
+               size_t pos3 = value.find("-");
+               // Attempt to split off -
+               if (pos3 != std::string::npos) {
+                  // v1 is min, v2 is max
+                  std::string v1 = value.substr(0, pos3);
+                  std::string v2 = value.substr(pos3+1);
+                  uint8_t val1 = atoi(v1.c_str());
+                  uint8_t val2 = atoi(v2.c_str());
+                  if (val1 > 0 && val2 > 0) {
+                     // Set the bet limits if both numbers are positive
+                     bet_min = val1;
+                     bet_max = val2;
+                  }
+               }
+            } else if (header == "hit-soft-17") {
+               // Determine whether dealer hits on soft 17
+               if (value == "true") {
+                  hit_soft_17 = true;
+               } else if (value == "false") {
+                  hit_soft_17 = false;
+               }
+            } else if (header == "bet-window") {
+               // Set how many seconds the betting window stays open
+               uint16_t val = atoi(value.c_str());
+               if (val > 0) {
+                  bet_window = val;
+               }
+            } else if (header == "turn-timeout") {
+               // Set how many seconds each player has for their turn
+               uint16_t val = atoi(value.c_str());
+               if (val > 0) {
+                  turn_timeout = val;
+               }
+            } else if (header == "min-players-to-start") {
+               // Set how many seated players are needed before betting opens
+               uint8_t val = atoi(value.c_str());
+               if (val > 0) {
+                  min_players = val;
+               }
+            } else if (header == "simultaneous-turns") {
+               // Determine whether all players take their turns at once
+               if (value == "true") {
+                  simultaneous_turns = true;
+               } else if (value == "false") {
+                  simultaneous_turns = false;
+               }
+            } else if (header == "penetration") {
+               // Set the percent of the shoe dealt before the cut card
+               int val = atoi(value.c_str());
+               if (val > 0 && val <= 100) {
+                  penetration = val;
+               }
+            } else if (header == "bots") {
+               // Set how many bots to seat at the table, if the table seats them all
+               int val = atoi(value.c_str());
+               if (val >= 0 && val <= max_players) {
+                  bots = val;
+               }
+            } else if (header == "bot-strategy") {
+               // Set how the bots play, if it is a strategy bots know
+               if (value == "basic" || value == "random" ||
+                     (value.compare(0, 6, "stand-") == 0 && atoi(value.c_str() + 6) > 0)) {
+                  bot_strategy = value;
+               }
+            } else if (header == "tournament-tables") {
+               // Set how many tables the tournament plays at, at least two
+               int val = atoi(value.c_str());
+               if (val >= 2 && val <= MAX_TOURNAMENT_TABLES) {
+                  tournament_tables = val;
+               }
+            } else if (header == "starting-chips") {
+               // Set the chips every entrant starts with
+               uint32_t val = strtoul(value.c_str(), NULL, 10);
+               if (val > 0) {
+                  starting_chips = val;
+               }
+            } else if (header == "tournament-start") {
+               // Set how many seconds entries stay open
+               int val = atoi(value.c_str());
+               if (val >= 1 && val <= UINT16_MAX) {
+                  tournament_start = val;
+               }
+            } else if (header == "tournament-rounds") {
+               // Set how many rounds the tournament lasts at most
+               tournament_rounds = strtoul(value.c_str(), NULL, 10);
+            }
+         }
+         // erase each line from the headers list once we are done with it
+         headers.erase(0, pos1 + 1);
+      }
+      // A table can never start if it needs more players than it seats
+      if (min_players > max_players) {
+         min_players = max_players;
+      }
+      // Bots only take seats
+      if (bots > max_players) {
+         bots = max_players;
+      }
+   }
+};
+
+// settle_payout returns what a bet of bet on the player's hand pays back
+// once the dealer's hand is finished: nothing if the player bust or lost,
+// the bet back on a tie, and bet * payoff_high / payoff_low on a win. At
+// 21 each, a natural blackjack beats any other 21.
+inline uint32_t settle_payout(uint32_t bet, const Hand& player, const Hand& dealer, uint8_t payoff_high, uint8_t payoff_low)
+{
+   uint32_t payout = 0; // Amount of funds the player wins
+   uint8_t value = player.value();
+   uint8_t dealer_value = dealer.value();
+   if (value <= 21) { // Player's value is less than or equal to 21, so they did not bust
+      if (dealer_value > 21 || value > dealer_value) { // Dealer bust, or you beat the dealer
+         payout = (bet*payoff_high)/payoff_low; // Multiple bet by payout ratio
+      } else if (dealer_value == value) { // Tie, or beat with blackjack
+         if (value == 21) { // Possibly beat with blackjack
+            if (player.is_blackjack() && !dealer.is_blackjack()) { // Player has blackjack, dealer does not
+               payout = (bet*payoff_high)/payoff_low; // Blackjack win
+            } else if (dealer.is_blackjack() && !player.is_blackjack()) { // Dealer has blackjack, player does not
+               payout = 0; // Dealer win by blackjack
+            } else {
+               payout = bet; // Tie, return bet
+            }
+         } else {
+            payout = bet; // Tie, return bet
+         }
+      }
+   }
+   return payout;
+}
+
+// RuntimeRules is the generic rules policy, which reads the dealer's soft 17
+// rule and the payoff ratio from the table's settings on every decision.
+struct RuntimeRules
+{
+   bool hit_soft_17;
+   uint8_t payoff_high;
+   uint8_t payoff_low;
+   RuntimeRules(const TableSettings& settings) :
+      hit_soft_17(settings.hit_soft_17),
+      payoff_high(settings.payoff_high),
+      payoff_low(settings.payoff_low) { }
+   // Return true if the dealer draws another card to dealer.
+   bool dealer_hits(const Hand& dealer) const {
+      return dealer.value() < 21 && !dealer.dealer_stands(hit_soft_17);
+   }
+   // Return what a bet of bet on player pays back against the finished dealer hand.
+   uint32_t payout(uint32_t bet, const Hand& player, const Hand& dealer) const {
+      return settle_payout(bet, player, dealer, payoff_high, payoff_low);
+   }
+   // Return a short description of the rules.
+   std::string name() const {
+      return std::string(hit_soft_17 ? "H17 " : "S17 ") + std::to_string(payoff_high) + "-" +
+         std::to_string(payoff_low) + " (generic)";
+   }
+};
+
+// FixedRules is a rules policy with the soft 17 rule and payoff ratio fixed at
+// compile time, so the dealer's policy folds to constants and the payout
+// division to a multiply and shift.
+template <bool HitSoft17, uint8_t PayoffHigh, uint8_t PayoffLow>
+struct FixedRules
+{
+   FixedRules(const TableSettings&) { }
+   bool dealer_hits(const Hand& dealer) const {
+      return dealer.value() < 21 && !dealer.dealer_stands(HitSoft17);
+   }
+   uint32_t payout(uint32_t bet, const Hand& player, const Hand& dealer) const {
+      return settle_payout(bet, player, dealer, PayoffHigh, PayoffLow);
+   }
+   std::string name() const {
+      return std::string(HitSoft17 ? "H17 " : "S17 ") + std::to_string(PayoffHigh) + "-" +
+         std::to_string(PayoffLow) + " (specialized)";
+   }
+};
+
+// with_rules calls visit(rules) with the rules policy for settings: a
+// FixedRules for the common configurations (either soft 17 rule, paying
+// 3-2, 6-5 or 2-1), otherwise RuntimeRules. The number of decks is not part
+// of the policy, as it only sizes the shoe and no decision depends on it.
+template <typename Visitor>
+void with_rules(const TableSettings& settings, Visitor& visit)
+{
+   uint8_t high = settings.payoff_high;
+   uint8_t low = settings.payoff_low;
+   if (high == 3 && low == 2) {
+      if (settings.hit_soft_17) {
+         visit(FixedRules<true, 3, 2>(settings));
+      } else {
+         visit(FixedRules<false, 3, 2>(settings));
+      }
+   } else if (high == 6 && low == 5) {
+      if (settings.hit_soft_17) {
+         visit(FixedRules<true, 6, 5>(settings));
+      } else {
+         visit(FixedRules<false, 6, 5>(settings));
+      }
+   } else if (high == 2 && low == 1) {
+      if (settings.hit_soft_17) {
+         visit(FixedRules<true, 2, 1>(settings));
+      } else {
+         visit(FixedRules<false, 2, 1>(settings));
+      }
+   } else {
+      visit(RuntimeRules(settings));
+   }
+}
+
+// RulesEngine is a table's rules, chosen once when the table is added, so
+// the table makes no rule checks of its own while dealing and settling.
+class RulesEngine
+{
+   public:
+      virtual bool dealer_hits(const Hand& dealer) const = 0;
+      virtual uint32_t payout(uint32_t bet, const Hand& player, const Hand& dealer) const = 0;
+      virtual std::string name() const = 0;
+      virtual ~RulesEngine() { }
+};
+
+// RulesEngineOf is the RulesEngine of the rules policy Rules.
+template <typename Rules>
+class RulesEngineOf: public RulesEngine
+{
+   private:
+      Rules rules;
+   public:
+      RulesEngineOf(const Rules& rules_) : rules(rules_) { }
+      bool dealer_hits(const Hand& dealer) const {
+         return rules.dealer_hits(dealer);
+      }
+      uint32_t payout(uint32_t bet, const Hand& player, const Hand& dealer) const {
+         return rules.payout(bet, player, dealer);
+      }
+      std::string name() const {
+         return rules.name();
+      }
+};
+
+// EngineMaker builds the RulesEngine of whichever rules policy it is given.
+struct EngineMaker
+{
+   RulesEngine* engine = NULL;
+   template <typename Rules>
+   void operator()(const Rules& rules) {
+      engine = new RulesEngineOf<Rules>(rules);
+   }
+};
+
+// make_rules_engine returns a new RulesEngine for settings, specialized if
+// with_rules has a FixedRules for them.
+RulesEngine* make_rules_engine(const TableSettings& settings)
+{
+   EngineMaker maker;
+   with_rules(settings, maker);
+   return maker.engine;
+}
@@ -0,0 +1,289 @@
+/* scheduler.h
+ * Contains the Scheduler, a small pool of worker threads plus a timer
+ * queue that runs every table in the server, and Actor, the interface
+ * a table implements to be run by it. Instead of a thread per table
+ * that sleeps between game phases, a table arms a timer for its next
+ * deadline and gives its worker back. A table is put on the run queue
+ * when a command is posted to it or its timer fires, and at most one
+ * worker runs a given table at a time.
+ *
+ * With core affinity, the Scheduler is shared-nothing: each worker is
+ * pinned to a core and has its own run queue, and every actor is given
+ * a home core the first time it is scheduled and only ever runs there.
+ * Connections that join a table move their fiber to the table's core
+ * (see FiberScheduler::migrate), so a table's traffic stays on one core.
+ * Work that must run on a particular core is sent there with run_on.
+ * Without affinity, every worker takes from one shared run queue.
+ *
+ * Deadlines are read from the Scheduler's Clock (see clock.h). With a
+ * VirtualClock, the timer thread waits until no actor is queued or
+ * running, then moves the clock straight to the earliest deadline, so
+ * the tables run through their timeouts as fast as they can play.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Actor is anything the Scheduler can run. run is only ever called by one
+// worker at a time, so an actor's state is owned by whichever worker is
+// running it.
+class Actor
+{
+   public:
+      // Times scheduled since its worker last gave it back, nonzero while
+      // queued or running. Owned by the Scheduler.
+      std::atomic<unsigned> wakes {0};
+      Deadline armed = Deadline::max(); // deadline in the timer queue, owned by the Scheduler
+      int core = -1; // home core with affinity, set on first schedule (or beforehand) and never changed
+      virtual ~Actor() {}
+      // Do whatever work is ready. Return false once the actor is finished,
+      // in which case the worker deletes it.
+      virtual bool run() = 0;
+      // Return true if run left work ready that it should be run again for.
+      // Called by the worker right after run, while it still holds the actor.
+      virtual bool has_work() = 0;
+};
+
+// pin_to_cpu pins the calling thread to cpu, modulo the number of CPUs.
+static void pin_to_cpu(unsigned cpu)
+{
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu % std::thread::hardware_concurrency(), &set);
+   pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// CoreInbox is the cross-core channel: an actor on every core that runs the
+// functions other cores send it, in order, on its own core.
+class CoreInbox : public Actor
+{
+   private:
+      ProfiledMutex mtx LOCK_SITE("CoreInbox::mtx"); // Protects messages
+      std::deque<std::function<void()>> messages;
+   public:
+      // Queue fn. The Scheduler schedules the inbox.
+      void push(std::function<void()> fn) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         messages.push_back(std::move(fn));
+      }
+      bool run() {
+         for (;;) {
+            std::function<void()> fn;
+            {
+               std::lock_guard<ProfiledMutex> lock(mtx);
+               if (messages.empty()) {
+                  return true;
+               }
+               fn = std::move(messages.front());
+               messages.pop_front();
+            }
+            fn();
+         }
+      }
+      bool has_work() {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         return !messages.empty();
+      }
+};
+
+// Scheduler runs actors on a fixed pool of workers. Workers take actors off
+// a run queue, and a timer thread puts actors back on the queue when
+// the deadline they armed passes.
+class Scheduler
+{
+   private:
+      // A run queue, and the workers that take from it.
+      struct alignas(64) RunQueue {
+         ProfiledMutex mtx LOCK_SITE("Scheduler::RunQueue::mtx"); // Protects actors
+         LockCV cv; // Signalled when an actor is queued
+         std::deque<Actor*> actors; // Actors waiting for a worker
+      };
+      bool affinity = false; // Whether each worker has its own queue and core
+      std::vector<RunQueue*> queues; // One per core with affinity, otherwise one shared by every worker
+      std::vector<CoreInbox*> inboxes; // One per core with affinity
+      std::atomic<unsigned> next_core {0}; // Round robin for placing actors
+      std::atomic<unsigned> busy {0}; // Actors queued or running
+      Clock* clock = &real_clock; // Where deadlines are read from, set by start
+      ProfiledMutex timer_mtx LOCK_SITE("Scheduler::timer_mtx"); // Protects timers and every actor's armed deadline
+      LockCV timer_cv; // Signalled when an earlier deadline is armed
+      std::set<std::pair<Deadline, Actor*>> timers; // Armed deadlines, earliest first
+      // worker takes actors off q and runs them, forever. With affinity it
+      // first pins itself to core.
+      void worker(RunQueue* q, int core) {
+         if (core >= 0) {
+            pin_to_cpu(core);
+         }
+         for (;;) {
+            Actor* actor;
+            {
+               std::unique_lock<ProfiledMutex> lock(q->mtx);
+               q->cv.wait(lock, [q]{ return !q->actors.empty(); });
+               actor = q->actors.front();
+               q->actors.pop_front();
+            }
+            // Every wake counted by now was for work run will see
+            unsigned seen = actor->wakes.load();
+            if (!actor->run()) {
+               // The actor is finished, nothing else may hold it now
+               disarm(actor);
+               delete actor;
+               idle();
+               continue;
+            }
+            // Give the actor back, unless run left work or it was scheduled
+            // again while running: those wakes found it still held and left
+            // it to this worker. Once given back, it is not touched again here,
+            // as another worker may be running it or have deleted it.
+            if (actor->has_work() || actor->wakes.fetch_sub(seen) != seen) {
+               enqueue(actor);
+               continue;
+            }
+            idle();
+         }
+      }
+      // idle counts off an actor that is no longer queued or running. With a
+      // virtual clock, the last one wakes the timer thread to move time on.
+      void idle() {
+         if (busy.fetch_sub(1) == 1 && clock->is_virtual()) {
+            std::lock_guard<ProfiledMutex> lock(timer_mtx);
+            timer_cv.notify_one();
+         }
+      }
+      // enqueue puts actor, already counted as busy, on its run queue. Only
+      // whoever holds the actor, by its first wake or as its worker, may call it.
+      void enqueue(Actor* actor) {
+         RunQueue* q = queues[0];
+         if (affinity) {
+            // Only the actor's holder gets here, so placing is race free
+            if (actor->core < 0) {
+               actor->core = pick_core();
+            }
+            q = queues[actor->core];
+         }
+         std::lock_guard<ProfiledMutex> lock(q->mtx);
+         q->actors.push_back(actor);
+         q->cv.notify_one();
+      }
+      // timer waits for the earliest armed deadline and schedules its actor, forever.
+      void timer() {
+         std::unique_lock<ProfiledMutex> lock(timer_mtx);
+         for (;;) {
+            if (timers.empty()) {
+               timer_cv.wait(lock);
+               continue;
+            }
+            auto first = timers.begin();
+            if (clock->now() < first->first) {
+               if (clock->is_virtual() && busy.load() > 0) {
+                  // Virtual time stands still until every actor is out of work
+                  timer_cv.wait(lock);
+                  continue;
+               }
+               clock->wait_until(lock, timer_cv, first->first);
+               continue;
+            }
+            Actor* actor = first->second;
+            timers.erase(first);
+            actor->armed = Deadline::max();
+            // Scheduled under timer_mtx, so disarm never races with a firing timer
+            schedule(actor);
+         }
+      }
+   public:
+      // Start workers worker threads and the timer thread, reading deadlines
+      // from clock_. With affinity, worker i is pinned to core i and runs only
+      // the actors homed there. The threads are detached, and run for the
+      // life of the process.
+      void start(unsigned workers, bool affinity_ = false, Clock* clock_ = &real_clock) {
+         if (workers == 0) {
+            workers = 1;
+         }
+         affinity = affinity_;
+         clock = clock_;
+         for (unsigned i = 0; i < (affinity ? workers : 1); i++) {
+            queues.push_back(new RunQueue());
+         }
+         if (affinity) {
+            for (unsigned i = 0; i < workers; i++) {
+               CoreInbox* inbox = new CoreInbox();
+               inbox->core = i;
+               inboxes.push_back(inbox);
+            }
+         }
+         for (unsigned i = 0; i < workers; i++) {
+            if (affinity) {
+               std::thread(&Scheduler::worker, this, queues[i], (int)i).detach();
+            } else {
+               std::thread(&Scheduler::worker, this, queues[0], -1).detach();
+            }
+         }
+         std::thread(&Scheduler::timer, this).detach();
+      }
+      // Return the current time by the scheduler's clock. Actors read the time
+      // here, so they run the same under a virtual clock.
+      Deadline now() {
+         return clock->now();
+      }
+      // Return the core the next actor should be homed on, round robin,
+      // or -1 without affinity.
+      int pick_core() {
+         if (!affinity) {
+            return -1;
+         }
+         return next_core.fetch_add(1, std::memory_order_relaxed) % queues.size();
+      }
+      // Queue actor to be run, unless it is already queued or running.
+      // Safe to call from any thread.
+      void schedule(Actor* actor) {
+         if (actor->wakes.fetch_add(1) != 0) {
+            return;
+         }
+         busy.fetch_add(1);
+         enqueue(actor);
+      }
+      // Run fn on core's worker, after anything already sent there. Without
+      // affinity, or for core -1, fn runs at once on the calling thread.
+      void run_on(int core, std::function<void()> fn) {
+         if (!affinity || core < 0) {
+            fn();
+            return;
+         }
+         CoreInbox* inbox = inboxes[core % inboxes.size()];
+         inbox->push(std::move(fn));
+         schedule(inbox);
+      }
+      // Schedule actor once deadline passes, replacing any deadline it already armed.
+      void arm(Actor* actor, Deadline deadline) {
+         std::lock_guard<ProfiledMutex> lock(timer_mtx);
+         if (actor->armed != Deadline::max()) {
+            timers.erase({actor->armed, actor});
+         }
+         actor->armed = deadline;
+         timers.insert({deadline, actor});
+         // Wake the timer thread if this is now the earliest deadline
+         if (timers.begin()->second == actor) {
+            timer_cv.notify_one();
+         }
+      }
+      // Remove actor's armed deadline, if any.
+      void disarm(Actor* actor) {
+         std::lock_guard<ProfiledMutex> lock(timer_mtx);
+         if (actor->armed != Deadline::max()) {
+            timers.erase({actor->armed, actor});
+            actor->armed = Deadline::max();
+         }
+      }
+};
+
+// scheduler runs every table in the server.
+Scheduler scheduler;
@@ -24,11 +24,13 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <map>
 #include <iostream>
 
 #include <openssl/ssl.h>
+#include <openssl/err.h>
 
 #include "server.h"
 
@@ -54,6 +56,39 @@ int main(int argc, char* argv[])
    setup_libssl();
 
    /* command line arguments */
+   // Replay a shoe from the seed a table logged for it, and exit
+   if (argc == 4 && strcmp(argv[1], "--replay") == 0) {
+      ShoeSeed seed;
+      int decks = atoi(argv[3]);
+      if (!seed.from_hex(argv[2]) || decks < 1 || decks > 255) {
+         fprintf(stderr, "Usage: %s --replay <shoe-seed> <number-decks>\n", argv[0]);
+         exit(EXIT_FAILURE);
+      }
+      printf("%s", replay_shoe(seed, decks).c_str());
+      exit(EXIT_SUCCESS);
+   }
+   while (argc > 2 && (strcmp(argv[1], "--seed") == 0 || strcmp(argv[1], "--ledger") == 0)) {
+      if (strcmp(argv[1], "--seed") == 0) {
+         // Deterministic mode: draw every shoe's seed from the given seed
+         ShoeSeed seed;
+         if (!seed.from_hex(argv[2])) {
+            fprintf(stderr, "Invalid seed, expected 64 hex digits.\n");
+            exit(EXIT_FAILURE);
+         }
+         shuffler.set_seed(seed);
+         fprintf(stderr, "Shuffling deterministically from seed %s\n", seed.to_hex().c_str());
+      } else {
+         // Record every settled round in the ledger file (see ledger.h)
+         if (!ledger.open(argv[2])) {
+            perror(argv[2]);
+            exit(EXIT_FAILURE);
+         }
+      }
+      // Drop the two arguments, keeping the program name for the usage message
+      argv[2] = argv[0];
+      argv += 2;
+      argc -= 2;
+   }
    // SERVICE
    if (argc == 4) {
       // Read port, cert file, key file
@@ -69,8 +104,8 @@ int main(int argc, char* argv[])
       load_certs_keys(argv[1], argv[2]);
    } else {
       // Wrong arguments
-      fprintf(stderr, "Usage: %s (<port-number>) <certificate-file> <key-file>\n",
-            argv[0]);
+      fprintf(stderr, "Usage: %s [--seed <seed>] [--ledger <file>] (<port-number>) <certificate-file> <key-file>\n"
+            "       %s --replay <shoe-seed> <number-decks>\n", argv[0], argv[0]);
       exit(EXIT_FAILURE);
    }
 
@@ -81,10 +116,34 @@ int main(int argc, char* argv[])
       perror("signal");
       exit(EXIT_FAILURE);
    }
+   // Ignore SIGPIPE, so a table writing to a client that just disconnected
+   // gets an error from SSL_write instead of killing the server
+   if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+   {
+      perror("signal");
+      exit(EXIT_FAILURE);
+   }
+
+   // Dump the lock profile to stderr on SIGUSR1. Started before any other
+   // thread, so every other thread inherits SIGUSR1 blocked
+   lock_profile_watch();
 
    // Setup a socket connection listening to the given port number
    socket_listen = setup_socket(port);
 
+   // Start the workers that run every table, one pinned to each core, each
+   // running only the tables homed on its core
+   scheduler.start(std::thread::hardware_concurrency(), true);
+   // Start the workers that run every connection's fiber, one pinned to each
+   // core, so a connection at a table runs on the same core as the table
+   fibers.start(std::thread::hardware_concurrency(), true);
+   // Start shuffling shoes ahead of time, so tables never shuffle mid-round
+   shuffler.start();
+
+   // Create the default table, which takes ID 0
+   uint16_t default_table_id;
+   table_registry.add(new TableDetails(), &default_table_id);
+
    // Start up a UDP receiver thread to handle any broadcast messages sent by clients.
    // Give the thread the service discovery port, and the port at which CBP is actually running.
    std::thread udp_receiver(handle_broadcast, std::to_string(svc_disc), std::to_string(port));
@@ -104,10 +163,8 @@ int main(int argc, char* argv[])
       }
 
       // CONCURRENT
-      // Create a new thread that runs connection_handler for the given socket.
-      std::thread conn(connection_handler, socket_conn);
-      // Detach the connection thread
-      conn.detach();
+      // Create a new fiber that runs connection_handler for the given socket.
+      fibers.spawn([socket_conn]{ connection_handler(socket_conn); });
    }
 
    return EXIT_SUCCESS;
@@ -172,8 +229,9 @@ static void load_certs_keys(const char* cert_file, const char* key_file)
 // connection_handler takes the socket connection and wraps it in SSL.
 // The server then loops on parsing client PDUs and using the DFA
 // implementation to send the appropriate response to the client at
-// each step. This function runs in a unique thread per each
-// connection.
+// each step. This function runs in a unique fiber per each
+// connection, and the socket is made non-blocking so that waiting
+// on the client parks the fiber instead of its worker thread.
 void connection_handler(int socket_conn)
 {
    SSL* ssl; /* SSL descriptor */
@@ -184,11 +242,22 @@ void connection_handler(int socket_conn)
       fprintf(stderr, "SSL_new failed.\n");
       exit(EXIT_FAILURE);
    }
-   // Wrap the socket in SSL
+   // Make the socket non-blocking, then wrap it in SSL
+   fcntl(socket_conn, F_SETFL, fcntl(socket_conn, F_GETFL) | O_NONBLOCK);
    SSL_set_fd(ssl, socket_conn);
 
-   // Initiate the TLS handshake
-   ret = SSL_accept(ssl);
+   // Initiate the TLS handshake, parking whenever it waits on the client
+   for (;;)
+   {
+      ERR_clear_error();
+      ret = SSL_accept(ssl);
+      int err = SSL_get_error(ssl, ret);
+      if (ret == 1 || (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE))
+      {
+         break;
+      }
+      fibers.wait_fd(socket_conn, err == SSL_ERROR_WANT_WRITE);
+   }
    if (ret != 1)
    {
       // Handshake failed
@@ -224,22 +293,27 @@ void connection_handler(int socket_conn)
       }
       fprintf(stderr, "\n");
       SSL_free(ssl);
+      fibers.forget_fd(socket_conn);
       close(socket_conn);
       return;
    }
 
    // At this point the SSL connection is established
-   // Set the connection to the VERSION state.
-   conn_to_state[ssl] = VERSION;
+   // Acquire a session for the connection, which starts in the VERSION state.
+   Session* session = sessions.acquire(ssl);
+   // Tables queue what they send the connection for this fiber to write
+   session->enable_outbox();
    std::string username = "";
    std::string password = "";
+   uint8_t next_seat = 0; // Seat the next command is for, picked by SEAT
+   int next_slot = -1; // Slot of the table the next command is for, picked by TABLE, -1 if none was
 
    char * write_buffer = (char *)malloc(4096);
    /* handle connections */
    for (;;)
    {
       // Get the next PDU from client
-      PDU * p = parse_pdu_server(ssl);
+      PDU * p = parse_pdu_server(session);
       // Client sent no PDU... client connection is gone.
       if (!p)
       {
@@ -249,22 +323,182 @@ void connection_handler(int socket_conn)
       // Check if user sends quit, valid at any state (no need to state check here)
       QuitPDU* quit_pdu = dynamic_cast<QuitPDU*>(p);
       if (quit_pdu) {
-         // Leave table if at a table
-         leavetable(ssl);
+         // Leave every table the session is at
+         EpochGuard guard;
+         leavetables(session);
          // Break the loop on reading PDUs
          break;
       }
+      // Any table reached while handling the PDU stays valid until the next PDU is read
+      EpochGuard guard;
       // STATEFUL
       // Here we check the state for the current connection and use that to guide
       // responses. Any command not handled at the current state is sent an error response.
-      if (conn_to_state[ssl] == VERSION) {
+      if (session->multitable) {
+         // A connection in multi-table play has no one state: it is in the lobby,
+         // and at each of its tables in a state of its own (a state per seat where
+         // it holds several), which the tables check as they apply the commands.
+         // So the lobby's commands are taken at any time, and every command of a
+         // game state is posted to the table picked by a TABLE just before it (or
+         // the only table the session is at), for the seat picked by a SEAT.
+         AtTablePDU* at_pdu = dynamic_cast<AtTablePDU*>(p);
+         if (at_pdu) { // PDU is table, remember it for the next command
+            // Found through the session's own slots, as a tournament's tables share one ID
+            TableSlot* slot = NULL;
+            for (size_t i = 0; i < MAX_TABLES; i++) {
+               TableDetails* table = session->tables[i].table;
+               if (table && table->getID() == at_pdu->getTableID()) {
+                  slot = &session->tables[i];
+               }
+            }
+            if (slot) {
+               next_slot = slot - session->tables;
+            } else {
+               next_slot = MAX_TABLES; // Refuse the command it was for, rather than send it elsewhere
+               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Not at this table.\n\n");
+               ssize_t len = rpdu->to_bytes(&write_buffer);
+               session->write(write_buffer, len);
+            }
+            continue;
+         }
+         SeatPDU* s_pdu = dynamic_cast<SeatPDU*>(p);
+         if (s_pdu) { // PDU is seat, remember it for the next command
+            next_seat = s_pdu->getSeat();
+            continue;
+         }
+         int slot = next_slot;
+         uint8_t seat = next_seat;
+         next_slot = -1;
+         next_seat = 0;
+         if (handle_lockstats(p, session)) {
+            continue;
+         }
+         if (handle_getbalance(p, session)) {
+            continue;
+         }
+         if (handle_getstrategy(p, session, guard)) {
+            continue;
+         }
+         if (handle_updatebalance(p, session)) {
+            continue;
+         }
+         if (handle_gettables(p, session)) {
+            continue;
+         }
+         if (handle_addtable(p, session, guard)) {
+            continue;
+         }
+         if (handle_removetable(p, session)) {
+            continue;
+         }
+         if (handle_jointable(p, session)) {
+            continue;
+         }
+         if (handle_multitable(p, session)) {
+            continue;
+         }
+         if (slot < 0) { // No TABLE, the command is for the only table the session is at
+            for (size_t i = 0; i < MAX_TABLES; i++) {
+               if (session->tables[i].table) {
+                  slot = slot < 0 ? i : MAX_TABLES;
+               }
+            }
+         }
+         const char* error = NULL;
+         if (slot < 0 || slot == (int)MAX_TABLES) {
+            error = "Name the table with TABLE.\n\n";
+         } else if (seat >= session->tables[slot].seats) {
+            error = "No such seat.\n\n";
+         }
+         if (error) {
+            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, error);
+            ssize_t len = rpdu->to_bytes(&write_buffer);
+            session->write(write_buffer, len);
+            continue;
+         }
+         session->focus = slot;
+         if (handle_leavetable(p, session)) {
+            continue;
+         }
+         if (handle_chat(p, session)) {
+            continue;
+         }
+         BetPDU* b_pdu = dynamic_cast<BetPDU*>(p);
+         if (b_pdu) { // PDU is bet, for the table to check against the seat's state
+            post_command(session, CMD_BET, b_pdu->getBetAmount(), "", seat);
+            continue;
+         }
+         if (handle_hit(p, session, seat)) {
+            continue;
+         }
+         if (handle_stand(p, session, seat)) {
+            continue;
+         }
+         if (handle_doubledown(p, session, seat)) {
+            continue;
+         }
+         // Command must not be valid at any state, send error
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         session->write(write_buffer, len);
+      } else if (session->tables[0].seats > 1) {
+         // A connection holding several seats has no one state, each seat has its own,
+         // which the table checks as it applies the command. So every command of a game
+         // state is posted here, for the seat picked by a SEAT just before it (else seat 0).
+         uint8_t seat = next_seat;
+         next_seat = 0;
+         SeatPDU* s_pdu = dynamic_cast<SeatPDU*>(p);
+         if (s_pdu) { // PDU is seat, remember it for the next command
+            if (s_pdu->getSeat() < session->tables[0].seats) {
+               next_seat = s_pdu->getSeat();
+            } else {
+               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "No such seat.\n\n");
+               ssize_t len = rpdu->to_bytes(&write_buffer);
+               session->write(write_buffer, len);
+            }
+            continue;
+         }
+         if (handle_getbalance(p, session)) {
+            continue;
+         }
+         if (handle_getstrategy(p, session, guard)) {
+            continue;
+         }
+         if (handle_updatebalance(p, session)) {
+            continue;
+         }
+         if (handle_leavetable(p, session)) {
+            continue;
+         }
+         if (handle_chat(p, session)) {
+            continue;
+         }
+         BetPDU* b_pdu = dynamic_cast<BetPDU*>(p);
+         if (b_pdu) { // PDU is bet, for the table to check against the seat's state
+            post_command(session, CMD_BET, b_pdu->getBetAmount(), "", seat);
+            continue;
+         }
+         if (handle_hit(p, session, seat)) {
+            continue;
+         }
+         if (handle_stand(p, session, seat)) {
+            continue;
+         }
+         if (handle_doubledown(p, session, seat)) {
+            continue;
+         }
+         // Command must not be valid at any game state, send error
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         session->write(write_buffer, len);
+      } else if (session->state == VERSION) {
          // VersionPDU is the only valid PDU at version
          VersionPDU* version_pdu = dynamic_cast<VersionPDU*>(p);
          if (!version_pdu) { // PDU is not version
             // Send error, close connection
             VersionResponsePDU *pdu = new VersionResponsePDU(5, 0, 1, htonl(server_version));
             ssize_t len = pdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
+            session->write(write_buffer, len);
             break;
          }
          uint32_t client_version = version_pdu->getVersion();
@@ -272,41 +506,41 @@ void connection_handler(int socket_conn)
             // Supported, send 2-0-1 and move to USERNAME
             VersionResponsePDU *pdu = new VersionResponsePDU(2, 0, 1, htonl(server_version));
             ssize_t len = pdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
-            conn_to_state[ssl] = USERNAME;
+            session->write(write_buffer, len);
+            session->state = USERNAME;
          } else {
             // Not supported. Send error, close connection
             VersionResponsePDU *pdu = new VersionResponsePDU(5, 0, 1, htonl(server_version));
             ssize_t len = pdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
+            session->write(write_buffer, len);
             // Immediately disconnect due to wrong version
             break;
          }
-      } else if (conn_to_state[ssl] == USERNAME) {
+      } else if (session->state == USERNAME) {
          // UserPDU is the only valid PDU here
          UserPDU* user_pdu = dynamic_cast<UserPDU*>(p);
          if (!user_pdu) { // Not a UserPDU
             // Send error, continue connection
             ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 0, 0, "Wrong command, expected USER.\n\n");
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
+            session->write(write_buffer, len);
             continue;
          }
          // Accept whatever the username is, move to PASSWORD
          username = user_pdu->getUsername();
-         conn_to_state[ssl] = PASSWORD;
+         session->state = PASSWORD;
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(3, 0, 0, "Provide password.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
-      } else if (conn_to_state[ssl] == PASSWORD) {
+         session->write(write_buffer, len);
+      } else if (session->state == PASSWORD) {
          // PassPDU is the only valid PDU here
          PassPDU* pass_pdu = dynamic_cast<PassPDU*>(p);
          if (!pass_pdu) { // Not a PassPDU
             // Send error, continue connection but go back to USERNAME
             ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 0, 0, "Wrong command, expected PASS. Going back to USERNAME state.\n\n");
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
-            conn_to_state[ssl] = USERNAME;
+            session->write(write_buffer, len);
+            session->state = USERNAME;
             continue;
          }
          // Accept whatever the password is, check auth
@@ -315,234 +549,195 @@ void connection_handler(int socket_conn)
             // No username or wrong password
             ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 0, 2, "Authentication failed.\n\n");
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
-            conn_to_state[ssl] = USERNAME;
+            session->write(write_buffer, len);
+            session->state = USERNAME;
          } else {
             // Valid login; proceed to ACCOUNT, send 2-0-2
             ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 0, 2, "Authenticated successfully.\n\n");
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
-            // Map connection to given username
-            conn_to_user[ssl] = username;
-            // Create new account details on first join
-            if (user_info.find(username) == user_info.end()) {
-               user_info[username] = new AccountDetails();
-            }
-            conn_to_state[ssl] = ACCOUNT;
+            session->write(write_buffer, len);
+            // Bind the session to the given username
+            session->username = username;
+            // Keep the account on the session so later commands need no lookup.
+            // The account is created on first join.
+            session->account = accounts.find_or_create(username);
+            session->state = ACCOUNT;
+         }
+      } else if (session->state == ACCOUNT) {
+         // Administrators may ask for the lock profile from the lobby
+         if (handle_lockstats(p, session)) {
+            continue;
          }
-      } else if (conn_to_state[ssl] == ACCOUNT) {
          // Attempt to handle get balance PDU
-         if (handle_getbalance(p, ssl)) {
+         if (handle_getbalance(p, session)) {
+            continue;
+         }
+         // Attempt to handle a strategy chart request
+         if (handle_getstrategy(p, session, guard)) {
             continue;
          }
          // Attempt to handle update to balance PDU
-         if (handle_updatebalance(p, ssl)) {
-            continue;
-         }
-         GetTablesPDU* gt_pdu = dynamic_cast<GetTablesPDU*>(p);
-         if (gt_pdu) { // PDU is GetTables
-            std::vector<TabledataPDU*> tabledata;
-            // Go through all tables, get a list of tabledata
-            for (std::map<uint16_t, TableDetails*>::iterator it = tables.begin(); it != tables.end(); it++) {
-               uint16_t tid = it->first;
-               std::string settings = it->second->to_string(); // Convert each table to a string
-               TabledataPDU* td = new TabledataPDU(htons(tid), settings); // Create a tabledata for the table ID and settings
-               tabledata.push_back(td);
-            }
-            // No tables available, send error
-            if (tabledata.size() == 0) {
-               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 1, "No tables available.\n\n");
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-            } else {
-               // Tables available, send list of tabledata in 2-1-1 ListTables response
-               ListTablesResponsePDU* ltr_pdu = new ListTablesResponsePDU(2, 1, 1, tabledata);
-               ssize_t len = ltr_pdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-            }
+         if (handle_updatebalance(p, session)) {
+            continue;
+         }
+         // Attempt to handle get tables
+         if (handle_gettables(p, session)) {
             continue;
          }
          // Attempt to handle add table
-         if (handle_addtable(p, ssl)) {
-            continue;
-         }
-         RemoveTablePDU* rt_pdu = dynamic_cast<RemoveTablePDU*>(p);
-         if (rt_pdu) { // User sent RemoveTable
-            uint16_t table_id = rt_pdu->getTableID(); // get table to remove
-            if (tables.find(table_id) != tables.end()) { // table ID exists
-               tables_lock.lock(); // lock the list of tables
-               tables[table_id]->shutdown(); // shutdown game (kick all players out)
-               tables.erase(table_id); // remove table
-               tables_lock.unlock();
-               // Inform of success
-               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 1, 0, "Successfully shut down table.\n\n");
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-            } else {
-               // Inform failure
-               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 2, "Table with ID does not exist.\n\n");
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-            }
+         if (handle_addtable(p, session, guard)) {
             continue;
          }
-         JoinTablePDU* jt_pdu = dynamic_cast<JoinTablePDU*>(p);
-         if (jt_pdu) { // User sent JoinTable
-            uint16_t table_id = jt_pdu->getTableID(); // get table to join
-            if (tables.find(table_id) != tables.end()) { // table ID exists
-               conn_to_table_id[ssl] = table_id; // map connection to table ID
-               tables[table_id]->add_player(ssl); // add player to table (this will handle state transition, response)
-            } else {
-               // Table does not exist, inform failure
-               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 2, "Table with ID does not exist.\n\n");
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-            }
+         // Attempt to handle remove table
+         if (handle_removetable(p, session)) {
+            continue;
+         }
+         // Attempt to handle join table, join seats, or waitlist
+         if (handle_jointable(p, session)) {
+            continue;
+         }
+         // Attempt to handle a switch to multi-table play
+         if (handle_multitable(p, session)) {
             continue;
          }
          // Must be an invalid PDU at this state, send error
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 0, 0, "Command not accepted at current state.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
-      } else if (conn_to_state[ssl] == IN_PROGRESS) {
+         session->write(write_buffer, len);
+      } else if (session->state == IN_PROGRESS) {
          // This state only handles balance commands, leavetable, and chat, nothing else
-         if (handle_getbalance(p, ssl)) {
+         if (handle_getbalance(p, session)) {
+            continue;
+         }
+         if (handle_getstrategy(p, session, guard)) {
             continue;
          }
-         if (handle_updatebalance(p, ssl)) {
+         if (handle_updatebalance(p, session)) {
             continue;
          }
-         if (handle_leavetable(p, ssl)) {
+         if (handle_leavetable(p, session)) {
             continue;
          }
-         if (handle_chat(p, ssl)) {
+         if (handle_chat(p, session)) {
             continue;
          }
          // At this point, PDU must not be valid for state, send error
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
-      } else if (conn_to_state[ssl] == ENTER_BETS) {
+         session->write(write_buffer, len);
+      } else if (session->state == ENTER_BETS) {
          // Attempt to handle either getbalance, updatebalance, leavetable, or chat first
-         if (handle_getbalance(p, ssl)) {
+         if (handle_getbalance(p, session)) {
+            continue;
+         }
+         if (handle_getstrategy(p, session, guard)) {
             continue;
          }
-         if (handle_updatebalance(p, ssl)) {
+         if (handle_updatebalance(p, session)) {
             continue;
          }
-         if (handle_leavetable(p, ssl)) {
+         if (handle_leavetable(p, session)) {
             continue;
          }
-         if (handle_chat(p, ssl)) {
+         if (handle_chat(p, session)) {
             continue;
          }
          BetPDU* b_pdu = dynamic_cast<BetPDU*>(p);
          if (b_pdu) { // PDU is bet
-            uint32_t amt = b_pdu->getBetAmount(); // Get amount to bet
-            if (amt > user_info[conn_to_user[ssl]]->getBalance()) { // Check if amount does not fit in balance for username
-               // Amount out of range
-               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "You do not have sufficient funds to make this bet.\n\n");
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-               continue;
-            }
-            uint16_t table_id = conn_to_table_id[ssl]; // Get player's current table
-            if (!tables[table_id]->betInRange(amt)) { // Check if bet in accepted table range
-               // Bet out of table range, send error
-               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Bet not in range allowed by table.\n\n");
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               SSL_write(ssl, write_buffer, len);
-               continue;
-            }
-            // Get the player's info at the current table
-            PlayerInfo* pi = tables[table_id]->getPlayerInfo(ssl);
-            // Set the player's bet
-            pi->setBet(amt);
-            // Remove the bet amount from the username's account info
-            user_info[conn_to_user[ssl]]->adjustBalance(-amt);
-            // Inform player of bet success
-            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 1, 0, "Accepted bet, please wait for turn.\n\n");
-            // Move to WAIT_FOR_TURN
-            conn_to_state[ssl] = WAIT_FOR_TURN;
-            ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(ssl, write_buffer, len);
+            // Post the bet to the player's current table, which checks it against the
+            // table's range and the balance, then informs the player and moves them to WAIT_FOR_TURN
+            post_command(session, CMD_BET, b_pdu->getBetAmount());
             continue;
          }
          // At this point command must be invalid for state, send error
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
-      } else if (conn_to_state[ssl] == WAIT_FOR_TURN) {
+         session->write(write_buffer, len);
+      } else if (session->state == WAIT_FOR_TURN) {
          // This state only handles balance commands, leavetable, and chat, nothing else
-         if (handle_getbalance(p, ssl)) {
+         if (handle_getbalance(p, session)) {
             continue;
          }
-         if (handle_updatebalance(p, ssl)) {
+         if (handle_getstrategy(p, session, guard)) {
             continue;
          }
-         if (handle_leavetable(p, ssl)) {
+         if (handle_updatebalance(p, session)) {
             continue;
          }
-         if (handle_chat(p, ssl)) {
+         if (handle_leavetable(p, session)) {
+            continue;
+         }
+         if (handle_chat(p, session)) {
             continue;
          }
          // Command must not be valid, send error
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
-      } else if (conn_to_state[ssl] == TURN) {
+         session->write(write_buffer, len);
+      } else if (session->state == TURN) {
          // TURN can handle getbalance, updatebalance, leavetable, hit, stand, doubledown, and chat.
          // State transitions, responses are in those respective methods.
-         if (handle_getbalance(p, ssl)) {
+         if (handle_getbalance(p, session)) {
+            continue;
+         }
+         if (handle_getstrategy(p, session, guard)) {
             continue;
          }
-         if (handle_updatebalance(p, ssl)) {
+         if (handle_updatebalance(p, session)) {
             continue;
          }
-         if (handle_leavetable(p, ssl)) {
+         if (handle_leavetable(p, session)) {
             continue;
          }
-         if (handle_hit(p, ssl)) {
+         if (handle_hit(p, session)) {
             continue;
          }
-         if (handle_stand(p, ssl)) {
+         if (handle_stand(p, session)) {
             continue;
          }
-         if (handle_doubledown(p, ssl)) {
+         if (handle_doubledown(p, session)) {
             continue;
          }
-         if (handle_chat(p, ssl)) {
+         if (handle_chat(p, session)) {
             continue;
          }
          // Command must not be valid, send error
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
-      } else if (conn_to_state[ssl] == WAIT_FOR_DEALER) {
+         session->write(write_buffer, len);
+      } else if (session->state == WAIT_FOR_DEALER) {
          // This state only handles balance commands, leavetable, and chat, nothing else
-         if (handle_getbalance(p, ssl)) {
+         if (handle_getbalance(p, session)) {
             continue;
          }
-         if (handle_updatebalance(p, ssl)) {
+         if (handle_getstrategy(p, session, guard)) {
             continue;
          }
-         if (handle_leavetable(p, ssl)) {
+         if (handle_updatebalance(p, session)) {
             continue;
          }
-         if (handle_chat(p, ssl)) {
+         if (handle_leavetable(p, session)) {
+            continue;
+         }
+         if (handle_chat(p, session)) {
             continue;
          }
          // Command must not be valid, send error
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Command not accepted at current state.\n\n");
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(ssl, write_buffer, len);
+         session->write(write_buffer, len);
       }
    }
    // PDU failed to parse here, or quit, remove the client connection.
    free(write_buffer);
    /* close connection to client */
-   leavetable(ssl); // Remove player from current table (if they are at any)
+   {
+      EpochGuard guard;
+      leavetables(session); // Remove player from every table they are at (if any)
+   }
+   sessions.release(session); // Return the session to the pool
    SSL_free(ssl); // Free the SSL connection
+   fibers.forget_fd(socket_conn); // Stop polling the socket before its fd can be reused
    if (close(socket_conn) < 0) // Close the socket.
    {
       fprintf(stderr, "Error during close(2). \n");
@@ -5,8 +5,11 @@
  * server.h
  * Contains many helper methods to help in defining the
  * server program. Also contains many globals, which help
- * with mapping connections to usernames, mapping connections
- * to current table, mapping usernames to passwords, etc.
+ * with mapping usernames to passwords and accounts, mapping
+ * table IDs to tables, etc. Per-connection state lives in
+ * the Session (see session.h), each connection runs as a
+ * fiber (see fiber.h), and each table is driven by commands
+ * posted to its mailbox (see mailbox.h).
  * In particular UDP broadcast methods, blackjack logic,
  * account details, player details, table details, and PDU
  * parsing are all handled here.
@@ -21,6 +24,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -28,6 +32,8 @@
 #include <algorithm>
 #include <random>
 #include <map>
+#include <set>
+#include <deque>
 #include <mutex>
 #include <chrono>
 #include <thread>
@@ -36,13 +42,26 @@
 
 #include "../protocol/dfa.h"
 #include "../protocol/pdu.h"
+#include "lockprof.h"
+#include "fiber.h"
+#include "session.h"
+#include "accounts.h"
+#include "ledger.h"
+#include "chacha.h"
+#include "cards.h"
+#include "rules.h"
+#include "strategy.h"
+#include "shuffler.h"
+#include "mailbox.h"
+#include "bots.h"
+#include "clock.h"
+#include "scheduler.h"
 
 // auth_credentials maps username to password
 std::map<std::string, std::string> auth_credentials = {{"foo", "bar"}, {"sph77", "admin"}, {"kain", "itdepends"}};
-// conn_to_user maps SSL connection to username
-std::map<SSL*, std::string> conn_to_user;
-// conn_to_state maps SSL connection to current DFA state
-std::map<SSL*, STATE> conn_to_state;
+
+// admin_users are the usernames allowed to run administrator commands
+std::set<std::string> admin_users = {"sph77"};
 
 // handle_broadcast runs in a separate thread, on a UDP broadcast message,
 // if the message is "CBP" the server responds with the port that CBP is running on.
@@ -95,96 +114,124 @@ void handle_broadcast(std::string port, std::string service_port) {
    }
 }
 
-// AccountDetails holds all critical information for a given username "account".
-// All usernames map to an AccountDetails for that specific username.
-// Here AccountDetails holds a user balance, and uses a mutex lock so that
-// the balance is updated correctly if a user is authenticated on multiple
-// clients.
-class AccountDetails
-{
-   private:
-      std::mutex mtx;
-      uint32_t balance;
-   public:
-      AccountDetails() {
-         balance = 0;
-      }
-      // Return the user's balance
-      uint32_t getBalance() {
-         return balance;
-      }
-      // Update the balance by funds (a change in balance). Note that
-      // this method is protected by a lock - only one update can be
-      // applied at any given time.
-      void adjustBalance(int32_t funds) {
-         mtx.lock();
-         uint32_t new_balance = balance + funds;
-         // Check for overflow before applying the change. If there is no overflow, apply the adjustment.
-         bool overflow = (((funds < 0) && (new_balance > balance)) || ((funds > 0) && (new_balance < balance)));
-         if (!overflow) {
-            balance += funds;
-         }
-         mtx.unlock();
-      }
-};
-
-// user_info is a map from usernames to AccountDetails* (lock-protected balances).
-std::map<std::string, AccountDetails*> user_info;
+// send_marked sends the message in buf, of length num, from table table_id
+// to the session at it in slot. For a session in multi-table play it follows
+// a 1-1-9 response naming the table, and if seat is not -1 a 1-1-8 response
+// naming the seat follows that, all in the one send so nothing comes between.
+void send_marked(Session* session, TableSlot* slot, uint16_t table_id, int seat, const void* buf, int num) {
+   if (!session->multitable && seat < 0) {
+      session->send(slot, buf, num);
+      return;
+   }
+   char framed[sizeof(TableResponse) + sizeof(SeatResponse) + 4096]; // Messages fit the 4096 byte write buffers
+   ssize_t len = 0;
+   if (session->multitable) {
+      char* out = framed;
+      TableResponsePDU table_pdu(1, 1, 9, htons(table_id));
+      len += table_pdu.to_bytes(&out);
+   }
+   if (seat >= 0) {
+      char* out = framed + len;
+      SeatResponsePDU seat_pdu(1, 1, 8, seat);
+      len += seat_pdu.to_bytes(&out);
+   }
+   memcpy(framed + len, buf, num);
+   session->send(slot, framed, len + num);
+}
 
 // PlayerInfo denotes all information critical to a player in a given game.
-// Each player (rather, each SSL connection) maintains a PlayerInfo which denotes
-// the current round bet, the hand's value, the hand itself, and if the player
-// has disconnected. The "quit" bool is important - all updates to a player are
-// wrapped around a mutex lock. If the player disconnects at any point, this bool
-// ensures that messages are not errorneously written to the player. Likewise, it
-// also ensures that the player's state is not updated any further by a game
-// on leaving a table.
+// Each seat at a table (a Session holds one, or several after JOINSEATS)
+// maintains a PlayerInfo which denotes the current round bet, the hand's
+// value, the hand itself, the seat's DFA state, and if the player has
+// disconnected. A PlayerInfo is only ever touched by its table's executor, so
+// it needs no lock. The "quit" bool is important - if the
+// player disconnects at any point, this bool ensures that messages are not
+// errorneously written to the player, and that the Session (which may be
+// recycled once the connection closes) is never touched again by the game.
+// The username and account are copied out of the Session for the same reason.
+// The fields the game reads every round come first, with the hand held inline,
+// so a seat's game state sits in its first cache line.
 class PlayerInfo
 {
-   SSL* connection;
-   std::mutex mtx;
    uint32_t bet = 0;
-   uint8_t hand_value;
-   std::vector<CardPDU*> hand;
+   STATE state = IN_PROGRESS;
    bool quit = false;
+   bool prompted = false; // Set when the seat is a bot's and waits on its play
+   bool marked = false; // Set when the session holds several seats, whose messages name the seat
+   uint8_t seat = 0; // Which of the session's seats this is, from 0
+   uint16_t table_id; // The table's ID, which messages name in multi-table play
+   Hand hand;
+   Session* session;
+   TableSlot* slot; // The session's slot for the table
+   AccountDetails* account;
+   Bot* bot; // The bot in this seat, or NULL for a connection
+   std::string username;
    public:
-      PlayerInfo(SSL* conn) {
-         connection = conn;
+      // Seat s at seat_ of the seats it holds in slot_, at table tid, betting
+      // from account_, or the session's account if it is NULL. The slot's
+      // seats must already be set.
+      PlayerInfo(Session* s, TableSlot* slot_, uint16_t tid, uint8_t seat_ = 0, AccountDetails* account_ = NULL) {
+         session = s;
+         slot = slot_;
+         table_id = tid;
+         seat = seat_;
+         marked = slot->seats > 1;
+         username = s->username;
+         if (marked) { // Tell the seats apart at the table
+            username += "#" + std::to_string(seat);
+         }
+         account = account_ ? account_ : s->account;
+         bot = s->bot;
+      }
+      // Get the session seated here. Only valid while the player is connected.
+      Session* getSession() {
+         return session;
+      }
+      // Get which of the session's seats this is
+      uint8_t getSeat() {
+         return seat;
+      }
+      // Get the username of the player in this seat
+      const std::string& getUsername() {
+         return username;
+      }
+      // Get the account that bets and payouts for this seat go to
+      AccountDetails* getAccount() {
+         return account;
+      }
+      // Get the bot in this seat, or NULL if a connection is seated here
+      Bot* getBot() {
+         return bot;
+      }
+      // Return true if the seat is a bot's and waits on its play, once per
+      // time the seat was moved to a state the bot must act in.
+      bool takePrompt() {
+         bool ret = prompted && !quit;
+         prompted = false;
+         return ret;
       }
       // Set the current round bet to whatever is given.
       void setBet(uint32_t b) {
-         mtx.lock();
          bet = b;
-         mtx.unlock();
       }
       // Get the bet for the current round
       uint32_t getBet() {
          return bet;
       }
       // Add a card to the player's hand.
-      void addCard(CardPDU* c) {
-         mtx.lock();
-         hand.push_back(c);
-         mtx.unlock();
-      }
-      // Set the value of the player's hand.
-      void setValue(uint8_t v) {
-         mtx.lock();
-         hand_value = v;
-         mtx.unlock();
+      void addCard(card_t c) {
+         hand.add(c);
       }
       // Get the player's hand value
       uint8_t getValue() {
-         return hand_value;
+         return hand.value();
       }
       // Remove all cards from the player's hand
       void clearHand() {
-         mtx.lock();
          hand.clear();
-         mtx.unlock();
       }
-      // Get the player's hand (list of cards)
-      std::vector<CardPDU*> getHand() {
+      // Get the player's hand
+      const Hand& getHand() {
          return hand;
       }
       // Check whether the player is still connected to the game
@@ -193,307 +240,774 @@ class PlayerInfo
       }
       // Disconnect the player from the game by setting the quit flag to true
       void disconnect() {
-         mtx.lock();
          quit = true;
-         mtx.unlock();
       }
-      // Write the message, stored in buf, with length num,
-      // to the player's SSL connection. Fails if the
-      // player disconnected.
+      // Write the message for this seat, stored in buf, with length num,
+      // to the player's session. Fails if the player disconnected. If the
+      // session holds several seats, the message names the seat (see send_marked).
       void write(const void *buf, int num) {
-         mtx.lock();
          // Write only if the player is connected.
          if (!quit) {
-            SSL_write(connection, buf, num);
+            send_marked(session, slot, table_id, marked ? seat : -1, buf, num);
+         }
+      }
+      // Write a message for the whole table, stored in buf, with length num,
+      // to the player's connection, naming no seat. Fails if the player disconnected.
+      void writeTable(const void *buf, int num) {
+         if (!quit) {
+            send_marked(session, slot, table_id, -1, buf, num);
          }
-         mtx.unlock();
       }
       // Set the player's current STATE to st, only
-      // if the player is connected.
+      // if the player is connected. The session follows the state of its
+      // only seat, a session with several seats, or at several tables,
+      // leaves their states to the tables. A bot is prompted to play
+      // whenever it is moved to a state that waits on it.
       void setState(STATE st) {
-         mtx.lock();
-         // Update conn_to_state to st if the player is connected.
          if (!quit) {
-            conn_to_state[connection] = st;
+            state = st;
+            if (!marked && !session->multitable) {
+               session->state = st;
+            }
+            prompted = bot && (st == ENTER_BETS || st == TURN);
+         }
+      }
+      // Get the player's current STATE. A disconnected player is
+      // reported as WAIT_FOR_DEALER, since they can take no more actions.
+      STATE getState() {
+         if (quit) {
+            return WAIT_FOR_DEALER;
+         }
+         return state;
+      }
+      // Detach the player from their session when the player leaves or the
+      // table is closed, disconnecting the player from the game. Closing the
+      // last of the session's seats at the table frees its slot, moving the
+      // session back to ACCOUNT unless it is in multi-table play. The session
+      // may be released as soon as the slot is free, so it is the last thing
+      // touched.
+      void closeSeat() {
+         if (!quit) {
+            quit = true;
+            if (--slot->seats == 0) {
+               if (!session->multitable) {
+                  session->state = ACCOUNT;
+               }
+               slot->table = NULL;
+            }
          }
-         mtx.unlock();
       }
 };
 
-// rank_to_values maps card ranks to valuations.
-// Each pair represents the soft valuation and hard valuation respectively.
-std::map<char, std::pair<uint8_t, uint8_t>> rank_to_values = {
-   {'A', {11,1}},
-   {'2', {2,2}},
-   {'3', {3,3}},
-   {'4', {4,4}},
-   {'5', {5,5}},
-   {'6', {6,6}},
-   {'7', {7,7}},
-   {'8', {8,8}},
-   {'9', {9,9}},
-   {'T', {10,10}},
-   {'J', {10,10}},
-   {'Q', {10,10}},
-   {'K', {10,10}},
-};
-
-// Get the valuation of a hand, if we treat the
-// first ace as having soft value.
-uint8_t get_soft_value(std::vector<CardPDU*> hand) {
-   bool seen_soft_ace = false;
-   uint8_t value = 0;
-   for (auto card : hand) { // Go through every card
-      char rank = card->getRank();
-      if (!seen_soft_ace) { // If we haven't seen an ace, use soft value 
-         value += rank_to_values[rank].first;
-      } else { // We have seen an ace, so use hard value
-         value += rank_to_values[rank].second;
-      }
-      if (rank == 'A') { // Seen an ace
-         seen_soft_ace = true;
-      }
-   }
-   return value;
-}
-
-// Get the valuation of a hand, if we treat all
-// cards as having hard value.
-uint8_t get_hard_value(std::vector<CardPDU*> hand) {
-   uint8_t value = 0;
-   for (auto card: hand) { // Go through every card
-      value += rank_to_values[card->getRank()].second; // Add the hard value
-   }
-   return value;
-}
-
-// Merge the soft value and hard value into one hand value
-// based on whether either value busts or not.
-uint8_t get_value(uint8_t soft_value, uint8_t hard_value) {
-   if (soft_value <= 21) { // Keep soft value if not bust
-      return soft_value;
-   } else { // Soft value is a bust, use hard value
-      return hard_value;
-   }
-}
+class Tournament;
 
 // TableDetails holds all information about a blackjack game,
 // including settings specified when creating the table,
-// a list of players, information about the dealer,
-// a map of connections to PlayerInfo*, a buffer to
-// populate when writing to clients, and a random
-// engine for shuffling the deck. This class uses a mutex
-// lock whenever updating any aspect, and is also responsible
-// for running a game thread that manages game logic and ensures
-// the game is making progress.
-class TableDetails
+// a list of players (as PlayerInfo* seats), information
+// about the dealer, a buffer to populate when writing to clients, and the
+// shoe being dealt from. The table runs as an actor: connection
+// threads never touch its state, they post TableCommands into its mailbox.
+// The shared scheduler runs the table whenever a command is posted or the
+// deadline of the current game phase passes, on one worker at a time, so all
+// table state is owned by whichever worker is running it and needs no lock.
+class TableDetails : public Actor
 {
    private:
-      std::mutex mtx; // mutex lock, used for class updates
-      std::vector<SSL*> players; // list of players in the game
-      std::vector<SSL*> pending_players; // list of players to add next round
-      std::vector<CardPDU*> deck; // deck to draw cards from (for players and dealer)
-      std::vector<CardPDU*> dealer_hand; // dealer's current hand
-      uint8_t dealer_value = 0; // value of dealer's hand
-      std::thread game_thread; // game thread which handles game logic, runs independently
-      bool is_running = false; // true if game thread is running, false otherwise
+      // Phase is the step of the round the table is in. Each phase ends
+      // either when its deadline passes or when a command completes it.
+      enum Phase {
+         IDLE, // No players, nothing is armed
+         WAITING, // Fewer than min_players seated, betting opens once enough join
+         BETTING, // Waiting for bets, until the bet window closes
+         TURNS, // Waiting for the player at turn_index (or with simultaneous_turns, everyone) to finish their turn
+         BARRIER, // In a tournament, waiting for the tournament to start the next round
+      };
+      Mailbox<TableCommand> mailbox; // commands posted by connection threads
+      bool stopping = false; // true once the table is being freed
+      Phase phase = IDLE; // current phase of the round
+      Deadline deadline = Deadline::max(); // when the current phase times out
+      std::vector<PlayerInfo*> round_players; // players in the current round, in turn order
+      size_t turn_index = 0; // index in round_players of the player whose turn it is
+      std::vector<PlayerInfo*> players; // list of players in the game
+      std::vector<PlayerInfo*> pending_players; // list of players to add next round
+      std::vector<PlayerInfo*> departed_players; // seats of players who left, freed at the next round
+      std::deque<Session*> waitlist; // sessions waiting for a seat to free up, seated first come first served
+      std::vector<Session*> bot_sessions; // sessions of the bots seated here, released with the table
+      Settlement settlement; // payouts of the round being settled (see ledger.h)
+      std::vector<PlayerInfo*> settled_players; // the seat of each of settlement's results
+      uint64_t rounds_settled = 0; // rounds settled so far, numbering the table's ledger records
+      Tournament* tournament = NULL; // the tournament the table plays in, which starts each round (see tournament.h)
+      size_t tournament_table = 0; // index of the table in its tournament
+      Shoe* shoe = NULL; // shoe to draw cards from (for players and dealer), taken from the shuffler
+      Hand dealer_hand; // dealer's current hand
       bool is_available = true; // true if table can be joined, false otherwise
-      std::map<SSL*,PlayerInfo*> player_info; // A mapping of SSL connections to PlayerInfo*
+      uint16_t table_id = 0; // ID of the table in the registry, set when the table is added
       uint8_t max_players = 5; // Maximum number of players (size of players + pending players)
       uint8_t number_decks = 8; // Number of decks to shuffle
+      uint8_t penetration = 75; // Percent of the shoe dealt before the cut card
       uint8_t payoff_high = 3; // Numerator of payoff ratio
       uint8_t payoff_low = 2; // Denominator of payoff ratio
       uint16_t bet_min = 25; // Minimum allowed bet
       uint16_t bet_max = 1000; // Maximum allowed bet
       bool hit_soft_17 = true; // Whether the dealer hits on soft 17 (false means stand)
+      uint16_t bet_window = 15; // Seconds the betting window stays open
+      uint16_t turn_timeout = 30; // Seconds each player has for their turn
+      uint8_t min_players = 1; // Seated players needed before betting opens
+      bool simultaneous_turns = false; // Whether all players take their turns at once, under one deadline
+      RulesEngine* rules; // The dealer's policy and payouts for this table's settings (see rules.h)
       char * write_buffer = (char *)malloc(4096); // A buffer to write messages through
-      std::random_device rd {}; // A random device used for shuffling the deck
-      std::default_random_engine rng = std::default_random_engine { rd() }; // The random engine used for shuffling
    public:
-      TableDetails() {}
+      TableDetails() : rules(make_rules_engine(TableSettings())) {}
       // The below constructor is used when adding a new table to configure the table
       // based off all the possible configuration headers.
       TableDetails(uint8_t max_players_, uint8_t number_decks_, uint8_t payoff_high_,
-            uint8_t payoff_low_, uint16_t bet_min_, uint16_t bet_max_, bool hit_soft_17_) :
+            uint8_t payoff_low_, uint16_t bet_min_, uint16_t bet_max_, bool hit_soft_17_,
+            uint16_t bet_window_, uint16_t turn_timeout_, uint8_t min_players_, bool simultaneous_turns_,
+            uint8_t penetration_, RulesEngine* rules_) :
          max_players(max_players_),
          number_decks(number_decks_),
+         penetration(penetration_),
          payoff_high(payoff_high_),
          payoff_low(payoff_low_),
          bet_min(bet_min_),
          bet_max(bet_max_),
-         hit_soft_17(hit_soft_17_) { }
-      // On call to destructor, the write buffer is freed.
+         hit_soft_17(hit_soft_17_),
+         bet_window(bet_window_),
+         turn_timeout(turn_timeout_),
+         min_players(min_players_),
+         simultaneous_turns(simultaneous_turns_),
+         rules(rules_) { }
+      // On call to destructor, the write buffer, rules engine, any remaining seats and the
+      // bots are freed, and the shoe goes back to the shuffler.
+      // Tables are only deleted by the scheduler, once they have been stopped.
       ~TableDetails() {
          free(write_buffer);
+         delete rules;
+         if (shoe) {
+            shuffler.recycle(shoe);
+         }
+         for (auto pi : departed_players) {
+            delete pi;
+         }
+         for (auto s : bot_sessions) {
+            delete s->bot;
+            sessions.release(s);
+         }
+      }
+      // post hands a command to the table, and schedules the table to run it.
+      // Safe to call from any thread. The table deletes cmd once it is applied.
+      void post(TableCommand* cmd) {
+         mailbox.push(cmd);
+         scheduler.schedule(this);
+      }
+      // post_and_wait posts cmd and blocks until the table has applied it.
+      void post_and_wait(TableCommand* cmd) {
+         Completion done;
+         cmd->done = &done;
+         post(cmd);
+         done.wait();
+      }
+      // stop has the scheduler free the table. The table must already be shut
+      // down, and no connection thread may post to it any more.
+      void stop() {
+         TableCommand* cmd = new TableCommand();
+         cmd->type = CMD_STOP;
+         post(cmd);
       }
-      // broadcast sends the message to all connected players as an ASCII response (1-1-5)
+      // run is called by the scheduler. It applies every command posted so far,
+      // then advances the round if the current phase has timed out.
+      bool run() {
+         while (TableCommand* cmd = mailbox.pop()) {
+            handle_command(cmd);
+         }
+         if (stopping) {
+            return false;
+         }
+         if (scheduler.now() >= deadline) {
+            deadline = Deadline::max();
+            on_timeout();
+         }
+         play_bots();
+         return true;
+      }
+      // play_bots has every bot whose seat waits on it decide its play, and
+      // posts the play as a command, just as a connection would. The table
+      // runs again to apply them once it has given its worker back.
+      void play_bots() {
+         for (auto player : players) {
+            if (player->takePrompt()) {
+               TableCommand* cmd = new TableCommand();
+               cmd->session = player->getSession();
+               cmd->type = player->getBot()->decide(player->getState(), player->getHand(), dealer_hand.cards[0],
+                     &cmd->amount);
+               post(cmd);
+            }
+         }
+      }
+      // Return true if a command is waiting or the current phase has timed out.
+      bool has_work() {
+         return !mailbox.empty() || scheduler.now() >= deadline;
+      }
+      // arm_for sets the deadline of the current phase to d from now, by the
+      // scheduler's clock.
+      void arm_for(Deadline::duration d) {
+         deadline = scheduler.now() + d;
+         scheduler.arm(this, deadline);
+      }
+      // broadcast sends the message to all connected players as an ASCII response (1-1-5),
+      // once per connection however many seats it holds. A connection's seats
+      // all leave together, so its seat 0 is here as long as any of them are.
       void broadcast(std::string message) {
          // Create the broadcast PDU
          char * write_buffer = (char *)malloc(4096);
          ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 5, message);
          ssize_t len = rpdu->to_bytes(&write_buffer);
-         // Send message to every player in the player_info map
-         for (auto pi : player_info) {
-            pi.second->write(write_buffer, len);
+         // Send message to every seated and pending player
+         for (auto pi : players) {
+            if (pi->getSeat() == 0) {
+               pi->writeTable(write_buffer, len);
+            }
+         }
+         for (auto pi : pending_players) {
+            if (pi->getSeat() == 0) {
+               pi->writeTable(write_buffer, len);
+            }
          }
          free(write_buffer);
          delete rpdu;
       }
-      // run_blackjack handles the game logic. It ensures that the blackjack game is making
-      // progress even if some players fail to submit an action (hit/stand/double). The
-      // method runs in a separate thread and uses sleep durations as timeouts. If the
-      // timeout elapses without the player finishing (finishing denoted by a change of state
-      // to WAIT_FOR_DEALER), then the game just moves the player there automatically and continues.
-      // The dealer's actions are automated here and the winnings are broadcast to each player
-      // at the end of each round, and then a new round starts.
-      // The thread terminates when no players are at the table, to save on processing power.
-      void run_blackjack() {
-         is_running = true;
-         // Loop forever on rounds, until there are no players
-         while (players.size() + pending_players.size() > 0) {
-            // Move all pending players in
-            mtx.lock();
-            for (auto player : pending_players) {
-               players.push_back(player);
-               // Send the player info that the game is starting
-               JoinTableResponsePDU* rpdu = new JoinTableResponsePDU(3, 1, 0, to_string());
-               ssize_t len = rpdu->to_bytes(&write_buffer);
-               player_info[player]->write(write_buffer, len);
-               // Move player to ENTER_BETS
-               player_info[player]->setState(ENTER_BETS);
+      // The methods below are the game logic, written as a state machine over the
+      // phases of a round: bets, deal, turns, dealer and settle. The game makes
+      // progress even if some players fail to submit an action (bet/hit/stand/double),
+      // since every wait is a phase with a deadline. If the deadline passes without
+      // the player finishing (finishing denoted by a change of state to
+      // WAIT_FOR_DEALER), then the game just moves the player there automatically and
+      // continues. A turn that finishes early moves on to the next player at once,
+      // from the command that finished it. The dealer's actions are automated and the winnings are sent to each
+      // player at the end of each round, and then a new round starts. Once no players
+      // are at the table, it goes IDLE and arms nothing, to save on processing power.
+      // Players may join or leave during any phase, so the round runs over a copy of
+      // the list of players and skips seats that have disconnected.
+
+      // on_timeout advances the round when the deadline of the current phase passes.
+      void on_timeout() {
+         if (phase == BETTING) {
+            deal_round();
+         } else if (phase == TURNS && simultaneous_turns) {
+            // Everyone still deciding is out of time, move them to the next state together.
+            for (auto player : round_players) {
+               if (player->isConnected() && player->getState() == TURN) {
+                  time_out_turn(player);
+               }
             }
-            pending_players.clear();
-            mtx.unlock();
-            broadcast("Accepting bets!\n\n");
-            dealer_hand.clear();
-            // Round started, wait on bets
-            std::this_thread::sleep_for(std::chrono::seconds(15));
-            // Okay, moving to WAIT_FOR_TURN
-            broadcast("Starting round...\n\n");
-            uint8_t number_of_players = 0;
-            // Go through all players, move them into the correct states based on bet.
-            for (auto player : players) {
-               player_info[player]->clearHand(); // Clear hand from previous round
-               if (player_info[player]->getBet() > 0) { // Player has made a bet
-                  player_info[player]->setState(WAIT_FOR_TURN); // Player will wait for their turn
-                  number_of_players += 1;
-                  hit(player); // Give the player their first card
-               } else {
+            settle_round();
+            end_round();
+         } else if (phase == TURNS) {
+            // The player did not end their turn in time, move the player automatically to next state.
+            time_out_turn(round_players[turn_index]);
+            turn_index += 1;
+            next_turn();
+         }
+      }
+      // time_out_turn ends the turn of a player who ran out of time.
+      void time_out_turn(PlayerInfo* player) {
+         player->setState(WAIT_FOR_DEALER);
+         // Send warning of timeout
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 7, "Timeout elapsed.\n\n");
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         player->write(write_buffer, len);
+      }
+      // check_turn moves on to the next player as soon as the player whose turn
+      // it is finishes, by standing, busting, doubling down or leaving, rather
+      // than waiting for the turn's deadline.
+      void check_turn() {
+         if (phase != TURNS) {
+            return;
+         }
+         if (simultaneous_turns) {
+            // Only move on once nobody is still deciding
+            for (auto player : round_players) {
+               if (player->isConnected() && player->getState() == TURN) {
+                  return;
+               }
+            }
+            settle_round();
+            end_round();
+            return;
+         }
+         PlayerInfo* player = round_players[turn_index];
+         if (player->getState() == WAIT_FOR_DEALER || !(player->isConnected())) {
+            turn_index += 1;
+            next_turn();
+         }
+      }
+      // check_bets closes the betting window as soon as every seated player has
+      // either bet or passed, rather than waiting for the window's deadline.
+      void check_bets() {
+         if (phase != BETTING) {
+            return;
+         }
+         for (auto player : players) {
+            if (player->getState() == ENTER_BETS) {
+               return;
+            }
+         }
+         deal_round();
+      }
+      // check_waiting sends the table back to IDLE if everyone left before
+      // enough players joined to start.
+      void check_waiting() {
+         if (phase == WAITING && !waitlist.empty() && players.size() < max_players) {
+            start_round(); // No round is being played, so a seat that frees up is taken at once
+         }
+         if (phase == WAITING && players.size() + pending_players.size() == 0) {
+            phase = IDLE;
+         }
+      }
+      // open_betting opens the betting window for bet_window seconds, once at
+      // least min_players are seated. Until then the table waits, and seats
+      // anyone who joins straight away.
+      void open_betting() {
+         if (players.size() < min_players) {
+            phase = WAITING;
+            broadcast("Waiting for " + std::to_string(min_players - players.size()) + " more player(s) to start.\n\n");
+            return;
+         }
+         phase = BETTING;
+         broadcast("Accepting bets!\n\n");
+         arm_for(std::chrono::seconds(bet_window));
+      }
+      // start_round begins a new round and opens the betting window. If there are
+      // no players at the table, the table goes IDLE instead, or in a
+      // tournament goes straight back to the tournament's barrier.
+      void start_round() {
+         seat_waitlist();
+         if (players.size() + pending_players.size() == 0) {
+            // If we get here, there are no players in the room.
+            if (tournament) {
+               arrive();
+            } else {
+               phase = IDLE;
+            }
+            return;
+         }
+         // Move all pending players in, and free the seats of players who left
+         round_players.clear();
+         free_departed();
+         for (auto player : pending_players) {
+            players.push_back(player);
+            // Send the player info that the game is starting
+            JoinTableResponsePDU* rpdu = new JoinTableResponsePDU(3, 1, 0, to_string());
+            ssize_t len = rpdu->to_bytes(&write_buffer);
+            player->write(write_buffer, len);
+            // Move player to ENTER_BETS
+            player->setState(ENTER_BETS);
+         }
+         pending_players.clear();
+         dealer_hand.clear();
+         // Round started, wait on bets
+         open_betting();
+      }
+      // seat_waitlist gives every seat that is free to the sessions at the front
+      // of the waitlist, who join in the round being started. Called only
+      // between rounds, so players who left mid-round have freed their seats.
+      void seat_waitlist() {
+         while (!waitlist.empty() && players.size() + pending_players.size() < max_players) {
+            Session* session = waitlist.front();
+            waitlist.pop_front();
+            // The session already holds its slot here, for one seat
+            PlayerInfo* player = new PlayerInfo(session, session->slot_of(this), table_id);
+            pending_players.push_back(player);
+            broadcast(player->getUsername() + " is joining from the waitlist.\n\n");
+         }
+      }
+      // join_waitlist seats the session at the table as JOIN does if a seat is
+      // free, or else queues it for the next seat to free up, telling it its
+      // place in the queue by a 1-1-0 response. Waiting, it is at the table
+      // as a player waiting for the next round is, so it may leave the
+      // waitlist with LEAVETABLE. A tournament seats its tables itself, so
+      // its tables are only ever joined.
+      void join_waitlist(Session* session) {
+         if (tournament || !is_available || free_seats() > 0) {
+            add_player(session);
+            return;
+         }
+         TableSlot* slot = session->slot_of(this);
+         slot->seats = 1;
+         if (!session->multitable) {
+            session->state = IN_PROGRESS;
+         }
+         waitlist.push_back(session);
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 0, "Table is full, you are number " +
+               std::to_string(waitlist.size()) + " on the waitlist.\n\n");
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         send_marked(session, slot, table_id, -1, write_buffer, len);
+         delete rpdu;
+      }
+      // leave_waitlist takes the session off the waitlist, telling it by the
+      // rc_1-rc_2-rc_3 response with message, and frees its slot. Returns false
+      // if it was not waiting.
+      bool leave_waitlist(Session* session, uint8_t rc_1, uint8_t rc_2, uint8_t rc_3, std::string message) {
+         auto it = std::find(waitlist.begin(), waitlist.end(), session);
+         if (it == waitlist.end()) {
+            return false;
+         }
+         waitlist.erase(it);
+         TableSlot* slot = session->slot_of(this);
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(rc_1, rc_2, rc_3, message);
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         send_marked(session, slot, table_id, -1, write_buffer, len);
+         delete rpdu;
+         // As closing the last seat does, the slot is the last thing touched
+         slot->seats = 0;
+         if (!session->multitable) {
+            session->state = ACCOUNT;
+         }
+         slot->table = NULL;
+         return true;
+      }
+      // free_seats returns how many seats are free for a new player, once
+      // everyone on the waitlist has been seated.
+      size_t free_seats() {
+         size_t taken = players.size() + pending_players.size() + waitlist.size();
+         return taken < max_players ? max_players - taken : 0;
+      }
+      // end_round starts the next round once a round is over. A table in a
+      // tournament waits at the tournament's barrier instead, until every
+      // table in the tournament has finished the round.
+      void end_round() {
+         if (tournament) {
+            broadcast("Round over, waiting for the other tables.\n\n");
+            arrive();
+         } else {
+            start_round();
+         }
+      }
+      // arrive, handle_tournament, enter_tournament and leave_tournament are
+      // the table's side of its tournament, and are defined with it (see
+      // tournament.h).
+      void arrive();
+      void handle_tournament(TableCommand* cmd);
+      TableDetails* enter_tournament(Session* session, TableSlot* slot, AccountDetails** account);
+      void leave_tournament();
+      // deal_round closes the betting window and deals the first two cards to every
+      // player who bet, and the dealer's face card. Players who did not bet wait for
+      // the next round.
+      void deal_round() {
+         // Okay, moving to WAIT_FOR_TURN
+         broadcast("Starting round...\n\n");
+         // Change the shoe between rounds once the cut card has come out
+         if (!shoe || shoe->past_cut()) {
+            change_shoe();
+         }
+         uint8_t number_of_players = 0;
+         // Go through all players, move them into the correct states based on bet.
+         round_players = players;
+         for (auto player : round_players) {
+            player->clearHand(); // Clear hand from previous round
+            if (player->getBet() > 0) { // Player has made a bet
+               player->setState(WAIT_FOR_TURN); // Player will wait for their turn
+               number_of_players += 1;
+               hit(player); // Give the player their first card
+            } else {
+               if (player->getState() != IN_PROGRESS) { // Player did not pass
                   // No bet response from player, issue timeout
                   ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 7, "Timeout elapsed, please wait for next round.\n\n");
                   ssize_t len = rpdu->to_bytes(&write_buffer);
-                  player_info[player]->write(write_buffer, len);
-                  // Move the player to IN_PROGRESS, they will join next game
-                  player_info[player]->setState(IN_PROGRESS);
-                  // Put the player back in pending_players, and remove from players
-                  mtx.lock();
-                  pending_players.push_back(player);
-                  players.erase(std::remove(players.begin(), players.end(), player), players.end());
-                  mtx.unlock();
+                  player->write(write_buffer, len);
                }
+               // Move the player to IN_PROGRESS, they will join next game
+               player->setState(IN_PROGRESS);
+               // Put the player back in pending_players, and remove from players
+               pending_players.push_back(player);
+               players.erase(std::remove(players.begin(), players.end(), player), players.end());
             }
-            // If there are no players in the current round, just restart and begin a new round
-            if (number_of_players == 0) {
-               // Immediately start new round
-               for (auto player : players) { // Set all players to ENTER_BETS state
-                  player_info[player]->setState(ENTER_BETS);
-               }
-               continue;
+         }
+         // If there are no players in the current round, just restart and begin a new round
+         if (number_of_players == 0) {
+            // Immediately end the round
+            for (auto player : players) { // Set all players to ENTER_BETS state
+               player->setState(ENTER_BETS);
             }
-            // Get dealer hit (first card, face card)
-            hit_dealer();
-
-            // Get second hit per each player
-            for (auto player : players) {
-               if (player_info[player]->getBet() > 0) {
-                  hit(player); // Give all betting players their second card
+            end_round();
+            return;
+         }
+         round_players = players;
+         // Get dealer hit (first card, face card)
+         hit_dealer();
+         // Get second hit per each player
+         for (auto player : round_players) {
+            if (player->getBet() > 0) {
+               hit(player); // Give all betting players their second card
+            }
+         }
+         // Now to go through each player, get their turn.
+         phase = TURNS;
+         if (simultaneous_turns) {
+            start_all_turns();
+         } else {
+            turn_index = 0;
+            next_turn();
+         }
+      }
+      // start_all_turns starts the turn of every player who bet and is still
+      // connected at once, skipping players with a natural blackjack, and gives
+      // them all one shared deadline. Every hand is settled against the dealer
+      // on its own, so the players' decisions do not depend on each other.
+      void start_all_turns() {
+         std::vector<PlayerInfo*> deciding;
+         for (auto player : round_players) {
+            if (player->isConnected() && player->getBet() > 0) { // Ensure we only consider players with bets
+               if (player->getHand().is_blackjack()) { // Check if player has blackjack (value of 21, 2 cards)
+                  player->setState(WAIT_FOR_DEALER); // Move player immediately to WAIT_FOR_DEALER
+                  broadcast("Player " + player->getUsername() + " has a natural blackjack! Skipping turn.\n\n");
+               } else {
+                  deciding.push_back(player);
                }
             }
-
-            // Now to go through each player, get their turn. Giving 30 seconds for actions on each.
-            for (auto player : players) {
-               if (player_info[player]->getBet() > 0) { // Ensure we only consider players with bets
-                  if (player_info[player]->getHand().size() == 2 && player_info[player]->getValue() == 21) { // Check if player has blackjack (value of 21, 2 cards)
-                     player_info[player]->setState(WAIT_FOR_DEALER); // Move player immediately to WAIT_FOR_DEALER
-                     broadcast("Player " + conn_to_user[player] + " has a natural blackjack! Skipping turn.\n\n");
-                  } else {
-                     // Player does not have a natural blackjack, start their turn.
-                     player_info[player]->setState(TURN);
-                     broadcast("It is " + conn_to_user[player] + "'s turn.\n\n");
-                     // Send 3-1-2 response to signify new state.
-                     ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(3, 1, 2, "It is your turn!\n\n");
-                     ssize_t len = rpdu->to_bytes(&write_buffer);
-                     player_info[player]->write(write_buffer, len);
-                     delete rpdu;
-                     // This technically employs a busy wait, albeit it only runs at most 30 times...
-                     // Sorry about this. Not experienced with timeout-driven events.
-                     for (int k=0; k<30; k++) {
-                        std::this_thread::sleep_for(std::chrono::seconds(1));
-                        // Quit the timeout if the player is at WAIT_FOR_DEALER or disconnects.
-                        if (conn_to_state[player] == WAIT_FOR_DEALER || !(player_info[player]->isConnected())) {
-                           break;
-                        }
-                     }
-                     // The player did not end their turn if the state is not WAIT_FOR_DEALER.
-                     if (conn_to_state[player] != WAIT_FOR_DEALER) {
-                        // Move the player automatically to next state.
-                        player_info[player]->setState(WAIT_FOR_DEALER);
-                        // Send warning of timeout
-                        ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 7, "Timeout elapsed.\n\n");
-                        ssize_t len = rpdu->to_bytes(&write_buffer);
-                        player_info[player]->write(write_buffer, len);
-                     }
-                  }
+         }
+         if (deciding.empty()) { // Nobody has a decision to make, straight to the dealer
+            settle_round();
+            end_round();
+            return;
+         }
+         broadcast("It is everyone's turn.\n\n");
+         for (auto player : deciding) {
+            player->setState(TURN);
+            // Send 3-1-2 response to signify new state.
+            reply(player, 3, 1, 2, "It is your turn!\n\n");
+         }
+         // Give the players turn_timeout seconds between them
+         arm_for(std::chrono::seconds(turn_timeout));
+      }
+      // next_turn starts the turn of the next player from turn_index who bet and is
+      // still connected, skipping players with a natural blackjack. Once every player
+      // has had their turn, the dealer plays and the round is settled.
+      void next_turn() {
+         for (; turn_index < round_players.size(); turn_index++) {
+            PlayerInfo* player = round_players[turn_index];
+            if (player->isConnected() && player->getBet() > 0) { // Ensure we only consider players with bets
+               if (player->getHand().is_blackjack()) { // Check if player has blackjack (value of 21, 2 cards)
+                  player->setState(WAIT_FOR_DEALER); // Move player immediately to WAIT_FOR_DEALER
+                  broadcast("Player " + player->getUsername() + " has a natural blackjack! Skipping turn.\n\n");
+               } else {
+                  // Player does not have a natural blackjack, start their turn.
+                  player->setState(TURN);
+                  broadcast("It is " + player->getUsername() + "'s turn.\n\n");
+                  // Send 3-1-2 response to signify new state.
+                  ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(3, 1, 2, "It is your turn!\n\n");
+                  ssize_t len = rpdu->to_bytes(&write_buffer);
+                  player->write(write_buffer, len);
+                  delete rpdu;
+                  // Give the player turn_timeout seconds for their turn
+                  arm_for(std::chrono::seconds(turn_timeout));
+                  return;
                }
             }
-            // Now all players have made their moves
-            // Time to play the dealer strategy
-            // Keep hitting until you cannot any more
-            while (hit_dealer()) {} // Returns false once the dealer's policy tells them to stand (or they bust)
-            // Calculate payouts
-            for (auto player : players) {
-               uint32_t bet = player_info[player]->getBet(); // Get the player's bet
-               uint32_t payout = 0; // Amount of funds the player wins
-               if (bet > 0) { // Only consider players with positive bet
-                  uint8_t value = player_info[player]->getValue();
-                  if (value <= 21) { // Player's value is less than or equal to 21, so they did not bust
-                     if (dealer_value > 21 || value > dealer_value) { // Dealer bust, or you beat the dealer
-                        payout = (bet*payoff_high)/payoff_low; // Multiple bet by payout ratio
-                     } else if (dealer_value == value) { // Tie, or beat with blackjack
-                        if (value == 21) { // Possibly beat with blackjack
-                           if (player_info[player]->getHand().size() == 2 && dealer_hand.size() > 2) { // Player has blackjack, dealer does not
-                              payout = (bet*payoff_high)/payoff_low; // Blackjack win
-                           } else if (dealer_hand.size() == 2 && player_info[player]->getHand().size() > 2) { // Dealer has blackjack, player does not
-                              payout = 0; // Dealer win by blackjack
-                           } else {
-                              payout = bet; // Tie, return bet
-                           }
-                        } else {
-                           payout = bet; // Tie, return bet
-                        }
-                     }
-                  }
-                  // Update balance to payoff
-                  player_info[player]->setBet(0); // Clear bet
-                  user_info[conn_to_user[player]]->adjustBalance(payout); // Add payout to player balance
-                  WinningsResponsePDU* win_pdu = new WinningsResponsePDU(3,1,4,htonl(payout)); // Send payout as winnings, big endian
-                  ssize_t len = win_pdu->to_bytes(&write_buffer);
-                  player_info[player]->write(write_buffer, len);
+         }
+         // Now all players have made their moves
+         settle_round();
+         end_round();
+      }
+      // settle_round plays the dealer's hand and pays out every player still at the
+      // table, as one batch: payouts first, then the accounts and the ledger, then the players.
+      void settle_round() {
+         // Time to play the dealer strategy
+         // Keep hitting until you cannot any more
+         while (hit_dealer()) {} // Returns false once the dealer's policy tells them to stand (or they bust)
+         // Calculate every payout first
+         settlement.clear();
+         settled_players.clear();
+         for (auto player : round_players) {
+            uint32_t bet = player->getBet(); // Get the player's bet
+            if (player->isConnected() && bet > 0) { // Only consider players still here with positive bet
+               uint32_t payout = rules->payout(bet, player->getHand(), dealer_hand); // Amount of funds the player wins
+               player->setBet(0); // Clear bet
+               settlement.add(player->getAccount(), player->getUsername(), bet, payout, !player->getBot());
+               settled_players.push_back(player);
+            }
+         }
+         // Then pay the whole round out in one pass over the accounts, and record it,
+         // unless the round was played for a tournament's chips
+         settlement.apply();
+         rounds_settled++;
+         if (!tournament) {
+            ledger.record(table_id, rounds_settled, settlement);
+         }
+         // Only then tell each player their winnings
+         const std::vector<Settlement::Entry>& results = settlement.results();
+         for (size_t i = 0; i < settled_players.size(); i++) {
+            WinningsResponsePDU* win_pdu = new WinningsResponsePDU(3,1,4,htonl(results[i].payout)); // Send payout as winnings, big endian
+            ssize_t len = win_pdu->to_bytes(&write_buffer);
+            settled_players[i]->write(write_buffer, len);
+            delete win_pdu;
+         }
+         round_players.clear();
+         // Dealer done, new round
+         for (auto player : players) {
+            // Move all players to ENTER_BETS
+            player->setState(ENTER_BETS);
+         }
+      }
+      // free_departed deletes the seats of players who have left the table.
+      // Only called between rounds, when the round holds no PlayerInfo*.
+      void free_departed() {
+         for (auto pi : departed_players) {
+            delete pi;
+         }
+         departed_players.clear();
+      }
+      // find_seat returns the given seat of the session at this table
+      // (seated or pending), or NULL if the session is not at this table.
+      PlayerInfo* find_seat(Session* session, uint8_t seat = 0) {
+         for (auto pi : players) {
+            if (pi->isConnected() && pi->getSession() == session && pi->getSeat() == seat) {
+               return pi;
+            }
+         }
+         for (auto pi : pending_players) {
+            if (pi->isConnected() && pi->getSession() == session && pi->getSeat() == seat) {
+               return pi;
+            }
+         }
+         return NULL;
+      }
+      // find_entrant returns the seat playing a tournament entrant's chips,
+      // which is how the tournament names its entrants' seats, or NULL if
+      // the entrant is not seated here.
+      PlayerInfo* find_entrant(AccountDetails* chips) {
+         for (auto pi : players) {
+            if (pi->isConnected() && pi->getAccount() == chips) {
+               return pi;
+            }
+         }
+         for (auto pi : pending_players) {
+            if (pi->isConnected() && pi->getAccount() == chips) {
+               return pi;
+            }
+         }
+         return NULL;
+      }
+      // reply sends an ASCII response to the player's connection.
+      void reply(PlayerInfo* player, uint8_t rc_1, uint8_t rc_2, uint8_t rc_3, std::string message) {
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(rc_1, rc_2, rc_3, message);
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         player->write(write_buffer, len);
+         delete rpdu;
+      }
+      // handle_command applies one command from the mailbox to the table, then
+      // deletes it. Commands from sessions that are no longer seated here are
+      // dropped, since their session may already be gone.
+      void handle_command(TableCommand* cmd) {
+         if (cmd->type == CMD_JOIN) {
+            bool joined = add_player(cmd->session, cmd->amount, cmd->account);
+            if (cmd->session->bot) {
+               // The table owns the bots it seats, and frees any it could not seat
+               if (joined) {
+                  bot_sessions.push_back(cmd->session);
+               } else {
+                  delete cmd->session->bot;
+                  sessions.release(cmd->session);
                }
             }
-            // Dealer done, new round
-            for (auto player : players) {
-               // Move all players to ENTER_BETS
-               player_info[player]->setState(ENTER_BETS);
+         } else if (cmd->type == CMD_WAITLIST) {
+            join_waitlist(cmd->session);
+         } else if (cmd->type == CMD_LEAVE) {
+            // The connection leaves the waitlist, or with every seat it holds
+            leave_waitlist(cmd->session, 2, 1, 5, "Left the waitlist.\n\n");
+            for (uint8_t seat = 0; PlayerInfo* player = find_seat(cmd->session, seat); seat++) {
+               remove_player(player);
+               // Inform client by 2-1-5 response
+               reply(player, 2, 1, 5, "Left table.\n\n");
+               player->closeSeat();
+            }
+         } else if (cmd->type == CMD_SHUTDOWN) {
+            shutdown();
+         } else if (cmd->type == CMD_STOP) {
+            stopping = true;
+         } else if (cmd->type == CMD_ROUND || cmd->type == CMD_REPORT || cmd->type == CMD_MOVE_OUT ||
+               cmd->type == CMD_MOVE_IN || cmd->type == CMD_KNOCKOUT) {
+            handle_tournament(cmd);
+         } else {
+            PlayerInfo* player = find_seat(cmd->session, cmd->seat);
+            if (player) {
+               if (cmd->type == CMD_BET) {
+                  place_bet(player, cmd->amount);
+               } else if (cmd->type != CMD_CHAT && player->getState() != TURN) {
+                  // The turn ended before the play arrived, or the seat's turn has not come
+                  reply(player, 5, 1, 0, "Command not accepted at current state.\n\n");
+               } else if (cmd->type == CMD_HIT) {
+                  // Hit for the player, keep them at TURN if they can hit again
+                  bool can_continue = hit(player);
+                  player->setState(can_continue ? TURN : WAIT_FOR_DEALER);
+               } else if (cmd->type == CMD_STAND) {
+                  // Move player to WAIT_FOR_DEALER, inform them they successfully stand
+                  player->setState(WAIT_FOR_DEALER);
+                  reply(player, 2, 1, 0, "You stand.\n\n");
+               } else if (cmd->type == CMD_DOUBLEDOWN) {
+                  doubledown(player);
+               } else if (cmd->type == CMD_CHAT) {
+                  // Broadcast to the table the player's username and their message, ending in newline
+                  broadcast(player->getUsername() + ": " + cmd->message + "\n");
+               }
             }
          }
-         // If we get here, there are no players in the room.
-         // Thread terminates, is_running set to false.
-         is_running = false;
+         // The command may have ended the current turn or the betting window
+         check_turn();
+         check_bets();
+         check_waiting();
+         if (cmd->done) {
+            cmd->done->signal();
+         }
+         delete cmd;
+      }
+      // place_bet takes the bet amt for the player, if they are still entering bets,
+      // the bet is in the table range, and their balance covers it. A bet of 0 passes,
+      // sitting the player out until the next round.
+      void place_bet(PlayerInfo* player, uint32_t amt) {
+         if (player->getState() != ENTER_BETS) { // Betting window closed before the bet arrived
+            reply(player, 5, 1, 0, "Command not accepted at current state.\n\n");
+            return;
+         }
+         if (amt == 0) { // Player passes on this round
+            // Move the player to IN_PROGRESS, inform them to wait via 1-1-0 response
+            player->setState(IN_PROGRESS);
+            reply(player, 1, 1, 0, "You sit out this round, please wait for next round.\n\n");
+            return;
+         }
+         if (!betInRange(amt)) { // Check if bet in accepted table range
+            // Bet out of table range, send error
+            reply(player, 5, 1, 0, "Bet not in range allowed by table.\n\n");
+            return;
+         }
+         // Remove the bet amount from the player's account, if it fits in the balance
+         if (!player->getAccount()->reserve(amt)) {
+            reply(player, 5, 1, 0, "You do not have sufficient funds to make this bet.\n\n");
+            return;
+         }
+         // Set the player's bet
+         player->setBet(amt);
+         // Move to WAIT_FOR_TURN, inform player of bet success
+         player->setState(WAIT_FOR_TURN);
+         reply(player, 2, 1, 0, "Accepted bet, please wait for turn.\n\n");
       }
-      // Given an SSL* connection, return the PlayerInfo* for that connection.
-      PlayerInfo* getPlayerInfo(SSL* conn) {
-         return player_info[conn];
+      // doubledown doubles the player's bet, if the balance covers the second bet,
+      // then hits once and moves the player to WAIT_FOR_DEALER.
+      void doubledown(PlayerInfo* player) {
+         // Get the player's original bet
+         uint32_t orig_bet = player->getBet();
+         // Take the second bet out of the balance, if it fits within the balance
+         if (!player->getAccount()->reserve(orig_bet)) {
+            // Bet does not fit within balance, inform client via 5-1-0
+            reply(player, 5, 1, 0, "You do not have sufficient funds to double down.\n\n");
+            return;
+         }
+         // Double the player's original bet
+         player->setBet(orig_bet*2);
+         // Hit a new card, use true to specify double down response code
+         hit(player, true);
+         // Set new state to WAIT_FOR_DEALER
+         player->setState(WAIT_FOR_DEALER);
       }
       // Convert the table to a std::string. In this case, it
       // converts the table to the settings string based on the BNF grammar
@@ -518,6 +1032,20 @@ class TableDetails
          } else {
             out += "false";
          }
+         out += "\nbet-window:";
+         out += std::to_string(bet_window);
+         out += "\nturn-timeout:";
+         out += std::to_string(turn_timeout);
+         out += "\nmin-players-to-start:";
+         out += std::to_string(min_players);
+         out += "\nsimultaneous-turns:";
+         if (simultaneous_turns) {
+            out += "true";
+         } else {
+            out += "false";
+         }
+         out += "\npenetration:";
+         out += std::to_string(penetration);
          out += "\n\n";
          return out;
       }
@@ -525,174 +1053,228 @@ class TableDetails
       bool betInRange(uint32_t amt) {
          return (amt >= bet_min) && (amt <= bet_max);
       }
-      // Add the player's SSL connection to the table. Returns true if the player is successfully added,
-      // false otherwise. Also handles response back to player.
-      bool add_player(SSL* player) {
-         mtx.lock();
+      // Set the table's ID, done by the registry when the table is added.
+      void setID(uint16_t id) {
+         table_id = id;
+      }
+      // Return the table's ID in the registry.
+      uint16_t getID() {
+         return table_id;
+      }
+      // Make the table the index'th of tournament t. Done before the table is
+      // used, and the table then only plays the rounds t starts. Only the
+      // first table of a tournament is published, and the others take its ID.
+      void setTournament(Tournament* t, size_t index) {
+         tournament = t;
+         tournament_table = index;
+         phase = BARRIER;
+         min_players = 1; // The tournament decides who plays, and never holds a round up
+      }
+      // Return the tournament the table plays in, or NULL if none.
+      Tournament* getTournament() {
+         return tournament;
+      }
+      // Seat the session at the table, in the slot it took for the table.
+      // Returns true if the player is successfully added, false otherwise, in
+      // which case the slot is freed again. Also handles response back to
+      // player. seats is the number of seats asked for by JOINSEATS, which is
+      // given as many as are free and told how many by a 2-1-14 response, or
+      // 0 for a plain JOIN of one seat. account is what the seats bet from, the
+      // session's own account if NULL. Joining a tournament enters it, for one
+      // seat playing the entrant's chips, at whichever of its tables the
+      // tournament picks, where the join is passed on if it is not this one.
+      bool add_player(Session* session, uint8_t seats = 0, AccountDetails* account = NULL) {
+         TableSlot* slot = session->slot_of(this);
          if (!is_available) { // Table is not available, tell player the table is closed
             ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 4, "Table is being closed.\n\n");
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(player, write_buffer, len);
-            mtx.unlock();
+            send_marked(session, slot, table_id, -1, write_buffer, len);
+            slot->table = NULL;
             return false;
          }
-         if (players.size() + pending_players.size() == max_players) { // Table is full, inform player and return false
-            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 3, "Table provided is full, try again later.\n\n");
+         if (tournament) {
+            if (!account) {
+               TableDetails* at = enter_tournament(session, slot, &account);
+               if (at != this) { // Refused, or entered at another of the tournament's tables
+                  return at != NULL;
+               }
+            }
+            seats = std::min<uint8_t>(seats, 1);
+         }
+         size_t free = free_seats();
+         if (free == 0) { // Table is full, inform player and return false
+            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 3, "Table provided is full, try again later or join its waitlist.\n\n");
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            SSL_write(player, write_buffer, len);
-            mtx.unlock();
+            send_marked(session, slot, table_id, -1, write_buffer, len);
+            slot->table = NULL;
             return false;
          }
-         player_info[player] = new PlayerInfo(player); // Add player to map of player info
-         if (!is_running) { // Player is the first connection to the server
-            players.push_back(player);
-            // Start the game thread here
-            game_thread = std::thread(&TableDetails::run_blackjack,this);
-            // Detach the thread so that we don't need to join it
-            game_thread.detach();
-            // Move player to ENTER_BETS
-            conn_to_state[player] = ENTER_BETS;
-            // Inform player the game has started via 3-1-0 response
-            JoinTableResponsePDU* rpdu = new JoinTableResponsePDU(3, 1, 0, to_string());
-            ssize_t len = rpdu->to_bytes(&write_buffer);
-            player_info[player]->write(write_buffer, len);
-         } else { // Server is running for other players currently
-            // Move player to IN_PROGRESS, they will join later
-            conn_to_state[player] = IN_PROGRESS;
-            pending_players.push_back(player); // Player joins in next round
-            broadcast(conn_to_user[player] + " is joining in the next round.\n\n");
-            // Inform the player to wait via 1-1-0 response.
-            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 0, "Game in progress, please wait for next round.\n\n");
+         if (seats > 0) { // JOINSEATS, tell the player how many seats they got via 2-1-14 response
+            seats = std::min<size_t>(seats, free);
+            SeatResponsePDU* rpdu = new SeatResponsePDU(2, 1, 14, seats);
             ssize_t len = rpdu->to_bytes(&write_buffer);
-            player_info[player]->write(write_buffer, len);
+            send_marked(session, slot, table_id, -1, write_buffer, len);
+            delete rpdu;
+         } else {
+            seats = 1;
+         }
+         slot->seats = seats;
+         bool waiting = phase == IDLE || phase == WAITING; // No round is being played yet
+         for (uint8_t seat = 0; seat < seats; seat++) {
+            PlayerInfo* player = new PlayerInfo(session, slot, table_id, seat, account); // Create the player's seat
+            if (waiting) {
+               players.push_back(player);
+               // Move player to ENTER_BETS
+               player->setState(ENTER_BETS);
+               // Inform player the game has started via 3-1-0 response
+               JoinTableResponsePDU* rpdu = new JoinTableResponsePDU(3, 1, 0, to_string());
+               ssize_t len = rpdu->to_bytes(&write_buffer);
+               player->write(write_buffer, len);
+            } else { // Game is running for other players currently
+               // Move player to IN_PROGRESS, they will join later
+               player->setState(IN_PROGRESS);
+               pending_players.push_back(player); // Player joins in next round
+               broadcast(player->getUsername() + " is joining in the next round.\n\n");
+               // Inform the player to wait via 1-1-0 response.
+               ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(1, 1, 0, "Game in progress, please wait for next round.\n\n");
+               ssize_t len = rpdu->to_bytes(&write_buffer);
+               player->write(write_buffer, len);
+            }
+         }
+         if (phase == IDLE) { // Player is the first connection to the table, start the game
+            start_round();
+         } else if (phase == WAITING) { // Open betting if enough players are now seated
+            open_betting();
          }
-         mtx.unlock();
          return true;
       }
       // shutdown closes the table. It also kicks out any current players and moves all players
-      // back to the ACCOUNT state.
+      // back to the ACCOUNT state. Nobody can join the table after it is shut down.
       void shutdown() {
-         mtx.lock();
+         is_available = false;
          // First, inform all current players.
-         for (auto player : players) {
-            PlayerInfo* pi = getPlayerInfo(player);
+         for (auto pi : players) {
             // Inform of closure by 4-1-4 response.
-            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 4, "Table is being closed.\n\n");
-            ssize_t len = rpdu->to_bytes(&write_buffer);
-            pi->write(write_buffer, len);
-            // Disconnect player from game.
-            pi->disconnect();
-            // Move player to ACCOUNT state.
-            conn_to_state[player] = ACCOUNT;
+            reply(pi, 4, 1, 4, "Table is being closed.\n\n");
+            // Disconnect player from game, moving them to ACCOUNT state.
+            pi->closeSeat();
+            departed_players.push_back(pi);
          }
          // Wipe all players.
          players.clear();
          // Inform all pending players
-         for (auto player : pending_players) {
-            PlayerInfo* pi = getPlayerInfo(player);
+         for (auto pi : pending_players) {
             // Inform of closure by 4-1-4 response
-            ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 4, "Table is being closed.\n\n");
-            ssize_t len = rpdu->to_bytes(&write_buffer);
-            pi->write(write_buffer, len);
-            // Disconnect player from game.
-            pi->disconnect();
-            // Move player to ACCOUNT state.
-            conn_to_state[player] = ACCOUNT;
+            reply(pi, 4, 1, 4, "Table is being closed.\n\n");
+            // Disconnect player from game, moving them to ACCOUNT state.
+            pi->closeSeat();
+            departed_players.push_back(pi);
          }
          // Wipe all pending players
          pending_players.clear();
-         mtx.unlock();
+         // And turn the waitlist away
+         while (!waitlist.empty()) {
+            leave_waitlist(waitlist.front(), 4, 1, 4, "Table is being closed.\n\n");
+         }
+         if (tournament) {
+            leave_tournament();
+         }
       }
-      // remove_player removes the given player connection from the current game.
-      // Returns true if successful, false otherwise.
-      bool remove_player(SSL* player) {
+      // remove_player removes the given player seat from the current game.
+      // The seat is freed at the start of the next round, once the game
+      // logic can no longer be using it. Returns true if successful, false otherwise.
+      bool remove_player(PlayerInfo* player) {
          bool ret = false;
-         mtx.lock();
          // Check if player is in list of current players
          if (std::count(players.begin(), players.end(), player)) {
-            // Remove the player, disconnect them
+            // Remove the player
             players.erase(std::remove(players.begin(), players.end(), player), players.end());
-            PlayerInfo* pi = getPlayerInfo(player);
-            pi->disconnect();
+            departed_players.push_back(player);
             ret = true;
          } else if (std::count(pending_players.begin(), pending_players.end(), player)) {
-            // Player is in pending players, remove them, disconnect
+            // Player is in pending players, remove them
             pending_players.erase(std::remove(pending_players.begin(), pending_players.end(), player), pending_players.end());
-            PlayerInfo* pi = getPlayerInfo(player);
-            pi->disconnect();
+            departed_players.push_back(player);
             ret = true;
          }
-         mtx.unlock();
          // Tell the players that the player has left
-         broadcast(conn_to_user[player] + " has left! Bye!\n\n");
+         broadcast(player->getUsername() + " has left! Bye!\n\n");
          return ret;
       }
-      // init_deck initializes the table's deck with a sorted vector of cards,
-      // based on the number of decks for the table
-      bool init_deck() {
-         std::vector<char> ranks = {'A','2','3','4','5','6','7','8','9','T','J','Q','K'};
-         std::vector<char> suits = {'H','C','D','S'};
-         std::vector<CardPDU*> cards;
-         // Create the deck of cards number_decks time, put into cards
-         for (int i=0; i<number_decks; i++) {
-            for (auto rank : ranks) {
-               for (auto suit : suits) {
-                  CardPDU* card = new CardPDU(rank, suit);
-                  cards.push_back(card);
-               }
+      // change_shoe swaps the table's shoe for one of number_decks decks the
+      // shuffler has ready, and places its cut card.
+      void change_shoe() {
+         if (shoe) {
+            shuffler.recycle(shoe);
+         }
+         shoe = shuffler.take(number_decks);
+         shoe->place_cut(penetration);
+         // Record the shoe's seed, which replays its exact card order (see replay_shoe),
+         // unless only bots are playing it
+         if (has_connections()) {
+            fprintf(stderr, "Table %u: new %u deck shoe, seed %s\n", table_id, number_decks, shoe->seed.to_hex().c_str());
+         }
+      }
+      // first_seat returns true if seats[i] is the first of its session's seats in seats.
+      bool first_seat(const std::vector<PlayerInfo*>& seats, size_t i) {
+         for (size_t j = 0; j < i; j++) {
+            if (seats[j]->getSession() == seats[i]->getSession() && seats[j]->isConnected()) {
+               return false;
             }
          }
-         // Shuffle the combined deck
-         std::shuffle(std::begin(cards), std::end(cards), rng);
-         // Update the table's deck.
-         deck = cards;
          return true;
       }
-      // hit gives the specified player connection an extra card. The function writes
+      // Return true if any connection (rather than a bot) is seated or waiting to be.
+      bool has_connections() {
+         for (auto pi : players) {
+            if (!pi->getBot()) {
+               return true;
+            }
+         }
+         for (auto pi : pending_players) {
+            if (!pi->getBot()) {
+               return true;
+            }
+         }
+         return false;
+      }
+      // hit gives the specified player seat an extra card. The function writes
       // the appropriate response code to the player depending on their new hand value.
       // If dbl is set to true, the player doubles their bet, which will result in a different
       // response code sent to the player. Note that the return value does not indicate success.
       // If hit returns true, the player is still allowed to hit. If hit returns false, the
       // player may not hit again.
-      bool hit(SSL* player, bool dbl=false) {
-         mtx.lock();
+      bool hit(PlayerInfo* player, bool dbl=false) {
          bool ret = true;
-         // Re-init the deck if it is empty
-         if (deck.size() == 0) {
-            init_deck();
-         }
-         // Give the player the last card in the deck
-         player_info[player]->addCard(deck.back());
-         // Remove last card from deck
-         deck.pop_back();
-         // Compute soft value, hard value, and overall hand value
-         std::vector<CardPDU*> player_hand = player_info[player]->getHand();
-         uint8_t soft_value = get_soft_value(player_hand);
-         uint8_t hard_value = get_hard_value(player_hand);
-         uint8_t value = get_value(soft_value, hard_value);
-         // Save the hand's value
-         player_info[player]->setValue(value);
+         // The cut card changes the shoe between rounds, so this only
+         // happens if a round deals past the end of the shoe
+         if (shoe->empty()) {
+            change_shoe();
+         }
+         // Give the player the next card in the shoe
+         player->addCard(shoe->draw());
+         // The hand keeps its own totals as cards are added
+         const Hand& player_hand = player->getHand();
+         uint8_t value = player_hand.value();
          // Determine response code (1-1-x)
          uint8_t rc3 = 1; // Default is 1-1-1
          if (dbl) { // Double default is 1-1-3
             rc3 = 3;
          }
          if (value == 21) { // Player has 21
-            if (player_hand.size() == 2) { // Player has blackjack
+            if (player_hand.is_blackjack()) { // Player has blackjack
                rc3 = 4; // Return 1-1-4
             } else { // Player has 21 (Not blackjack)
                rc3 = 6; // Return 1-1-6
             }
             ret = false; // Player cannot hit on 21
-         } else if (value > 21) { // Player busts
+         } else if (player_hand.is_bust()) { // Player busts
             rc3 = 2; // Return 1-1-2
             ret = false; // Cannot hit on bust
          }
          // Send the card hand response for hit
-         CardHandResponsePDU* chr_pdu = new CardHandResponsePDU(1,1,rc3,1,soft_value,hard_value,player_hand);
-         ssize_t len = chr_pdu->to_bytes(&write_buffer);
-         player_info[player]->write(write_buffer, len);
-         mtx.unlock();
+         ssize_t len = encode_hand(&write_buffer,1,1,rc3,1,player_hand.soft_value(),player_hand.hard_value(),player_hand);
+         player->write(write_buffer, len);
          return ret;
       }
       // hit_dealer simulates a hit for the dealer. This method is simulate to hit for the player.
@@ -701,370 +1283,621 @@ class TableDetails
       // dealer should hit again. If the return value is false, this is interpreted as
       // the dealer stands.
       bool hit_dealer() {
-         mtx.lock();
-         bool ret = true;
-         // Re-init deck if it is empty
-         if (deck.size() == 0) {
-            init_deck();
-         }
-         // Give dealer the last card in deck
-         dealer_hand.push_back(deck.back());
-         // Remove last card from deck
-         deck.pop_back();
-         // Calculate soft value, hard value, overall value for dealer hand
-         uint8_t soft_value = get_soft_value(dealer_hand);
-         uint8_t hard_value = get_hard_value(dealer_hand);
-         uint8_t value = get_value(soft_value, hard_value);
+         // Change shoes if a round deals past the end of the shoe
+         if (shoe->empty()) {
+            change_shoe();
+         }
+         // Give dealer the next card in the shoe
+         dealer_hand.add(shoe->draw());
+         uint8_t value = dealer_hand.value();
          uint8_t rc3 = 1; // Default return code 1-1-1
          // Determine return code
          if (value == 21) { // Dealer has 21
-            if (dealer_hand.size() == 2) { // Dealer has blackjack
+            if (dealer_hand.is_blackjack()) { // Dealer has blackjack
                rc3 = 4; // Send 1-1-4
             } else { // Dealer has 21 (No blackjack)
                rc3 = 6; // Send 1-1-6
             }
-            ret = false; // Do not hit on blackjack
-         } else if (value > 21) { // Dealer busts
+         } else if (dealer_hand.is_bust()) { // Dealer busts
             rc3 = 2; // Send 1-1-2
-            ret = false; // Dealer cannot hit again
-         } else if (value >= 18 || hard_value == 17) {
-            // Dealer never hits on hard 17, or hard/soft 18 or higher
-            ret = false;
-         } else if (!hit_soft_17 && soft_value == 17) {
-            // Do not hit on soft 17, if hit_soft_17 is false
-            ret = false;
-         }
-         // Store the dealer's hand value
-         dealer_value = value;
+         }
+         // The dealer never hits on 21 or a bust, hard 17, or hard/soft 18 or
+         // higher, or on soft 17 if hit_soft_17 is false
+         bool ret = rules->dealer_hits(dealer_hand);
          // Build the card hand response for dealer
-         CardHandResponsePDU* chr_pdu = new CardHandResponsePDU(1,1,rc3,0,soft_value,hard_value,dealer_hand);
-         ssize_t len = chr_pdu->to_bytes(&write_buffer);
-         // Send dealer's hand to all players
-         for (auto player : players) {
-            player_info[player]->write(write_buffer, len);
+         ssize_t len = encode_hand(&write_buffer,1,1,rc3,0,dealer_hand.soft_value(),dealer_hand.hard_value(),dealer_hand);
+         // Send dealer's hand to all players, once to a connection playing several seats
+         for (size_t i = 0; i < players.size(); i++) {
+            if (first_seat(players, i)) {
+               players[i]->writeTable(write_buffer, len);
+            }
          }
-         delete chr_pdu;
-         mtx.unlock();
          return ret;
       }
 };
 
-// tables_lock is a lock on tables, a global map of IDs to TableDetails*
-std::mutex tables_lock;
-// next_table_id is a counter which denotes the ID of the next table via AddTable
-uint16_t next_table_id = 1;
-// tables maps table ID to table when joining or removing a table
-std::map<uint16_t, TableDetails*> tables = {{0, new TableDetails()}};
-// conn_to_table_id maps a connection to the table the connection is at
-std::map<SSL*, uint16_t> conn_to_table_id;
+#include "registry.h"
+#include "tournament.h"
+
+// handle_lockstats sends the lock profile (see lockprof.h) if the PDU is
+// LockStats and the session is an administrator. Return true if the PDU
+// was LockStats, false otherwise.
+bool handle_lockstats(PDU* p, Session* session) {
+   // Attempt to cast to LockStats
+   LockStatsPDU* pdu = dynamic_cast<LockStatsPDU*>(p);
+   if (!pdu) { // Not LockStats
+      return false;
+   }
+   char * write_buffer = (char *)malloc(4096);
+   ASCIIResponsePDU* rpdu;
+   if (admin_users.count(session->username)) {
+      // Send the profile (2-0-6), cut to fit the write buffer with its terminating newline
+      rpdu = new ASCIIResponsePDU(2, 0, 6, lock_profile_report(4000) + "\n");
+   } else {
+      // Not an administrator, inform failure
+      rpdu = new ASCIIResponsePDU(4, 0, 6, "Only administrators may view lock statistics.\n\n");
+   }
+   ssize_t len = rpdu->to_bytes(&write_buffer);
+   session->write(write_buffer, len);
+   free(write_buffer);
+   return true;
+}
+
+// fetch_strategy returns the strategy chart (see strategy.h) of a table with
+// the given settings. A chart already in the cache is returned at once.
+// Otherwise it is computed on the cache's worker the first time any table
+// with the same settings asks for it, and every caller waits for that one
+// computation, the calling fiber's worker serving other connections meanwhile.
+const StrategyChart* fetch_strategy(const std::string& settings) {
+   const StrategyChart* chart = NULL;
+   Completion computed;
+   const StrategyChart* cached = strategy_cache.find(settings, [&](const StrategyChart* ready) {
+      chart = ready;
+      computed.signal();
+   });
+   if (cached) {
+      return cached;
+   }
+   computed.wait();
+   return chart;
+}
+
+// handle_getstrategy sends the strategy chart and house edge of a table if
+// the PDU is GetStrategy. The table's settings are read under guard, which
+// is then released, so a chart being computed holds up no reclamation.
+// Return true if the PDU was GetStrategy, false otherwise.
+bool handle_getstrategy(PDU* p, Session* session, EpochGuard& guard) {
+   // Attempt to cast to GetStrategy
+   GetStrategyPDU* pdu = dynamic_cast<GetStrategyPDU*>(p);
+   if (!pdu) { // Not GetStrategy
+      return false;
+   }
+   char * write_buffer = (char *)malloc(4096);
+   uint16_t table_id = pdu->getTableID();
+   TableDetails* table = table_registry.find(table_id);
+   if (!table) {
+      // Table does not exist, inform failure
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 2, "Table with ID does not exist.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+      free(write_buffer);
+      return true;
+   }
+   std::string settings = table->to_string();
+   guard.release();
+   const StrategyChart* chart = fetch_strategy(settings);
+   // Send the chart (2-1-13), one row per hand value, with the house edge in millionths of a bet
+   std::string rows = "";
+   for (int r = 0; r < StrategyChart::ROWS; r++) {
+      rows += (char)StrategyChart::label(r);
+      rows.append(chart->actions[r], StrategyChart::COLUMNS);
+   }
+   int32_t edge = (int32_t)lround(chart->house_edge() * 1000000);
+   StrategyResponsePDU* rpdu = new StrategyResponsePDU(2, 1, 13, htons(table_id), htonl(edge), rows);
+   ssize_t len = rpdu->to_bytes(&write_buffer);
+   session->write(write_buffer, len);
+   free(write_buffer);
+   return true;
+}
 
 // handle_getbalance sends the player's balance if the PDU is GetBalance.
 // Return true if successful, false otherwise.
-bool handle_getbalance(PDU* p, SSL* conn) {
+bool handle_getbalance(PDU* p, Session* session) {
    // Attempt to cast to GetBalance
    GetBalancePDU* pdu = dynamic_cast<GetBalancePDU*>(p);
    if (!pdu) { // Not GetBalance
       return false;
    }
    char * write_buffer = (char *)malloc(4096);
-   // Send the balance, as big endian. Get it from user_info with the connection's username.
-   BalanceResponsePDU* rpdu = new BalanceResponsePDU(2, 0, 3, htonl(user_info[conn_to_user[conn]]->getBalance()));
+   // Send the balance, as big endian. Get it from the session's account.
+   BalanceResponsePDU* rpdu = new BalanceResponsePDU(2, 0, 3, htonl(session->account->getBalance()));
    ssize_t len = rpdu->to_bytes(&write_buffer);
-   SSL_write(conn, write_buffer, len);
+   session->write(write_buffer, len);
    free(write_buffer);
    return true;
 }
 
 // handle_updatebalance attempts to update the player balance if the PDU is UpdateBalance.
 // Return true if successful, false otherwise.
-bool handle_updatebalance(PDU* p, SSL* conn) {
+bool handle_updatebalance(PDU* p, Session* session) {
    // Attempt to cast to UpdateBalance
    UpdateBalancePDU* pdu = dynamic_cast<UpdateBalancePDU*>(p);
    if (!pdu) { // Not UpdateBalance
       return false;
    }
    int32_t funds = pdu->getFunds();
-   // Adjust the user's balance by the given amount, do this by the username.
-   user_info[conn_to_user[conn]]->adjustBalance(funds);
+   // Adjust the user's balance by the given amount, through the session's account.
+   session->account->adjustBalance(funds);
    // Inform the user that the balance has been updated.
    ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 0, 0, "Balance updated.\n\n");
    char * write_buffer = (char *)malloc(4096);
    ssize_t len = rpdu->to_bytes(&write_buffer);
-   SSL_write(conn, write_buffer, len);
+   session->write(write_buffer, len);
    free(write_buffer);
    return true;
 }
 
-// addtable creates a new table given the std::string settings, and gives
-// the table the settings as specified. The string follows the BNF grammar from
-// the design document for AddTable. The connection conn is informed of the
-// added table.
-void addtable(std::string settings, SSL* conn) {
-   std::string headers = settings.substr(0, settings.length()-1); // Cut off trailing \n from headers.
-   std::string line;
-   size_t pos1;
-   // These are the default table settings, per the design doc.
-   // Used in case some headers are missing.
-   uint8_t max_players = 5;
-   uint8_t number_decks = 8;
-   uint8_t payoff_high = 3;
-   uint8_t payoff_low = 2;
-   uint16_t bet_min = 25;
-   uint16_t bet_max = 1000;
-   bool hit_soft_17 = true;
-   // Loop over each individual line in the settings.
-   while ((pos1 = headers.find("\n")) != std::string::npos) {
-      line = headers.substr(0, pos1);
-      size_t pos2 = line.find(":");
-      // Try to split line on first :. Skip the line otherwise.
-      if (pos2 != std::string::npos) {
-         // Get header up to :, value after :
-         std::string header = line.substr(0, pos2);
-         std::string value = line.substr(pos2+1);
-         // Match on header
-         if (header == "max-players") {
-            // Set the max amount of players
-            uint8_t val = atoi(value.c_str());
-            if (val > 0) {
-               max_players = val;
-            }
-         } else if (header == "number-decks") {
-            // Set the number of decks
-            uint8_t val = atoi(value.c_str());
-            if (val > 0) {
-               number_decks = val;
-            }
-         } else if (header == "payoff") {
-            // Set payoff ratio
-            size_t pos3 = value.find("-");
-            // Attempt to split off -
-            if (pos3 != std::string::npos) {
-               // v1 is numerator, v2 is denominator
-               std::string v1 = value.substr(0, pos3);
-               std::string v2 = value.substr(pos3+1);
-               uint8_t val1 = atoi(v1.c_str());
-               uint8_t val2 = atoi(v2.c_str());
-               if (val1 > 0 && val2 > 0) {
-                  // Set the payoff ratio if both numbers are positive
-                  payoff_high = val1;
-                  payoff_low = val2;
-               }
-            }
-         } else if (header == "bet-limits") {
-            // Set the bet limits
-            size_t pos3 = value.find("-");
-            // Attempt to split off -
-            if (pos3 != std::string::npos) {
-               // v1 is min, v2 is max
-               std::string v1 = value.substr(0, pos3);
-               std::string v2 = value.substr(pos3+1);
-               uint8_t val1 = atoi(v1.c_str());
-               uint8_t val2 = atoi(v2.c_str());
-               if (val1 > 0 && val2 > 0) {
-                  // Set the bet limits if both numbers are positive
-                  bet_min = val1;
-                  bet_max = val2;
-               }
-            }
-         } else if (header == "hit-soft-17") {
-            // Determine whether dealer hits on soft 17
-            if (value == "true") {
-               hit_soft_17 = true;
-            } else if (value == "false") {
-               hit_soft_17 = false;
-            }
+// bot_chart returns the strategy chart the bots of a table with the settings
+// ts play by, or NULL if they play without one. table need not be published.
+const StrategyChart* bot_chart(TableDetails* table, const TableSettings& ts) {
+   if (ts.bots == 0 || ts.bot_strategy != "basic") {
+      return NULL;
+   }
+   return fetch_strategy(table->to_string());
+}
+
+// addbots seats the bots the settings ask for at the table. Each bot gets a
+// session with no connection and joins through the table's mailbox, as a
+// connection does, and from then on the table owns it. The bots are named
+// name-1, name-2 and so on. chart is the table's strategy chart (see
+// bot_chart).
+void addbots(TableDetails* table, const std::string& name, const TableSettings& ts, const StrategyChart* chart) {
+   if (ts.bots == 0) {
+      return;
+   }
+   for (uint8_t i = 0; i < ts.bots; i++) {
+      Session* bot = sessions.acquire(NULL);
+      bot->bot = new Bot(ts.bot_strategy, chart, ts.bet_min);
+      bot->username = name + "-" + std::to_string(i + 1);
+      bot->account = &bot->bot->account;
+      bot->state = ACCOUNT;
+      bot->tables[0].table = table;
+      TableCommand* cmd = new TableCommand();
+      cmd->type = CMD_JOIN;
+      cmd->session = bot;
+      table->post(cmd);
+   }
+}
+
+// build_table makes a table with the settings ts, to run on core. It is
+// called on that core, so the table's memory comes from that core's
+// allocator arena. The table's rules engine is picked here, specialized for
+// its rules if they are common.
+TableDetails* build_table(const TableSettings& ts, int core) {
+   TableDetails* table = new TableDetails(ts.max_players, ts.number_decks, ts.payoff_high, ts.payoff_low, ts.bet_min,
+         ts.bet_max, ts.hit_soft_17, ts.bet_window, ts.turn_timeout, ts.min_players, ts.simultaneous_turns,
+         ts.penetration, make_rules_engine(ts));
+   table->core = core;
+   return table;
+}
+
+// addtournament creates the tables of a tournament with the settings ts, and
+// opens its entries (see tournament.h). The tables are built on the cores
+// they will run on, all at once. Only the first is published, as a
+// tournament may have more tables than the registry has IDs: the others
+// take its ID, and are only reached through the tournament. The session's
+// connection is informed of the ID, which entrants join, then any bots the
+// settings ask for are seated at every table, entering the tournament as
+// they join. on_finish, if set, is called by the tournament once it is over.
+void addtournament(const TableSettings& ts, Session* session,
+      std::function<void(Tournament*)> on_finish = nullptr) {
+   size_t count = ts.tournament_tables;
+   std::vector<TableDetails*> tables(count, NULL);
+   std::atomic<size_t> left(count);
+   Completion built;
+   for (size_t i = 0; i < count; i++) {
+      int core = scheduler.pick_core();
+      scheduler.run_on(core, [&, i, core]{
+         tables[i] = build_table(ts, core);
+         if (--left == 0) {
+            built.signal();
          }
+      });
+   }
+   built.wait();
+   // Every table plays the same rules, so they share one strategy chart. It is
+   // fetched while the tables are unpublished, so no guard is held meanwhile.
+   const StrategyChart* chart = bot_chart(tables[0], ts);
+   Tournament* tournament = new Tournament(ts, on_finish);
+   for (auto table : tables) {
+      tournament->add_table(table);
+   }
+   char * write_buffer = (char *)malloc(4096);
+   // Once published, the first table may be joined, so use it under a guard
+   EpochGuard guard;
+   // Publish the first table in the registry, which assigns the tournament's ID
+   uint16_t id;
+   if (!table_registry.add(tables[0], &id)) {
+      // Every registry slot is taken, inform failure
+      for (auto table : tables) {
+         delete table;
       }
-      // erase each line from the headers list once we are done with it
-      headers.erase(0, pos1 + 1);
+      delete tournament; // Never opened, so no table calls it
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 0, "Too many tables, remove a table first.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+      free(write_buffer);
+      return;
+   }
+   for (size_t i = 1; i < count; i++) {
+      tables[i]->setID(id);
+   }
+   tournament->open();
+   // Send the client the tournament's ID as big endian
+   AddTableResponsePDU* rpdu = new AddTableResponsePDU(2, 1, 4, htons(id));
+   ssize_t len = rpdu->to_bytes(&write_buffer);
+   session->write(write_buffer, len);
+   free(write_buffer);
+   for (size_t i = 0; i < count; i++) {
+      addbots(tables[i], "bot-" + std::to_string(id) + "-" + std::to_string(i + 1), ts, chart);
+   }
+   tournament->begin();
+}
+
+// addtable creates a new table given the std::string settings, and gives
+// the table the settings as specified. The string follows the BNF grammar from
+// the design document for AddTable. The session's connection is informed of the
+// added table, then any bots the settings ask for are seated. The caller need
+// not hold an EpochGuard.
+void addtable(std::string settings, Session* session) {
+   TableSettings ts;
+   ts.parse(settings);
+   if (ts.tournament_tables > 0) {
+      addtournament(ts, session);
+      return;
    }
    uint16_t table_id;
-   // Create the new table. Lock on tables_lock (so that concurrent adds cannot happen).
-   tables_lock.lock();
-   // Use the next table ID
-   table_id = next_table_id;
-   // Assign table details based on the header parsing.
-   tables[table_id] = new TableDetails(max_players, number_decks, payoff_high, payoff_low, bet_min, bet_max, hit_soft_17);
-   // Update next table ID
-   next_table_id += 1;
-   tables_lock.unlock();
+   // Assign table details based on the header parsing. The table is built
+   // on the core it will run on, so its memory comes from that core's
+   // allocator arena.
+   TableDetails* table = NULL;
+   int core = scheduler.pick_core();
+   Completion built;
+   scheduler.run_on(core, [&]{
+      table = build_table(ts, core);
+      built.signal();
+   });
+   built.wait();
+   // Fetched while the table is unpublished, so no guard is held meanwhile
+   const StrategyChart* chart = bot_chart(table, ts);
+   char * write_buffer = (char *)malloc(4096);
+   // Once published, the table may be removed, so use it under a guard
+   EpochGuard guard;
+   // Publish the table in the registry, which assigns its ID.
+   if (!table_registry.add(table, &table_id)) {
+      // Every registry slot is taken, inform failure
+      delete table;
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 0, "Too many tables, remove a table first.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+      free(write_buffer);
+      return;
+   }
    // Send the client the new table ID as big endian
    AddTableResponsePDU* rpdu = new AddTableResponsePDU(2, 1, 4, htons(table_id));
-   char * write_buffer = (char *)malloc(4096);
    ssize_t len = rpdu->to_bytes(&write_buffer);
-   SSL_write(conn, write_buffer, len);
+   session->write(write_buffer, len);
    free(write_buffer);
+   addbots(table, "bot-" + std::to_string(table_id), ts, chart);
 }
 
 // handle_addtable checks if the PDU is AddTable
 // and if so attempts to add a new table based on
-// the provided settings. Returns true if successful,
-// false otherwise.
-bool handle_addtable(PDU* p, SSL* conn) {
+// the provided settings. guard is released first, as adding a table
+// may compute its bots' strategy chart, and addtable guards the table it
+// publishes itself. Returns true if successful, false otherwise.
+bool handle_addtable(PDU* p, Session* session, EpochGuard& guard) {
    // Attempt to cast to AddTable
    AddTablePDU* pdu = dynamic_cast<AddTablePDU*>(p);
    if (!pdu) { // Not AddTable
       return false;
    }
-   // Call addtable with the settings string and connection
-   addtable(pdu->getSettings(), conn);
+   guard.release();
+   // Call addtable with the settings string and session
+   addtable(pdu->getSettings(), session);
+   return true;
+}
+
+// handle_gettables sends the ID and settings of every table if the PDU is
+// GetTables. Return true if the PDU was GetTables, false otherwise.
+bool handle_gettables(PDU* p, Session* session) {
+   GetTablesPDU* gt_pdu = dynamic_cast<GetTablesPDU*>(p);
+   if (!gt_pdu) { // Not GetTables
+      return false;
+   }
+   char * write_buffer = (char *)malloc(4096);
+   std::vector<TabledataPDU*> tabledata;
+   // Go through all tables, get a list of tabledata
+   for (auto table : table_registry.snapshot()) {
+      uint16_t tid = table->getID();
+      std::string settings = table->to_string(); // Convert each table to a string
+      TabledataPDU* td = new TabledataPDU(htons(tid), settings); // Create a tabledata for the table ID and settings
+      tabledata.push_back(td);
+   }
+   // No tables available, send error
+   if (tabledata.size() == 0) {
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 1, "No tables available.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+   } else {
+      // Tables available, send list of tabledata in 2-1-1 ListTables response
+      ListTablesResponsePDU* ltr_pdu = new ListTablesResponsePDU(2, 1, 1, tabledata);
+      ssize_t len = ltr_pdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+   }
+   free(write_buffer);
+   return true;
+}
+
+// handle_removetable shuts down and frees the table the PDU names if it is
+// RemoveTable, kicking out everyone at it. Return true if the PDU was
+// RemoveTable, false otherwise.
+bool handle_removetable(PDU* p, Session* session) {
+   RemoveTablePDU* rt_pdu = dynamic_cast<RemoveTablePDU*>(p);
+   if (!rt_pdu) { // Not RemoveTable
+      return false;
+   }
+   char * write_buffer = (char *)malloc(4096);
+   uint16_t table_id = rt_pdu->getTableID(); // get table to remove
+   TableDetails* table = table_registry.find(table_id);
+   if (table && table->getTournament()) {
+      // Its tournament shuts its tables down as it breaks them up
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 2, "Table is part of a tournament.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+      free(write_buffer);
+      return true;
+   }
+   table = table_registry.remove(table_id); // unpublish the table
+   if (table) { // table ID exists
+      // shutdown game (kick all players out), waiting for the table's executor to finish
+      TableCommand* cmd = new TableCommand();
+      cmd->type = CMD_SHUTDOWN;
+      table->post_and_wait(cmd);
+      table_registry.retire(table); // free the table once nobody can be using it
+      // Inform of success
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 1, 0, "Successfully shut down table.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+   } else {
+      // Inform failure
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 2, "Table with ID does not exist.\n\n");
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+   }
+   free(write_buffer);
+   return true;
+}
+
+// handle_jointable seats the session at the table the PDU names if it is
+// JoinTable, or JoinSeats for several seats, in a free slot of the session,
+// or Waitlist to wait for a seat if the table is full. The table's executor
+// handles the state transition and response. A connection in multi-table
+// play may join any table it is not already at, up to MAX_TABLES. Return
+// true if the PDU was any of them, false otherwise.
+bool handle_jointable(PDU* p, Session* session) {
+   JoinTablePDU* jt_pdu = dynamic_cast<JoinTablePDU*>(p);
+   JoinSeatsPDU* js_pdu = dynamic_cast<JoinSeatsPDU*>(p);
+   WaitlistPDU* wl_pdu = dynamic_cast<WaitlistPDU*>(p);
+   if (!jt_pdu && !js_pdu && !wl_pdu) { // Not JoinTable, JoinSeats or Waitlist
+      return false;
+   }
+   uint16_t table_id = jt_pdu ? jt_pdu->getTableID() : js_pdu ? js_pdu->getTableID() : wl_pdu->getTableID(); // get table to join
+   TableDetails* table = table_registry.find(table_id);
+   ASCIIResponsePDU* rpdu = NULL;
+   TableSlot* slot = NULL;
+   if (!table) { // Table does not exist, inform failure
+      rpdu = new ASCIIResponsePDU(4, 1, 2, "Table with ID does not exist.\n\n");
+   } else if (session->slot_of(table)) { // Joining twice would leave two slots for the table
+      rpdu = new ASCIIResponsePDU(4, 1, 5, "Already at this table.\n\n");
+   } else if (!(slot = session->free_slot())) {
+      rpdu = new ASCIIResponsePDU(4, 1, 6, "At too many tables, leave one first.\n\n");
+   }
+   if (rpdu) {
+      char * write_buffer = (char *)malloc(4096);
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      session->write(write_buffer, len);
+      free(write_buffer);
+      return true;
+   }
+   // seat session at table, waiting for the table's executor (this will handle state transition, response)
+   slot->table = table;
+   TableCommand* cmd = new TableCommand();
+   cmd->type = wl_pdu ? CMD_WAITLIST : CMD_JOIN;
+   cmd->session = session;
+   if (js_pdu) { // Ask for the seats, at least one
+      cmd->amount = std::max<uint8_t>(js_pdu->getSeats(), 1);
+   }
+   table->post_and_wait(cmd);
+   // Once seated (or waiting for a seat), move the connection to the table's core, so
+   // the table's traffic never crosses cores. A connection at several tables stays put.
+   // An entrant to a tournament may have been passed on to another of its tables.
+   TableDetails* at = slot->table;
+   if (at && !session->multitable) {
+      fibers.migrate(at->core);
+   }
+   return true;
+}
+
+// handle_multitable switches the session to multi-table play if the PDU is
+// MultiTable, for the rest of the connection, and confirms by 2-0-7
+// response. Only accepted while the session holds no table slot, otherwise
+// a 4-0-7 response is sent. Return true if the PDU was MultiTable, false
+// otherwise.
+bool handle_multitable(PDU* p, Session* session) {
+   MultiTablePDU* pdu = dynamic_cast<MultiTablePDU*>(p);
+   if (!pdu) { // Not MultiTable
+      return false;
+   }
+   ASCIIResponsePDU* rpdu;
+   bool seated = false;
+   for (size_t i = 0; i < MAX_TABLES; i++) {
+      if (session->tables[i].table) {
+         seated = true;
+      }
+   }
+   if (seated) { // Slots were taken in single-table play, leave them first
+      rpdu = new ASCIIResponsePDU(4, 0, 7, "Leave your table before enabling multi-table play.\n\n");
+   } else {
+      session->multitable = true;
+      rpdu = new ASCIIResponsePDU(2, 0, 7, "Multi-table play enabled.\n\n");
+   }
+   char * write_buffer = (char *)malloc(4096);
+   ssize_t len = rpdu->to_bytes(&write_buffer);
+   session->write(write_buffer, len);
+   free(write_buffer);
    return true;
 }
 
-// leavetable removes the connection conn from the current table that
-// the player is at.
-void leavetable(SSL* conn) {
-   // Lookup player table, find table ID for connection
-   uint32_t table_id = conn_to_table_id[conn];
-   if (!(tables.find(table_id) == tables.end())) { // Table ID exists.
-      tables[table_id]->remove_player(conn); // Remove the player from the table
-      conn_to_table_id.erase(conn); // Remove mapping of conn to table ID
-      conn_to_state[conn] = ACCOUNT; // Move to ACCOUNT state
-      // Inform client by 2-1-5 response
-      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 1, 5, "Left table.\n\n");
+// post_command posts a command of the given type from the session to the
+// table the command is for (its focus). If the session is no longer at that
+// table (it was closed), the connection is sent an error instead. The
+// table's executor applies the command and sends any responses. amount is
+// the bet for BET, message is the text for CHAT, seat is which of the
+// session's seats plays.
+void post_command(Session* session, CommandType type, uint32_t amount=0, std::string message="", uint8_t seat=0) {
+   // Get the table the command is for
+   TableDetails* table = session->tables[session->focus].table;
+   if (!table) { // Table for session no longer exists
+      // Send an error (5-1-0) to connection
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Table ID is no longer valid.\n\n");
       char * write_buffer = (char *)malloc(4096);
       ssize_t len = rpdu->to_bytes(&write_buffer);
-      SSL_write(conn, write_buffer, len);
+      session->write(write_buffer, len);
       free(write_buffer);
+      return;
+   }
+   TableCommand* cmd = new TableCommand();
+   cmd->type = type;
+   cmd->session = session;
+   cmd->amount = amount;
+   cmd->message = message;
+   cmd->seat = seat;
+   table->post(cmd);
+}
+
+// leavetable removes the session from the table the command is for (its
+// focus), if it is at one. Waits until the table's executor has
+// removed the seats, so the session may be released afterwards. A
+// tournament may be moving the session to another of its tables
+// meanwhile, in which case it leaves that table once seated there.
+void leavetable(Session* session) {
+   TableSlot* slot = &session->tables[session->focus];
+   bool left = false;
+   while (TableDetails* table = slot->table) { // Session is seated at a table.
+      // The executor removes the seats, moves the session to ACCOUNT,
+      // and informs the client by 2-1-5 response
+      TableCommand* cmd = new TableCommand();
+      cmd->type = CMD_LEAVE;
+      cmd->session = session;
+      table->post_and_wait(cmd);
+      left = true;
+   }
+   if (left) {
+      // Back in the lobby, any core may run the connection again
+      fibers.migrate(-1);
+   }
+}
+
+// leavetables removes the session from every table it is at, as leavetable.
+void leavetables(Session* session) {
+   for (size_t i = 0; i < MAX_TABLES; i++) {
+      session->focus = i;
+      leavetable(session);
    }
+   session->focus = 0;
 }
 
 // handle_leavetable checks if the PDU is LeaveTable
 // and if so attempts to have the connection leave the
 // current table that it is at. Return true if successful,
 // false otherwise.
-bool handle_leavetable(PDU* p, SSL* conn) {
+bool handle_leavetable(PDU* p, Session* session) {
    // Attempt to cast to LeaveTable
    LeaveTablePDU* pdu = dynamic_cast<LeaveTablePDU*>(p);
    if (!pdu) { // Not LeaveTable
       return false;
    }
-   // Call leavetable for the connection.
-   leavetable(conn);
+   // Call leavetable for the session.
+   leavetable(session);
    return true;
 }
 
 // handle_chat checks if the PDU is Chat
-// and if so finds the connection conn's current
-// table, broadcasting the chat message to
-// everyone at the table. The message is displayed
+// and if so posts the chat message to the session's
+// current table, which broadcasts it to everyone at
+// the table. The message is displayed
 // as "<username>: <message>". Return true if successful,
 // false otherwise.
-bool handle_chat(PDU* p, SSL* conn) {
+bool handle_chat(PDU* p, Session* session) {
    // Attempt to cast to Chat
    ChatPDU* pdu = dynamic_cast<ChatPDU*>(p);
    if (!pdu) { // Not Chat
       return false;
    }
-   // Get the connection's current table ID
-   uint32_t table_id = conn_to_table_id[conn];
-   if (!(tables.find(table_id) == tables.end())) { // Check that table exists
-      // Broadcast to the table the player's username and their message, ending in newline
-      tables[table_id]->broadcast(conn_to_user[conn] + ": " + pdu->getMessage() + "\n");
+   if (session->tables[session->focus].table) { // Check that the session is at the table
+      post_command(session, CMD_CHAT, 0, pdu->getMessage());
    }
    return true;
 }
 
 // handle_hit checks if the PDU is Hit
-// and if so has the connection conn hit a new
-// card and their current table. Returns true if
+// and if so has the session hit a new
+// card at their current table, for the given seat. Returns true if
 // successful, false otherwise.
-bool handle_hit(PDU* p, SSL* conn) {
+bool handle_hit(PDU* p, Session* session, uint8_t seat=0) {
    // Attempt to cast to Hit
    HitPDU* pdu = dynamic_cast<HitPDU*>(p);
    if (!pdu) { // Not Hit
       return false;
    }
-   // Get the connection's current table ID
-   uint32_t table_id = conn_to_table_id[conn];
-   if (tables.find(table_id) == tables.end()) { // Table ID for connection no longer exists
-      // Send an error (5-1-0) to connection
-      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Table ID is no longer valid.\n\n");
-      char * write_buffer = (char *)malloc(4096);
-      ssize_t len = rpdu->to_bytes(&write_buffer);
-      SSL_write(conn, write_buffer, len);  
-      free(write_buffer);
-   } else {
-      // Hit for the player at their table
-      bool can_continue = tables[table_id]->hit(conn);
-      if (can_continue) { // Player can hit again, so keep their state at TURN
-         conn_to_state[conn] = TURN;
-      } else { // Player cannot hit again, they must wait for dealer
-         conn_to_state[conn] = WAIT_FOR_DEALER;
-      }
-   }
+   // The table hits for the player, and keeps them at TURN if they may hit again
+   post_command(session, CMD_HIT, 0, "", seat);
    return true;
 }
 
 // handle_doubledown checks if the PDU is DoubleDown
-// and if so has the connection conn first double their bet.
-// The doubled bet is checked to ensure that it fits within the
-// user's balance. Then, the player hits, and is then moved to
+// and if so has the session first double their bet.
+// The second bet is reserved from the user's balance, which
+// fails if it does not fit within the balance. Then, the player hits, and is then moved to
 // WAIT_FOR_DEALER. Returns true if successful, false otherwise.
 // Note here that successful means the PDU parsed successfully,
 // not if the request was actually successful (you might
-// fail to doubledown if you have no balance).
-bool handle_doubledown(PDU* p, SSL* conn) {
+// fail to doubledown if you have no balance). seat is the seat that doubles.
+bool handle_doubledown(PDU* p, Session* session, uint8_t seat=0) {
    // Attempt to case to DoubleDown
    DoubleDownPDU* pdu = dynamic_cast<DoubleDownPDU*>(p);
    if (!pdu) { // Not DoubleDown
       return false;
    }
-   // Get the connection's current table ID
-   uint32_t table_id = conn_to_table_id[conn];
-   if (tables.find(table_id) == tables.end()) { // Table ID for connection no longer exists
-      // Send an error (5-1-0) to connection
-      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "Table ID is no longer valid.\n\n");
-      char * write_buffer = (char *)malloc(4096);
-      ssize_t len = rpdu->to_bytes(&write_buffer);
-      SSL_write(conn, write_buffer, len);  
-      free(write_buffer);
-   } else {
-      // Get the player's info at their table.
-      PlayerInfo* pi = tables[table_id]->getPlayerInfo(conn);
-      // Get the player's original bet
-      uint32_t orig_bet = pi->getBet();
-      if (orig_bet > user_info[conn_to_user[conn]]->getBalance()) { // Ensure that the second bet fits within the balance
-         // Bet does not fit within balance, inform client via 5-1-0
-         char * write_buffer = (char *)malloc(4096);
-         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(5, 1, 0, "You do not have sufficient funds to double down.\n\n");
-         ssize_t len = rpdu->to_bytes(&write_buffer);
-         SSL_write(conn, write_buffer, len);
-         free(write_buffer);
-         // The request failed, but the parse did succeed, so return true
-         return true;
-      }
-      // Double the player's original bet
-      pi->setBet(orig_bet*2);
-      // Remove the bet again from the balance
-      user_info[conn_to_user[conn]]->adjustBalance(-orig_bet);
-      // Hit a new card, use true to specify double down response code
-      tables[table_id]->hit(conn, true);
-      // Set new state to WAIT_FOR_DEALER
-      conn_to_state[conn] = WAIT_FOR_DEALER;
-   }
+   // The table reserves the second bet, hits and ends the player's turn
+   post_command(session, CMD_DOUBLEDOWN, 0, "", seat);
    return true;
 }
 
 // handle_stand checks if the PDU is Stand
 // and if so moves the player's state to WAIT_FOR_DEALER
 // essentially ending their turn. The player is informed
-// of this succeeding. Returns true if successful and
+// of this succeeding, for the given seat. Returns true if successful and
 // false otherwise.
-bool handle_stand(PDU* p, SSL* conn) {
+bool handle_stand(PDU* p, Session* session, uint8_t seat=0) {
    // Attempt to cast to Stand
    StandPDU* pdu = dynamic_cast<StandPDU*>(p);
    if (!pdu) { // Not Stand
       return false;
    }
-   // Move player to WAIT_FOR_DEALER
-   conn_to_state[conn] = WAIT_FOR_DEALER;
-   // Inform player they successfully stand
-   ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(2, 1, 0, "You stand.\n\n");
-   char * write_buffer = (char *)malloc(4096);
-   ssize_t len = rpdu->to_bytes(&write_buffer);
-   SSL_write(conn, write_buffer, len);
-   free(write_buffer);
+   // The table moves the player to WAIT_FOR_DEALER and informs them
+   post_command(session, CMD_STAND, 0, "", seat);
    return true;
 }
 
@@ -1115,21 +1948,21 @@ int setup_socket(short port)
 }
 
 // parse_pdu_server is the guts of the server PDU parsing,
-// this function reads in a PDU from a SSL connection and
+// this function reads in a PDU from a session's connection and
 // parses it into the appropriate PDU class. The class
 // is then returned, for which you should then do a dynamic
 // type check on it to figure out what PDU was parsed and
 // how it should be handled at the current state. This
 // handles converting bytes into a human-readable PDU
 // class for the server.
-PDU* parse_pdu_server(SSL* ssl) {
+PDU* parse_pdu_server(Session* session) {
    ssize_t rc = 0;
    char header_buf[2];
    Header* header;
    PDU* pdu = NULL;
 
    // Read in the 2 byte header
-   if ((rc = SSL_read(ssl, header_buf, 2)) <= 0) {
+   if ((rc = session->read(header_buf, 2)) <= 0) {
       return pdu;
    }
    // Extract category_code, command_code from header
@@ -1141,7 +1974,7 @@ PDU* parse_pdu_server(SSL* ssl) {
       if (command_code == 0) { // VERSION
          char message_buf[4];
          // Read in the version number
-         if ((rc = SSL_read(ssl, message_buf, 4)) <= 0) {
+         if ((rc = session->read(message_buf, 4)) <= 0) {
             return pdu;
          }
          // Build a VersionPDU
@@ -1152,7 +1985,7 @@ PDU* parse_pdu_server(SSL* ssl) {
          int i = 0;
          char c = '\0';
          // Read a string up to terminating newline or 33 characters
-         while ((rc = SSL_read(ssl, &c, 1) > 0)) {
+         while ((rc = session->read(&c, 1) > 0)) {
             message_buf[i] = c;
             i++;
             if (c == '\n') {
@@ -1173,7 +2006,7 @@ PDU* parse_pdu_server(SSL* ssl) {
          int i = 0;
          char c = '\0';
          // Read a string up to terminating newline or 33 characters
-         while ((rc = SSL_read(ssl, &c, 1) > 0)) {
+         while ((rc = session->read(&c, 1) > 0)) {
             message_buf[i] = c;
             i++;
             if (c == '\n') {
@@ -1195,7 +2028,7 @@ PDU* parse_pdu_server(SSL* ssl) {
       } else if (command_code == 4) { // UPDATEBALANCE
          char message_buf[4];
          // Read in the funds
-         if ((rc = SSL_read(ssl, message_buf, 4)) <= 0) {
+         if ((rc = session->read(message_buf, 4)) <= 0) {
             return pdu;
          }
          // Create an UpdateBalancePDU with the amount of funds
@@ -1204,6 +2037,12 @@ PDU* parse_pdu_server(SSL* ssl) {
       } else if (command_code == 5) { // QUIT
          // No additional parsing necessary, build Quit PDU
          pdu = new QuitPDU();
+      } else if (command_code == 6) { // LOCKSTATS
+         // No additional parsing necessary, build LockStats PDU
+         pdu = new LockStatsPDU();
+      } else if (command_code == 7) { // MULTITABLE
+         // No additional parsing necessary, build MultiTable PDU
+         pdu = new MultiTablePDU();
       }
    } else if (category_code == 1) { // Blackjack-commands
       if (command_code == 0) { // GETTABLES
@@ -1215,7 +2054,7 @@ PDU* parse_pdu_server(SSL* ssl) {
          int i = 0;
          char c = '\0';
          bool saw_newline = false; // Tracks whether previous character is newline
-         while ((rc = SSL_read(ssl, &c, 1) > 0)) {
+         while ((rc = session->read(&c, 1) > 0)) {
             message_buf[i] = c;
             i++;
             if (c == '\n') {
@@ -1243,7 +2082,7 @@ PDU* parse_pdu_server(SSL* ssl) {
       } else if (command_code == 2) { // REMOVETABLE
          char message_buf[2];
          // Read in the table ID
-         if ((rc = SSL_read(ssl, message_buf, 2)) <= 0) {
+         if ((rc = session->read(message_buf, 2)) <= 0) {
             return pdu;
          }
          // Get table ID, create RemoveTable PDU
@@ -1252,7 +2091,7 @@ PDU* parse_pdu_server(SSL* ssl) {
       } else if (command_code == 3) { // JOINTABLE
          char message_buf[2];
          // Read in the table ID
-         if ((rc = SSL_read(ssl, message_buf, 2)) <= 0) {
+         if ((rc = session->read(message_buf, 2)) <= 0) {
             return pdu;
          }
          // Get table ID, create JoinTable PDU
@@ -1264,7 +2103,7 @@ PDU* parse_pdu_server(SSL* ssl) {
       } else if (command_code == 5) { // BET
          char message_buf[4];
          // Read in the bet amount
-         if ((rc = SSL_read(ssl, message_buf, 4)) <= 0) {
+         if ((rc = session->read(message_buf, 4)) <= 0) {
             return pdu;
          }
          // Get amount to bet, create Bet PDU
@@ -1284,7 +2123,7 @@ PDU* parse_pdu_server(SSL* ssl) {
          int i = 0;
          char c = '\0';
          // Read up to terminating newline or 129 characters
-         while ((rc = SSL_read(ssl, &c, 1) > 0)) {
+         while ((rc = session->read(&c, 1) > 0)) {
             message_buf[i] = c;
             i++;
             if (c == '\n') {
@@ -1301,6 +2140,50 @@ PDU* parse_pdu_server(SSL* ssl) {
             pdu = new ChatPDU(std::string(message_buf));
          }
 
+      } else if (command_code == 13) { // GETSTRATEGY
+         char message_buf[2];
+         // Read in the table ID
+         if ((rc = session->read(message_buf, 2)) <= 0) {
+            return pdu;
+         }
+         // Get table ID, create GetStrategy PDU
+         uint16_t tid = *reinterpret_cast<uint16_t*>(message_buf);
+         pdu = new GetStrategyPDU(tid);
+      } else if (command_code == 14) { // JOINSEATS
+         char message_buf[3];
+         // Read in the table ID and number of seats
+         if ((rc = session->read(message_buf, 3)) <= 0) {
+            return pdu;
+         }
+         // Get table ID and seats, create JoinSeats PDU
+         uint16_t tid = *reinterpret_cast<uint16_t*>(message_buf);
+         pdu = new JoinSeatsPDU(tid, message_buf[2]);
+      } else if (command_code == 15) { // SEAT
+         uint8_t seat;
+         // Read in the seat
+         if ((rc = session->read(&seat, 1)) <= 0) {
+            return pdu;
+         }
+         // Create Seat PDU
+         pdu = new SeatPDU(seat);
+      } else if (command_code == 16) { // TABLE
+         char message_buf[2];
+         // Read in the table ID
+         if ((rc = session->read(message_buf, 2)) <= 0) {
+            return pdu;
+         }
+         // Get table ID, create AtTable PDU
+         uint16_t tid = *reinterpret_cast<uint16_t*>(message_buf);
+         pdu = new AtTablePDU(tid);
+      } else if (command_code == 17) { // WAITLIST
+         char message_buf[2];
+         // Read in the table ID
+         if ((rc = session->read(message_buf, 2)) <= 0) {
+            return pdu;
+         }
+         // Get table ID, create Waitlist PDU
+         uint16_t tid = *reinterpret_cast<uint16_t*>(message_buf);
+         pdu = new WaitlistPDU(tid);
       }
    }
    // Return whatever PDU was found. If the PDU fails to be created, returns NULL.
@@ -0,0 +1,313 @@
+/* session.h
+ * Contains the Session struct, which holds everything the server
+ * knows about a single client connection (DFA state, username,
+ * account, the tables it is at), and the SessionPool which hands
+ * Sessions out of fixed-size slabs. A Session is acquired when the
+ * TLS handshake completes and released when the connection closes,
+ * and it is passed by pointer to every handler in between.
+ *
+ * All reads and writes on the connection go through the Session,
+ * since the connection fiber reads from it while tables write to
+ * it, and an SSL object may only be used by one thread at a time.
+ * The socket is non-blocking: a read or write that would block parks
+ * the fiber (see fiber.h) rather than its worker thread.
+ *
+ * Tables never write to a connection themselves, since a write to a
+ * client that stops reading would block the table's worker, and every
+ * table on its core with it. They queue what they send in the
+ * connection's Outbox, and its fiber writes the queues out whenever it
+ * would otherwise wait for the client. A connection in multi-table play
+ * (see MULTITABLE) is at up to MAX_TABLES tables at once, one TableSlot
+ * each, and its fiber takes a message from each table in turn.
+ */
+
+#include <openssl/err.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class AccountDetails;
+class TableDetails;
+class Bot;
+
+// MAX_TABLES is how many tables a connection in multi-table play may be at at once.
+const size_t MAX_TABLES = 16;
+
+// TableSlot is a table the session is at, and how many seats it holds there.
+// The connection takes a free slot when it joins a table, and the table
+// frees the slot again when the last of those seats is closed, so both are
+// atomic. The table pointer may only be used under an EpochGuard.
+struct TableSlot
+{
+   std::atomic<TableDetails*> table {NULL}; // The table, NULL if the slot is free
+   std::atomic<uint8_t> seats {0}; // Seats held at the table, each with its own state once there are several
+};
+
+// Outbox holds what tables send a connection until its fiber writes it
+// out, in a queue per table slot. Tables never wait on the client this
+// way, and the fiber takes a message from each table in turn, so a busy
+// table cannot hold the others' events up behind its own. A client that
+// stops reading cannot make it grow without bound either: past MAX_BYTES
+// it refuses everything, and the connection is closed.
+class Outbox
+{
+   private:
+      static const size_t MAX_BYTES = 1 << 20; // Most a client may leave unread before it is dropped
+      ProfiledMutex mtx LOCK_SITE("Outbox::mtx"); // Protects queues, next, bytes and overflowed
+      std::deque<std::string> queues[MAX_TABLES]; // Messages from the table in each slot, oldest first
+      size_t next = 0; // Slot whose turn is next
+      size_t bytes = 0; // Bytes in all the queues
+      bool overflowed = false; // Set once a push would have gone past MAX_BYTES
+      std::atomic<size_t> queued {0}; // Messages in all the queues, read without the lock
+   public:
+      // Queue the num bytes in buf from the table in slot. Returns false, and
+      // queues nothing from then on, once the client has fallen too far behind.
+      bool push(size_t slot, const void* buf, int num) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         if (overflowed || bytes + num > MAX_BYTES) {
+            overflowed = true;
+            return false;
+         }
+         queues[slot].emplace_back((const char*)buf, num);
+         bytes += num;
+         queued++;
+         return true;
+      }
+      // Return true if nothing is queued.
+      bool empty() {
+         return queued.load() == 0;
+      }
+      // Append queued messages to batch, one from each table that has any in
+      // turn, until batch holds at least max bytes or nothing is left. The
+      // next call carries on from the table after the last one taken from.
+      // Returns false if nothing was queued.
+      bool take(std::string& batch, size_t max) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         bool took = false;
+         // Stop once a full turn finds every queue empty
+         for (size_t idle = 0; idle < MAX_TABLES && batch.size() < max; ) {
+            std::deque<std::string>& q = queues[next];
+            next = (next + 1) % MAX_TABLES;
+            if (q.empty()) {
+               idle++;
+               continue;
+            }
+            batch += q.front();
+            bytes -= q.front().size();
+            q.pop_front();
+            queued--;
+            took = true;
+            idle = 0;
+         }
+         return took;
+      }
+};
+
+// Session is the per-connection state of the server. Every field a handler
+// needs is one pointer dereference away, rather than a lookup in a global map.
+// The state is atomic since table executors also move players between
+// game states.
+struct Session
+{
+   SSL* connection = NULL; // The TLS connection for this client
+   std::atomic<STATE> state {VERSION}; // Current DFA state of the connection
+   std::string username = ""; // Authenticated username, empty until PASS succeeds
+   AccountDetails* account = NULL; // Account for username, set on login
+   TableSlot tables[MAX_TABLES]; // Tables the connection is at, only the first is used unless multitable
+   bool multitable = false; // Set by MULTITABLE, for the rest of the connection
+   size_t focus = 0; // Slot of the table the command being handled is for, picked by TABLE
+   Outbox* outbox = NULL; // What tables send the connection, NULL without a connection
+   Fiber* fiber = NULL; // The connection's fiber, woken to write out the outbox
+   Bot* bot = NULL; // The bot playing this session, which then has no connection (see bots.h)
+   Session* next_free = NULL; // Link used by SessionPool while the session is unused
+   Profiled<FiberMutex> io_mtx LOCK_SITE("Session::io_mtx"); // Serializes every SSL call on connection
+
+   // Read up to num bytes from the connection into buf, as SSL_read. The
+   // socket is non-blocking, and the connection is only locked while
+   // OpenSSL is called, so tables can write to the connection while its
+   // fiber is parked waiting for the client.
+   int read(void* buf, int num) {
+      int fd = SSL_get_fd(connection);
+      for (;;) {
+         int ret, err;
+         {
+            std::lock_guard<Profiled<FiberMutex>> lock(io_mtx);
+            // The error queue is per thread, and another fiber may have left errors on it
+            ERR_clear_error();
+            ret = SSL_read(connection, buf, num);
+            if (ret > 0) {
+               return ret;
+            }
+            err = SSL_get_error(connection, ret);
+         }
+         if (outbox && !outbox->empty()) {
+            // Nothing from the client yet, write out what the tables sent meanwhile
+            flush();
+            continue;
+         }
+         if (err == SSL_ERROR_WANT_READ) {
+            fibers.wait_fd(fd, false);
+         } else if (err == SSL_ERROR_WANT_WRITE) {
+            fibers.wait_fd(fd, true);
+         } else {
+            return ret;
+         }
+      }
+   }
+   // Write num bytes from buf to the connection, as SSL_write. Only the
+   // connection's fiber writes, and anything its tables sent first is
+   // written out ahead of it.
+   int write(const void* buf, int num) {
+      if (outbox) {
+         flush();
+      }
+      return write_out(buf, num);
+   }
+   // Write num bytes from buf to the connection now. OpenSSL requires a
+   // write that would block to be retried with the same arguments before
+   // anything else is written, so the connection stays locked while
+   // waiting for the socket to drain. A bot's session has no connection,
+   // and whatever is written to it is dropped.
+   int write_out(const void* buf, int num) {
+      if (!connection) {
+         return num;
+      }
+      int fd = SSL_get_fd(connection);
+      std::lock_guard<Profiled<FiberMutex>> lock(io_mtx);
+      for (;;) {
+         ERR_clear_error();
+         int ret = SSL_write(connection, buf, num);
+         if (ret > 0) {
+            return ret;
+         }
+         int err = SSL_get_error(connection, ret);
+         if (err == SSL_ERROR_WANT_WRITE) {
+            fibers.wait_fd(fd, true);
+         } else if (err == SSL_ERROR_WANT_READ) {
+            fibers.wait_fd(fd, false);
+         } else {
+            return ret;
+         }
+      }
+   }
+   // send queues num bytes from buf, sent by the table in slot, in the
+   // outbox, and wakes the connection's fiber to write them. A client too
+   // far behind to take them has its socket shut down, which ends the
+   // fiber's wait on it, so the connection closes as if the client had
+   // gone. Whatever is sent to a bot's session is dropped.
+   void send(TableSlot* slot, const void* buf, int num) {
+      if (!outbox) {
+         return;
+      }
+      if (!outbox->push(slot - tables, buf, num)) {
+         shutdown(SSL_get_fd(connection), SHUT_RDWR);
+      }
+      fibers.unpark(fiber);
+   }
+   // flush writes out everything in the outbox, up to 16 kB at a time. Only
+   // called by the connection's fiber.
+   void flush() {
+      std::string batch;
+      while (outbox->take(batch, 16384)) {
+         if (write_out(batch.data(), batch.size()) <= 0) {
+            return; // The connection is gone, its fiber finds out on its next read
+         }
+         batch.clear();
+      }
+   }
+   // Take the connection's writes from tables through an outbox that the
+   // calling fiber, the connection's, writes out.
+   void enable_outbox() {
+      outbox = new Outbox();
+      fiber = fibers.current();
+   }
+   // Return the slot the session is at table in, or NULL if it is not at table.
+   TableSlot* slot_of(TableDetails* table) {
+      for (size_t i = 0; i < MAX_TABLES; i++) {
+         if (tables[i].table == table) {
+            return &tables[i];
+         }
+      }
+      return NULL;
+   }
+   // Return a free slot to join a table in, or NULL if the session is at
+   // as many tables as it may be: one, unless multitable.
+   TableSlot* free_slot() {
+      size_t n = multitable ? MAX_TABLES : 1;
+      for (size_t i = 0; i < n; i++) {
+         if (!tables[i].table) {
+            return &tables[i];
+         }
+      }
+      return NULL;
+   }
+
+   // Reset the session to a freshly connected state for the given connection.
+   void reset(SSL* conn) {
+      connection = conn;
+      state = VERSION;
+      username = "";
+      account = NULL;
+      for (size_t i = 0; i < MAX_TABLES; i++) {
+         tables[i].table = NULL;
+         tables[i].seats = 0;
+      }
+      multitable = false;
+      focus = 0;
+      delete outbox;
+      outbox = NULL;
+      fiber = NULL;
+      bot = NULL;
+      next_free = NULL;
+   }
+};
+
+// SessionPool allocates Sessions in slabs of SLAB_SIZE and recycles them
+// through a free list, so accepting a connection never touches the heap
+// once the pool has warmed up. Slabs are never returned to the system.
+class SessionPool
+{
+   private:
+      static const size_t SLAB_SIZE = 256;
+      ProfiledMutex mtx LOCK_SITE("SessionPool::mtx"); // Protects slabs and free_list
+      std::vector<Session*> slabs; // Every slab allocated so far
+      Session* free_list = NULL; // Singly linked list of unused sessions
+      // Allocate a new slab and push all of its sessions onto the free list.
+      // Must be called with mtx held.
+      void grow() {
+         Session* slab = new Session[SLAB_SIZE];
+         slabs.push_back(slab);
+         for (size_t i = 0; i < SLAB_SIZE; i++) {
+            slab[i].next_free = free_list;
+            free_list = &slab[i];
+         }
+      }
+   public:
+      // Take a session off the free list and bind it to the connection conn.
+      Session* acquire(SSL* conn) {
+         mtx.lock();
+         if (!free_list) {
+            grow();
+         }
+         Session* session = free_list;
+         free_list = session->next_free;
+         mtx.unlock();
+         session->reset(conn);
+         return session;
+      }
+      // Return the session to the free list. The caller must have already
+      // removed the session from any table it was seated at.
+      void release(Session* session) {
+         session->reset(NULL);
+         mtx.lock();
+         session->next_free = free_list;
+         free_list = session;
+         mtx.unlock();
+      }
+};
+
+// sessions is the pool every connection handler acquires its Session from.
+SessionPool sessions;
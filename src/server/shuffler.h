@@ -0,0 +1,132 @@
+/* shuffler.h
+ * Contains the ShoeShuffler, a background thread that keeps a few
+ * freshly shuffled shoes ready for every number of decks tables are
+ * playing with. A table swaps in a ready shoe between rounds, once its
+ * cut card comes out, and hands the old one back to be refilled, so
+ * neither a deal nor a table's worker ever pays for a multi-deck
+ * shuffle. If the pool has run dry, the table shuffles a shoe itself.
+ *
+ * Every shoe is shuffled from its own seed, drawn from one master
+ * ChaCha20 stream keyed from the OS entropy pool. Tables log each
+ * shoe's seed as it comes into play, and replay_shoe rebuilds the shoe
+ * from it. With set_seed, the master stream is keyed from a given seed
+ * instead, so every run draws the same sequence of shoe seeds, and
+ * shoes are handed out in the order their seeds were drawn.
+ * Expects cards.h and lockprof.h to be included first.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ShoeShuffler prepares shuffled shoes ahead of time. take and recycle
+// may be called from any thread.
+class ShoeShuffler
+{
+   private:
+      static const size_t READY = 4; // Shoes kept ready per number of decks
+      static const size_t SPARES = 64; // Returned shoes kept for refilling, the rest are freed
+      ProfiledMutex mtx LOCK_SITE("ShoeShuffler::mtx"); // Protects ready, spares and seeds
+      LockCV cv; // Signalled when a pool drops below READY
+      std::map<uint8_t, std::deque<Shoe*>> ready; // Shuffled shoes, by number of decks, for every number taken so far
+      std::vector<Shoe*> spares; // Returned shoes, refilled in place so their arrays are reused
+      ChaCha20 seeds { ShoeSeed::random() }; // Master stream every shoe's seed is drawn from
+      std::atomic<uint64_t> misses {0}; // Shoes a table had to shuffle itself
+      // Return the number of decks of a pool below READY, or 0 if every pool is full.
+      uint8_t short_pool() {
+         for (auto& pool : ready) {
+            if (pool.second.size() < READY) {
+               return pool.first;
+            }
+         }
+         return 0;
+      }
+      // Refill pools below READY, forever.
+      void shuffle_loop() {
+         std::unique_lock<ProfiledMutex> lock(mtx);
+         for (;;) {
+            uint8_t decks;
+            cv.wait(lock, [&]{ return (decks = short_pool()) != 0; });
+            Shoe* shoe;
+            if (spares.empty()) {
+               shoe = new Shoe();
+            } else {
+               shoe = spares.back();
+               spares.pop_back();
+            }
+            ShoeSeed seed = seeds.seed();
+            // Shuffle without the lock, so tables can take and recycle meanwhile
+            lock.unlock();
+            shoe->fill(decks, seed);
+            lock.lock();
+            ready[decks].push_back(shoe);
+         }
+      }
+   public:
+      // Key the master stream from seed, so every run deals the same sequence
+      // of shoe seeds. Must be called before start and before any table deals.
+      void set_seed(const ShoeSeed& seed) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         seeds = ChaCha20(seed);
+      }
+      // Start the shuffler thread.
+      void start() {
+         std::thread([this]{ shuffle_loop(); }).detach();
+      }
+      // Return a shuffled shoe of decks decks. From then on the shuffler keeps
+      // shoes of that many decks ready.
+      Shoe* take(uint8_t decks) {
+         ShoeSeed seed;
+         {
+            std::lock_guard<ProfiledMutex> lock(mtx);
+            std::deque<Shoe*>& pool = ready[decks];
+            cv.notify_one();
+            if (!pool.empty()) {
+               Shoe* shoe = pool.front();
+               pool.pop_front();
+               return shoe;
+            }
+            seed = seeds.seed();
+         }
+         // None ready, shuffle one here
+         misses.fetch_add(1);
+         Shoe* shoe = new Shoe();
+         shoe->fill(decks, seed);
+         return shoe;
+      }
+      // Hand back a shoe that is no longer dealt from, to be refilled.
+      void recycle(Shoe* shoe) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         if (spares.size() < SPARES) {
+            spares.push_back(shoe);
+            return;
+         }
+         delete shoe;
+      }
+      // Return how many shoes tables have had to shuffle themselves.
+      uint64_t getMisses() {
+         return misses.load();
+      }
+};
+
+// replay_shoe returns the card order of the decks deck shoe shuffled from
+// seed, as the protocol's rank and suit characters, one deck per line.
+std::string replay_shoe(const ShoeSeed& seed, uint8_t decks)
+{
+   Shoe shoe;
+   shoe.fill(decks, seed);
+   std::string out = "";
+   for (size_t i = 0; i < shoe.cards.size(); i++) {
+      out += card_rank(shoe.cards[i]);
+      out += card_suit(shoe.cards[i]);
+      out += (i % 52 == 51) ? "\n" : " ";
+   }
+   return out;
+}
+
+// shuffler is the ShoeShuffler every table takes its shoes from.
+ShoeShuffler shuffler;
@@ -0,0 +1,394 @@
+/* strategy.h
+ * Contains the exact strategy calculator. For a table's settings it
+ * works out, by dynamic programming over the cards left in a full shoe,
+ * the dealer's final total distribution for every up card, the best
+ * hit, stand or double down play for every player hand, and the house
+ * edge of a player who always makes it. The play depends on the exact
+ * cards the player holds (composition-dependent), and is summed up as a
+ * chart by hand total and up card for clients and bots.
+ *
+ * It follows the server's rules: the dealer is dealt one card and draws
+ * the rest after the players (there is no hole card or peek), a player
+ * may double down at any point of their turn, a turn ends at 21, and a
+ * win pays back payoff_high / payoff_low of the bet in all (see
+ * settle_payout). Charts are cached per table settings string, so each
+ * configuration is only ever computed once, on the cache's own worker
+ * thread.
+ * Expects cards.h, rules.h and lockprof.h to be included first.
+ */
+
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// StrategyChart is the best play for a table by hand total and dealer up card.
+struct StrategyChart
+{
+   static const int HARD_ROWS = 17; // Hard 4 to hard 20
+   static const int SOFT_ROWS = 9; // Soft 12 to soft 20
+   static const int ROWS = HARD_ROWS + SOFT_ROWS;
+   static const int COLUMNS = 10; // Dealer up card 2 to 9, ten, ace
+   double ev = 0; // The player's expected result per hand, in bets
+   char actions[ROWS][COLUMNS]; // 'H' hit, 'S' stand or 'D' double down
+   // Return the row of a hand worth value, soft or hard, or -1 if the chart
+   // has none (21 and over, where the turn is over).
+   static int row(uint8_t value, bool soft) {
+      if (soft) {
+         return (value >= 12 && value <= 20) ? HARD_ROWS + value - 12 : -1;
+      }
+      return (value >= 4 && value <= 20) ? value - 4 : -1;
+   }
+   // Return the hand value of row, with 0x80 set if the row is soft, as rows
+   // are labelled on the wire.
+   static uint8_t label(int row) {
+      return row < HARD_ROWS ? row + 4 : (row - HARD_ROWS + 12) | 0x80;
+   }
+   // Return the column of the dealer's up card.
+   static int column(card_t up) {
+      uint8_t value = card_hard_value(up);
+      return value == 1 ? 9 : value - 2;
+   }
+   // Return the chart's play for hand against the dealer's up card, or 'S'
+   // for hands the chart has no row for.
+   char action(const Hand& hand, card_t up) const {
+      bool soft = hand.value() != hand.hard_value();
+      int r = row(hand.value(), soft);
+      return r < 0 ? 'S' : actions[r][column(up)];
+   }
+   // Return the house edge, the fraction of each bet the house keeps.
+   double house_edge() const {
+      return -ev;
+   }
+};
+
+// StrategyCalculator computes the StrategyChart of one set of table
+// settings. It is only used for one calculation, by one thread.
+class StrategyCalculator
+{
+   private:
+      static const int RANKS = 10; // Ace, 2 to 9, and the ten-valued cards
+      static const int BUST = 5; // Index of busting, after the totals 17 to 21
+      static const int NATURAL = 6; // Index of a dealer blackjack
+      // Node is what is known about one player hand against one up card.
+      struct Node
+      {
+         bool stood = false; // stand is set
+         bool decided = false; // hit and dbl are set
+         double stand;
+         double hit; // Hitting, then playing on as well as possible
+         double dbl; // Doubling down
+      };
+      // DealerEnd is one set of cards the dealer can draw to after their up
+      // card, and how their hand then ends. How likely it is only depends on
+      // the shoe through the cards drawn, whatever order they come in.
+      struct DealerEnd
+      {
+         uint8_t outcome; // Final total - 17, BUST or NATURAL
+         uint8_t cards; // Cards drawn
+         uint8_t factors[Hand::MAX_CARDS]; // Per card drawn, its index into dealer_odds' factors
+         double orders; // Orders the cards can be drawn in before the dealer stands
+      };
+      TableSettings settings;
+      double win; // What a win nets, in bets
+      uint32_t counts[RANKS]; // Cards of each rank left in the shoe
+      uint32_t total; // Cards left in the shoe
+      // Every hand worked out so far, by the ranks it holds and the up card.
+      // Elements stay put as the map grows, so Node& can be held across calls.
+      std::unordered_map<uint64_t, Node> memo;
+      std::vector<DealerEnd> ends[RANKS]; // Every way the dealer's hand can end, by up card rank index
+      // Return the card of rank index r (ten-valued cards as tens).
+      static card_t rank_card(int r) {
+         return make_card(r, 0);
+      }
+      // Return the memo key of a hand after adding a card of rank index r.
+      static uint64_t with(uint64_t key, int r) {
+         return key + ((uint64_t)1 << (5 * r)); // At most 21 cards of a rank, in 5 bits each
+      }
+      // Remove a card of rank index r from the shoe.
+      void take(int r) {
+         counts[r]--;
+         total--;
+      }
+      // Put a card of rank index r back in the shoe.
+      void put(int r) {
+         counts[r]++;
+         total++;
+      }
+      // Add every way the dealer's hand can end from dealer, having drawn the
+      // cards in drawn (memo key key), to ends, as TableDetails::hit_dealer
+      // plays it. index maps a set of cards drawn to its place in ends.
+      void enumerate(const Hand& dealer, uint64_t key, uint8_t* drawn, std::vector<DealerEnd>& ends,
+            std::unordered_map<uint64_t, size_t>& index) {
+         uint8_t value = dealer.value();
+         uint8_t outcome = 0;
+         if (dealer.is_bust()) {
+            outcome = BUST;
+         } else if (dealer.is_blackjack()) {
+            outcome = NATURAL;
+         } else if (value == 21 || dealer.dealer_stands(settings.hit_soft_17)) {
+            outcome = value - 17;
+         } else {
+            for (int r = 0; r < RANKS; r++) {
+               Hand next = dealer;
+               next.add(rank_card(r));
+               drawn[r]++;
+               enumerate(next, with(key, r), drawn, ends, index);
+               drawn[r]--;
+            }
+            return;
+         }
+         auto found = index.emplace(key, ends.size());
+         if (found.second) {
+            DealerEnd end;
+            end.outcome = outcome;
+            end.cards = 0;
+            for (int r = 0; r < RANKS; r++) {
+               for (int j = 0; j < drawn[r]; j++) {
+                  // The j+1th card of rank r drawn is one of the counts[r] - j left
+                  end.factors[end.cards++] = r * Hand::MAX_CARDS + j;
+               }
+            }
+            end.orders = 0;
+            ends.push_back(end);
+         }
+         ends[found.first->second].orders++;
+      }
+      // Set d to the chance of each way the dealer's hand can end from the
+      // up card of rank index u, drawing from the shoe as it is.
+      void dealer_odds(int u, double* d) {
+         double scale[Hand::MAX_CARDS + 1]; // 1 / the orders n cards can be drawn in from the shoe
+         scale[0] = 1;
+         for (int n = 1; n <= Hand::MAX_CARDS; n++) {
+            scale[n] = total >= (uint32_t)n ? scale[n - 1] / (total - n + 1) : 0;
+         }
+         double factors[RANKS * Hand::MAX_CARDS]; // counts[r] - j, for the j+1th card of rank r drawn
+         for (int r = 0; r < RANKS; r++) {
+            for (int j = 0; j < Hand::MAX_CARDS; j++) {
+               factors[r * Hand::MAX_CARDS + j] = counts[r] > (uint32_t)j ? counts[r] - j : 0;
+            }
+         }
+         for (int i = 0; i < 7; i++) {
+            d[i] = 0;
+         }
+         for (auto& end : ends[u]) {
+            double p = end.orders * scale[end.cards];
+            for (int i = 0; i < end.cards; i++) {
+               p *= factors[end.factors[i]];
+            }
+            d[end.outcome] += p;
+         }
+      }
+      // Return what standing on player nets against the dealer's final
+      // totals d, as settle_payout pays it.
+      double stand_ev(const Hand& player, const double* d) {
+         uint8_t value = player.value();
+         double ev = d[BUST] * win;
+         for (int t = 17; t <= 21; t++) {
+            if (value > t) {
+               ev += d[t - 17] * win;
+            } else if (value < t) {
+               ev -= d[t - 17];
+            }
+         }
+         if (player.is_blackjack()) {
+            ev += d[4] * win; // A natural beats any other 21, and pushes with one
+         } else {
+            ev -= d[NATURAL];
+         }
+         return ev;
+      }
+      // Return the node of player (memo key key) against up, working out how
+      // hitting and doubling down do if decide is set. The shoe holds
+      // neither player's cards nor up.
+      Node& evaluate(uint64_t key, const Hand& player, card_t up, bool decide) {
+         Node& node = memo[key | (uint64_t)card_hard_value(up) << 56];
+         if (!node.stood) {
+            double d[7];
+            dealer_odds(card_hard_value(up) - 1, d);
+            node.stand = stand_ev(player, d);
+            node.stood = true;
+         }
+         if (decide && !node.decided) {
+            double hit = 0;
+            double dbl = 0;
+            for (int r = 0; r < RANKS; r++) {
+               if (counts[r]) {
+                  double p = (double)counts[r] / total;
+                  Hand next = player;
+                  next.add(rank_card(r));
+                  if (next.is_bust()) {
+                     hit -= p;
+                     dbl -= 2 * p;
+                     continue;
+                  }
+                  take(r);
+                  // The turn ends at 21, otherwise the player plays on
+                  Node& child = evaluate(with(key, r), next, up, next.value() != 21);
+                  put(r);
+                  double best = child.stand;
+                  if (next.value() != 21) {
+                     best = std::max(best, std::max(child.hit, child.dbl));
+                  }
+                  hit += p * best;
+                  dbl += 2 * p * child.stand;
+               }
+            }
+            node.hit = hit;
+            node.dbl = dbl;
+            node.decided = true;
+         }
+         return node;
+      }
+   public:
+      StrategyCalculator(const TableSettings& settings_) : settings(settings_) {
+         win = (double)settings.payoff_high / settings.payoff_low - 1;
+         for (int r = 0; r < RANKS; r++) {
+            counts[r] = settings.number_decks * (r == RANKS - 1 ? 16 : 4);
+         }
+         total = settings.number_decks * 52;
+         for (int u = 0; u < RANKS; u++) {
+            Hand dealer;
+            dealer.add(rank_card(u));
+            uint8_t drawn[RANKS] = {0};
+            std::unordered_map<uint64_t, size_t> index;
+            enumerate(dealer, 0, drawn, ends[u], index);
+         }
+      }
+      // Compute the chart, dealing every first two cards and up card from a
+      // full shoe in the server's order: player, dealer, player.
+      StrategyChart compute() {
+         StrategyChart chart;
+         double sums[StrategyChart::ROWS][StrategyChart::COLUMNS][3] = {}; // Stand, hit, double, by how likely each hand is
+         for (int c1 = 0; c1 < RANKS; c1++) {
+            double p1 = (double)counts[c1] / total;
+            take(c1);
+            for (int u = 0; u < RANKS; u++) {
+               double p2 = p1 * counts[u] / total;
+               take(u);
+               for (int c2 = 0; c2 < RANKS; c2++) {
+                  double p = p2 * counts[c2] / total;
+                  take(c2);
+                  Hand player;
+                  player.add(rank_card(c1));
+                  player.add(rank_card(c2));
+                  card_t up = rank_card(u);
+                  uint64_t key = with(with(0, c1), c2);
+                  if (player.is_blackjack()) { // A natural has no turn
+                     chart.ev += p * evaluate(key, player, up, false).stand;
+                  } else {
+                     Node& node = evaluate(key, player, up, true);
+                     chart.ev += p * std::max(node.stand, std::max(node.hit, node.dbl));
+                     bool soft = player.value() != player.hard_value();
+                     double* cell = sums[StrategyChart::row(player.value(), soft)][StrategyChart::column(up)];
+                     cell[0] += p * node.stand;
+                     cell[1] += p * node.hit;
+                     cell[2] += p * node.dbl;
+                  }
+                  put(c2);
+               }
+               put(u);
+            }
+            put(c1);
+         }
+         // Every row's play is the one that does best over the hands that start it
+         for (int r = 0; r < StrategyChart::ROWS; r++) {
+            for (int c = 0; c < StrategyChart::COLUMNS; c++) {
+               double* cell = sums[r][c];
+               if (cell[2] > cell[0] && cell[2] > cell[1]) {
+                  chart.actions[r][c] = 'D';
+               } else if (cell[1] > cell[0]) {
+                  chart.actions[r][c] = 'H';
+               } else {
+                  chart.actions[r][c] = 'S';
+               }
+            }
+         }
+         return chart;
+      }
+};
+
+// compute_strategy returns the StrategyChart of settings.
+StrategyChart compute_strategy(const TableSettings& settings)
+{
+   StrategyCalculator calculator(settings);
+   return calculator.compute();
+}
+
+// StrategyCache holds the StrategyChart of every table settings string
+// asked for so far. Charts are never freed, so the pointers find returns
+// and passes on stay valid. Each chart is computed once, on a worker
+// thread of the cache's own that is started on the first miss, and
+// whoever asks for it meanwhile waits for that computation.
+class StrategyCache
+{
+   private:
+      // Entry is the chart of one settings string, or, while it is being
+      // computed, the callbacks waiting for it.
+      struct Entry
+      {
+         const StrategyChart* chart = NULL;
+         std::vector<std::function<void(const StrategyChart*)>> waiting;
+      };
+      ProfiledMutex mtx LOCK_SITE("StrategyCache::mtx"); // Protects charts, pending and working
+      LockCV cv; // Signalled when a chart is asked for that is not yet computed
+      std::map<std::string, Entry> charts;
+      std::deque<std::string> pending; // Settings whose chart is yet to be computed, oldest first
+      bool working = false; // Whether the worker thread has been started
+      // Compute every pending chart and hand it to everyone waiting, forever.
+      void work() {
+         std::unique_lock<ProfiledMutex> lock(mtx);
+         for (;;) {
+            cv.wait(lock, [this]{ return !pending.empty(); });
+            std::string settings = pending.front();
+            pending.pop_front();
+            // Compute without the lock, so charts already cached are served meanwhile
+            lock.unlock();
+            TableSettings ts;
+            ts.parse(settings);
+            const StrategyChart* chart = new StrategyChart(compute_strategy(ts));
+            std::vector<std::function<void(const StrategyChart*)>> waiting;
+            lock.lock();
+            Entry& entry = charts[settings];
+            entry.chart = chart;
+            waiting.swap(entry.waiting);
+            lock.unlock();
+            for (auto& ready : waiting) {
+               ready(chart);
+            }
+            lock.lock();
+         }
+      }
+   public:
+      // Return the chart of the table with the given settings string
+      // (TableDetails::to_string) if it has been computed. Otherwise return
+      // NULL, and ready is called with the chart, on the cache's worker
+      // thread, once it has been.
+      const StrategyChart* find(const std::string& settings, std::function<void(const StrategyChart*)> ready) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         auto added = charts.emplace(settings, Entry());
+         Entry& entry = added.first->second;
+         if (entry.chart) {
+            return entry.chart;
+         }
+         entry.waiting.push_back(ready);
+         if (added.second) { // First to ask, have the worker compute it
+            pending.push_back(settings);
+            if (!working) {
+               working = true;
+               std::thread([this]{ work(); }).detach();
+            }
+            cv.notify_one();
+         }
+         return NULL;
+      }
+};
+
+// strategy_cache is the cache of every table's StrategyChart.
+StrategyCache strategy_cache;
@@ -0,0 +1,587 @@
+/* tournament.h
+ * Contains the Tournament, which plays thousands of tables in lockstep,
+ * and the tables' side of it. Entrants play for chips of their own
+ * rather than their balance. Every table plays one round, then waits at
+ * the tournament's round barrier until all of them have settled theirs.
+ * At the barrier the tournament knocks out every entrant whose chips no
+ * longer cover the minimum bet (and anyone who left their table), breaks
+ * up the emptiest tables once fewer are needed, evens the rest out so no
+ * table has two more players than another, and releases every table
+ * into the next round.
+ *
+ * The tournament is an actor like its tables (see scheduler.h), and
+ * only drives them through commands in their mailboxes, so it never
+ * touches a table's state. Each table arrives at the barrier by
+ * counting an atomic down, and the last one to arrive schedules the
+ * tournament, so nothing polls or sleeps, and the barrier's own work is
+ * one pass over the tables and entrants. Every phase of a round has a
+ * deadline, so the barrier waits at most the bet window and the turn
+ * timeouts of the slowest table. A player moved to another table goes
+ * there through the table they leave, which seats them at the new one
+ * before the tournament starts the next round.
+ *
+ * Only the first table is in the table registry, whose 16-bit IDs are
+ * too few for a tournament's tables. The others share its ID, and are
+ * only reached through the tournament: joining the ID enters the
+ * tournament, which seats the entrant at one of its tables with room,
+ * and from then on the entrant's seat is named by the chips it plays,
+ * as its session may be gone. The first table is never broken up, so
+ * the tournament stays listed until it is over.
+ *
+ * Expects registry.h to be included first.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Tournament runs a tournament over its tables. Entries are taken until
+// the start deadline, by joining its first table, and from then on its
+// tables only play the rounds it starts. Once it is over and every table
+// has closed, nothing reaches it any more, and it is freed.
+class Tournament : public Actor
+{
+   private:
+      // Entrant is a player in the tournament, with the chips they play,
+      // which also name the entrant's seat to the tables.
+      struct Entrant {
+         std::string username;
+         AccountDetails chips;
+         size_t table = 0; // Index of the table the entrant is at
+         uint32_t place = 0; // Place the entrant finished in once out, 0 while still in
+         bool seen = false; // Whether a table reported the entrant seated at the last barrier
+         bool lost = false; // Set by the table a move failed to seat the entrant at
+      };
+      // Move is an entrant to move from one table to another before the next round.
+      struct Move {
+         Entrant* entrant;
+         size_t from;
+         size_t to;
+      };
+      enum Stage {
+         ENTRIES, // Taking entries until the start deadline
+         PLAYING, // The tables are playing a round, waiting for all of them to arrive
+         MOVING, // Waiting for the moves between tables to land
+         FINISHED, // Every table is shut down
+      };
+      ProfiledMutex mtx LOCK_SITE("Tournament::mtx"); // Protects entries_open, entrants, names, by_chips, entered and next_open while entries are open
+      bool entries_open = false;
+      std::vector<Entrant*> entrants;
+      std::unordered_set<std::string> names; // Usernames entered, one entry each
+      std::unordered_map<AccountDetails*, Entrant*> by_chips; // Entrants by the chips their tables report
+      std::vector<uint8_t> entered; // Entrants seated at each table at entry
+      size_t next_open = 0; // No table before it has room for another entrant
+      TableSettings settings;
+      std::function<void(Tournament*)> on_finish;
+      uint16_t id = 0; // The first table's ID, which names the tournament
+      Stage stage = ENTRIES;
+      Deadline start;
+      std::vector<TableDetails*> tables; // Every table, NULL once broken up
+      std::atomic<size_t> open_tables {0}; // Tables not yet closed, the last to close schedules the tournament
+      std::vector<std::vector<AccountDetails*>> reports; // Chips seated at each table, written by the table as it arrives
+      std::atomic<size_t> arriving {0}; // Tables yet to arrive at the barrier
+      std::atomic<int64_t> arrived_ns {0}; // When the last table arrived, in steady clock nanoseconds
+      std::atomic<size_t> moving {0}; // Moves yet to land
+      size_t remaining = 0; // Entrants still in
+      std::string winner = "";
+      // Scratch space reused every barrier
+      std::vector<Entrant*> out; // Entrants being knocked out
+      std::vector<std::vector<Entrant*>> seated; // Entrants still in at each table
+      std::vector<size_t> live; // Tables not broken up, fullest first
+      std::vector<Entrant*> spare; // Entrants above their table's share
+      std::vector<Move> moves;
+      std::vector<size_t> broken; // Tables emptied by the moves, shut down once they land
+   public:
+      uint32_t round = 0; // Rounds played
+      uint64_t barrier_max_ns = 0; // Longest a barrier took, from the last table arriving to every table released
+      uint64_t barrier_total_ns = 0;
+      // Make a tournament playing tables with settings ts. The tables are
+      // added with add_table before the tournament is opened. on_finish, if
+      // set, is called once the tournament is over, before it is freed.
+      Tournament(const TableSettings& ts, std::function<void(Tournament*)> on_finish_ = nullptr) :
+            settings(ts), on_finish(on_finish_) {}
+      // Free the entrants, whose chips no table reads once every table has closed.
+      ~Tournament() {
+         for (auto e : entrants) {
+            delete e;
+         }
+      }
+      // Add table as the next table of the tournament. Must be called before
+      // the first table is published.
+      void add_table(TableDetails* table) {
+         table->setTournament(this, tables.size());
+         tables.push_back(table);
+         reports.emplace_back();
+         seated.emplace_back();
+         entered.push_back(0);
+         open_tables++;
+      }
+      // Open entries, naming the tournament by its first table's ID. They
+      // close once the tournament is started.
+      void open() {
+         id = tables[0]->getID();
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         entries_open = true;
+      }
+      // Return the index'th table. The tournament's tables only reach each
+      // other through it.
+      TableDetails* table(size_t index) {
+         return tables[index];
+      }
+      // Start the tournament tournament-start seconds from now. Called once
+      // the entries posted by its creator, its bots, are on their way, so a
+      // virtual clock cannot skip past the start before they arrive.
+      void begin() {
+         start = scheduler.now() + std::chrono::seconds(settings.tournament_start);
+         scheduler.arm(this, start);
+         fprintf(stderr, "Tournament %u: %zu tables, entries open for %u s\n", id, tables.size(), settings.tournament_start);
+      }
+      // enter enters the session, joining the table-th table, and returns the
+      // chips it plays with. A bot enters at the table it joins, anyone else
+      // at the first table with room, which is written to table. Returns
+      // NULL and sets error if entries are closed, the username is already
+      // entered, or there is no room. Called by the table.
+      AccountDetails* enter(Session* session, size_t* table, const char** error) {
+         std::lock_guard<ProfiledMutex> lock(mtx);
+         if (!entries_open) {
+            *error = "Entries to the tournament are closed.\n\n";
+            return NULL;
+         }
+         if (!session->bot) {
+            while (next_open < tables.size() && entered[next_open] >= settings.max_players) {
+               next_open++;
+            }
+            *table = next_open;
+         }
+         if (*table >= tables.size() || entered[*table] >= settings.max_players) {
+            *error = "The tournament is full.\n\n";
+            return NULL;
+         }
+         if (!names.insert(session->username).second) {
+            *error = "Already entered in this tournament.\n\n";
+            return NULL;
+         }
+         entered[*table]++;
+         Entrant* e = new Entrant();
+         e->username = session->username;
+         e->table = *table;
+         e->chips.adjustBalance(settings.starting_chips);
+         entrants.push_back(e);
+         by_chips[&e->chips] = e;
+         return &e->chips;
+      }
+      // Return where the table-th table reports the chips seated at it.
+      std::vector<AccountDetails*>& report(size_t table) {
+         return reports[table];
+      }
+      // arrive counts a table in at the barrier, once it has written its
+      // report. The last table to arrive schedules the tournament.
+      void arrive() {
+         arrived_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count());
+         if (arriving.fetch_sub(1) == 1) {
+            scheduler.schedule(this);
+         }
+      }
+      // moved counts a move between tables as landed, of the entrant playing
+      // chips, who was seated at the new table unless it had no room left.
+      // chips is NULL for a move there was nobody left to make. The last
+      // move to land schedules the tournament, which knocks out anyone a
+      // move failed to seat.
+      void moved(AccountDetails* chips, bool seated) {
+         if (!seated) {
+            by_chips[chips]->lost = true; // by_chips no longer changes once entries close
+         }
+         if (moving.fetch_sub(1) == 1) {
+            scheduler.schedule(this);
+         }
+      }
+      // closed counts a table as closed, after which it no longer reaches
+      // the tournament. The last table to close schedules the tournament,
+      // which is then freed.
+      void closed() {
+         if (open_tables.fetch_sub(1) == 1) {
+            scheduler.schedule(this);
+         }
+      }
+      bool run() {
+         if (stage == FINISHED) {
+            return open_tables.load() > 0;
+         } else if (stage == ENTRIES && scheduler.now() >= start) {
+            close_entries();
+         } else if (stage == PLAYING && arriving.load() == 0) {
+            at_barrier();
+         } else if (stage == MOVING && moving.load() == 0) {
+            next_round();
+         }
+         return true;
+      }
+      bool has_work() {
+         return (stage == ENTRIES && scheduler.now() >= start) || (stage == PLAYING && arriving.load() == 0) ||
+               (stage == MOVING && moving.load() == 0);
+      }
+   private:
+      // post posts a command of type to the table-th table, for the seat
+      // playing chips.
+      void post(size_t table, CommandType type, AccountDetails* chips = NULL, std::string message = "") {
+         TableCommand* cmd = new TableCommand();
+         cmd->type = type;
+         cmd->account = chips;
+         cmd->message = message;
+         tables[table]->post(cmd);
+      }
+      // close_entries closes entries, and has every table report who is seated
+      // at it, as if at the barrier after a round 0.
+      void close_entries() {
+         {
+            std::lock_guard<ProfiledMutex> lock(mtx);
+            entries_open = false;
+         }
+         remaining = entrants.size();
+         fprintf(stderr, "Tournament %u: entries closed, %zu entrants\n", id, remaining);
+         stage = PLAYING;
+         arriving = tables.size();
+         for (size_t t = 0; t < tables.size(); t++) {
+            post(t, CMD_REPORT);
+         }
+      }
+      // at_barrier runs once every table has finished the round. It knocks
+      // out whoever left or can no longer cover the minimum bet, ends the
+      // tournament once one entrant is left (or its rounds are up), and
+      // otherwise moves players between tables before the next round.
+      void at_barrier() {
+         // Find who is still seated, and where
+         for (auto e : entrants) {
+            e->seen = false;
+         }
+         for (size_t t = 0; t < tables.size(); t++) {
+            if (!tables[t]) {
+               continue;
+            }
+            for (auto chips : reports[t]) {
+               auto it = by_chips.find(chips);
+               if (it != by_chips.end() && !it->second->place) {
+                  it->second->seen = true;
+                  it->second->table = t;
+               }
+            }
+         }
+         out.clear();
+         for (auto e : entrants) {
+            if (!e->place && (!e->seen || e->chips.getBalance() < settings.bet_min)) {
+               out.push_back(e);
+            }
+         }
+         knock_out();
+         if (remaining <= 1 || (settings.tournament_rounds && round >= settings.tournament_rounds)) {
+            finish();
+            return;
+         }
+         rebalance();
+         if (moves.empty()) {
+            next_round();
+            return;
+         }
+         // Each move goes through the table the player leaves, which seats them at the other
+         stage = MOVING;
+         moving = moves.size();
+         for (auto& m : moves) {
+            TableCommand* cmd = new TableCommand();
+            cmd->type = CMD_MOVE_OUT;
+            cmd->account = &m.entrant->chips;
+            cmd->target = tables[m.to];
+            tables[m.from]->post(cmd);
+         }
+      }
+      // knock_out takes the entrants in out out of the tournament, placing
+      // them below everyone still in: the most chips place highest, and
+      // anyone who left their table places below anyone who went bust.
+      void knock_out() {
+         std::sort(out.begin(), out.end(), [](Entrant* a, Entrant* b) {
+            if (a->seen != b->seen) {
+               return a->seen;
+            }
+            return a->chips.getBalance() > b->chips.getBalance();
+         });
+         uint32_t place = remaining - out.size() + 1;
+         for (auto e : out) {
+            e->place = place++;
+            if (e->place == 1) {
+               winner = e->username;
+            }
+            if (e->seen) {
+               std::string message = e->place == 1 ? "You won the tournament!\n\n" :
+                     "You are out of the tournament, in place " + std::to_string(e->place) + " of " +
+                     std::to_string(entrants.size()) + ".\n\n";
+               post(e->table, CMD_KNOCKOUT, &e->chips, message);
+            }
+         }
+         remaining -= out.size();
+         out.clear();
+      }
+      // rebalance works out the moves that leave just enough tables to seat
+      // everyone still in, keeping the fullest, with the players shared out as
+      // evenly as they go. Tables left empty are broken up.
+      void rebalance() {
+         moves.clear();
+         live.clear();
+         for (size_t t = 0; t < tables.size(); t++) {
+            if (tables[t]) {
+               live.push_back(t);
+               seated[t].clear();
+            }
+         }
+         for (auto e : entrants) {
+            if (!e->place) {
+               seated[e->table].push_back(e);
+            }
+         }
+         // The first table stays, since it carries the tournament's ID
+         std::stable_sort(live.begin(), live.end(), [this](size_t a, size_t b) {
+            if ((a == 0) != (b == 0)) {
+               return a == 0;
+            }
+            return seated[a].size() > seated[b].size();
+         });
+         size_t needed = (remaining + settings.max_players - 1) / settings.max_players;
+         // The fullest tables take a player over the even share, if it does not divide evenly
+         spare.clear();
+         for (size_t i = 0; i < live.size(); i++) {
+            size_t share = i < needed ? remaining / needed + (i < remaining % needed) : 0;
+            std::vector<Entrant*>& at = seated[live[i]];
+            while (at.size() > share) {
+               spare.push_back(at.back());
+               at.pop_back();
+            }
+         }
+         for (size_t i = 0; i < needed; i++) {
+            size_t share = remaining / needed + (i < remaining % needed);
+            std::vector<Entrant*>& at = seated[live[i]];
+            while (at.size() < share) {
+               Entrant* e = spare.back();
+               spare.pop_back();
+               moves.push_back(Move{e, e->table, live[i]});
+               e->table = live[i];
+               at.push_back(e);
+            }
+         }
+         broken.assign(live.begin() + needed, live.end());
+      }
+      // next_round shuts down the tables that were broken up, knocks out
+      // anyone a move failed to seat, and starts the next round at every
+      // other table, unless that leaves the tournament over.
+      void next_round() {
+         for (auto t : broken) {
+            shut_down(t);
+         }
+         broken.clear();
+         for (auto e : entrants) {
+            if (!e->place && e->lost) {
+               e->seen = false; // The table told them they were out
+               out.push_back(e);
+            }
+         }
+         if (!out.empty()) {
+            knock_out();
+            if (remaining <= 1) {
+               finish();
+               return;
+            }
+         }
+         round++;
+         size_t playing = 0;
+         for (auto table : tables) {
+            playing += table != NULL;
+         }
+         stage = PLAYING;
+         arriving = playing;
+         for (size_t t = 0; t < tables.size(); t++) {
+            if (tables[t]) {
+               post(t, CMD_ROUND);
+            }
+         }
+         // Time the barrier, from the last table arriving to every table released
+         int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+         uint64_t took = now - arrived_ns.load();
+         barrier_max_ns = std::max(barrier_max_ns, took);
+         barrier_total_ns += took;
+         fprintf(stderr, "Tournament %u: round %u, %zu entrants at %zu tables\n", id, round, remaining, playing);
+      }
+      // finish places everyone still in by their chips, and shuts down every
+      // table once the tournament is over.
+      void finish() {
+         for (auto e : entrants) {
+            if (!e->place) {
+               out.push_back(e);
+            }
+         }
+         knock_out();
+         for (size_t t = 0; t < tables.size(); t++) {
+            if (tables[t]) {
+               shut_down(t);
+            }
+         }
+         fprintf(stderr, "Tournament %u: won by %s after %u rounds, barrier at most %.2f ms, %.2f ms on average\n", id,
+               winner.empty() ? "nobody" : winner.c_str(), round, barrier_max_ns / 1e6,
+               round ? barrier_total_ns / 1e6 / round : 0.0);
+         if (on_finish) {
+            on_finish(this);
+         }
+         stage = FINISHED;
+      }
+      // shut_down closes the table-th table, unpublishing it first if it is
+      // the first, and frees it once nobody can be using it, as RemoveTable
+      // does.
+      void shut_down(size_t t) {
+         TableDetails* table = tables[t];
+         tables[t] = NULL;
+         if (t == 0) {
+            table_registry.remove(id);
+         }
+         TableCommand* cmd = new TableCommand();
+         cmd->type = CMD_SHUTDOWN;
+         table->post(cmd);
+         table_registry.retire(table);
+      }
+};
+
+// arrive waits at the tournament's barrier: the table reports the chips
+// seated at it, and arms nothing until the tournament starts the next round.
+// The players wait for that round meanwhile.
+void TableDetails::arrive() {
+   std::vector<AccountDetails*>& report = tournament->report(tournament_table);
+   report.clear();
+   for (auto player : players) {
+      player->setState(IN_PROGRESS);
+      report.push_back(player->getAccount());
+   }
+   for (auto player : pending_players) {
+      report.push_back(player->getAccount());
+   }
+   phase = BARRIER;
+   deadline = Deadline::max();
+   tournament->arrive();
+}
+
+// handle_tournament applies one of the tournament's commands to the table.
+void TableDetails::handle_tournament(TableCommand* cmd) {
+   if (cmd->type == CMD_ROUND) {
+      if (phase == BARRIER) {
+         for (auto player : players) {
+            player->setState(ENTER_BETS);
+         }
+         start_round();
+      }
+   } else if (cmd->type == CMD_REPORT) {
+      if (phase == BARRIER) {
+         arrive();
+      }
+   } else if (cmd->type == CMD_MOVE_OUT) {
+      PlayerInfo* player = find_entrant(cmd->account);
+      if (!player) { // Left the table since the barrier, nothing to move
+         tournament->moved(NULL, true);
+         return;
+      }
+      Session* session = player->getSession();
+      remove_player(player);
+      reply(player, 2, 1, 5, "Moving to table " + std::to_string(cmd->target->tournament_table + 1) +
+            " of the tournament.\n\n");
+      player->disconnect();
+      if (session->bot) { // The bot's new table owns it from now on
+         bot_sessions.erase(std::remove(bot_sessions.begin(), bot_sessions.end(), session), bot_sessions.end());
+      }
+      // Point the slot at the new table before seating the player there, so that
+      // leaving meanwhile waits for the seat there (see leavetable)
+      session->slot_of(this)->table = cmd->target;
+      TableCommand* in = new TableCommand();
+      in->type = CMD_MOVE_IN;
+      in->session = session;
+      in->account = cmd->account;
+      cmd->target->post(in);
+   } else if (cmd->type == CMD_MOVE_IN) {
+      Session* session = cmd->session;
+      if (!is_available || players.size() + pending_players.size() >= max_players) {
+         // Nowhere to seat the entrant, who is out. The session is moved back to
+         // the lobby as if their seat had closed, freeing the slot last.
+         TableSlot* slot = session->slot_of(this);
+         ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 3, "No seat left at the table you were moved to, "
+               "you are out of the tournament.\n\n");
+         ssize_t len = rpdu->to_bytes(&write_buffer);
+         send_marked(session, slot, table_id, -1, write_buffer, len);
+         delete rpdu;
+         slot->seats = 0;
+         if (session->bot) {
+            delete session->bot;
+            sessions.release(session);
+         } else {
+            if (!session->multitable) {
+               session->state = ACCOUNT;
+            }
+            slot->table = NULL;
+         }
+         tournament->moved(cmd->account, false);
+         return;
+      }
+      add_player(session, 0, cmd->account);
+      if (session->bot) {
+         bot_sessions.push_back(session);
+      }
+      tournament->moved(cmd->account, true);
+   } else if (cmd->type == CMD_KNOCKOUT) {
+      PlayerInfo* player = find_entrant(cmd->account);
+      if (player) {
+         remove_player(player);
+         reply(player, 2, 1, 5, cmd->message);
+         player->closeSeat();
+      }
+   }
+}
+
+// enter_tournament enters the session joining the table in slot into the
+// tournament, and returns the table the tournament seats it at, setting
+// account to the chips it plays with. A join for another table is passed on
+// to it. If the session cannot enter, it is told why by a 4-1-7 response,
+// the slot is freed, and NULL is returned.
+TableDetails* TableDetails::enter_tournament(Session* session, TableSlot* slot, AccountDetails** account) {
+   const char* error = NULL;
+   size_t index = tournament_table;
+   AccountDetails* chips = tournament->enter(session, &index, &error);
+   if (!chips) {
+      ASCIIResponsePDU* rpdu = new ASCIIResponsePDU(4, 1, 7, error);
+      ssize_t len = rpdu->to_bytes(&write_buffer);
+      send_marked(session, slot, table_id, -1, write_buffer, len);
+      delete rpdu;
+      slot->table = NULL;
+      return NULL;
+   }
+   *account = chips;
+   if (index == tournament_table) {
+      return this;
+   }
+   // As for a move, point the slot at the other table before the join reaches it
+   TableDetails* table = tournament->table(index);
+   slot->table = table;
+   TableCommand* cmd = new TableCommand();
+   cmd->type = CMD_JOIN;
+   cmd->session = session;
+   cmd->account = chips;
+   table->post(cmd);
+   return table;
+}
+
+// leave_tournament tells the tournament the table has closed, once it is
+// shut down. The tournament may be freed from then on, so the table never
+// reaches it again: it is shut down at the barrier, where nothing but the
+// tournament's commands would start another round.
+void TableDetails::leave_tournament() {
+   tournament->closed();
+}
@@ -0,0 +1,326 @@
+/* sim.cpp
+ * cbp-sim, a Monte Carlo simulator for a table's rules. It plays hands
+ * with the server's own Shoe, cut card, deal order, dealer policy and
+ * payout (cards.h and rules.h), from table settings given as the same
+ * headers AddTable takes, and estimates the house edge of the table
+ * against a basic hit, stand and double down strategy, with its
+ * variance and a 95% confidence interval. With --exact it also computes
+ * the table's exact edge and strategy chart (strategy.h) and plays the
+ * chart instead, which checks the two against each other.
+ *
+ * Every worker thread plays its share of the hands from its own ChaCha20
+ * stream of shoe seeds, all keyed from one master seed, so a run with
+ * the same seed and number of threads always plays the same hands. Each
+ * worker keeps its own totals and they are only added up at the end.
+ *
+ * Usage: ./cbp-sim [--hands <hands>] [--threads <threads>] [--seed <seed>] [--exact] [<header>:<value> ...]
+ * e.g.   ./cbp-sim --hands 100000000 number-decks:6 payoff:6-5 hit-soft-17:false
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/lockprof.h"
+#include "../protocol/pdu.h"
+#include "../server/chacha.h"
+#include "../server/cards.h"
+#include "../server/rules.h"
+#include "../server/strategy.h"
+
+// Totals is what a worker adds up over the hands it plays. Results are in
+// chips, from the player's side. A win pays back the wager times the payoff
+// ratio in all, as the server pays it, so at 1-1 a win only breaks even.
+struct Totals
+{
+   uint64_t hands = 0;
+   int64_t net = 0; // Sum of each hand's payout less its wager
+   double net_sq = 0; // Sum of each hand's net squared
+   uint64_t ahead = 0; // Hands paying back more than their wager
+   uint64_t even = 0; // Hands paying back their wager
+   uint64_t behind = 0; // Hands paying back less than their wager
+   uint64_t blackjacks = 0; // Player naturals
+   uint64_t doubles = 0;
+   uint64_t shoes = 0;
+   // Add other's totals to these.
+   void add(const Totals& other) {
+      hands += other.hands;
+      net += other.net;
+      net_sq += other.net_sq;
+      ahead += other.ahead;
+      even += other.even;
+      behind += other.behind;
+      blackjacks += other.blackjacks;
+      doubles += other.doubles;
+      shoes += other.shoes;
+   }
+};
+
+// Action is what the player does with a hand.
+enum Action { HIT, STAND, DOUBLE };
+
+// basic_strategy returns the player's play for hand against the dealer's up
+// card, a basic strategy for hitting, standing and doubling down on the first
+// two cards. The protocol has no splitting or surrender, so neither is played.
+static Action basic_strategy(const Hand& hand, card_t up)
+{
+   uint8_t dealer = card_hard_value(up);
+   if (dealer == 1) {
+      dealer = 11; // Ace
+   }
+   bool first = hand.size() == 2;
+   uint8_t value = hand.value();
+   if (hand.aces && value != hand.hard_value()) { // Soft hand
+      if (value >= 19) {
+         return STAND;
+      }
+      if (value == 18) {
+         if (first && dealer >= 3 && dealer <= 6) {
+            return DOUBLE;
+         }
+         return dealer <= 8 ? STAND : HIT;
+      }
+      if (first && dealer >= 5 && dealer <= 6 && value >= 13) {
+         return DOUBLE;
+      }
+      if (first && value >= 15 && dealer == 4) {
+         return DOUBLE;
+      }
+      if (first && value == 17 && dealer == 3) {
+         return DOUBLE;
+      }
+      return HIT;
+   }
+   if (value >= 17) {
+      return STAND;
+   }
+   if (value >= 13) {
+      return dealer <= 6 ? STAND : HIT;
+   }
+   if (value == 12) {
+      return (dealer >= 4 && dealer <= 6) ? STAND : HIT;
+   }
+   if (first && value == 11) {
+      return DOUBLE;
+   }
+   if (first && value == 10 && dealer <= 9) {
+      return DOUBLE;
+   }
+   if (first && value == 9 && dealer >= 3 && dealer <= 6) {
+      return DOUBLE;
+   }
+   return HIT;
+}
+
+// SimTable plays hands by one table's rules, one player at a time, with
+// the dealer's policy and payouts of the rules policy Rules (see rules.h).
+template <typename Rules>
+class SimTable
+{
+   private:
+      Rules rules;
+      TableSettings settings;
+      const StrategyChart* chart; // The chart the player plays, or NULL for basic_strategy
+      ChaCha20 seeds; // This table's stream of shoe seeds
+      Shoe shoe;
+      Hand player;
+      Hand dealer;
+      // Change to a new shoe and place its cut card, as TableDetails::change_shoe does.
+      void change_shoe(Totals& totals) {
+         shoe.fill(settings.number_decks, seeds.seed());
+         shoe.place_cut(settings.penetration);
+         totals.shoes++;
+      }
+      // Draw the next card, changing shoes if a round deals past the end of the shoe.
+      card_t draw(Totals& totals) {
+         if (shoe.empty()) {
+            change_shoe(totals);
+         }
+         return shoe.draw();
+      }
+   public:
+      SimTable(const Rules& rules_, const TableSettings& settings_, const StrategyChart* chart_, const ShoeSeed& master,
+            uint64_t stream) : rules(rules_), settings(settings_), chart(chart_), seeds(master, stream) {}
+      // Return the player's play for their hand.
+      Action decide() {
+         if (!chart) {
+            return basic_strategy(player, dealer.cards[0]);
+         }
+         char action = chart->action(player, dealer.cards[0]);
+         return action == 'H' ? HIT : action == 'D' ? DOUBLE : STAND;
+      }
+      // Play one hand of bet_min, adding its result to totals.
+      void play(Totals& totals) {
+         // Change the shoe between rounds once the cut card has come out
+         if (shoe.cards.empty() || shoe.past_cut()) {
+            change_shoe(totals);
+         }
+         player.clear();
+         dealer.clear();
+         // Player card, dealer card, player card, as TableDetails::deal_round deals
+         player.add(draw(totals));
+         dealer.add(draw(totals));
+         player.add(draw(totals));
+         uint32_t wager = settings.bet_min;
+         if (player.is_blackjack()) {
+            totals.blackjacks++;
+         } else {
+            // The player's turn, which ends at 21 or on a bust as TableDetails::hit does
+            for (;;) {
+               if (player.value() >= 21) {
+                  break;
+               }
+               Action action = decide();
+               if (action == STAND) {
+                  break;
+               }
+               player.add(draw(totals));
+               if (action == DOUBLE) {
+                  wager *= 2;
+                  totals.doubles++;
+                  break;
+               }
+            }
+         }
+         // The dealer plays out their hand whatever the player has, as
+         // TableDetails::settle_round does
+         do {
+            dealer.add(draw(totals));
+         } while (rules.dealer_hits(dealer));
+         uint32_t payout = rules.payout(wager, player, dealer);
+         int64_t net = (int64_t)payout - wager;
+         totals.hands++;
+         totals.net += net;
+         totals.net_sq += (double)net * net;
+         if (net > 0) {
+            totals.ahead++;
+         } else if (net == 0) {
+            totals.even++;
+         } else {
+            totals.behind++;
+         }
+      }
+};
+
+// simulate plays hands hands at a table on stream of master, into totals.
+template <typename Rules>
+static void simulate(const Rules& rules, const TableSettings& settings, const StrategyChart* chart, const ShoeSeed& master,
+      uint64_t stream, uint64_t hands, Totals* totals)
+{
+   SimTable<Rules> table(rules, settings, chart, master, stream);
+   Totals local; // Kept on the worker's stack, so workers never share a cache line
+   for (uint64_t i = 0; i < hands; i++) {
+      table.play(local);
+   }
+   *totals = local;
+}
+
+// Simulation runs the workers, once with_rules gives it the rules policy of
+// the table's settings.
+struct Simulation
+{
+   TableSettings settings;
+   const StrategyChart* chart = NULL; // The chart to play, or NULL for basic_strategy
+   ShoeSeed master;
+   uint64_t hands;
+   unsigned threads;
+   std::string rules; // Name of the rules policy played
+   std::vector<Totals> results; // Per worker
+   // Split the hands between workers, each on its own stream of shoe seeds,
+   // and wait for them all.
+   template <typename Rules>
+   void operator()(const Rules& policy) {
+      rules = policy.name();
+      results.resize(threads);
+      std::vector<std::thread> workers;
+      for (unsigned w = 0; w < threads; w++) {
+         uint64_t share = hands / threads + (w < hands % threads);
+         workers.emplace_back(simulate<Rules>, std::cref(policy), std::cref(settings), chart, std::cref(master), w, share,
+               &results[w]);
+      }
+      for (auto& worker : workers) {
+         worker.join();
+      }
+   }
+};
+
+int main(int argc, char* argv[]) {
+   uint64_t hands = 10000000;
+   unsigned threads = std::thread::hardware_concurrency();
+   ShoeSeed master = ShoeSeed::random();
+   bool exact = false;
+   std::string headers = "";
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--hands") == 0 && i + 1 < argc) {
+         hands = strtoull(argv[++i], NULL, 0);
+      } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+         threads = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+         if (!master.from_hex(argv[++i])) {
+            fprintf(stderr, "Invalid seed, expected 64 hex digits\n");
+            return EXIT_FAILURE;
+         }
+      } else if (strcmp(argv[i], "--exact") == 0) {
+         exact = true;
+      } else if (strchr(argv[i], ':')) {
+         headers += argv[i];
+         headers += "\n";
+      } else {
+         fprintf(stderr, "Usage: %s [--hands <hands>] [--threads <threads>] [--seed <seed>] [--exact] [<header>:<value> ...]\n",
+               argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+   if (threads < 1) {
+      threads = 1;
+   }
+   if (hands < threads) {
+      hands = threads;
+   }
+   TableSettings settings;
+   settings.parse(headers + "\n");
+   printf("%u decks, payoff %u-%u, bet %u, %s soft 17, penetration %u%%\n", settings.number_decks,
+         settings.payoff_high, settings.payoff_low, settings.bet_min, settings.hit_soft_17 ? "hits" : "stands on",
+         settings.penetration);
+   printf("%llu hands, %u threads, seed %s\n", (unsigned long long)hands, threads, master.to_hex().c_str());
+   StrategyChart chart;
+   if (exact) {
+      auto begin = std::chrono::steady_clock::now();
+      chart = compute_strategy(settings);
+      printf("exact edge:   %+.4f%% off the top of the shoe, playing by the cards held (%.2f s)\n",
+            100 * chart.house_edge(), std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+   }
+   Simulation sim;
+   sim.settings = settings;
+   sim.chart = exact ? &chart : NULL;
+   sim.master = master;
+   sim.hands = hands;
+   sim.threads = threads;
+   auto start = std::chrono::steady_clock::now();
+   with_rules(settings, sim);
+   Totals totals;
+   for (auto& result : sim.results) {
+      totals.add(result);
+   }
+   double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   // Per hand results, in units of the bet placed
+   double n = totals.hands;
+   double mean = totals.net / n / settings.bet_min;
+   double variance = (totals.net_sq / n / settings.bet_min / settings.bet_min - mean * mean) * n / (n - 1);
+   double stddev = sqrt(variance);
+   double ci = 1.96 * stddev / sqrt(n);
+   printf("house edge:   %+.4f%% (95%% CI %+.4f%% to %+.4f%%)\n", -100 * mean, -100 * (mean + ci), -100 * (mean - ci));
+   printf("player EV:    %+.5f bets/hand\n", mean);
+   printf("variance:     %.4f bets^2/hand (std dev %.4f)\n", variance, stddev);
+   printf("ahead %.2f%%, even %.2f%%, behind %.2f%%, blackjacks %.2f%%, doubles %.2f%%\n",
+         100 * totals.ahead / n, 100 * totals.even / n, 100 * totals.behind / n, 100 * totals.blackjacks / n,
+         100 * totals.doubles / n);
+   printf("%llu shoes, %.2f s, %.1fM hands/min, %s rules\n", (unsigned long long)totals.shoes, secs, n / secs * 60 / 1e6,
+         sim.rules.c_str());
+   return EXIT_SUCCESS;
+}